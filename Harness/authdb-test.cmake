@@ -0,0 +1,36 @@
+# cmake -DTOOL=lsp-authdb -DCOMMAND=enable|disable -DINPUT=plist -DEXPECTED=plist
+#       [-DSTATUS=code] [-DSEPARATE=ON] -DWORK_DIR=dir -P authdb-test.cmake
+#
+# Edit a copy of a sample right with lsp-authdb, in place or with -o, and
+# compare what it left with the expected plist.
+
+if(NOT DEFINED STATUS)
+    set(STATUS 0)
+endif()
+get_filename_component(name ${INPUT} NAME_WE)
+set(work ${WORK_DIR}/${name}-${COMMAND}.plist)
+file(MAKE_DIRECTORY ${WORK_DIR})
+configure_file(${INPUT} ${work} COPYONLY)
+
+if(SEPARATE)
+    set(output ${work}.out)
+    file(REMOVE ${output})
+    execute_process(COMMAND ${TOOL} -i ${work} -o ${output} ${COMMAND} RESULT_VARIABLE result)
+    # The input is left alone.
+    execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${INPUT} ${work} RESULT_VARIABLE changed)
+    if(changed)
+        message(FATAL_ERROR "${work} was modified")
+    endif()
+else()
+    set(output ${work})
+    execute_process(COMMAND ${TOOL} -i ${work} ${COMMAND} RESULT_VARIABLE result)
+endif()
+
+if(NOT result EQUAL STATUS)
+    message(FATAL_ERROR "lsp-authdb ${COMMAND} exited with ${result}, expected ${STATUS}")
+endif()
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${EXPECTED} ${output} RESULT_VARIABLE differ)
+if(differ)
+    execute_process(COMMAND diff -u ${EXPECTED} ${output})
+    message(FATAL_ERROR "${output} differs from ${EXPECTED}")
+endif()
@@ -0,0 +1,115 @@
+//
+//  AuthorizationPlugin.h
+//  LoginScriptPlugin harness
+//
+//  The parts of the Security framework's plugin interface that
+//  LoginScriptPlugin uses, with the same layout and values, so that the
+//  plugin can be built and driven on Linux by the harness.
+//
+
+#ifndef __LoginScriptPlugin__AuthorizationPlugin__
+#define __LoginScriptPlugin__AuthorizationPlugin__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// From MacTypes.h.
+typedef int32_t OSStatus;
+typedef uint32_t OSType;
+typedef uint32_t UInt32;
+typedef unsigned char Boolean;
+
+typedef const char *AuthorizationString;
+typedef void *AuthorizationPluginRef;
+typedef void *AuthorizationEngineRef;
+typedef void *AuthorizationMechanismRef;
+typedef AuthorizationString AuthorizationMechanismId;
+typedef UInt32 AuthorizationContextFlags;
+typedef UInt32 AuthorizationSessionId;
+
+enum {
+    errAuthorizationSuccess = 0,
+    errAuthorizationDenied = -60005,
+    errAuthorizationInternal = -60008
+};
+
+typedef enum AuthorizationResult {
+    kAuthorizationResultAllow,
+    kAuthorizationResultDeny,
+    kAuthorizationResultUndefined,
+    kAuthorizationResultUserCanceled
+} AuthorizationResult;
+
+enum {
+    kAuthorizationContextFlagExtractable = 1 << 0,
+    kAuthorizationContextFlagVolatile = 1 << 1,
+    kAuthorizationContextFlagSticky = 1 << 2
+};
+
+/// AuthorizationValue is a value in the context or the hints.
+struct AuthorizationValue {
+    size_t length;
+    void *data;
+};
+typedef struct AuthorizationValue AuthorizationValue;
+
+struct AuthorizationValueVector {
+    UInt32 count;
+    AuthorizationValue *values;
+};
+typedef struct AuthorizationValueVector AuthorizationValueVector;
+
+enum {
+    kAuthorizationCallbacksVersion = 1
+};
+
+/// AuthorizationCallbacks are the engine's functions, version 1.
+struct AuthorizationCallbacks {
+    UInt32 version;
+    OSStatus (*SetResult)(AuthorizationEngineRef inEngine, AuthorizationResult inResult);
+    OSStatus (*RequestInterrupt)(AuthorizationEngineRef inEngine);
+    OSStatus (*DidDeactivate)(AuthorizationEngineRef inEngine);
+    OSStatus (*GetContextValue)(AuthorizationEngineRef inEngine,
+                                AuthorizationString inKey,
+                                AuthorizationContextFlags *outContextFlags,
+                                const AuthorizationValue **outValue);
+    OSStatus (*SetContextValue)(AuthorizationEngineRef inEngine,
+                                AuthorizationString inKey,
+                                AuthorizationContextFlags inContextFlags,
+                                const AuthorizationValue *inValue);
+    OSStatus (*GetHintValue)(AuthorizationEngineRef inEngine,
+                             AuthorizationString inKey,
+                             const AuthorizationValue **outValue);
+    OSStatus (*SetHintValue)(AuthorizationEngineRef inEngine,
+                             AuthorizationString inKey,
+                             const AuthorizationValue *inValue);
+    OSStatus (*GetArguments)(AuthorizationEngineRef inEngine,
+                             const AuthorizationValueVector **outArguments);
+    OSStatus (*GetSessionId)(AuthorizationEngineRef inEngine,
+                             AuthorizationSessionId *outSessionId);
+};
+typedef struct AuthorizationCallbacks AuthorizationCallbacks;
+
+enum {
+    kAuthorizationPluginInterfaceVersion = 0
+};
+
+/// AuthorizationPluginInterface is what the plugin hands the engine.
+struct AuthorizationPluginInterface {
+    UInt32 version;
+    OSStatus (*PluginDestroy)(AuthorizationPluginRef inPlugin);
+    OSStatus (*MechanismCreate)(AuthorizationPluginRef inPlugin,
+                                AuthorizationEngineRef inEngine,
+                                AuthorizationMechanismId mechanismId,
+                                AuthorizationMechanismRef *outMechanism);
+    OSStatus (*MechanismInvoke)(AuthorizationMechanismRef inMechanism);
+    OSStatus (*MechanismDeactivate)(AuthorizationMechanismRef inMechanism);
+    OSStatus (*MechanismDestroy)(AuthorizationMechanismRef inMechanism);
+};
+typedef struct AuthorizationPluginInterface AuthorizationPluginInterface;
+
+OSStatus AuthorizationPluginCreate(const AuthorizationCallbacks *callbacks,
+                                   AuthorizationPluginRef *outPlugin,
+                                   const AuthorizationPluginInterface **outPluginInterface);
+
+#endif /* defined(__LoginScriptPlugin__AuthorizationPlugin__) */
@@ -0,0 +1,6 @@
+//
+//  AuthorizationTags.h
+//  LoginScriptPlugin harness
+//
+//  Nothing from it is used on Linux, it only has to exist.
+//
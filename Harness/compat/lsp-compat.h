@@ -0,0 +1,43 @@
+//
+//  lsp-compat.h
+//  LoginScriptPlugin harness
+//
+//  BSD functions and constants that the sources use and glibc lacks. It's
+//  included ahead of every source when building on Linux.
+//
+
+#ifndef __LoginScriptPlugin__lsp_compat__
+#define __LoginScriptPlugin__lsp_compat__
+
+#include <string.h>
+#include <limits.h>
+
+#if !defined(HAVE_STRLCPY)
+static inline size_t strlcpy(char *dst, const char *src, size_t size)
+{
+    size_t len;
+    size_t n;
+    
+    len = strlen(src);
+    if (size > 0) {
+        n = len < size - 1 ? len : size - 1;
+        memcpy(dst, src, n);
+        dst[n] = '\0';
+    }
+    return len;
+}
+
+static inline size_t strlcat(char *dst, const char *src, size_t size)
+{
+    size_t len;
+    
+    len = strnlen(dst, size);
+    return len + strlcpy(dst + len, src, size - len);
+}
+#endif
+
+#if !defined(OPEN_MAX)
+#define OPEN_MAX 1024
+#endif
+
+#endif /* defined(__LoginScriptPlugin__lsp_compat__) */
@@ -0,0 +1,8 @@
+//
+//  errno.h
+//  LoginScriptPlugin harness
+//
+//  The BSD location of errno.h, which glibc doesn't provide.
+//
+
+#include <errno.h>
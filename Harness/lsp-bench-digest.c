@@ -0,0 +1,206 @@
+//
+//  lsp-bench-digest.c
+//  LoginScriptPlugin harness
+//
+//  Measures what a manifest costs a login: large scripts are listed in a
+//  manifest written by sha256sum, and logins are timed in a new instance
+//  of the plugin each, which has to index the scripts again, first with
+//  the digest cache removed every time so every script is hashed, then
+//  with the cache kept, and last in a single instance that keeps its
+//  index. The times are printed as percentiles for each.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <syslog.h>
+#include <sysexits.h>
+
+#include "lsp-harness.h"
+#include "lsp-verify.h"
+
+enum {
+    kDigestManifestMax = 64 * 1024      // room for the manifest
+};
+
+static const char *const kMechanisms[] = {
+    "premount-root", "premount-user", "postmount-root", "postmount-user"
+};
+#define kNumMechanisms (sizeof(kMechanisms) / sizeof(*kMechanisms))
+
+/// How a run treats the plugin and its digest cache between logins.
+enum {
+    kDigestCold,                        // new instance, cache removed
+    kDigestWarm,                        // new instance, cache kept
+    kDigestIndexed,                     // one instance for all logins
+    kNumDigestRuns
+};
+
+static const char *const kRunLabels[kNumDigestRuns] = {
+    "cold cache, new index", "warm cache, new index", "index kept"
+};
+
+static void Usage(void)
+{
+    fprintf(stderr,
+            "usage: lsp-bench-digest [-n logins] [-s scripts] [-k KB]\n"
+            "  -n logins   logins to time in each run, default 20\n"
+            "  -s scripts  scripts in each postmount mechanism, default 2\n"
+            "  -k KB       size of each script, default 4096\n");
+}
+
+/// Write a script that exits right away, padded with comments to size.
+static bool WritePaddedScript(const char *name, size_t size)
+{
+    char *body;
+    size_t length;
+    bool ok;
+    
+    if ((body = malloc(size + 1)) == NULL) {
+        return false;
+    }
+    strlcpy(body, "exit 0\n", size + 1);
+    for (length = strlen(body); length + 64 <= size; length += 64) {
+        memset(body + length, '#', 63);
+        body[length + 63] = '\n';
+    }
+    body[length] = '\0';
+    ok = HarnessWriteScript(kLoginScriptDir, name, body);
+    free(body);
+    
+    return ok;
+}
+
+/// Write the manifest with sha256sum, in the script directory.
+static bool WriteManifest(void)
+{
+    char command[MAXPATHLEN + 64];
+    char *manifest;
+    size_t length;
+    FILE *pipe;
+    bool ok;
+    
+    if ((manifest = malloc(kDigestManifestMax)) == NULL) {
+        return false;
+    }
+    snprintf(command, sizeof(command), "cd '%s' && sha256sum postmount-*", kLoginScriptDir);
+    if ((pipe = popen(command, "r")) == NULL) {
+        free(manifest);
+        return false;
+    }
+    length = fread(manifest, 1, kDigestManifestMax - 1, pipe);
+    manifest[length] = '\0';
+    ok = pclose(pipe) == 0 && length > 0
+         && HarnessWriteFile(kLoginScriptDir, kManifestName, manifest, 0644);
+    if (! ok) {
+        fprintf(stderr, "lsp-bench-digest: can't write the manifest with sha256sum\n");
+    }
+    free(manifest);
+    
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    HarnessPlugin plugin;
+    HarnessEngine engine;
+    uint64_t *times;
+    uint64_t median[kNumDigestRuns];
+    uint64_t start;
+    char name[64];
+    int run;
+    long numLogins;
+    long numScripts;
+    long kilobytes;
+    long i;
+    int ch;
+    
+    numLogins = 20;
+    numScripts = 2;
+    kilobytes = 4096;
+    while ((ch = getopt(argc, argv, "n:s:k:h")) != -1) {
+        switch (ch) {
+            case 'n':
+                numLogins = HarnessNumberArg(optarg, "logins", 1, 100000);
+                break;
+            case 's':
+                numScripts = HarnessNumberArg(optarg, "scripts", 1, 100);
+                break;
+            case 'k':
+                kilobytes = HarnessNumberArg(optarg, "KB", 1, 1024 * 1024);
+                break;
+            default:
+                Usage();
+                return EX_USAGE;
+        }
+    }
+    if (optind != argc) {
+        Usage();
+        return EX_USAGE;
+    }
+    if (! HarnessPreflight(kLoginScriptDir, LSP_STATE_DIR)) {
+        return kHarnessSkipped;
+    }
+    
+    HarnessClearDir(kLoginScriptDir);
+    if (! HarnessWriteFile(kLoginScriptDir, kSettingsName, "RequireManifest = yes\n", 0644)) {
+        return EX_CANTCREAT;
+    }
+    for (i = 0; i < numScripts * 2; i++) {
+        snprintf(name, sizeof(name), "%s-%03ld", i % 2 ? "postmount-user" : "postmount-root", i / 2);
+        if (! WritePaddedScript(name, (size_t)kilobytes * 1024)) {
+            return EX_CANTCREAT;
+        }
+    }
+    if (! WriteManifest()) {
+        return EX_SOFTWARE;
+    }
+    
+    if ((times = calloc((size_t)numLogins, sizeof(*times))) == NULL) {
+        return EX_OSERR;
+    }
+    printf("%ld logins, %ld scripts of %ld KB in each postmount mechanism, all in a manifest\n",
+           numLogins, numScripts, kilobytes);
+    for (run = 0; run < kNumDigestRuns; run++) {
+        if (run == kDigestIndexed && ! HarnessCreate(&plugin)) {
+            return EX_OSERR;
+        }
+        for (i = 0; i < numLogins; i++) {
+            if (run == kDigestCold) {
+                unlink(LSP_STATE_DIR "/DigestCache");
+            }
+            start = HarnessTime();
+            if (run != kDigestIndexed && ! HarnessCreate(&plugin)) {
+                return EX_OSERR;
+            }
+            HarnessEngineInit(&engine, 10000 + (uid_t)(i % 100), 10000, "/");
+            if (HarnessLogin(&plugin, &engine, kMechanisms, kNumMechanisms) != kAuthorizationResultAllow) {
+                fprintf(stderr, "lsp-bench-digest: a login with %s wasn't allowed\n", kRunLabels[run]);
+                return EX_SOFTWARE;
+            }
+            times[i] = HarnessTime() - start;
+            if (run != kDigestIndexed) {
+                HarnessDestroy(&plugin);
+            }
+        }
+        if (run == kDigestIndexed) {
+            HarnessDestroy(&plugin);
+        }
+        HarnessReport(kRunLabels[run], times, (size_t)numLogins);
+        median[run] = HarnessPercentile(times, (size_t)numLogins, 50);
+    }
+    if (median[kDigestCold] > median[kDigestWarm]) {
+        printf("hashing %ld KB in each login that misses the cache, at %.0f MB/s\n", numScripts * 2 * kilobytes,
+               numScripts * 2 * kilobytes / 1024.0 / ((median[kDigestCold] - median[kDigestWarm]) / 1e6));
+    }
+    
+    // A script that doesn't match the manifest is logged as an error and
+    // not run, which would make the numbers meaningless.
+    if (HarnessLoggedCount(LOG_ERR) > 0) {
+        fprintf(stderr, "lsp-bench-digest: the plugin logged errors, set LSP_HARNESS_LOG to a file to see them\n");
+        return EX_SOFTWARE;
+    }
+    
+    return EX_OK;
+}
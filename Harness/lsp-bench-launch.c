@@ -0,0 +1,177 @@
+//
+//  lsp-bench-launch.c
+//  LoginScriptPlugin harness
+//
+//  Compares launching user scripts through lsp-launcher with forking them
+//  in the plugin's host: logins run no-op postmount-user scripts one
+//  after the other, first with UseLauncher on and then off, and the time
+//  each script takes is printed as percentiles for both. The host can be
+//  made bigger, with resident memory and idle threads, to show what that
+//  costs a fork in it.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sysexits.h>
+
+#include "lsp-harness.h"
+#include "lsp-verify.h"
+
+static const char *const kMechanisms[] = {
+    "premount-root", "premount-user", "postmount-root", "postmount-user"
+};
+#define kNumMechanisms (sizeof(kMechanisms) / sizeof(*kMechanisms))
+
+static void Usage(void)
+{
+    fprintf(stderr,
+            "usage: lsp-bench-launch [-n logins] [-s scripts] [-m MB] [-t threads]\n"
+            "  -n logins   logins to time with each, default 200\n"
+            "  -s scripts  no-op postmount-user scripts, default 8\n"
+            "  -m MB       resident memory to add to the host, default 0\n"
+            "  -t threads  idle threads to add to the host, default 0\n");
+}
+
+static void *IdleThread(void *arg)
+{
+    for (;;) {
+        pause();
+    }
+    return NULL;
+}
+
+/// Time logins with UseLauncher set to useLauncher, in a new instance of
+/// the plugin, and put the time per script into perScript.
+///
+/// With the launcher, the scripts deny if they're children of the host,
+/// so a launcher that isn't used shows up as denied logins.
+static bool TimeLogins(bool useLauncher, long numLogins, long numScripts, uint64_t *perScript)
+{
+    HarnessPlugin plugin;
+    HarnessEngine engine;
+    AuthorizationResult result;
+    char settings[128];
+    char name[64];
+    char body[128];
+    uint64_t start;
+    long i;
+    
+    HarnessClearDir(kLoginScriptDir);
+    snprintf(settings, sizeof(settings), "UseLauncher = %s\n", useLauncher ? "yes" : "no");
+    if (! HarnessWriteFile(kLoginScriptDir, kSettingsName, settings, 0644)) {
+        return false;
+    }
+    snprintf(body, sizeof(body), useLauncher ? "[ $PPID = %d ] && exit 77\nexit 0\n" : "exit 0\n", (int)getpid());
+    for (i = 0; i < numScripts; i++) {
+        snprintf(name, sizeof(name), "postmount-user-%03ld", i);
+        if (! HarnessWriteScript(kLoginScriptDir, name, body)) {
+            return false;
+        }
+    }
+    if (! HarnessCreate(&plugin)) {
+        return false;
+    }
+    
+    // The first login indexes the scripts and starts lsp-launcher.
+    for (i = -1; i < numLogins; i++) {
+        HarnessEngineInit(&engine, 10000 + (uid_t)((i + 1) % 100), 10000, "/");
+        start = HarnessTime();
+        result = HarnessLogin(&plugin, &engine, kMechanisms, kNumMechanisms);
+        if (result != kAuthorizationResultAllow) {
+            fprintf(stderr, "lsp-bench-launch: a login with UseLauncher %s wasn't allowed%s\n",
+                    useLauncher ? "on" : "off", useLauncher ? ", is lsp-launcher running?" : "");
+            HarnessDestroy(&plugin);
+            return false;
+        }
+        if (i >= 0) {
+            perScript[i] = (HarnessTime() - start) / (uint64_t)numScripts;
+        }
+    }
+    HarnessDestroy(&plugin);
+    
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t thread;
+    uint64_t *launcher;
+    uint64_t *inHost;
+    char *ballast;
+    long numLogins;
+    long numScripts;
+    long megabytes;
+    long numThreads;
+    long i;
+    int ch;
+    
+    numLogins = 200;
+    numScripts = 8;
+    megabytes = 0;
+    numThreads = 0;
+    while ((ch = getopt(argc, argv, "n:s:m:t:h")) != -1) {
+        switch (ch) {
+            case 'n':
+                numLogins = HarnessNumberArg(optarg, "logins", 1, 1000000);
+                break;
+            case 's':
+                numScripts = HarnessNumberArg(optarg, "scripts", 1, 100);
+                break;
+            case 'm':
+                megabytes = HarnessNumberArg(optarg, "MB", 0, 65536);
+                break;
+            case 't':
+                numThreads = HarnessNumberArg(optarg, "threads", 0, 4096);
+                break;
+            default:
+                Usage();
+                return EX_USAGE;
+        }
+    }
+    if (optind != argc) {
+        Usage();
+        return EX_USAGE;
+    }
+    if (! HarnessPreflight(kLoginScriptDir, LSP_STATE_DIR)) {
+        return kHarnessSkipped;
+    }
+    
+    // Touch every page, so the ballast is resident and a fork has to copy
+    // its page tables.
+    if (megabytes > 0) {
+        if ((ballast = malloc((size_t)megabytes << 20)) == NULL) {
+            return EX_OSERR;
+        }
+        memset(ballast, 1, (size_t)megabytes << 20);
+    }
+    for (i = 0; i < numThreads; i++) {
+        if (pthread_create(&thread, NULL, IdleThread, NULL) != 0) {
+            return EX_OSERR;
+        }
+        pthread_detach(thread);
+    }
+    
+    launcher = calloc((size_t)numLogins, sizeof(*launcher));
+    inHost = calloc((size_t)numLogins, sizeof(*inHost));
+    if (launcher == NULL || inHost == NULL) {
+        return EX_OSERR;
+    }
+    if (! TimeLogins(true, numLogins, numScripts, launcher) || ! TimeLogins(false, numLogins, numScripts, inHost)) {
+        return EX_SOFTWARE;
+    }
+    if (HarnessLoggedCount(LOG_ERR) > 0) {
+        fprintf(stderr, "lsp-bench-launch: the plugin logged errors, set LSP_HARNESS_LOG to a file to see them\n");
+        return EX_SOFTWARE;
+    }
+    
+    printf("%ld logins, %ld postmount-user scripts each, host %llu KB resident with %ld extra threads\n",
+           numLogins, numScripts, (unsigned long long)HarnessResidentKB(), numThreads);
+    HarnessReport("per script, lsp-launcher", launcher, (size_t)numLogins);
+    HarnessReport("per script, forked in host", inHost, (size_t)numLogins);
+    
+    return EX_OK;
+}
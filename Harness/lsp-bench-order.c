@@ -0,0 +1,175 @@
+//
+//  lsp-bench-order.c
+//  LoginScriptPlugin harness
+//
+//  Shows what ordering scripts by their history saves: a phase has slow
+//  scripts that always allow, a quick check, and a gatekeeper that comes
+//  last by name and denies half of the logins. Logins are timed with
+//  ScriptOrder = name and then history, after the plugin has seen enough
+//  of them to learn which script denies, and the time allowed and denied
+//  logins take is printed as percentiles for both.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <syslog.h>
+#include <sysexits.h>
+
+#include "lsp-harness.h"
+#include "lsp-verify.h"
+#include "lsp-stats.h"
+
+enum {
+    kOrderDeniedEvery = 2,              // every other uid is denied
+    kOrderWarmUp = 20                   // logins before timing, for the history
+};
+
+static const char *const kMechanisms[] = {
+    "premount-root", "premount-user", "postmount-root", "postmount-user"
+};
+#define kNumMechanisms (sizeof(kMechanisms) / sizeof(*kMechanisms))
+
+static void Usage(void)
+{
+    fprintf(stderr,
+            "usage: lsp-bench-order [-n logins] [-s scripts] [-d ms]\n"
+            "  -n logins   logins to time with each order, default 200\n"
+            "  -s scripts  slow scripts ahead of the gatekeeper, default 4\n"
+            "  -d ms       how long each slow script runs, default 50\n");
+}
+
+/// Time logins with ScriptOrder set to order, in a new instance of the
+/// plugin with no history, and put the times of allowed and denied logins
+/// into allowed and denied.
+static bool TimeLogins(const char *order, long numLogins, uint64_t *allowed, size_t *outAllowed,
+                       uint64_t *denied, size_t *outDenied)
+{
+    HarnessPlugin plugin;
+    HarnessEngine engine;
+    AuthorizationResult result;
+    AuthorizationResult expected;
+    char settings[64];
+    uint64_t elapsed;
+    uint64_t start;
+    long i;
+    
+    snprintf(settings, sizeof(settings), "ScriptOrder = %s\n", order);
+    if (! HarnessWriteFile(kLoginScriptDir, kSettingsName, settings, 0644)) {
+        return false;
+    }
+    unlink(LSP_STATE_DIR "/" kStatsName);
+    if (! HarnessCreate(&plugin)) {
+        return false;
+    }
+    
+    *outAllowed = *outDenied = 0;
+    for (i = -kOrderWarmUp; i < numLogins; i++) {
+        HarnessEngineInit(&engine, 10000 + (uid_t)(i + kOrderWarmUp) % 100, 10000, "/");
+        expected = engine.fUid % kOrderDeniedEvery == 0 ? kAuthorizationResultDeny : kAuthorizationResultAllow;
+        start = HarnessTime();
+        result = HarnessLogin(&plugin, &engine, kMechanisms, kNumMechanisms);
+        elapsed = HarnessTime() - start;
+        if (result != expected) {
+            fprintf(stderr, "lsp-bench-order: login %ld with ScriptOrder %s didn't get the expected result\n",
+                    i, order);
+            HarnessDestroy(&plugin);
+            return false;
+        }
+        if (i < 0) {
+            continue;
+        }
+        if (result == kAuthorizationResultAllow) {
+            allowed[(*outAllowed)++] = elapsed;
+        } else {
+            denied[(*outDenied)++] = elapsed;
+        }
+    }
+    HarnessDestroy(&plugin);
+    
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *const orders[] = { "name", "history" };
+    uint64_t *allowed;
+    uint64_t *denied;
+    char name[64];
+    char label[64];
+    char body[128];
+    size_t numAllowed;
+    size_t numDenied;
+    size_t i;
+    long numLogins;
+    long numScripts;
+    long duration;
+    int ch;
+    
+    numLogins = 200;
+    numScripts = 4;
+    duration = 50;
+    while ((ch = getopt(argc, argv, "n:s:d:h")) != -1) {
+        switch (ch) {
+            case 'n':
+                numLogins = HarnessNumberArg(optarg, "logins", 1, 1000000);
+                break;
+            case 's':
+                numScripts = HarnessNumberArg(optarg, "scripts", 0, 100);
+                break;
+            case 'd':
+                duration = HarnessNumberArg(optarg, "ms", 0, 10000);
+                break;
+            default:
+                Usage();
+                return EX_USAGE;
+        }
+    }
+    if (optind != argc) {
+        Usage();
+        return EX_USAGE;
+    }
+    if (! HarnessPreflight(kLoginScriptDir, LSP_STATE_DIR)) {
+        return kHarnessSkipped;
+    }
+    
+    // By name, the slow scripts come first, then the check and last the
+    // gatekeeper.
+    HarnessClearDir(kLoginScriptDir);
+    snprintf(body, sizeof(body), "sleep %ld.%03ld\n", duration / 1000, duration % 1000);
+    for (i = 0; i < (size_t)numScripts; i++) {
+        snprintf(name, sizeof(name), "postmount-root-%02zu-inventory", 10 + i);
+        if (! HarnessWriteScript(kLoginScriptDir, name, body)) {
+            return EX_CANTCREAT;
+        }
+    }
+    snprintf(body, sizeof(body), "[ $(($1 %% %d)) = 0 ] && exit 77\nexit 0\n", kOrderDeniedEvery);
+    if (! HarnessWriteScript(kLoginScriptDir, "postmount-root-80-check", "exit 0\n")
+        || ! HarnessWriteScript(kLoginScriptDir, "postmount-root-90-gatekeeper", body)) {
+        return EX_CANTCREAT;
+    }
+    
+    allowed = calloc((size_t)numLogins, sizeof(*allowed));
+    denied = calloc((size_t)numLogins, sizeof(*denied));
+    if (allowed == NULL || denied == NULL) {
+        return EX_OSERR;
+    }
+    printf("%ld logins, %ld slow scripts of %ld ms, a check and a gatekeeper that denies 1 in %d\n",
+           numLogins, numScripts, duration, kOrderDeniedEvery);
+    for (i = 0; i < sizeof(orders) / sizeof(*orders); i++) {
+        if (! TimeLogins(orders[i], numLogins, allowed, &numAllowed, denied, &numDenied)) {
+            return EX_SOFTWARE;
+        }
+        snprintf(label, sizeof(label), "allowed, by %s", orders[i]);
+        HarnessReport(label, allowed, numAllowed);
+        snprintf(label, sizeof(label), "denied, by %s", orders[i]);
+        HarnessReport(label, denied, numDenied);
+    }
+    if (HarnessLoggedCount(LOG_ERR) > 0) {
+        fprintf(stderr, "lsp-bench-order: the plugin logged errors, set LSP_HARNESS_LOG to a file to see them\n");
+        return EX_SOFTWARE;
+    }
+    
+    return EX_OK;
+}
@@ -0,0 +1,175 @@
+//
+//  lsp-bench-overhead.c
+//  LoginScriptPlugin harness
+//
+//  Measures what the plugin adds to a login: logins run all four
+//  mechanisms, with no-op scripts in the postmount ones, in a script
+//  directory at the end of a deep chain, and the overhead the plugin
+//  reports for each login is printed as percentiles next to the time the
+//  login took and the time the same scripts take when run directly.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <syslog.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sysexits.h>
+
+#include "lsp-harness.h"
+#include "lsp-verify.h"
+
+extern char **environ;
+
+static const char *const kMechanisms[] = {
+    "premount-root", "premount-user", "postmount-root", "postmount-user"
+};
+#define kNumMechanisms (sizeof(kMechanisms) / sizeof(*kMechanisms))
+
+static void Usage(void)
+{
+    fprintf(stderr,
+            "usage: lsp-bench-overhead [-n logins] [-s scripts]\n"
+            "  -n logins   logins to time, default 500\n"
+            "  -s scripts  no-op scripts in each postmount mechanism, default 8\n");
+}
+
+/// Run the scripts one after the other, like the plugin does with
+/// MaxConcurrentScripts = 1, but without it.
+static uint64_t RunDirectly(char **paths, size_t numPaths)
+{
+    char *argv[3];
+    uint64_t start;
+    size_t i;
+    pid_t pid;
+    int status;
+    
+    start = HarnessTime();
+    for (i = 0; i < numPaths; i++) {
+        argv[0] = paths[i];
+        argv[1] = "0";
+        argv[2] = NULL;
+        if (posix_spawn(&pid, paths[i], NULL, NULL, argv, environ) == 0) {
+            waitpid(pid, &status, 0);
+        }
+    }
+    return HarnessTime() - start;
+}
+
+int main(int argc, char *argv[])
+{
+    HarnessPlugin plugin;
+    HarnessEngine engine;
+    AuthorizationResult result;
+    char name[64];
+    char **paths;
+    uint64_t *logins;
+    uint64_t *direct;
+    uint64_t *samples;
+    uint64_t *overhead;
+    uint64_t start;
+    size_t numSamples;
+    size_t numPaths;
+    size_t i;
+    size_t m;
+    long numLogins;
+    long numScripts;
+    int ch;
+    
+    numLogins = 500;
+    numScripts = 8;
+    while ((ch = getopt(argc, argv, "n:s:h")) != -1) {
+        switch (ch) {
+            case 'n':
+                numLogins = HarnessNumberArg(optarg, "logins", 1, 1000000);
+                break;
+            case 's':
+                numScripts = HarnessNumberArg(optarg, "scripts", 0, 100);
+                break;
+            default:
+                Usage();
+                return EX_USAGE;
+        }
+    }
+    if (optind != argc) {
+        Usage();
+        return EX_USAGE;
+    }
+    if (! HarnessPreflight(kLoginScriptDir, LSP_STATE_DIR)) {
+        return kHarnessSkipped;
+    }
+    
+    HarnessClearDir(kLoginScriptDir);
+    HarnessWriteFile(kLoginScriptDir, kSettingsName, "LogLevel = info\n", 0644);
+    numPaths = 0;
+    if ((paths = calloc((size_t)numScripts * 2 + 1, sizeof(*paths))) == NULL) {
+        return EX_OSERR;
+    }
+    for (i = 0; i < (size_t)numScripts * 2; i++) {
+        snprintf(name, sizeof(name), "%s-%03zu", i % 2 ? "postmount-user" : "postmount-root", i / 2);
+        if (! HarnessWriteScript(kLoginScriptDir, name, "exit 0\n")) {
+            return EX_CANTCREAT;
+        }
+        if (asprintf(&paths[numPaths++], "%s/%s", kLoginScriptDir, name) == -1) {
+            return EX_OSERR;
+        }
+    }
+    
+    logins = calloc((size_t)numLogins, sizeof(*logins));
+    direct = calloc((size_t)numLogins, sizeof(*direct));
+    overhead = calloc((size_t)numLogins, sizeof(*overhead));
+    samples = calloc((size_t)numLogins * kNumMechanisms, sizeof(*samples));
+    if (logins == NULL || direct == NULL || overhead == NULL || samples == NULL
+        || ! HarnessCreate(&plugin)) {
+        return EX_OSERR;
+    }
+    
+    // The first login indexes the scripts and starts lsp-launcher, and if
+    // the plugin logs errors the numbers would be off.
+    HarnessEngineInit(&engine, 10000, 10000, "/");
+    result = HarnessLogin(&plugin, &engine, kMechanisms, kNumMechanisms);
+    if (result != kAuthorizationResultAllow || HarnessLoggedCount(LOG_ERR) > 0) {
+        fprintf(stderr, "lsp-bench-overhead: the first login failed or logged errors, "
+                "set LSP_HARNESS_LOG to a file to see why\n");
+        return EX_SOFTWARE;
+    }
+    HarnessTakeOverhead(samples, (size_t)numLogins * kNumMechanisms, kNumMechanisms, 1000);
+    
+    for (i = 0; i < (size_t)numLogins; i++) {
+        HarnessEngineInit(&engine, 10000 + (uid_t)(i % 100), 10000, "/");
+        start = HarnessTime();
+        result = HarnessLogin(&plugin, &engine, kMechanisms, kNumMechanisms);
+        logins[i] = HarnessTime() - start;
+        if (result != kAuthorizationResultAllow) {
+            fprintf(stderr, "lsp-bench-overhead: login %zu wasn't allowed\n", i);
+            return EX_SOFTWARE;
+        }
+        direct[i] = RunDirectly(paths, numPaths);
+    }
+    
+    // Every mechanism logs its overhead, in order.
+    numSamples = HarnessTakeOverhead(samples, (size_t)numLogins * kNumMechanisms,
+                                     (size_t)numLogins * kNumMechanisms, 5000);
+    HarnessDestroy(&plugin);
+    
+    printf("%ld logins, %ld scripts in each postmount mechanism, scripts in %s\n",
+           numLogins, numScripts, kLoginScriptDir);
+    HarnessReport("login", logins, (size_t)numLogins);
+    HarnessReport("scripts run directly", direct, (size_t)numLogins);
+    if (numSamples == (size_t)numLogins * kNumMechanisms) {
+        for (i = 0; i < (size_t)numLogins; i++) {
+            for (m = 0; m < kNumMechanisms; m++) {
+                overhead[i] += samples[i * kNumMechanisms + m];
+            }
+        }
+        HarnessReport("plugin overhead per login", overhead, (size_t)numLogins);
+    } else {
+        fprintf(stderr, "lsp-bench-overhead: expected %zu overhead samples, the plugin logged %zu\n",
+                (size_t)numLogins * kNumMechanisms, numSamples);
+    }
+    HarnessReport("plugin overhead per mechanism", samples, numSamples);
+    
+    return numSamples == (size_t)numLogins * kNumMechanisms ? EX_OK : EX_SOFTWARE;
+}
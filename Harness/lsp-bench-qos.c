@@ -0,0 +1,205 @@
+//
+//  lsp-bench-qos.c
+//  LoginScriptPlugin harness
+//
+//  Shows what lsp-qos does for the scripts a user is waiting on when
+//  other scripts are busy: a phase runs a foreground script, which does a
+//  fixed amount of work and logs how long it took, at the same time as
+//  scripts that burn CPU, all on one CPU. Logins are timed with the
+//  foreground script alone, with every script in the default class, and
+//  with the foreground script interactive and the others background, and
+//  the foreground script's times are printed as percentiles for each.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <syslog.h>
+#include <sched.h>
+#include <sysexits.h>
+
+#include "lsp-harness.h"
+#include "lsp-verify.h"
+
+static const char *const kMechanisms[] = {
+    "premount-root", "premount-user", "postmount-root", "postmount-user"
+};
+#define kNumMechanisms (sizeof(kMechanisms) / sizeof(*kMechanisms))
+
+/// How a run sets up the phase.
+struct QoSRun {
+    const char *fLabel;
+    bool fBurners;                      // with the CPU burners
+    const char *fForegroundQoS;         // lsp-qos lines, or ""
+    const char *fBurnerQoS;
+};
+typedef struct QoSRun QoSRun;
+
+static const QoSRun kRuns[] = {
+    { "foreground alone", false, "", "" },
+    { "all default", true, "", "" },
+    { "interactive, background", true, "# lsp-qos: interactive\n", "# lsp-qos: background\n" }
+};
+#define kNumRuns (sizeof(kRuns) / sizeof(*kRuns))
+
+static void Usage(void)
+{
+    fprintf(stderr,
+            "usage: lsp-bench-qos [-n logins] [-b burners] [-w work]\n"
+            "  -n logins   logins to time in each run, default 30\n"
+            "  -b burners  scripts burning CPU next to the foreground one, default 3\n"
+            "  -w work     loop iterations in the foreground script, default 20000,\n"
+            "              and four times as many in each burner\n");
+}
+
+/// Run logins with the scripts set up for run, and put how long the
+/// foreground script took in each into times, as it logged to timeLog.
+static bool TimeLogins(const QoSRun *run, long numLogins, long numBurners, long work,
+                       const char *timeLog, uint64_t *times)
+{
+    HarnessPlugin plugin;
+    HarnessEngine engine;
+    unsigned long long start;
+    unsigned long long end;
+    char settings[128];
+    char name[64];
+    char body[MAXPATHLEN + 256];
+    FILE *file;
+    long i;
+    
+    HarnessClearDir(kLoginScriptDir);
+    snprintf(settings, sizeof(settings),
+             "MaxConcurrentScripts = %ld\n"
+             "MaxBackgroundScripts = %ld\n", numBurners + 1, numBurners);
+    if (! HarnessWriteFile(kLoginScriptDir, kSettingsName, settings, 0644)) {
+        return false;
+    }
+    snprintf(body, sizeof(body),
+             "%s"
+             "start=$(date +%%s%%N)\n"
+             "i=0; while [ $i -lt %ld ]; do i=$((i + 1)); done\n"
+             "echo $start $(date +%%s%%N) >> %s\n",
+             run->fForegroundQoS, work, timeLog);
+    if (! HarnessWriteScript(kLoginScriptDir, "postmount-root-90-foreground", body)) {
+        return false;
+    }
+    snprintf(body, sizeof(body),
+             "%s"
+             "i=0; while [ $i -lt %ld ]; do i=$((i + 1)); done\n",
+             run->fBurnerQoS, work * 4);
+    for (i = 0; run->fBurners && i < numBurners; i++) {
+        snprintf(name, sizeof(name), "postmount-root-%02ld-burner", 10 + i);
+        if (! HarnessWriteScript(kLoginScriptDir, name, body)) {
+            return false;
+        }
+    }
+    unlink(timeLog);
+    if (! HarnessCreate(&plugin)) {
+        return false;
+    }
+    for (i = 0; i < numLogins; i++) {
+        HarnessEngineInit(&engine, 10000 + (uid_t)(i % 100), 10000, "/");
+        if (HarnessLogin(&plugin, &engine, kMechanisms, kNumMechanisms) != kAuthorizationResultAllow) {
+            fprintf(stderr, "lsp-bench-qos: a login with %s wasn't allowed\n", run->fLabel);
+            HarnessDestroy(&plugin);
+            return false;
+        }
+    }
+    HarnessDestroy(&plugin);
+    
+    if ((file = fopen(timeLog, "re")) == NULL) {
+        fprintf(stderr, "lsp-bench-qos: can't read %s\n", timeLog);
+        return false;
+    }
+    for (i = 0; i < numLogins && fscanf(file, "%llu %llu", &start, &end) == 2; i++) {
+        times[i] = end > start ? (end - start) / 1000 : 0;
+    }
+    fclose(file);
+    if (i < numLogins) {
+        fprintf(stderr, "lsp-bench-qos: the foreground script logged %ld times for %ld logins\n", i, numLogins);
+        return false;
+    }
+    
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    cpu_set_t cpus;
+    char timeLog[MAXPATHLEN];
+    char *slash;
+    uint64_t *times;
+    size_t i;
+    long numLogins;
+    long numBurners;
+    long work;
+    int cpu;
+    int ch;
+    
+    numLogins = 30;
+    numBurners = 3;
+    work = 20000;
+    while ((ch = getopt(argc, argv, "n:b:w:h")) != -1) {
+        switch (ch) {
+            case 'n':
+                numLogins = HarnessNumberArg(optarg, "logins", 1, 100000);
+                break;
+            case 'b':
+                numBurners = HarnessNumberArg(optarg, "burners", 1, 32);
+                break;
+            case 'w':
+                work = HarnessNumberArg(optarg, "work", 1, 100000000);
+                break;
+            default:
+                Usage();
+                return EX_USAGE;
+        }
+    }
+    if (optind != argc) {
+        Usage();
+        return EX_USAGE;
+    }
+    if (! HarnessPreflight(kLoginScriptDir, LSP_STATE_DIR)) {
+        return kHarnessSkipped;
+    }
+    
+    // Everything runs on the first CPU this process may use, so the
+    // scripts have to share it, however many the host has. lsp-launcher
+    // and the scripts inherit it.
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0) {
+        return EX_OSERR;
+    }
+    for (cpu = 0; cpu < CPU_SETSIZE && ! CPU_ISSET(cpu, &cpus); cpu++)
+        ;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+        return EX_OSERR;
+    }
+    
+    // The foreground script logs its times next to the state directory.
+    strlcpy(timeLog, LSP_STATE_DIR, sizeof(timeLog));
+    if ((slash = strrchr(timeLog, '/')) != NULL) {
+        *slash = '\0';
+    }
+    strlcat(timeLog, "/foreground", sizeof(timeLog));
+    
+    if ((times = calloc((size_t)numLogins, sizeof(*times))) == NULL) {
+        return EX_OSERR;
+    }
+    printf("%ld logins, a foreground script looping %ld times and %ld burners looping %ld times, on CPU %d\n",
+           numLogins, work, numBurners, work * 4, cpu);
+    for (i = 0; i < kNumRuns; i++) {
+        if (! TimeLogins(&kRuns[i], numLogins, numBurners, work, timeLog, times)) {
+            return EX_SOFTWARE;
+        }
+        HarnessReport(kRuns[i].fLabel, times, (size_t)numLogins);
+    }
+    if (HarnessLoggedCount(LOG_ERR) > 0) {
+        fprintf(stderr, "lsp-bench-qos: the plugin logged errors, set LSP_HARNESS_LOG to a file to see them\n");
+        return EX_SOFTWARE;
+    }
+    
+    return EX_OK;
+}
@@ -0,0 +1,238 @@
+//
+//  lsp-bench-spawn.c
+//  LoginScriptPlugin harness
+//
+//  Compares the ways a root script can be started from a host with a large
+//  descriptor table: logins run no-op postmount-root scripts, first with
+//  no limits, so the plugin uses posix_spawn(), then with ScriptLimits
+//  set, so it forks and marks only the open descriptors for closing. Last,
+//  the harness forks the same scripts itself and sweeps every descriptor
+//  up to _SC_OPEN_MAX, as the plugin used to. The time each script takes
+//  is printed as percentiles for all three.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sysexits.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "lsp-harness.h"
+#include "lsp-verify.h"
+
+static const char *const kMechanisms[] = {
+    "premount-root", "premount-user", "postmount-root", "postmount-user"
+};
+#define kNumMechanisms (sizeof(kMechanisms) / sizeof(*kMechanisms))
+
+extern char **environ;
+
+static void Usage(void)
+{
+    fprintf(stderr,
+            "usage: lsp-bench-spawn [-n logins] [-s scripts] [-f fds]\n"
+            "  -n logins   logins to time with each, default 200\n"
+            "  -s scripts  no-op postmount-root scripts, default 8\n"
+            "  -f fds      descriptors to open in the host, at least 16, default 10000\n");
+}
+
+/// Time logins with settings, in a new instance of the plugin, and put the
+/// time per script into perScript.
+static bool TimeLogins(const char *label, const char *settings, long numLogins, long numScripts,
+                       uint64_t *perScript)
+{
+    HarnessPlugin plugin;
+    HarnessEngine engine;
+    AuthorizationResult result;
+    uint64_t start;
+    long i;
+    
+    if (! HarnessWriteFile(kLoginScriptDir, kSettingsName, settings, 0644)) {
+        return false;
+    }
+    if (! HarnessCreate(&plugin)) {
+        return false;
+    }
+    
+    // The first login indexes the scripts.
+    for (i = -1; i < numLogins; i++) {
+        HarnessEngineInit(&engine, 10000 + (uid_t)((i + 1) % 100), 10000, "/");
+        start = HarnessTime();
+        result = HarnessLogin(&plugin, &engine, kMechanisms, kNumMechanisms);
+        if (result != kAuthorizationResultAllow) {
+            fprintf(stderr, "lsp-bench-spawn: a login with %s wasn't allowed, did a descriptor leak?\n", label);
+            HarnessDestroy(&plugin);
+            return false;
+        }
+        if (i >= 0) {
+            perScript[i] = (HarnessTime() - start) / (uint64_t)numScripts;
+        }
+    }
+    HarnessDestroy(&plugin);
+    
+    return true;
+}
+
+/// Fork and execute a script the way the plugin used to, marking every
+/// descriptor up to _SC_OPEN_MAX for closing, and wait for it.
+///
+/// @return the script's exit status, or -1.
+static int ForkWithSweep(const char *path)
+{
+    char *argv[2];
+    pid_t childPid;
+    long maxfd;
+    long fd;
+    int status;
+    
+    argv[0] = (char *)path;
+    argv[1] = NULL;
+    childPid = fork();
+    if (childPid == -1) {
+        return -1;
+    } else if (childPid == 0) {
+        setpgid(0, 0);
+        maxfd = sysconf(_SC_OPEN_MAX);
+        for (fd = STDERR_FILENO + 1; fd < maxfd; fd++) {
+            if (fcntl((int)fd, F_SETFD, FD_CLOEXEC) == -1 && errno != EBADF) {
+                _exit(EX_OSERR);
+            }
+        }
+        execve(path, argv, environ);
+        _exit(EX_OSERR);
+    }
+    while (waitpid(childPid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/// Time the scripts forked with a full sweep, numLogins times, and put the
+/// time per script into perScript.
+static bool TimeSweeps(long numLogins, long numScripts, uint64_t *perScript)
+{
+    char path[MAXPATHLEN];
+    uint64_t start;
+    long i;
+    long j;
+    
+    for (i = 0; i < numLogins; i++) {
+        start = HarnessTime();
+        for (j = 0; j < numScripts; j++) {
+            snprintf(path, sizeof(path), "%s/postmount-root-%03ld", kLoginScriptDir, j);
+            if (ForkWithSweep(path) != 0) {
+                fprintf(stderr, "lsp-bench-spawn: %s failed when forked with a full sweep\n", path);
+                return false;
+            }
+        }
+        perScript[i] = (HarnessTime() - start) / (uint64_t)numScripts;
+    }
+    
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    struct rlimit files;
+    uint64_t *spawned;
+    uint64_t *bounded;
+    uint64_t *swept;
+    char name[64];
+    char body[128];
+    long numLogins;
+    long numScripts;
+    long numFDs;
+    long i;
+    int nullFD;
+    int fd;
+    int ch;
+    
+    numLogins = 200;
+    numScripts = 8;
+    numFDs = 10000;
+    while ((ch = getopt(argc, argv, "n:s:f:h")) != -1) {
+        switch (ch) {
+            case 'n':
+                numLogins = HarnessNumberArg(optarg, "logins", 1, 1000000);
+                break;
+            case 's':
+                numScripts = HarnessNumberArg(optarg, "scripts", 1, 100);
+                break;
+            case 'f':
+                numFDs = HarnessNumberArg(optarg, "fds", 16, 1000000);
+                break;
+            default:
+                Usage();
+                return EX_USAGE;
+        }
+    }
+    if (optind != argc) {
+        Usage();
+        return EX_USAGE;
+    }
+    if (! HarnessPreflight(kLoginScriptDir, LSP_STATE_DIR)) {
+        return kHarnessSkipped;
+    }
+    
+    // Raise the descriptor limit as far as it goes, as hosts that need a
+    // large table do, and fill the table up to the number asked for.
+    if (getrlimit(RLIMIT_NOFILE, &files) != 0) {
+        return EX_OSERR;
+    }
+    files.rlim_cur = files.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &files) != 0) {
+        return EX_OSERR;
+    }
+    if ((nullFD = open("/dev/null", O_RDONLY)) == -1) {
+        return EX_OSERR;
+    }
+    fd = nullFD;
+    for (i = 1; i < numFDs; i++) {
+        if ((fd = fcntl(nullFD, F_DUPFD, 0)) == -1) {
+            fprintf(stderr, "lsp-bench-spawn: opened %ld of %ld descriptors, errno %d\n", i, numFDs, errno);
+            return EX_OSERR;
+        }
+    }
+    
+    // The scripts fail if the last descriptor opened reaches them, which
+    // is above any they're meant to get.
+    HarnessClearDir(kLoginScriptDir);
+    snprintf(body, sizeof(body), "[ -e /dev/fd/%d ] && exit 77\nexit 0\n", fd);
+    for (i = 0; i < numScripts; i++) {
+        snprintf(name, sizeof(name), "postmount-root-%03ld", i);
+        if (! HarnessWriteScript(kLoginScriptDir, name, body)) {
+            return EX_CANTCREAT;
+        }
+    }
+    
+    spawned = calloc((size_t)numLogins, sizeof(*spawned));
+    bounded = calloc((size_t)numLogins, sizeof(*bounded));
+    swept = calloc((size_t)numLogins, sizeof(*swept));
+    if (spawned == NULL || bounded == NULL || swept == NULL) {
+        return EX_OSERR;
+    }
+    if (! TimeLogins("posix_spawn", "", numLogins, numScripts, spawned)
+        || ! TimeLogins("ScriptLimits", "ScriptLimits = cpu=3600\n", numLogins, numScripts, bounded)
+        || ! TimeSweeps(numLogins, numScripts, swept)) {
+        return EX_SOFTWARE;
+    }
+    if (HarnessLoggedCount(LOG_ERR) > 0) {
+        fprintf(stderr, "lsp-bench-spawn: the plugin logged errors, set LSP_HARNESS_LOG to a file to see them\n");
+        return EX_SOFTWARE;
+    }
+    
+    printf("%ld logins, %ld postmount-root scripts each, %ld descriptors open of %ld\n",
+           numLogins, numScripts, numFDs, sysconf(_SC_OPEN_MAX));
+    HarnessReport("per script, posix_spawn", spawned, (size_t)numLogins);
+    HarnessReport("per script, fork, open fds", bounded, (size_t)numLogins);
+    HarnessReport("per script, fork, full sweep", swept, (size_t)numLogins);
+    
+    return EX_OK;
+}
@@ -0,0 +1,380 @@
+//
+//  lsp-contend.c
+//  LoginScriptPlugin harness
+//
+//  Runs logins from many threads at once through one instance of the
+//  plugin, each with its own engine, so their scripts contend for the
+//  MaxTotalScripts slots of the plugin-wide pool. The scripts log when
+//  they start and end, and from that it checks that the pool never ran
+//  more than MaxTotalScripts at once and that no login waited longer for
+//  its first slot than fair sharing allows. Every login has to get its own
+//  result, and the time logins take under contention is printed as
+//  percentiles.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sysexits.h>
+
+#include "lsp-harness.h"
+#include "lsp-verify.h"
+
+enum {
+    kContendFirstUid = 10000,           // uid of the first login, the rest follow
+    kContendDeniedEvery = 5             // every 5th uid is denied by the last script
+};
+
+static const char *const kMechanisms[] = {
+    "premount-root", "premount-user", "postmount-root", "postmount-user"
+};
+#define kNumMechanisms (sizeof(kMechanisms) / sizeof(*kMechanisms))
+
+/// What's known about one login once the threads are done: when it
+/// started and ended, from the harness, and when its first script started
+/// and how many of its scripts never logged an end, from the event log.
+struct ContendLogin {
+    uint64_t fBegin;                    // realtime nanoseconds
+    uint64_t fEnd;
+    uint64_t fFirstStart;               // or 0 if no script started
+    long fUnfinished;                   // scripts that logged a start but no end
+    AuthorizationResult fResult;
+};
+typedef struct ContendLogin ContendLogin;
+
+/// An event from the log, +1 for a script starting and -1 for one ending.
+struct ContendEvent {
+    uint64_t fTime;
+    int fDelta;
+};
+typedef struct ContendEvent ContendEvent;
+
+static HarnessPlugin gPlugin;
+static ContendLogin *gLogins;
+static long gNumThreads;
+static long gLoginsPerThread;
+
+static void Usage(void)
+{
+    fprintf(stderr,
+            "usage: lsp-contend [-t threads] [-n logins] [-s scripts] [-c total] [-d ms]\n"
+            "  -t threads  logins running at once, default 16\n"
+            "  -n logins   logins per thread, default 10\n"
+            "  -s scripts  scripts in each login, default 4\n"
+            "  -c total    MaxTotalScripts, default 8\n"
+            "  -d ms       how long each script runs, default 200\n");
+}
+
+/// Wall clock nanoseconds, which is what date +%s%N in the scripts gives.
+static uint64_t RealTime(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static void *LoginThread(void *arg)
+{
+    HarnessEngine engine;
+    ContendLogin *login;
+    long thread;
+    long i;
+    
+    thread = (long)arg;
+    for (i = 0; i < gLoginsPerThread; i++) {
+        login = &gLogins[thread * gLoginsPerThread + i];
+        HarnessEngineInit(&engine, kContendFirstUid + (uid_t)(login - gLogins), 10000, "/");
+        login->fBegin = RealTime();
+        login->fResult = HarnessLogin(&gPlugin, &engine, kMechanisms, kNumMechanisms);
+        login->fEnd = RealTime();
+    }
+    return NULL;
+}
+
+/// Ends sort before starts at the same time, so a slot that's handed
+/// straight over isn't counted twice.
+static int CompareEvents(const void *a, const void *b)
+{
+    const ContendEvent *ea = a;
+    const ContendEvent *eb = b;
+    
+    if (ea->fTime != eb->fTime) {
+        return ea->fTime < eb->fTime ? -1 : 1;
+    }
+    return ea->fDelta - eb->fDelta;
+}
+
+/// Read the event log into events, noting each login's first start and
+/// unfinished scripts.
+///
+/// @return the number of events, or 0 if the log can't be read.
+static size_t ReadEvents(const char *path, size_t numLogins, ContendEvent **outEvents)
+{
+    ContendEvent *events;
+    ContendEvent *grown;
+    ContendLogin *login;
+    unsigned long long time;
+    size_t numEvents;
+    size_t maxEvents;
+    unsigned uid;
+    char line[128];
+    char kind[8];
+    FILE *file;
+    
+    if ((file = fopen(path, "re")) == NULL) {
+        fprintf(stderr, "lsp-contend: can't read %s\n", path);
+        return 0;
+    }
+    numEvents = 0;
+    maxEvents = 1024;
+    events = malloc(maxEvents * sizeof(*events));
+    while (events != NULL && fgets(line, sizeof(line), file) != NULL) {
+        // A script that's terminated while date runs logs no time.
+        if (sscanf(line, "%7s %u %llu", kind, &uid, &time) != 3
+            || uid < kContendFirstUid || uid - kContendFirstUid >= numLogins) {
+            continue;
+        }
+        login = &gLogins[uid - kContendFirstUid];
+        if (numEvents == maxEvents) {
+            maxEvents *= 2;
+            if ((grown = realloc(events, maxEvents * sizeof(*events))) == NULL) {
+                free(events);
+            }
+            events = grown;
+        }
+        events[numEvents].fTime = time;
+        if (strcmp(kind, "start") == 0) {
+            events[numEvents].fDelta = 1;
+            login->fUnfinished++;
+            if (login->fFirstStart == 0 || time < login->fFirstStart) {
+                login->fFirstStart = time;
+            }
+        } else if (login->fUnfinished > 0) {
+            events[numEvents].fDelta = -1;
+            login->fUnfinished--;
+        } else {
+            // A script that was terminated before it logged its start, or
+            // without its time.
+            continue;
+        }
+        numEvents++;
+    }
+    fclose(file);
+    if (events == NULL) {
+        fprintf(stderr, "lsp-contend: out of memory\n");
+        return 0;
+    }
+        *outEvents = events;
+    return numEvents;
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t *threads;
+    ContendEvent *events;
+    AuthorizationResult expected;
+    char settings[256];
+    char eventLog[MAXPATHLEN];
+    char name[64];
+    char body[MAXPATHLEN * 3 + 256];
+    char *slash;
+    uint64_t *latency;
+    uint64_t *waits;
+    uint64_t runStart;
+    uint64_t round;
+    uint64_t bound;
+    size_t numLogins;
+    size_t numEvents;
+    size_t numStarts;
+    size_t wrong;
+    size_t unfinished;
+    size_t late;
+    size_t i;
+    long numScripts;
+    long maxTotal;
+    long duration;
+    long running;
+    long maxRunning;
+    bool failed;
+    int len;
+    int ch;
+    
+    gNumThreads = 16;
+    gLoginsPerThread = 10;
+    numScripts = 4;
+    maxTotal = 8;
+    duration = 200;
+    while ((ch = getopt(argc, argv, "t:n:s:c:d:h")) != -1) {
+        switch (ch) {
+            case 't':
+                gNumThreads = HarnessNumberArg(optarg, "threads", 1, 256);
+                break;
+            case 'n':
+                gLoginsPerThread = HarnessNumberArg(optarg, "logins", 1, 100000);
+                break;
+            case 's':
+                numScripts = HarnessNumberArg(optarg, "scripts", 1, 64);
+                break;
+            case 'c':
+                maxTotal = HarnessNumberArg(optarg, "total", 1, 256);
+                break;
+            case 'd':
+                duration = HarnessNumberArg(optarg, "ms", 10, 10000);
+                break;
+            default:
+                Usage();
+                return EX_USAGE;
+        }
+    }
+    if (optind != argc) {
+        Usage();
+        return EX_USAGE;
+    }
+    if (! HarnessPreflight(kLoginScriptDir, LSP_STATE_DIR)) {
+        return kHarnessSkipped;
+    }
+    
+    // The event log goes next to the state directory, where the scripts,
+    // which run as root, can append to it.
+    strlcpy(eventLog, LSP_STATE_DIR, sizeof(eventLog));
+    if ((slash = strrchr(eventLog, '/')) != NULL) {
+        *slash = '\0';
+    }
+    strlcat(eventLog, "/events", sizeof(eventLog));
+    unlink(eventLog);
+    
+    // Each login can run all of its scripts at once, so only the pool holds
+    // them back.
+    HarnessClearDir(kLoginScriptDir);
+    snprintf(settings, sizeof(settings),
+             "MaxConcurrentScripts = %ld\n"
+             "MaxTotalScripts = %ld\n", numScripts, maxTotal);
+    if (! HarnessWriteFile(kLoginScriptDir, kSettingsName, settings, 0644)) {
+        return EX_CANTCREAT;
+    }
+    for (i = 0; i < (size_t)numScripts; i++) {
+        snprintf(name, sizeof(name), "postmount-root-%03zu", i);
+        len = snprintf(body, sizeof(body),
+                 "trap 'echo end $1 $(date +%%s%%N) >> %s; exit 1' TERM\n"
+                 "echo start $1 $(date +%%s%%N) >> %s\n"
+                 "sleep %ld.%03ld &\n"
+                 "wait\n"
+                 "echo end $1 $(date +%%s%%N) >> %s\n"
+                 "[ $(($1 %% %d)) = %d ] && exit 77\n"
+                 "exit 0\n",
+                 eventLog, eventLog, duration / 1000, duration % 1000, eventLog,
+                 kContendDeniedEvery, i + 1 == (size_t)numScripts ? kContendDeniedEvery - 1 : -1);
+        if (len < 0 || len >= (int)sizeof(body) || ! HarnessWriteScript(kLoginScriptDir, name, body)) {
+            return EX_CANTCREAT;
+        }
+    }
+    
+    numLogins = (size_t)gNumThreads * (size_t)gLoginsPerThread;
+    gLogins = calloc(numLogins, sizeof(*gLogins));
+    threads = calloc((size_t)gNumThreads, sizeof(*threads));
+    latency = calloc(numLogins, sizeof(*latency));
+    waits = calloc(numLogins, sizeof(*waits));
+    if (gLogins == NULL || threads == NULL || latency == NULL || waits == NULL || ! HarnessCreate(&gPlugin)) {
+        return EX_OSERR;
+    }
+    
+    printf("%ld threads, %ld logins each, %ld scripts of %ld ms per login, MaxTotalScripts = %ld\n",
+           gNumThreads, gLoginsPerThread, numScripts, duration, maxTotal);
+    runStart = RealTime();
+    for (i = 0; i < (size_t)gNumThreads; i++) {
+        if (pthread_create(&threads[i], NULL, LoginThread, (void *)(long)i) != 0) {
+            fprintf(stderr, "lsp-contend: can't start a thread\n");
+            return EX_OSERR;
+        }
+    }
+    for (i = 0; i < (size_t)gNumThreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    round = (RealTime() - runStart) / 1000;
+    HarnessDestroy(&gPlugin);
+    
+    failed = false;
+    wrong = 0;
+    for (i = 0; i < numLogins; i++) {
+        expected = (i + kContendFirstUid) % kContendDeniedEvery == kContendDeniedEvery - 1
+            ? kAuthorizationResultDeny : kAuthorizationResultAllow;
+        if (gLogins[i].fResult != expected) {
+            wrong++;
+        }
+    }
+    if (wrong > 0) {
+        fprintf(stderr, "lsp-contend: %zu logins didn't get the expected result\n", wrong);
+        failed = true;
+    }
+    if (HarnessLoggedCount(LOG_ERR) > 0) {
+        fprintf(stderr, "lsp-contend: the plugin logged %zu errors, set LSP_HARNESS_LOG to a file to see them\n",
+                HarnessLoggedCount(LOG_ERR));
+        failed = true;
+    }
+    if ((numEvents = ReadEvents(eventLog, numLogins, &events)) == 0) {
+        return EX_SOFTWARE;
+    }
+    
+    // A script logs its start after it has taken its slot, and its end,
+    // even when it's terminated because its login was denied, before it's
+    // reaped and gives the slot back, so counting them can only come up
+    // short of what the pool had running.
+    unfinished = 0;
+    for (i = 0; i < numLogins; i++) {
+        unfinished += (size_t)gLogins[i].fUnfinished;
+    }
+    if (unfinished > 0) {
+        fprintf(stderr, "lsp-contend: %zu scripts didn't log their end\n", unfinished);
+        return EX_SOFTWARE;
+    }
+    qsort(events, numEvents, sizeof(*events), CompareEvents);
+    running = maxRunning = 0;
+    numStarts = 0;
+    for (i = 0; i < numEvents; i++) {
+        running += events[i].fDelta;
+        numStarts += events[i].fDelta > 0;
+        if (running > maxRunning) {
+            maxRunning = running;
+        }
+    }
+    if (maxRunning > maxTotal) {
+        fprintf(stderr, "lsp-contend: %ld scripts ran at once, MaxTotalScripts is %ld\n", maxRunning, maxTotal);
+        failed = true;
+    }
+    
+    // A login that's waiting for its first slot is behind at most the
+    // other threads' logins, which are waiting for their first slot too,
+    // and maxTotal slots come free every round, which is how long the pool
+    // took on average to run maxTotal scripts. It's longer than a script's
+    // duration by what starting and reaping scripts costs on this host.
+    // Two more rounds cover starting the login and its first script. A pool
+    // that let logins with scripts running go first would keep a login
+    // waiting for whole logins.
+    round = round * (uint64_t)maxTotal / (numStarts > 0 ? numStarts : 1);
+    bound = ((uint64_t)(gNumThreads + maxTotal - 1) / (uint64_t)maxTotal + 2) * round;
+    printf("%zu scripts, %ld at most at once, %.1f ms for each round of %ld\n",
+           numStarts, maxRunning, round / 1000.0, maxTotal);
+    late = 0;
+    for (i = 0; i < numLogins; i++) {
+        latency[i] = (gLogins[i].fEnd - gLogins[i].fBegin) / 1000;
+        waits[i] = gLogins[i].fFirstStart > gLogins[i].fBegin ? (gLogins[i].fFirstStart - gLogins[i].fBegin) / 1000 : 0;
+        if (gLogins[i].fFirstStart == 0 || waits[i] > bound) {
+            late++;
+        }
+    }
+    HarnessReport("login", latency, numLogins);
+    HarnessReport("wait for the first script", waits, numLogins);
+    if (late > 0) {
+        fprintf(stderr, "lsp-contend: %zu logins waited more than %.1f ms for their first script\n",
+                late, bound / 1000.0);
+        failed = true;
+    }
+    free(events);
+    
+    return failed ? EX_SOFTWARE : EX_OK;
+}
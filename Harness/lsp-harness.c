@@ -0,0 +1,720 @@
+//
+//  lsp-harness.c
+//  LoginScriptPlugin harness
+//
+//  A stand-in for the authorization engine, which drives LoginScriptPlugin
+//  through its plugin interface on Linux, and what the tests and
+//  benchmarks built on it share.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/errno.h>
+#include <sysexits.h>
+
+#include "lsp-harness.h"
+#include "lsp-verify.h"
+
+
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Logging Shim
+/////////////////////////////////////////////////////////////////////
+
+
+// The plugin logs with syslog() on Linux. These definitions take the place
+// of the C library's, so its messages come here instead: they're counted
+// by level, written to the file named by LSP_HARNESS_LOG if it's set, and
+// the overhead it reports for each mechanism is kept for the benchmarks.
+
+static pthread_mutex_t gLogLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gLogCond = PTHREAD_COND_INITIALIZER;
+static uint64_t *gOverhead;             // protected by gLogLock
+static size_t gNumOverhead;             // protected by gLogLock
+static size_t gLogged[LOG_DEBUG + 1];   // protected by gLogLock
+static FILE *gLogFile;                  // protected by gLogLock
+static bool gLogFileOpened;             // protected by gLogLock
+
+static void HarnessLogMessage(int priority, const char *message)
+{
+    static const char *const levels[] = {
+        "emergency", "alert", "critical", "error", "warning", "notice", "info", "debug"
+    };
+    const char *overhead;
+    const char *path;
+    char *end;
+    double ms;
+    int level;
+    
+    level = LOG_PRI(priority);
+    pthread_mutex_lock(&gLogLock);
+    gLogged[level]++;
+    if ((overhead = strstr(message, "plugin overhead ")) != NULL) {
+        ms = strtod(overhead + strlen("plugin overhead "), &end);
+        if (end != overhead + strlen("plugin overhead ") && ms >= 0.0) {
+            if (gOverhead == NULL) {
+                gOverhead = malloc(kHarnessMaxOverhead * sizeof(*gOverhead));
+            }
+            if (gOverhead != NULL && gNumOverhead < kHarnessMaxOverhead) {
+                gOverhead[gNumOverhead++] = (uint64_t)(ms * 1000.0 + 0.5);
+                pthread_cond_broadcast(&gLogCond);
+            }
+        }
+    }
+    if (! gLogFileOpened) {
+        gLogFileOpened = true;
+        if ((path = getenv("LSP_HARNESS_LOG")) != NULL && path[0] != '\0') {
+            gLogFile = fopen(path, "a");
+        }
+    }
+    if (gLogFile != NULL) {
+        fprintf(gLogFile, "%llu <%s>: %s\n", (unsigned long long)HarnessTime(), levels[level], message);
+        fflush(gLogFile);
+    }
+    pthread_mutex_unlock(&gLogLock);
+}
+
+void vsyslog(int priority, const char *format, va_list args)
+{
+    char message[2048];
+    
+    vsnprintf(message, sizeof(message), format, args);
+    HarnessLogMessage(priority, message);
+}
+
+void syslog(int priority, const char *format, ...)
+{
+    va_list args;
+    
+    va_start(args, format);
+    vsyslog(priority, format, args);
+    va_end(args);
+}
+
+// What syslog() becomes with _FORTIFY_SOURCE.
+void __vsyslog_chk(int priority, int flag, const char *format, va_list args)
+{
+    vsyslog(priority, format, args);
+}
+
+void __syslog_chk(int priority, int flag, const char *format, ...)
+{
+    va_list args;
+    
+    va_start(args, format);
+    vsyslog(priority, format, args);
+    va_end(args);
+}
+
+size_t HarnessTakeOverhead(uint64_t *values, size_t maxValues, size_t expected, long timeoutMs)
+{
+    struct timespec deadline;
+    size_t count;
+    
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (timeoutMs % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    
+    pthread_mutex_lock(&gLogLock);
+    while (gNumOverhead < expected && pthread_cond_timedwait(&gLogCond, &gLogLock, &deadline) == 0)
+        ;
+    count = gNumOverhead < maxValues ? gNumOverhead : maxValues;
+    if (count > 0) {
+        memcpy(values, gOverhead, count * sizeof(*values));
+    }
+    gNumOverhead = 0;
+    pthread_mutex_unlock(&gLogLock);
+    
+    return count;
+}
+
+size_t HarnessLoggedCount(int level)
+{
+    size_t count;
+    int i;
+    
+    count = 0;
+    pthread_mutex_lock(&gLogLock);
+    for (i = 0; i <= level && i <= LOG_DEBUG; i++) {
+        count += gLogged[i];
+    }
+    pthread_mutex_unlock(&gLogLock);
+    
+    return count;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Engine
+/////////////////////////////////////////////////////////////////////
+
+
+static OSStatus EngineSetResult(AuthorizationEngineRef inEngine, AuthorizationResult inResult)
+{
+    HarnessEngine *engine;
+    
+    engine = (HarnessEngine *) inEngine;
+    engine->fResult = inResult;
+    engine->fHasResult = true;
+    
+    return errAuthorizationSuccess;
+}
+
+static OSStatus EngineRequestInterrupt(AuthorizationEngineRef inEngine)
+{
+    return errAuthorizationInternal;
+}
+
+static OSStatus EngineDidDeactivate(AuthorizationEngineRef inEngine)
+{
+    HarnessEngine *engine;
+    
+    engine = (HarnessEngine *) inEngine;
+    engine->fDeactivated = true;
+    
+    return errAuthorizationSuccess;
+}
+
+/// Like the real engine, values that were never set aren't found.
+static OSStatus EngineGetContextValue(AuthorizationEngineRef inEngine,
+                                      AuthorizationString inKey,
+                                      AuthorizationContextFlags *outContextFlags,
+                                      const AuthorizationValue **outValue)
+{
+    HarnessEngine *engine;
+    
+    engine = (HarnessEngine *) inEngine;
+    if (strcmp(inKey, "uid") == 0) {
+        *outValue = &engine->fUidValue;
+    } else if (strcmp(inKey, "gid") == 0) {
+        *outValue = &engine->fGidValue;
+    } else if (strcmp(inKey, "home") == 0) {
+        *outValue = &engine->fHomeValue;
+    } else if (strcmp(inKey, "username") == 0) {
+        *outValue = &engine->fUsernameValue;
+    } else {
+        return errAuthorizationInternal;
+    }
+    if (outContextFlags != NULL) {
+        *outContextFlags = 0;
+    }
+    
+    return errAuthorizationSuccess;
+}
+
+static OSStatus EngineSetContextValue(AuthorizationEngineRef inEngine,
+                                      AuthorizationString inKey,
+                                      AuthorizationContextFlags inContextFlags,
+                                      const AuthorizationValue *inValue)
+{
+    return errAuthorizationInternal;
+}
+
+static OSStatus EngineGetHintValue(AuthorizationEngineRef inEngine,
+                                   AuthorizationString inKey,
+                                   const AuthorizationValue **outValue)
+{
+    return errAuthorizationInternal;
+}
+
+static OSStatus EngineSetHintValue(AuthorizationEngineRef inEngine,
+                                   AuthorizationString inKey,
+                                   const AuthorizationValue *inValue)
+{
+    return errAuthorizationInternal;
+}
+
+static OSStatus EngineGetArguments(AuthorizationEngineRef inEngine,
+                                   const AuthorizationValueVector **outArguments)
+{
+    return errAuthorizationInternal;
+}
+
+static OSStatus EngineGetSessionId(AuthorizationEngineRef inEngine,
+                                   AuthorizationSessionId *outSessionId)
+{
+    return errAuthorizationInternal;
+}
+
+static const AuthorizationCallbacks kEngineCallbacks = {
+    kAuthorizationCallbacksVersion,
+    EngineSetResult,
+    EngineRequestInterrupt,
+    EngineDidDeactivate,
+    EngineGetContextValue,
+    EngineSetContextValue,
+    EngineGetHintValue,
+    EngineSetHintValue,
+    EngineGetArguments,
+    EngineGetSessionId
+};
+
+void HarnessEngineInit(HarnessEngine *engine, uid_t uid, gid_t gid, const char *home)
+{
+    memset(engine, 0, sizeof(*engine));
+    engine->fUid = uid;
+    engine->fGid = gid;
+    strlcpy(engine->fHome, home, sizeof(engine->fHome));
+    snprintf(engine->fUsername, sizeof(engine->fUsername), "lsp%u", (unsigned)uid);
+    engine->fUidValue.length = sizeof(engine->fUid);
+    engine->fUidValue.data = &engine->fUid;
+    engine->fGidValue.length = sizeof(engine->fGid);
+    engine->fGidValue.data = &engine->fGid;
+    engine->fHomeValue.length = strlen(engine->fHome) + 1;
+    engine->fHomeValue.data = engine->fHome;
+    engine->fUsernameValue.length = strlen(engine->fUsername) + 1;
+    engine->fUsernameValue.data = engine->fUsername;
+    engine->fResult = kAuthorizationResultUndefined;
+}
+
+bool HarnessCreate(HarnessPlugin *plugin)
+{
+    OSStatus err;
+    
+    err = AuthorizationPluginCreate(&kEngineCallbacks, &plugin->fRef, &plugin->fInterface);
+    if (err != errAuthorizationSuccess) {
+        fprintf(stderr, "lsp-harness: AuthorizationPluginCreate failed with %d\n", (int)err);
+        return false;
+    }
+    return true;
+}
+
+void HarnessDestroy(HarnessPlugin *plugin)
+{
+    plugin->fInterface->PluginDestroy(plugin->fRef);
+    plugin->fRef = NULL;
+    plugin->fInterface = NULL;
+}
+
+AuthorizationResult HarnessLogin(HarnessPlugin *plugin,
+                                 HarnessEngine *engine,
+                                 const char *const mechanisms[],
+                                 size_t numMechanisms)
+{
+    AuthorizationMechanismRef refs[kHarnessMaxMechanisms];
+    AuthorizationResult result;
+    size_t created;
+    size_t i;
+    
+    result = kAuthorizationResultAllow;
+    for (created = 0; created < numMechanisms && created < kHarnessMaxMechanisms; created++) {
+        if (plugin->fInterface->MechanismCreate(plugin->fRef, engine, mechanisms[created], &refs[created]) != errAuthorizationSuccess) {
+            fprintf(stderr, "lsp-harness: MechanismCreate failed for %s\n", mechanisms[created]);
+            result = kAuthorizationResultUndefined;
+            break;
+        }
+    }
+    for (i = 0; i < created && result == kAuthorizationResultAllow; i++) {
+        engine->fHasResult = false;
+        plugin->fInterface->MechanismInvoke(refs[i]);
+        result = engine->fHasResult ? engine->fResult : kAuthorizationResultUndefined;
+    }
+    for (i = 0; i < created; i++) {
+        plugin->fInterface->MechanismDeactivate(refs[i]);
+    }
+    for (i = 0; i < created; i++) {
+        plugin->fInterface->MechanismDestroy(refs[i]);
+    }
+    
+    return result;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Files
+/////////////////////////////////////////////////////////////////////
+
+
+/// Check one directory of a chain, saying what's wrong with it.
+static bool HarnessVerifyDir(const char *path, dev_t rootDev)
+{
+    struct stat info;
+    uint32_t problems;
+    size_t i;
+    
+    if (lstat(path, &info) != 0) {
+        fprintf(stderr, "lsp-harness: skipped, can't stat %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    problems = VerifyPathProblems(&info, rootDev, true);
+    for (i = 0; i < kNumVerifyProblems; i++) {
+        if (problems & (1U << i)) {
+            fprintf(stderr, "lsp-harness: skipped, %s %s, so the plugin won't use it\n", path, kVerifyProblemMessages[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Check every directory from / to path.
+static bool HarnessVerifyChain(const char *path, dev_t rootDev)
+{
+    char prefix[MAXPATHLEN];
+    char *slash;
+    
+    if (strlcpy(prefix, path, sizeof(prefix)) >= sizeof(prefix) || prefix[0] != '/') {
+        fprintf(stderr, "lsp-harness: skipped, %s isn't an absolute path\n", path);
+        return false;
+    }
+    for (slash = strchr(prefix + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (! HarnessVerifyDir(prefix, rootDev)) {
+            return false;
+        }
+        *slash = '/';
+    }
+    return HarnessVerifyDir(prefix, rootDev);
+}
+
+bool HarnessPreflight(const char *scriptDir, const char *stateDir)
+{
+    char exeDir[MAXPATHLEN];
+    char parent[MAXPATHLEN];
+    char *slash;
+    struct stat rootInfo;
+    ssize_t len;
+    
+    if (geteuid() != 0) {
+        fprintf(stderr, "lsp-harness: skipped, the plugin only runs scripts for root\n");
+        return false;
+    }
+    strlcpy(parent, stateDir, sizeof(parent));
+    if ((slash = strrchr(parent, '/')) != NULL) {
+        *slash = '\0';
+    }
+    if (! HarnessMakeDirs(scriptDir) || ! HarnessMakeDirs(parent) || lstat("/", &rootInfo) != 0) {
+        fprintf(stderr, "lsp-harness: skipped, can't create %s or %s: %s\n", scriptDir, parent, strerror(errno));
+        return false;
+    }
+    
+    // lsp-launcher is found next to the executable, like it is next to the
+    // plugin's, and has to pass the same checks. The plugin finds it with
+    // dladdr(), which only has the path the executable was run by.
+    if (program_invocation_name[0] != '/') {
+        fprintf(stderr, "lsp-harness: skipped, run %s by its absolute path so lsp-launcher can be found\n",
+                program_invocation_name);
+        return false;
+    }
+    len = readlink("/proc/self/exe", exeDir, sizeof(exeDir) - 1);
+    if (len <= 0) {
+        fprintf(stderr, "lsp-harness: skipped, can't find the executable: %s\n", strerror(errno));
+        return false;
+    }
+    exeDir[len] = '\0';
+    if ((slash = strrchr(exeDir, '/')) != NULL) {
+        *slash = '\0';
+    }
+    
+    strlcat(exeDir, "/lsp-launcher", sizeof(exeDir));
+    if (access(exeDir, X_OK) != 0) {
+        fprintf(stderr, "lsp-harness: skipped, %s: %s\n", exeDir, strerror(errno));
+        return false;
+    }
+    *strrchr(exeDir, '/') = '\0';
+    
+    return HarnessVerifyChain(scriptDir, rootInfo.st_dev)
+        && HarnessVerifyChain(parent, rootInfo.st_dev)
+        && HarnessVerifyChain(exeDir, rootInfo.st_dev);
+}
+
+bool HarnessWriteFile(const char *dir, const char *name, const char *contents, mode_t mode)
+{
+    char tmpPath[MAXPATHLEN];
+    char path[MAXPATHLEN];
+    size_t len;
+    ssize_t written;
+    int fd;
+    
+    // The temporary name doesn't look like a script to the plugin.
+    snprintf(tmpPath, sizeof(tmpPath), "%s/.harness.tmp", dir);
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    unlink(tmpPath);
+    fd = open(tmpPath, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        fprintf(stderr, "lsp-harness: can't create %s: %s\n", tmpPath, strerror(errno));
+        return false;
+    }
+    len = strlen(contents);
+    written = write(fd, contents, len);
+    if (written != (ssize_t)len || fchown(fd, 0, 0) != 0 || fchmod(fd, mode) != 0
+        || close(fd) != 0 || rename(tmpPath, path) != 0) {
+        fprintf(stderr, "lsp-harness: can't write %s: %s\n", path, strerror(errno));
+        unlink(tmpPath);
+        return false;
+    }
+    return true;
+}
+
+bool HarnessWriteScript(const char *dir, const char *name, const char *body)
+{
+    char *contents;
+    bool ok;
+    
+    if (asprintf(&contents, "#!/bin/sh\n%s", body) == -1) {
+        return false;
+    }
+    ok = HarnessWriteFile(dir, name, contents, 0755);
+    free(contents);
+    return ok;
+}
+
+bool HarnessMakeDirs(const char *path)
+{
+    char prefix[MAXPATHLEN];
+    char *slash;
+    
+    if (strlcpy(prefix, path, sizeof(prefix)) >= sizeof(prefix)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    for (slash = strchr(prefix + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+        if (slash != NULL) {
+            *slash = '\0';
+        }
+        if (mkdir(prefix, 0755) == 0) {
+            chmod(prefix, 0755);
+        } else if (errno != EEXIST) {
+            return false;
+        }
+        if (slash == NULL) {
+            break;
+        }
+        *slash = '/';
+    }
+    return true;
+}
+
+void HarnessClearDir(const char *dir)
+{
+    struct dirent *entry;
+    DIR *d;
+    
+    if ((d = opendir(dir)) == NULL) {
+        return;
+    }
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_type == DT_REG) {
+            unlinkat(dirfd(d), entry->d_name, 0);
+        }
+    }
+    closedir(d);
+}
+
+
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Measurements
+/////////////////////////////////////////////////////////////////////
+
+
+uint64_t HarnessTime(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static int CompareMicros(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    
+    return x < y ? -1 : x > y;
+}
+
+uint64_t HarnessPercentile(uint64_t *values, size_t count, unsigned p)
+{
+    size_t i;
+    
+    if (count == 0) {
+        return 0;
+    }
+    qsort(values, count, sizeof(*values), CompareMicros);
+    i = count * p / 100;
+    return values[i < count ? i : count - 1];
+}
+
+void HarnessReport(const char *label, uint64_t *values, size_t count)
+{
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    
+    if (count == 0) {
+        printf("%-32s n=0\n", label);
+        return;
+    }
+    p50 = HarnessPercentile(values, count, 50);
+    p90 = HarnessPercentile(values, count, 90);
+    p99 = HarnessPercentile(values, count, 99);
+    printf("%-32s n=%-6zu p50 %8.3f  p90 %8.3f  p99 %8.3f  max %8.3f ms\n", label, count,
+           p50 / 1000.0, p90 / 1000.0, p99 / 1000.0, values[count - 1] / 1000.0);
+    fflush(stdout);
+}
+
+size_t HarnessCountFDs(void)
+{
+    struct dirent *entry;
+    size_t count;
+    DIR *d;
+    
+    if ((d = opendir("/proc/self/fd")) == NULL) {
+        return 0;
+    }
+    count = 0;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            count++;
+        }
+    }
+    closedir(d);
+    
+    // Not counting the one that's reading it.
+    return count > 0 ? count - 1 : 0;
+}
+
+/// ProcEntry is a process from /proc.
+struct ProcEntry {
+    pid_t fPid;
+    pid_t fParent;
+    char fState;
+};
+typedef struct ProcEntry ProcEntry;
+
+size_t HarnessCountZombies(void)
+{
+    struct dirent *entry;
+    ProcEntry *procs;
+    ProcEntry *grown;
+    bool *mine;
+    char path[MAXNAMLEN + 16];
+    char line[512];
+    char *paren;
+    size_t numProcs;
+    size_t maxProcs;
+    size_t zombies;
+    size_t i;
+    size_t j;
+    bool changed;
+    ssize_t len;
+    int fd;
+    DIR *d;
+    
+    if ((d = opendir("/proc")) == NULL) {
+        return 0;
+    }
+    procs = NULL;
+    numProcs = maxProcs = 0;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%s/stat", entry->d_name);
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+            continue;
+        }
+        len = read(fd, line, sizeof(line) - 1);
+        close(fd);
+        if (len <= 0) {
+            continue;
+        }
+        line[len] = '\0';
+        
+        // The command name is in parentheses, and may contain anything.
+        if ((paren = strrchr(line, ')')) == NULL) {
+            continue;
+        }
+        if (numProcs == maxProcs) {
+            maxProcs = maxProcs ? maxProcs * 2 : 256;
+            if ((grown = realloc(procs, maxProcs * sizeof(*procs))) == NULL) {
+                break;
+            }
+            procs = grown;
+        }
+        procs[numProcs].fPid = (pid_t)atoi(line);
+        if (sscanf(paren + 1, " %c %d", &procs[numProcs].fState, &procs[numProcs].fParent) == 2) {
+            numProcs++;
+        }
+    }
+    closedir(d);
+    
+    // Mark descendants until nothing changes.
+    zombies = 0;
+    if ((mine = calloc(numProcs + 1, sizeof(*mine))) != NULL) {
+        do {
+            changed = false;
+            for (i = 0; i < numProcs; i++) {
+                if (mine[i]) {
+                    continue;
+                }
+                if (procs[i].fParent == getpid()) {
+                    mine[i] = changed = true;
+                    continue;
+                }
+                for (j = 0; j < numProcs; j++) {
+                    if (mine[j] && procs[j].fPid == procs[i].fParent) {
+                        mine[i] = changed = true;
+                        break;
+                    }
+                }
+            }
+        } while (changed);
+        for (i = 0; i < numProcs; i++) {
+            if (mine[i] && procs[i].fState == 'Z') {
+                zombies++;
+            }
+        }
+        free(mine);
+    }
+    free(procs);
+    
+    return zombies;
+}
+
+uint64_t HarnessResidentKB(void)
+{
+    unsigned long long size;
+    unsigned long long resident;
+    FILE *file;
+    
+    if ((file = fopen("/proc/self/statm", "re")) == NULL) {
+        return 0;
+    }
+    if (fscanf(file, "%llu %llu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(file);
+    
+    return (uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE) / 1024;
+}
+
+long HarnessNumberArg(const char *arg, const char *name, long min, long max)
+{
+    char *end;
+    long value;
+    
+    errno = 0;
+    value = strtol(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || value < min || value > max) {
+        fprintf(stderr, "lsp-harness: %s must be a number from %ld to %ld\n", name, min, max);
+        exit(EX_USAGE);
+    }
+    return value;
+}
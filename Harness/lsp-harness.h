@@ -0,0 +1,120 @@
+//
+//  lsp-harness.h
+//  LoginScriptPlugin harness
+//
+//  A stand-in for the authorization engine, which drives LoginScriptPlugin
+//  through its plugin interface on Linux, and what the tests and
+//  benchmarks built on it share.
+//
+
+#ifndef __LoginScriptPlugin__lsp_harness__
+#define __LoginScriptPlugin__lsp_harness__
+
+#include <Security/AuthorizationPlugin.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/param.h>
+
+enum {
+    kHarnessSkipped = 77,               // exit status that ctest reports as skipped
+    kHarnessMaxMechanisms = 4,          // mechanisms in a login
+    kHarnessMaxOverhead = 1 << 20       // overhead samples kept by the logging shim
+};
+
+/// HarnessEngine is the engine of one login: the context values that the
+/// plugin asks for, and the result it sets.
+struct HarnessEngine {
+    uid_t fUid;
+    gid_t fGid;
+    char fHome[MAXPATHLEN];
+    char fUsername[32];
+    AuthorizationValue fUidValue;
+    AuthorizationValue fGidValue;
+    AuthorizationValue fHomeValue;
+    AuthorizationValue fUsernameValue;
+    AuthorizationResult fResult;        // from SetResult
+    bool fHasResult;
+    bool fDeactivated;                  // DidDeactivate was called
+};
+typedef struct HarnessEngine HarnessEngine;
+
+/// HarnessPlugin is an instance of the plugin, as the engine holds it.
+struct HarnessPlugin {
+    AuthorizationPluginRef fRef;
+    const AuthorizationPluginInterface *fInterface;
+};
+typedef struct HarnessPlugin HarnessPlugin;
+
+/// Check that the harness can drive the plugin here: it has to run as
+/// root, and scriptDir, along with every directory leading to it, has to
+/// pass the plugin's checks once it's been created.
+///
+/// @return false, after saying why, if the caller should exit with
+///         kHarnessSkipped.
+bool HarnessPreflight(const char *scriptDir, const char *stateDir);
+
+/// Set up an engine for a login by uid, with a home directory.
+void HarnessEngineInit(HarnessEngine *engine, uid_t uid, gid_t gid, const char *home);
+
+/// Create and destroy an instance of the plugin.
+bool HarnessCreate(HarnessPlugin *plugin);
+void HarnessDestroy(HarnessPlugin *plugin);
+
+/// Run the mechanisms of a login in order, as the engine would, until one
+/// doesn't allow it, and then deactivate and destroy them all.
+///
+/// @param mechanisms  Mechanism names, like "postmount-root".
+/// @return the last result set, or kAuthorizationResultUndefined if a
+///         mechanism failed or didn't set one.
+AuthorizationResult HarnessLogin(HarnessPlugin *plugin,
+                                 HarnessEngine *engine,
+                                 const char *const mechanisms[],
+                                 size_t numMechanisms);
+
+/// Replace a file in a directory with contents and mode, atomically.
+bool HarnessWriteFile(const char *dir, const char *name, const char *contents, mode_t mode);
+
+/// Write a script that runs body with /bin/sh.
+bool HarnessWriteScript(const char *dir, const char *name, const char *body);
+
+/// Create a directory and any missing parents, with mode 0755.
+bool HarnessMakeDirs(const char *path);
+
+/// Remove the regular files in a directory, but not the directory.
+void HarnessClearDir(const char *dir);
+
+/// A monotonic timestamp in microseconds.
+uint64_t HarnessTime(void);
+
+/// The pth percentile of values, which are sorted in place.
+uint64_t HarnessPercentile(uint64_t *values, size_t count, unsigned p);
+
+/// Print count durations in microseconds as one line of percentiles in
+/// milliseconds, labelled.
+void HarnessReport(const char *label, uint64_t *values, size_t count);
+
+/// Move the plugin overhead samples, in microseconds, that the logging
+/// shim has picked up from the plugin's log since the last call into
+/// values, waiting up to timeoutMs for at least expected of them.
+///
+/// @return the number of samples moved.
+size_t HarnessTakeOverhead(uint64_t *values, size_t maxValues, size_t expected, long timeoutMs);
+
+/// Messages at this level or more severe that the plugin logged.
+size_t HarnessLoggedCount(int level);
+
+/// Descriptors open in this process.
+size_t HarnessCountFDs(void);
+
+/// Zombies among the descendants of this process.
+size_t HarnessCountZombies(void);
+
+/// Resident size of this process, in kilobytes.
+uint64_t HarnessResidentKB(void);
+
+/// Parse a positive number argument, or exit with usage.
+long HarnessNumberArg(const char *arg, const char *name, long min, long max);
+
+#endif /* defined(__LoginScriptPlugin__lsp_harness__) */
@@ -0,0 +1,215 @@
+//
+//  lsp-soak.c
+//  LoginScriptPlugin harness
+//
+//  Runs logins in batches through one instance of the plugin, with
+//  scripts that exit early, crash, deny, leave a process running in the
+//  background and hang until they time out, and checks after every batch
+//  that nothing has leaked: the number of open descriptors is back where
+//  it was, there are no zombies, and the resident size is flat.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <syslog.h>
+#include <sysexits.h>
+
+#include "lsp-harness.h"
+#include "lsp-verify.h"
+
+enum {
+    kSoakUsers = 100,                   // uids that logins cycle through
+    kSoakDeniedUser = 13,               // the one the deny script turns away
+    kSoakHungUser = 37,                 // the one the hang script times out and denies
+    kSoakSettleMs = 5000,               // for background processes to go away
+    kSoakRSSSlackKB = 512               // growth allowed for the allocator
+};
+
+static const char *const kMechanisms[] = {
+    "premount-root", "premount-user", "postmount-root", "postmount-user"
+};
+#define kNumMechanisms (sizeof(kMechanisms) / sizeof(*kMechanisms))
+
+/// The scripts, which get the uid as $1 and pick what to do with it, so
+/// every batch sees each of them.
+static const struct {
+    const char *fName;
+    const char *fBody;
+} kSoakScripts[] = {
+    { "postmount-root-early", "exit 0\n" },
+    { "postmount-root-crash", "[ $(($1 % 10)) = 3 ] && kill -SEGV $$\nexit 0\n" },
+    { "postmount-root-deny", "[ $(($1 % 100)) = 13 ] && exit 77\nexit 0\n" },
+    { "postmount-user-background", "[ $(($1 % 10)) = 5 ] && sleep 1 &\necho started\n" },
+    { "postmount-user-hang", "# lsp-timeout: 1\n[ $(($1 % 100)) = 37 ] && exec sleep 30\nexit 0\n" }
+};
+#define kNumSoakScripts (sizeof(kSoakScripts) / sizeof(*kSoakScripts))
+
+static const char *kSoakSettings =
+    "LogLevel = info\n"
+    "MaxConcurrentScripts = 2\n"
+    "TimeoutGracePeriod = 1\n";
+
+static void Usage(void)
+{
+    fprintf(stderr,
+            "usage: lsp-soak [-n logins] [-b batch]\n"
+            "  -n logins  logins to run, default 20000\n"
+            "  -b batch   logins between checks, default 1000\n");
+}
+
+/// Wait for background processes to exit and be reaped, until the
+/// descriptors are back to fds, or just steady if it's 0, and there are no
+/// zombies, or it times out.
+static void Settle(size_t fds, size_t *outFDs, size_t *outZombies)
+{
+    uint64_t deadline;
+    size_t last;
+    
+    deadline = HarnessTime() + kSoakSettleMs * 1000ULL;
+    last = 0;
+    for (;;) {
+        *outFDs = HarnessCountFDs();
+        *outZombies = HarnessCountZombies();
+        if ((*outFDs == (fds != 0 ? fds : last) && *outZombies == 0) || HarnessTime() > deadline) {
+            break;
+        }
+        last = *outFDs;
+        usleep(50000);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    HarnessPlugin plugin;
+    HarnessEngine engine;
+    AuthorizationResult result;
+    AuthorizationResult expected;
+    uint64_t *samples;
+    uint64_t batchStart;
+    uint64_t start;
+    uint64_t baseRSS;
+    uint64_t rss;
+    size_t baseFDs;
+    size_t fds;
+    size_t zombies;
+    size_t wrong;
+    size_t denied;
+    size_t errors;
+    size_t timeouts;
+    size_t i;
+    long numLogins;
+    long batch;
+    long login;
+    bool failed;
+    int ch;
+    
+    numLogins = 20000;
+    batch = 1000;
+    while ((ch = getopt(argc, argv, "n:b:h")) != -1) {
+        switch (ch) {
+            case 'n':
+                numLogins = HarnessNumberArg(optarg, "logins", 1, 100000000);
+                break;
+            case 'b':
+                batch = HarnessNumberArg(optarg, "batch", kSoakUsers, 1000000);
+                break;
+            default:
+                Usage();
+                return EX_USAGE;
+        }
+    }
+    if (optind != argc) {
+        Usage();
+        return EX_USAGE;
+    }
+    if (! HarnessPreflight(kLoginScriptDir, LSP_STATE_DIR)) {
+        return kHarnessSkipped;
+    }
+    
+    HarnessClearDir(kLoginScriptDir);
+    if (! HarnessWriteFile(kLoginScriptDir, kSettingsName, kSoakSettings, 0644)) {
+        return EX_CANTCREAT;
+    }
+    for (i = 0; i < kNumSoakScripts; i++) {
+        if (! HarnessWriteScript(kLoginScriptDir, kSoakScripts[i].fName, kSoakScripts[i].fBody)) {
+            return EX_CANTCREAT;
+        }
+    }
+    samples = calloc((size_t)batch * kNumMechanisms, sizeof(*samples));
+    if (samples == NULL || ! HarnessCreate(&plugin)) {
+        return EX_OSERR;
+    }
+    
+    // The first batch warms up the plugin, its caches, lsp-launcher and
+    // the allocator, and where it leaves things is the baseline.
+    printf("%ld logins in batches of %ld, cycling through %d uids\n", numLogins, batch, kSoakUsers);
+    failed = false;
+    baseFDs = 0;
+    baseRSS = 0;
+    timeouts = 0;
+    start = HarnessTime();
+    for (login = 0; login < numLogins && ! failed; ) {
+        batchStart = HarnessTime();
+        wrong = denied = 0;
+        for (i = 0; i < (size_t)batch && login < numLogins; i++, login++) {
+            HarnessEngineInit(&engine, 10000 + (uid_t)(login % kSoakUsers), 10000, "/");
+            expected = login % kSoakUsers == kSoakDeniedUser || login % kSoakUsers == kSoakHungUser
+                       ? kAuthorizationResultDeny : kAuthorizationResultAllow;
+            result = HarnessLogin(&plugin, &engine, kMechanisms, kNumMechanisms);
+            if (result == kAuthorizationResultDeny) {
+                denied++;
+            }
+            if (result != expected) {
+                wrong++;
+            }
+            if (login % kSoakUsers == kSoakHungUser) {
+                timeouts++;
+            }
+        }
+        
+        // The logging shim keeps the overhead samples until they're taken,
+        // which would look like the plugin growing.
+        HarnessTakeOverhead(samples, (size_t)batch * kNumMechanisms, 0, 0);
+        Settle(baseFDs, &fds, &zombies);
+        rss = HarnessResidentKB();
+        errors = HarnessLoggedCount(LOG_ERR);
+        printf("%8ld logins  %7.1f logins/s  %zu denied  %zu fds  %zu zombies  %llu KB resident\n",
+               login, i / ((HarnessTime() - batchStart) / 1e6), denied, fds, zombies, (unsigned long long)rss);
+        fflush(stdout);
+        if (baseRSS == 0) {
+            baseFDs = fds;
+            baseRSS = rss;
+        }
+        
+        if (wrong > 0) {
+            fprintf(stderr, "lsp-soak: %zu logins didn't get the expected result\n", wrong);
+            failed = true;
+        }
+        // Timeouts are logged as errors, and nothing else should be.
+        if (errors != timeouts) {
+            fprintf(stderr, "lsp-soak: the plugin logged %zu errors, for %zu timeouts\n", errors, timeouts);
+            failed = true;
+        }
+        if (fds != baseFDs) {
+            fprintf(stderr, "lsp-soak: %zu descriptors open, %zu after the first batch\n", fds, baseFDs);
+            failed = true;
+        }
+        if (zombies > 0) {
+            fprintf(stderr, "lsp-soak: %zu zombies\n", zombies);
+            failed = true;
+        }
+        if (rss > baseRSS + kSoakRSSSlackKB) {
+            fprintf(stderr, "lsp-soak: %llu KB resident, %llu KB after the first batch\n",
+                    (unsigned long long)rss, (unsigned long long)baseRSS);
+            failed = true;
+        }
+    }
+    printf("%ld logins in %.1f s, %.1f logins/s\n", login,
+           (HarnessTime() - start) / 1e6, login / ((HarnessTime() - start) / 1e6));
+    HarnessDestroy(&plugin);
+    free(samples);
+    
+    return failed ? EX_SOFTWARE : EX_OK;
+}
@@ -0,0 +1,77 @@
+# cmake -DTOOL=lsp-verify -DEXPECTED=dir -DWORK_DIR=dir -P verify-test.cmake
+#
+# Build a script folder with a known set of problems, check it with
+# lsp-verify, and compare the warnings and the JSON with the expected ones
+# in EXPECTED. The folder's path is replaced with <folder>, and anything
+# reported about the directories above it is left out.
+#
+# The files have to be owned by root, and so do the directories above
+# them, so it's skipped for other users and in build trees that don't pass.
+
+execute_process(COMMAND id -u OUTPUT_VARIABLE uid OUTPUT_STRIP_TRAILING_WHITESPACE)
+if(NOT uid STREQUAL "0")
+    message("Skipped, lsp-verify can only be tested as root")
+    return()
+endif()
+set(folder ${WORK_DIR}/scripts)
+file(REMOVE_RECURSE ${folder})
+file(MAKE_DIRECTORY ${folder})
+execute_process(COMMAND chmod 0755 ${WORK_DIR} ${folder})
+execute_process(COMMAND ${TOOL} ${folder} RESULT_VARIABLE result OUTPUT_VARIABLE output)
+if(NOT result EQUAL 0)
+    message("Skipped, ${WORK_DIR} doesn't pass lsp-verify:\n${output}")
+    return()
+endif()
+
+file(WRITE ${folder}/premount-root-ok "#!/bin/sh\nexit 0\n")
+file(WRITE ${folder}/postmount-root-group "#!/bin/sh\nexit 0\n")
+file(WRITE ${folder}/postmount-root-owner "#!/bin/sh\nexit 0\n")
+file(WRITE ${folder}/postmount-user-noexec "#!/bin/sh\nexit 0\n")
+file(WRITE ${folder}/LoginScriptPlugin.conf "")
+file(WRITE ${folder}/LoginScriptPlugin.rules "")
+file(WRITE ${folder}/README "")
+foreach(step
+        "chmod 0755 ${folder}/premount-root-ok ${folder}/postmount-root-owner"
+        "chmod 0775 ${folder}/postmount-root-group"
+        "chmod 0644 ${folder}/postmount-user-noexec ${folder}/LoginScriptPlugin.conf"
+        "chmod 0666 ${folder}/LoginScriptPlugin.rules ${folder}/README"
+        "chown 0:1 ${folder}/postmount-root-group"
+        "chown 1:0 ${folder}/postmount-root-owner"
+        "ln -s premount-root-ok ${folder}/premount-user-link")
+    separate_arguments(step UNIX_COMMAND "${step}")
+    execute_process(COMMAND ${step} RESULT_VARIABLE result)
+    if(result)
+        message(FATAL_ERROR "${step} failed")
+    endif()
+endforeach()
+
+foreach(format txt json)
+    if(format STREQUAL "json")
+        set(args -j)
+    else()
+        set(args)
+    endif()
+    execute_process(COMMAND ${TOOL} ${args} ${folder} RESULT_VARIABLE result OUTPUT_VARIABLE output)
+    if(NOT result EQUAL 77)
+        message(FATAL_ERROR "lsp-verify ${args} exited with ${result}, expected 77 (EX_NOPERM)")
+    endif()
+    string(REPLACE "${folder}" "<folder>" output "${output}")
+    string(REGEX REPLACE "\n  {\"path\": \"/[^\n]*" "" output "${output}")
+    file(WRITE ${WORK_DIR}/problems.${format} "${output}")
+    execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files
+                    ${EXPECTED}/problems.${format} ${WORK_DIR}/problems.${format}
+                    RESULT_VARIABLE differ)
+    if(differ)
+        execute_process(COMMAND diff -u ${EXPECTED}/problems.${format} ${WORK_DIR}/problems.${format})
+        message(FATAL_ERROR "lsp-verify ${args} printed something else than ${EXPECTED}/problems.${format}")
+    endif()
+endforeach()
+
+# Once the problems are fixed it passes, without a word.
+file(REMOVE ${folder}/README ${folder}/premount-user-link ${folder}/LoginScriptPlugin.rules
+     ${folder}/postmount-root-group ${folder}/postmount-root-owner)
+execute_process(COMMAND chmod 0755 ${folder}/postmount-user-noexec)
+execute_process(COMMAND ${TOOL} ${folder} RESULT_VARIABLE result OUTPUT_VARIABLE output)
+if(NOT result EQUAL 0 OR NOT output STREQUAL "")
+    message(FATAL_ERROR "lsp-verify exited with ${result} for a clean folder:\n${output}")
+endif()
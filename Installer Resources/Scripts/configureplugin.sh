@@ -25,89 +25,16 @@ declare -ri EX_NOPERM=77        # Required permission missing.
 declare -ri EX_CONFIG=78        # Something was unconfigured or misconfigured.
 
 
-# Ensure that permissions are valid.
-function check_script_perms() {
-    local path="$1"
-    local result=0
-    
-    # Reject if path isn't on boot volume.
-    if [[ $(stat -f "%d" "$path") != $(stat -f "%d" "/") ]]; then
-        echo "Warning: $path is not on boot volume"
-        result=1
-    fi
-    
-    # Reject symbolic links.
-    if [[ -h "$path" ]]; then
-        echo "Warning: $path is a symbolic link"
-        result=1
-    fi
-    
-    # Ensure that it's owned by root.
-    if [[ $(stat -f "%u" "$path") -ne 0 ]]; then
-        echo "Warning: $path isn't owned by root"
-        result=1
-    fi
-    
-    # Reject world writable paths.
-    if [[ $(ls -ld "$path" | cut -c 9) == "w" ]]; then
-        echo "Warning: $path is world writable"
-        result=1
-    fi
-    
-    # Reject group writable paths unless the gid is wheel.
-    if [[ $(ls -ld "$path" | cut -c 6) == "w" ]]; then
-        if [[ $(stat -f "%g" "$path") -ne 0 ]]; then
-            echo "Warning: $path is group writable"
-            result=1
-        fi
-    fi
-    
-    # Path must be executable.
-    if [[ ! -x "$path" ]]; then
-        echo "Warning: $path isn't executable"
-        result=1
-    fi
-    
-    return $result
-}
-
-# Check permissions on the plugin's support directory.
+# Check permissions on the plugin's support directory, the directories
+# leading to it and the scripts in it, with the plugin's own rules.
 function check_script_dir() {
-    local script_names=( \
-        "premount-root"  \
-        "premount-user"  \
-        "postmount-root" \
-        "postmount-user" \
-    )
-    local path
-    local script
+    local verify="$PLUGIN_PATH/Contents/MacOS/lsp-verify"
     
-    if [[ ! -d "$SCRIPT_DIR" ]]; then
-        echo "Warning: $SCRIPT_DIR does not exist"
+    if [[ ! -x "$verify" ]]; then
+        echo "Warning: $verify is missing"
+        return 1
     fi
-    
-    path="$SCRIPT_DIR"
-    while true; do
-        if [[ -d "$path" ]]; then
-            if ! check_script_perms "$path"; then
-                echo "Warning: wrong permissions on $path"
-            fi
-        fi
-        if [[ "$path" == "/" ]]; then
-            break
-        fi
-        path="$(dirname "$path")"
-    done
-    
-    for name in "${script_names[@]}"; do
-        for path in "$SCRIPT_DIR/$name"-*; do
-            if [[ -e "$path" ]]; then
-                if ! check_script_perms "$path"; then
-                    echo "Warning: wrong permissions on $path"
-                fi
-            fi
-        done
-    done
+    "$verify" "$SCRIPT_DIR"
 }
 
 # Execute security authorizationdb command.
@@ -190,34 +117,15 @@ function usage() {
     echo "Usage: $(basename "$0") [ enable | disable ]"
 }
 
-function main() {
+# Edit the right with PlistBuddy, for when lsp-authdb is missing because
+# the bundle was deleted before the plugin was disabled.
+function edit_right_with_plistbuddy() {
     local cmd="$1"
     local plist=$(mktemp -t "$RIGHT.plist")
     tempfiles+=("$plist")
     local org_plist=$(mktemp -t "$RIGHT.org.plist")
     tempfiles+=("$org_plist")
     
-    case "$cmd" in
-        "enable")
-            echo "* Adding $PLUGIN to $RIGHT"
-            ;;
-        "disable")
-            echo "* Removing $PLUGIN from $RIGHT"
-            ;;
-        *)
-            usage
-            return $EX_USAGE
-            ;;
-    esac
-    
-    # Make sure the plugin is installed before trying to enable it.
-    if [[ "$cmd" == "enable" ]]; then
-        if [[ ! -d "$PLUGIN_PATH" ]]; then
-            echo "$PLUGIN_PATH is not installed"
-            return $EX_UNAVAILABLE
-        fi
-    fi
-    
     # Read the right from the authorization db.
     if authdb read "$RIGHT" > "$plist" 2>/dev/null; then
         echo "Read $RIGHT from authorization db"
@@ -258,6 +166,42 @@ function main() {
         echo "No change, $PLUGIN was already ${cmd}d"
     fi
     
+    return 0
+}
+
+function main() {
+    local cmd="$1"
+    local edit="$PLUGIN_PATH/Contents/MacOS/lsp-authdb"
+    
+    case "$cmd" in
+        "enable")
+            echo "* Adding $PLUGIN to $RIGHT"
+            ;;
+        "disable")
+            echo "* Removing $PLUGIN from $RIGHT"
+            ;;
+        *)
+            usage
+            return $EX_USAGE
+            ;;
+    esac
+    
+    # Make sure the plugin is installed before trying to enable it.
+    if [[ "$cmd" == "enable" ]]; then
+        if [[ ! -d "$PLUGIN_PATH" ]]; then
+            echo "$PLUGIN_PATH is not installed"
+            return $EX_UNAVAILABLE
+        fi
+    fi
+    
+    # lsp-authdb edits the mechanisms in one pass, and only writes the
+    # right back if they changed.
+    if [[ -x "$edit" ]]; then
+        "$edit" "$cmd" || return $?
+    else
+        edit_right_with_plistbuddy "$cmd" || return $?
+    fi
+    
     if [[ "$cmd" == "enable" ]]; then
         echo "* Checking script permissions"
         check_script_dir
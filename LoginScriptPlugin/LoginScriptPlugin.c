@@ -11,23 +11,73 @@
 #include <Security/AuthorizationTags.h>
 
 #include <stdlib.h>
-#include <asl.h>
 #include <syslog.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <assert.h>
-#include <glob.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <dirent.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/errno.h>
 #include <sys/stat.h>
 #include <sys/param.h>
-#include <libgen.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sysexits.h>
 #include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <pwd.h>
+#include <grp.h>
+#if defined(__APPLE__)
+#include <sys/event.h>
+#include <mach/mach_time.h>
+#include <os/log.h>
+#include <CommonCrypto/CommonDigest.h>
+#else
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#endif
+
+#if defined(__APPLE__)
+#include <crt_externs.h>
+#include <libproc.h>
+#include <sys/proc.h>
+#include <mach/mach.h>
+#define environ (*_NSGetEnviron())
+#else
+#define HAVE_FEXECVE 1
+extern char **environ;
+#endif
+
+// posix_spawn() is used where it can be told not to leak descriptors.
+#if defined(__APPLE__) || (defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 34))
+#define HAVE_SPAWN_CLOSE_FDS 1
+#endif
+
+// The login context is shared in a sealed memfd where there is one.
+#if defined(MFD_ALLOW_SEALING) && defined(F_ADD_SEALS)
+#define HAVE_MEMFD 1
+#endif
 
 
 #include "LoginScriptPlugin.h"
+#include "lsp-launcher.h"
+#include "lsp-stats.h"
+#include "lsp-verify.h"
 
 
 
@@ -36,7 +86,15 @@
 /////////////////////////////////////////////////////////////////////
 
 
-static const char *kLoginScriptDir = "/Library/Application Support/LoginScriptPlugin";
+#if defined(LSP_STATE_DIR)
+static const char *kStateDir = LSP_STATE_DIR;
+#elif defined(__APPLE__)
+static const char *kStateDir = "/private/var/db/LoginScriptPlugin";
+#else
+static const char *kStateDir = "/var/lib/LoginScriptPlugin";
+#endif
+static const char *kResultCacheName = "ResultCache";
+static const char *kDigestCacheName = "DigestCache";
 
 
 
@@ -46,6 +104,62 @@ static const char *kLoginScriptDir = "/Library/Application Support/LoginScriptPl
 
 
 typedef struct PluginRecord PluginRecord;           // forward decl
+typedef struct LoginTrace LoginTrace;               // forward decl
+typedef struct LoginContext LoginContext;           // forward decl
+typedef struct OverlapGroup OverlapGroup;           // forward decl
+typedef struct WarmupJob WarmupJob;                 // forward decl
+typedef struct PoolClient PoolClient;               // forward decl
+
+
+#pragma mark *     Logging
+
+// Messages less severe than this are compiled out. Levels are the LOG_*
+// values from syslog.h.
+#if !defined(MAX_LOG_LEVEL)
+#define MAX_LOG_LEVEL LOG_DEBUG
+#endif
+
+enum {
+    kLogSlots = 256,            // messages the log ring holds
+    kLogMessageLength = 512     // bytes of a message, longer ones are truncated
+};
+
+/// LogSlot is a message waiting in the log ring.
+struct LogSlot {
+    uint64_t fSequence;         // the turn that may use it next
+    int fLevel;
+    time_t fTime;               // when it was logged
+    char fMessage[kLogMessageLength];
+};
+typedef struct LogSlot LogSlot;
+
+/// Logger is the plugin's logging backend.
+///
+/// Messages are formatted into a lock-free ring by the thread logging
+/// them and written to the sinks by a background thread, so logging on
+/// the login path never waits for syslog, os_log or a disk. Each slot
+/// carries a sequence number: a producer claims slot fHead when its
+/// sequence equals fHead, and publishes it by setting it to fHead + 1,
+/// which the consumer waits for. If the ring is full the message is
+/// counted in fDropped rather than blocking.
+struct Logger {
+    int fLevel;                 // atomic, messages less severe are ignored
+    uint64_t fHead;             // atomic, next slot to claim
+    uint64_t fTail;             // next slot to drain, only used by fThread
+    uint64_t fDropped;          // atomic, messages lost to a full ring
+    bool fSleeping;             // atomic, fThread is waiting on fWakePipe
+    bool fStopping;             // atomic, fThread should drain and exit
+    int fWakePipe[2];
+    pthread_t fThread;
+    pthread_mutex_t fFileLock;
+    int fFileFD;                // protected by fFileLock, LogFile or -1
+    char fFilePath[MAXPATHLEN]; // protected by fFileLock
+#if defined(__APPLE__)
+    os_log_t fOSLog;            // NULL where os_log isn't available
+#endif
+    LogSlot fSlots[kLogSlots];
+};
+typedef struct Logger Logger;
 
 
 #pragma mark *     Mechanism
@@ -75,9 +189,13 @@ enum {
 struct MechanismRecord {
     OSType fMagic;         // must be kMechanismMagic
     AuthorizationEngineRef fEngine;
-    const PluginRecord *fPlugin;
+    PluginRecord *fPlugin;
     userContext fContext;
     scriptPhase fPhase;
+    LoginTrace *fTrace;    // shared by the mechanisms of a login, or NULL
+    LoginContext *fLogin;  // shared by the mechanisms of a login, or NULL
+    OverlapGroup *fOverlap; // lsp-overlap scripts left running by premount
+    WarmupJob *fWarmup;    // shared by the mechanisms of a login, or NULL
 };
 typedef struct MechanismRecord MechanismRecord;
 
@@ -90,6 +208,408 @@ static Boolean MechanismValid(const MechanismRecord *mechanism)
 }
 
 
+#pragma mark *     Scripts
+
+enum {
+    kMaxConcurrentScripts = 64,     // upper bound for MaxConcurrentScripts
+    kMaxTotalScripts = 256,         // upper bound for MaxTotalScripts
+    kOrderDefaultCost = 100000,     // us, assumed run time of scripts without history
+    kOrderCostFloor = 1000,         // us, added to every run time
+    kMaxScriptDeps = 16,            // lsp-after entries per script
+    kMaxScriptHeader = 4096,        // bytes searched for lsp-* metadata
+    kMaxTimeout = 24 * 60 * 60,     // upper bound for timeouts, in seconds
+    kMaxChainDepth = 16,            // directories from / to kLoginScriptDir
+    kNumScriptBuckets = kNumScriptPrefixes, // one for each mechanism
+    kChildPollInterval = 50,        // ms, for children we can't watch
+    kLauncherRetryMin = 1,          // seconds before lsp-launcher is tried again
+    kLauncherRetryMax = 60,         // after it keeps failing
+    kOverheadSamples = 256,         // invocations kept for overhead percentiles
+    kMaxAsyncScripts = 64,          // detached scripts supervised at once
+    kSHA256Length = 32,
+    kMaxCacheEntries = 1024,        // lines kept in kResultCacheName
+    kCacheLineLength = 160,         // upper bound for a kResultCacheName line
+    kDigestLineLength = 192,        // upper bound for a kDigestCacheName or kManifestName line
+    kMaxManifestEntries = 4096,     // lines read from kManifestName
+    kCaptureBufferSize = 4096,      // bytes of a partial output line kept per stream
+    kMaxContextLength = 16384,      // bytes of a serialized LoginContext
+    kMaxContextGroups = 256,        // groups listed in a LoginContext
+    kHealthWarmup = 16,             // invocations before leak checks start
+    kHealthFDSlack = 64,            // descriptors above the baseline before warning
+    kMaxRulesLength = 64 * 1024,    // bytes read from kRulesName
+    kMaxRules = 256,                // rules compiled from kRulesName
+    kMaxRuleConditions = 16,        // conditions per rule
+    kMaxWarmupLength = 64 * 1024,   // bytes read from kWarmupName
+    kMaxWarmupThreads = 16,         // upper bound for WarmupThreads
+    kMaxWarmupBudget = 65536,       // upper bound for WarmupBudget, in MB
+    kMaxWarmupDepth = 16            // directories descended below a kWarmupName path
+};
+
+#define kMicrosPerSecond 1000000ULL
+
+typedef enum {
+    kScriptPending,
+    kScriptRunning,
+    kScriptFinished,
+    kScriptSkipped
+} scriptState;
+
+/// ScriptEntry describes a script found in kLoginScriptDir.
+///
+/// Entries live in a ScriptIndex and are immutable once it has been built,
+/// so they can be shared by mechanisms running at the same time. The
+/// entries of a phase are kept sorted by name, and dependencies declared
+/// with lsp-after refer to indices among them.
+struct ScriptEntry {
+    char fPath[MAXPATHLEN];
+    const char *fName;          // last path component of fPath
+    int fFD;                    // the verified script, or -1 if it failed
+    struct stat fInfo;          // for detecting changes
+    bool fWatched;              // changes are reported by the index watcher
+    char fAfter[256];           // lsp-after names
+    size_t fDeps[kMaxScriptDeps];
+    size_t fNumDeps;
+    long fTimeout;              // seconds, 0 for no timeout
+    AuthorizationResult fTimeoutPolicy;
+    bool fAsync;                // lsp-async, doesn't hold up the login
+    bool fOverlap;              // lsp-overlap, premount runs on until postmount
+    bool fHistoryOrder;         // lsp-order, may be moved ahead by its history
+    uint8_t fHash[kSHA256Length]; // SHA-256 of the verified contents
+    bool fCache;                // lsp-cache, skip if it succeeded before
+    bool fCacheByUid;           // the cached result is per user
+    long fCacheTTL;             // lsp-cache-ttl, seconds, 0 for no limit
+    char fCacheInputs[1024];    // lsp-cache-input paths, newline separated
+    ScriptLimits fLimits;       // ScriptLimits overridden by lsp-limit
+    ScriptQoS fQoS;             // lsp-qos, with the CPUs of its class
+    uint64_t fVerifyStart;      // MonotonicTime() span of verification,
+    uint64_t fVerifyEnd;        // for tracing
+};
+typedef struct ScriptEntry ScriptEntry;
+
+/// ScriptOutput is one captured output stream of a running script.
+struct ScriptOutput {
+    int fFD;                    // read end of the pipe, or -1
+    size_t fLength;             // bytes of an incomplete line in fBuffer
+    char fBuffer[kCaptureBufferSize];
+};
+typedef struct ScriptOutput ScriptOutput;
+
+/// ScriptJob tracks a single script through a phase.
+///
+/// The jobs of a phase are kept in an array parallel to the phase's
+/// entries in the index. Scripts that failed verification start out as
+/// finished.
+struct ScriptJob {
+    const ScriptEntry *fScript;
+    scriptState fState;
+    pid_t fPid;
+    int fWatchFD;               // kqueue or pidfd watching fPid, or -1
+    uint64_t fDeadline;         // MonotonicTime() when it times out, or 0
+    uint64_t fKillTime;         // when to send SIGKILL, or 0 if not signaled
+    bool fTimedOut;
+    uint64_t fLaunchTime;       // MonotonicTime() before launching, or 0
+    uint64_t fStartTime;        // after the launch returned
+    uint64_t fEndTime;          // when it was reaped
+    bool fCached;               // skipped thanks to the result cache
+    ScriptOutput fOutput[2];    // stdout and stderr
+    int fLogFD;                 // the script's log file, or -1
+    int fStatusFD;              // lsp-launcher reports the exit here, or -1
+    bool fContained;            // launched with limits, a QoS class or into a cgroup
+    bool fHaveUsage;            // fUsage is valid
+    ScriptUsage fUsage;         // from wait4(), or reported by lsp-launcher
+};
+typedef struct ScriptJob ScriptJob;
+
+/// ChildWatcher lets a single thread sleep until any of the running
+/// jobs of a phase exits.
+struct ChildWatcher {
+#if defined(__APPLE__)
+    int fQueue;                 // kqueue with an EVFILT_PROC per job
+#else
+    struct pollfd *fPollFDs;    // scratch space for polling pidfds
+#endif
+    int fWakeFD;                // also wakes up the watcher when readable, or -1
+};
+typedef struct ChildWatcher ChildWatcher;
+
+/// ResultCache is a phase's view of kResultCacheName.
+///
+/// The file is read the first time a phase looks up a script, and the
+/// scripts that succeed are collected in fAdded and written back in one go
+/// by ResultCacheFlush().
+struct ResultCache {
+    bool fLoaded;               // fContents has been read
+    char *fContents;            // the file when it was loaded, or NULL
+    char *fAdded;               // new lines, newest last, or NULL
+    size_t fAddedLength;
+    size_t fNumAdded;
+};
+typedef struct ResultCache ResultCache;
+
+/// PluginSettings holds the tunables read from kSettingsName.
+struct PluginSettings {
+    long fMaxConcurrentScripts; // scripts in a phase that may run at once
+    long fMaxTotalScripts;      // scripts of all logins that may run at once, or 0
+    long fScriptTimeout;        // default lsp-timeout, in seconds
+    long fPhaseTimeout;         // time budget for a whole phase, in seconds
+    long fTimeoutGracePeriod;   // seconds between SIGTERM and SIGKILL
+    AuthorizationResult fTimeoutPolicy; // default lsp-on-timeout
+    char fTraceDirectory[MAXPATHLEN];   // where to write traces, or empty
+    long fAsyncScriptTimeout;   // for lsp-async scripts without a timeout
+    char fScriptLogDirectory[MAXPATHLEN]; // where to write script output, or empty
+    int fLogLevel;              // LOG_* from syslog.h, less severe is ignored
+    char fLogFile[MAXPATHLEN];  // also write the log here, or empty
+    bool fRequireManifest;      // refuse to run anything without kManifestName
+    bool fUseLauncher;          // fork user scripts in lsp-launcher
+    bool fHistoryOrder;         // default lsp-order, history rather than name
+    ScriptLimits fScriptLimits; // default lsp-limit
+    uint32_t fScriptQoS;        // default lsp-qos
+    long fMaxClassScripts[kNumScriptQoS]; // scripts of each lsp-qos in a phase that may run at once, or 0
+    uint64_t fBackgroundCPUs;   // CPUs background scripts may use, 0 for any
+    char fCgroupDirectory[MAXPATHLEN]; // cgroup v2 for scripts, or empty
+    long fWarmupThreads;        // threads reading ahead kWarmupName
+    long fWarmupBudget;         // MB that may be read ahead, 0 to disable it
+    long fWarmupTimeout;        // seconds warming up may take
+    long fWarmupWait;           // ms postmount waits for it before returning
+};
+typedef struct PluginSettings PluginSettings;
+
+/// AsyncJob is a detached job on its way to a ScriptSupervisor.
+struct AsyncJob {
+    ScriptJob fJob;
+    ScriptEntry fScript;        // a copy, as the index may go away
+    long fGracePeriod;          // TimeoutGracePeriod when it was launched
+    OverlapGroup *fGroup;       // for lsp-overlap jobs, else NULL
+};
+typedef struct AsyncJob AsyncJob;
+
+/// PoolClient is a phase running scripts from the plugin-wide pool.
+///
+/// The pool is the MaxTotalScripts slots that the scripts of all logins
+/// share. A phase takes a slot for each script it starts and returns it
+/// when the script is reaped. A phase that has to wait for a slot is
+/// woken through fWakePipe when one is returned.
+struct PoolClient {
+    PoolClient *fNext;          // protected by the plugin's fPoolLock
+    size_t fRunning;            // protected by fPoolLock, slots held
+    uint64_t fWaitingSince;     // protected by fPoolLock, 0 unless waiting
+    int fWakePipe[2];           // or -1 if it has to be polled
+};
+
+/// ScriptSupervisor looks after lsp-async and lsp-overlap scripts once
+/// their mechanism has returned.
+///
+/// Jobs are handed over through fIncoming, and the supervisor thread moves
+/// them into fJobs, which only it touches. It reaps them, enforces their
+/// timeouts and logs how they exited, and reports the results of
+/// lsp-overlap scripts to their OverlapGroup.
+struct ScriptSupervisor {
+    pthread_mutex_t fLock;
+    pthread_t fThread;
+    bool fStopping;             // protected by fLock
+    size_t fNumAdopted;         // protected by fLock, incoming and running
+    AsyncJob fIncoming[kMaxAsyncScripts]; // protected by fLock
+    size_t fNumIncoming;        // protected by fLock
+    int fWakePipe[2];           // written to when fIncoming or fStopping change
+    ChildWatcher fWatcher;
+    ScriptJob fJobs[kMaxAsyncScripts];
+    ScriptEntry fScripts[kMaxAsyncScripts];
+    long fGracePeriods[kMaxAsyncScripts];
+    OverlapGroup *fGroups[kMaxAsyncScripts];
+    PluginRecord *fPlugin;
+    Logger *fLogClient;
+};
+typedef struct ScriptSupervisor ScriptSupervisor;
+
+/// OverlapGroup holds the lsp-overlap scripts that a premount mechanism has
+/// left running, until the postmount mechanism of the same login and
+/// context joins them.
+///
+/// Groups are registered in the PluginRecord and looked up by engine, like
+/// a LoginTrace. The premount mechanism and every job that's still running
+/// hold a reference, so the supervisor can report to a group whether or not
+/// the mechanisms are still around.
+struct OverlapGroup {
+    OverlapGroup *fNext;        // protected by the plugin's fOverlapLock
+    AuthorizationEngineRef fEngine;
+    userContext fContext;
+    uid_t fUid;                 // for the result cache
+    pthread_mutex_t fLock;
+    pthread_cond_t fChanged;    // broadcast when a job finishes
+    unsigned fRefCount;         // protected by fLock and the plugin's fOverlapLock
+    size_t fRunning;            // protected by fLock
+    AuthorizationResult fResult; // protected by fLock, deny if any job denied
+    long fJoinTimeout;          // seconds postmount waits for the jobs, or 0
+    long fGracePeriod;          // TimeoutGracePeriod when it was created
+    bool fExpired;              // protected by fLock, the jobs are to be terminated
+};
+
+typedef enum {
+    kRuleUser,                  // the user's short name
+    kRuleGroup,                 // membership of a group, by name
+    kRuleUid,                   // a range of uids
+    kRuleTime,                  // a range of minutes after local midnight
+    kRuleDays,                  // a mask of local weekdays, Sunday is bit 0
+    kRuleFile                   // a path that exists
+} ruleTest;
+
+/// RuleCondition is one test of a rule in kRulesName.
+struct RuleCondition {
+    ruleTest fTest;
+    bool fNegated;              // the rule needs the test to fail
+    long fMin;                  // the range of kRuleUid and kRuleTime,
+    long fMax;                  // or the mask of kRuleDays in fMin
+    const char *fString;        // the name or path, in the index's fRuleTokens
+};
+typedef struct RuleCondition RuleCondition;
+
+/// Rule is a line of kRulesName: the mechanisms it applies to, its
+/// verdict, and conditions that must all hold for it to match.
+struct Rule {
+    unsigned fBuckets;          // a bit for each ScriptIndex bucket
+    AuthorizationResult fAction;
+    size_t fLine;
+    const char *fText;          // the line, in the index's fRuleText
+    RuleCondition fConditions[kMaxRuleConditions];
+    size_t fNumConditions;
+};
+typedef struct Rule Rule;
+
+/// ScriptIndex is a verified and classified snapshot of kLoginScriptDir.
+///
+/// It's built with a single readdir() pass that sorts the scripts of all
+/// four mechanisms into buckets, and is kept by the PluginRecord until the
+/// directory, the chain of directories above it, the settings, the rules
+/// or a script changes. Changes are picked up by a kqueue or inotify
+/// watcher, with stat() fingerprints for anything that can't be watched,
+/// so a login with an unchanged directory doesn't scan or verify anything.
+///
+/// An index is immutable once built and reference counted, so mechanisms
+/// running on other threads can keep using it while it's replaced.
+struct ScriptIndex {
+    unsigned fRefCount;         // protected by the plugin's fIndexLock
+    bool fStale;                // changed while it was being built
+    int fDirFD;                 // kLoginScriptDir, also in fChainFDs
+    size_t fChainDepth;         // directories from / to kLoginScriptDir
+    int fChainFDs[kMaxChainDepth];
+    struct stat fChainInfo[kMaxChainDepth];
+    bool fChainWatched;
+    PluginSettings fSettings;
+    struct stat fSettingsInfo;  // zeroes if there's no settings file
+    int fSettingsFD;            // held open for the watcher, or -1
+    bool fSettingsWatched;
+    struct stat fManifestInfo;  // zeroes if there's no manifest
+    int fManifestFD;            // held open for the watcher, or -1
+    bool fManifestWatched;
+    struct stat fRulesInfo;     // zeroes if there's no rules file
+    int fRulesFD;               // held open for the watcher, or -1
+    bool fRulesWatched;
+    Rule *fRules;               // compiled from kRulesName
+    size_t fNumRules;
+    char *fRuleText;            // kRulesName, split into lines
+    char *fRuleTokens;          // a copy, split into words
+    struct stat fWarmupInfo;    // zeroes if there's no warm-up list
+    int fWarmupFD;              // held open for the watcher, or -1
+    bool fWarmupWatched;
+    char *fWarmupList;          // kWarmupName, or NULL
+    ScriptEntry *fScripts[kNumScriptBuckets];
+    size_t fNumScripts[kNumScriptBuckets];
+    int fWatchFD;               // kqueue or inotify, or -1
+#if !defined(__APPLE__)
+    int fWatchDescriptors[kMaxChainDepth];
+#endif
+    uint64_t fBuildStart;       // MonotonicTime() span of the build,
+    uint64_t fBuildEnd;         // for tracing
+};
+typedef struct ScriptIndex ScriptIndex;
+
+#pragma mark *     Tracing
+
+/// TraceEvent is a single Chrome trace event.
+struct TraceEvent {
+    char fPhase;                // 'X' for spans, 'i' instants, 'M' metadata
+    const char *fCategory;
+    char fName[MAXNAMLEN + 1];
+    int fTid;                   // 0 for the plugin, else the script's pid
+    uint64_t fStart;            // MonotonicTime()
+    uint64_t fEnd;
+    char fArgs[MAXPATHLEN];     // JSON object members, already escaped
+};
+typedef struct TraceEvent TraceEvent;
+
+/// LoginTrace collects the trace events of one login.
+///
+/// The mechanisms of a login share an engine, so traces are looked up by
+/// engine in the PluginRecord and reference counted by the mechanisms
+/// using them. The trace file is rewritten after each mechanism, so it's
+/// complete even if the login is aborted halfway.
+struct LoginTrace {
+    LoginTrace *fNext;          // protected by the plugin's fTraceLock
+    unsigned fRefCount;         // protected by the plugin's fTraceLock
+    AuthorizationEngineRef fEngine;
+    char fFileName[64];
+    TraceEvent *fEvents;
+    size_t fNumEvents;
+    size_t fMaxEvents;
+    char fCriticalPath[1024];
+};
+
+
+#pragma mark *     Login Context
+
+/// LoginContext is what the plugin knows about the user logging in.
+///
+/// It's gathered once per login from the authorization context and the
+/// user's record, and shared by the mechanisms of the login the same way
+/// as a LoginTrace. Scripts get it as key=value lines on kScriptContextFD,
+/// and the environments handed to scripts are built here as well, so
+/// launching a script only has to pass them on.
+struct LoginContext {
+    LoginContext *fNext;        // protected by the plugin's fLoginLock
+    unsigned fRefCount;         // protected by the plugin's fLoginLock
+    AuthorizationEngineRef fEngine;
+    char *fBlob;                // the serialized context
+    size_t fBlobLength;
+    int fBlobFD;                // a sealed memfd holding fBlob, or -1
+    char **fEnvironment[2];     // indexed by userContext, or NULL
+};
+
+
+#pragma mark *     Warm-up
+
+/// WarmupJob reads ahead the files in a home directory that a login is
+/// going to need first, on threads of its own, while the login goes on.
+///
+/// Jobs are registered in the PluginRecord and looked up by engine, like a
+/// LoginTrace, so a login is only warmed up once. The mechanisms of the
+/// login and the threads that are still running hold a reference.
+struct WarmupJob {
+    WarmupJob *fNext;           // protected by the plugin's fWarmupLock
+    AuthorizationEngineRef fEngine;
+    PluginRecord *fPlugin;
+    pthread_mutex_t fLock;
+    pthread_cond_t fFinished;   // broadcast when the last thread is done
+    unsigned fRefCount;         // protected by fLock and the plugin's fWarmupLock
+    size_t fRunning;            // protected by fLock
+    uint64_t fEnd;              // protected by fLock, when the last thread was done
+    bool fStop;                 // atomic, the plugin is going away
+    bool fOverBudget;           // atomic, fBudget ran out
+    bool fTimedOut;             // atomic, fDeadline passed
+    uid_t fUid;                 // only the user's own files are read ahead,
+    dev_t fHomeDev;             // and only on the home directory's volume
+    int fHomeFD;
+    char fHome[MAXPATHLEN];
+    char *fList;                // a copy of kWarmupName, split into lines
+    char **fPaths;              // relative to the home directory
+    size_t fNumPaths;
+    size_t fNextPath;           // atomic, the next path a thread takes
+    uint64_t fBudget;           // bytes
+    uint64_t fBytes;            // atomic, bytes read ahead
+    uint64_t fFiles;            // atomic, files read ahead
+    uint64_t fStart;            // MonotonicTime()
+    uint64_t fDeadline;
+};
+
+
 #pragma mark *     Plugin
 
 enum {
@@ -104,7 +624,36 @@ enum {
 struct PluginRecord {
     OSType fMagic;         // must be kPluginMagic
     const AuthorizationCallbacks *fCallbacks;
-    aslclient fLogClient;
+    Logger *fLogClient;
+    pthread_mutex_t fIndexLock;
+    ScriptIndex *fIndex;   // protected by fIndexLock, NULL until first use
+    pthread_mutex_t fTraceLock;
+    LoginTrace *fTraces;   // protected by fTraceLock
+    pthread_mutex_t fLoginLock;
+    LoginContext *fLogins; // protected by fLoginLock
+    pthread_mutex_t fOverlapLock;
+    OverlapGroup *fOverlaps; // protected by fOverlapLock
+    pthread_mutex_t fSupervisorLock;
+    ScriptSupervisor *fSupervisor; // protected by fSupervisorLock, NULL until needed
+    pthread_mutex_t fCacheLock; // serializes access to kResultCacheName
+    pthread_mutex_t fOverheadLock;
+    uint64_t fOverhead[kOverheadSamples]; // protected by fOverheadLock,
+    size_t fNumOverhead;   // a ring of MechanismInvoke overheads in us
+    size_t fBaselineFDs;   // protected by fOverheadLock, see CheckHealth()
+    uint64_t fBaselineRSS; // protected by fOverheadLock
+    pthread_mutex_t fLauncherLock;
+    pid_t fLauncherPid;    // protected by fLauncherLock, lsp-launcher or -1
+    int fLauncherSocket;   // protected by fLauncherLock, its control socket
+    uint64_t fLauncherRetryTime; // protected by fLauncherLock, when it may be tried again
+    unsigned fLauncherFailures; // protected by fLauncherLock, failures in a row
+    pthread_mutex_t fStatsLock;
+    StatsFile *fStats;     // protected by fStatsLock, NULL until mapped
+    bool fStatsFailed;     // protected by fStatsLock, it couldn't be mapped
+    pthread_mutex_t fWarmupLock;
+    WarmupJob *fWarmups;   // protected by fWarmupLock
+    pthread_mutex_t fPoolLock;
+    PoolClient *fPoolClients; // protected by fPoolLock, phases running scripts
+    size_t fPoolRunning;   // protected by fPoolLock, slots taken from the pool
 };
 
 static Boolean PluginValid(const PluginRecord *plugin)
@@ -118,6 +667,260 @@ static Boolean PluginValid(const PluginRecord *plugin)
 
 
 
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Logging
+/////////////////////////////////////////////////////////////////////
+
+
+/// Names of the LOG_* levels, as used in log files and LogLevel.
+static const char *kLogLevelNames[] = {
+    "emergency", "alert", "critical", "error", "warning", "notice", "info", "debug"
+};
+
+/// Log a message if level passes both the compile time and the runtime
+/// filter. Nothing is formatted for messages that don't.
+#define LogMessage(logger, level, ...) \
+    do { \
+        if ((level) <= MAX_LOG_LEVEL && (level) <= LoggerLevel(logger)) { \
+            LoggerWrite((logger), (level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+/// The least severe level that's currently logged.
+static inline int LoggerLevel(Logger *logger)
+{
+    return __atomic_load_n(&logger->fLevel, __ATOMIC_RELAXED);
+}
+
+/// Write a message to os_log, or syslog where that isn't available.
+static void LoggerEmitSystem(Logger *logger, int level, const char *message)
+{
+#if defined(__APPLE__)
+    if (logger->fOSLog != NULL) {
+        if (__builtin_available(macOS 10.12, *)) {
+            os_log_with_type(logger->fOSLog,
+                             level <= LOG_ERR ? OS_LOG_TYPE_ERROR :
+                             level == LOG_INFO ? OS_LOG_TYPE_INFO :
+                             level == LOG_DEBUG ? OS_LOG_TYPE_DEBUG : OS_LOG_TYPE_DEFAULT,
+                             "%{public}s", message);
+        }
+        return;
+    }
+#endif
+    syslog(LOG_AUTH | level, "LoginScriptPlugin: %s", message);
+}
+
+/// Write a message to the sinks, the system log and the log file.
+static void LoggerEmit(Logger *logger, int level, time_t when, const char *message)
+{
+    char stamp[32];
+    char line[kLogMessageLength + 64];
+    struct tm tm;
+    int len;
+    
+    LoggerEmitSystem(logger, level, message);
+    
+    pthread_mutex_lock(&logger->fFileLock);
+    if (logger->fFileFD != -1) {
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime_r(&when, &tm));
+        len = snprintf(line, sizeof(line), "%s LoginScriptPlugin[%d] <%s>: %s\n",
+                       stamp, getpid(), kLogLevelNames[level], message);
+        if (len >= (int)sizeof(line)) {
+            len = sizeof(line) - 1;
+            line[len - 1] = '\n';
+        }
+        write(logger->fFileFD, line, (size_t)len);
+    }
+    pthread_mutex_unlock(&logger->fFileLock);
+}
+
+/// Format a message into the ring and wake up the logging thread. Use
+/// LogMessage() rather than calling this directly.
+static void LoggerWrite(Logger *logger, int level, const char *format, ...) __attribute__((format(printf, 3, 4)));
+static void LoggerWrite(Logger *logger, int level, const char *format, ...)
+{
+    LogSlot *slot;
+    uint64_t pos;
+    uint64_t seq;
+    va_list args;
+    
+    pos = __atomic_load_n(&logger->fHead, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &logger->fSlots[pos % kLogSlots];
+        seq = __atomic_load_n(&slot->fSequence, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&logger->fHead, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (seq < pos) {
+            // The slot hasn't been drained since the last lap, the ring is full.
+            __atomic_add_fetch(&logger->fDropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&logger->fHead, __ATOMIC_RELAXED);
+        }
+    }
+    
+    slot->fLevel = level;
+    slot->fTime = time(NULL);
+    va_start(args, format);
+    vsnprintf(slot->fMessage, sizeof(slot->fMessage), format, args);
+    va_end(args);
+    __atomic_store_n(&slot->fSequence, pos + 1, __ATOMIC_SEQ_CST);
+    
+    if (__atomic_load_n(&logger->fSleeping, __ATOMIC_SEQ_CST)
+        && __atomic_exchange_n(&logger->fSleeping, false, __ATOMIC_SEQ_CST)) {
+        write(logger->fWakePipe[1], "", 1);
+    }
+}
+
+/// Write all published messages in the ring to the sinks.
+///
+/// @return true if anything was written.
+static bool LoggerDrain(Logger *logger)
+{
+    LogSlot *slot;
+    uint64_t dropped;
+    char message[64];
+    bool drained;
+    
+    drained = false;
+    for (;;) {
+        slot = &logger->fSlots[logger->fTail % kLogSlots];
+        if (__atomic_load_n(&slot->fSequence, __ATOMIC_SEQ_CST) != logger->fTail + 1) {
+            break;
+        }
+        LoggerEmit(logger, slot->fLevel, slot->fTime, slot->fMessage);
+        __atomic_store_n(&slot->fSequence, logger->fTail + kLogSlots, __ATOMIC_RELEASE);
+        logger->fTail++;
+        drained = true;
+    }
+    
+    dropped = __atomic_exchange_n(&logger->fDropped, 0, __ATOMIC_RELAXED);
+    if (dropped != 0) {
+        snprintf(message, sizeof(message), "%llu log messages were dropped", (unsigned long long)dropped);
+        LoggerEmit(logger, LOG_WARNING, time(NULL), message);
+    }
+    return drained;
+}
+
+/// The logging thread, drains the ring whenever something is logged.
+static void *LoggerMain(void *arg)
+{
+    Logger *logger = arg;
+    char buf[64];
+    
+    for (;;) {
+        if (LoggerDrain(logger)) {
+            continue;
+        }
+        if (__atomic_load_n(&logger->fStopping, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+        // Announce that we're going to sleep, then look again, so a message
+        // published in between either is seen here or writes to the pipe.
+        __atomic_store_n(&logger->fSleeping, true, __ATOMIC_SEQ_CST);
+        if (LoggerDrain(logger)) {
+            __atomic_store_n(&logger->fSleeping, false, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        if (read(logger->fWakePipe[0], buf, sizeof(buf)) == -1 && errno != EINTR) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/// Apply the LogLevel and LogFile settings.
+static void LoggerConfigure(Logger *logger, int level, const char *path)
+{
+    __atomic_store_n(&logger->fLevel, level, __ATOMIC_RELAXED);
+    
+    pthread_mutex_lock(&logger->fFileLock);
+    if (strcmp(path, logger->fFilePath) != 0) {
+        if (logger->fFileFD != -1) {
+            close(logger->fFileFD);
+            logger->fFileFD = -1;
+        }
+        strlcpy(logger->fFilePath, path, sizeof(logger->fFilePath));
+        if (path[0] != '\0') {
+            logger->fFileFD = open(path, O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+            if (logger->fFileFD == -1) {
+                syslog(LOG_AUTH | LOG_WARNING, "LoginScriptPlugin: Can't open %s, errno %d", path, errno);
+            }
+        }
+    }
+    pthread_mutex_unlock(&logger->fFileLock);
+}
+
+/// Create the logger and start its thread.
+///
+/// @return the logger, to be destroyed with LoggerDestroy(), or NULL.
+static Logger *LoggerCreate(void)
+{
+    Logger *logger;
+    uint64_t i;
+    
+    logger = calloc(1, sizeof(*logger));
+    if (logger == NULL) {
+        return NULL;
+    }
+    logger->fLevel = LOG_INFO;
+    logger->fFileFD = -1;
+    for (i = 0; i < kLogSlots; i++) {
+        logger->fSlots[i].fSequence = i;
+    }
+#if defined(__APPLE__)
+    if (__builtin_available(macOS 10.12, *)) {
+        logger->fOSLog = os_log_create("se.gu.it.LoginScriptPlugin", "plugin");
+    }
+#endif
+    if (pipe(logger->fWakePipe) != 0) {
+        free(logger);
+        return NULL;
+    }
+    fcntl(logger->fWakePipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(logger->fWakePipe[1], F_SETFD, FD_CLOEXEC);
+    fcntl(logger->fWakePipe[1], F_SETFL, fcntl(logger->fWakePipe[1], F_GETFL) | O_NONBLOCK);
+    pthread_mutex_init(&logger->fFileLock, NULL);
+    if (pthread_create(&logger->fThread, NULL, LoggerMain, logger) != 0) {
+        pthread_mutex_destroy(&logger->fFileLock);
+        close(logger->fWakePipe[0]);
+        close(logger->fWakePipe[1]);
+        free(logger);
+        return NULL;
+    }
+    return logger;
+}
+
+/// Write out everything that's been logged, then stop the logging thread
+/// and free the logger.
+static void LoggerDestroy(Logger *logger)
+{
+    __atomic_store_n(&logger->fStopping, true, __ATOMIC_SEQ_CST);
+    write(logger->fWakePipe[1], "", 1);
+    pthread_join(logger->fThread, NULL);
+    
+    // Anything published while the thread was exiting.
+    LoggerDrain(logger);
+    
+    close(logger->fWakePipe[0]);
+    close(logger->fWakePipe[1]);
+    if (logger->fFileFD != -1) {
+        close(logger->fFileFD);
+    }
+    pthread_mutex_destroy(&logger->fFileLock);
+#if defined(__APPLE__)
+    if (logger->fOSLog != NULL) {
+        os_release(logger->fOSLog);
+    }
+#endif
+    free(logger);
+}
+
+
+
 /////////////////////////////////////////////////////////////////////
 #pragma mark ***** Mechanism Entry Points
 /////////////////////////////////////////////////////////////////////
@@ -166,7 +969,7 @@ static OSStatus MechanismCreate(AuthorizationPluginRef inPlugin,
     scriptPhase phase;
     
     plugin = (PluginRecord *) inPlugin;
-    asl_log(plugin->fLogClient, NULL, ASL_LEVEL_DEBUG, "LoginScriptPlugin:MechanismCreate: inPlugin=%p, inEngine=%p, mechanismId='%s'", inPlugin, inEngine, mechanismId);
+    LogMessage(plugin->fLogClient, LOG_DEBUG, "LoginScriptPlugin:MechanismCreate: inPlugin=%p, inEngine=%p, mechanismId='%s'", inPlugin, inEngine, mechanismId);
     assert(PluginValid(plugin));
     assert(inEngine != NULL);
     assert(mechanismId != NULL);
@@ -186,7 +989,7 @@ static OSStatus MechanismCreate(AuthorizationPluginRef inPlugin,
         context = kRunAsUser;
         phase = kRunAfterHomedirMount;
     } else {
-        asl_log(plugin->fLogClient, NULL, ASL_LEVEL_ERR, "Unknown mechanism '%s'", mechanismId);
+        LogMessage(plugin->fLogClient, LOG_ERR, "Unknown mechanism '%s'", mechanismId);
         *outMechanism = NULL;
         return errAuthorizationInternal;
     }
@@ -203,260 +1006,6596 @@ static OSStatus MechanismCreate(AuthorizationPluginRef inPlugin,
     mechanism->fPlugin = plugin;
     mechanism->fContext = context;
     mechanism->fPhase = phase;
+    mechanism->fTrace = NULL;
+    mechanism->fLogin = NULL;
+    mechanism->fOverlap = NULL;
+    mechanism->fWarmup = NULL;
     
     *outMechanism = mechanism;
     
-    asl_log(plugin->fLogClient, NULL, ASL_LEVEL_DEBUG, "LoginScriptPlugin:MechanismCreate: *outMechanism=%p", *outMechanism);
+    LogMessage(plugin->fLogClient, LOG_DEBUG, "LoginScriptPlugin:MechanismCreate: *outMechanism=%p", *outMechanism);
     
     return errAuthorizationSuccess;
 }
 
-/// Get the parent directory of path in a threadsafe manner.
+/// Check the ownership and mode of a path that's part of a script chain,
+/// logging each problem found. See VerifyPathProblems() for the rules.
 ///
-/// @param path     A string with a path.
-/// @param parent   Pointer to a buffer large enough to hold
-///                 the parent directory string.
-/// @return true for success.
-static bool GetParentDir(const char *path, char **parent) {
-    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-    char *dirnameResult;
-    
-    pthread_mutex_lock(&lock);
+/// @param path     The path that info belongs to, for logging.
+/// @param info     The result of an lstat of the path.
+/// @param rootDev  The device of the root directory.
+static bool VerifyPathInfo(const char *path, const struct stat *info, dev_t rootDev, bool requireExec, Logger *logClient)
+{
+    uint32_t problems;
+    size_t i;
     
-    // BSD's dirname() doesn't modify the string passed so we can safely ignore
-    // the const warning
-    #pragma clang diagnostic push
-    #pragma clang diagnostic ignored "-Wincompatible-pointer-types-discards-qualifiers"
-    dirnameResult = dirname(path);
-    #pragma clang diagnostic pop
-    if (dirnameResult == NULL) {
-        pthread_mutex_unlock(&lock);
-        return false;
+    problems = VerifyPathProblems(info, rootDev, requireExec);
+    for (i = 0; i < kNumVerifyProblems; i++) {
+        if (problems & (1U << i)) {
+            LogMessage(logClient, LOG_WARNING, "%s %s", path, kVerifyProblemMessages[i]);
+        }
     }
-    strcpy(*parent, dirnameResult);
-    
-    pthread_mutex_unlock(&lock);
-
-    return true;
+    return problems == 0;
 }
 
-/// Verify that a script is suitable for launching as root.
+/// Open a verified entry of an already verified directory.
+///
+/// The entry is checked with fstatat() and then opened without following
+/// symbolic links, and the descriptor is compared with what was checked,
+/// so the caller holds exactly the file that was verified.
 ///
-/// The script itself and its containing directories should all be owned
-/// by root, and not writable by anyone other than root:wheel or root:admin.
-/// The path should be absolute, on the boot volume, and must not contain
-/// any symbolic links.
-static bool VerifyScript(const char *path, aslclient logClient)
+/// @param dirFD    Descriptor of the verified parent directory.
+/// @param name     Name of the entry in the directory.
+/// @param path     Full path of the entry, for logging.
+/// @param flags    Extra open() flags, e.g. O_DIRECTORY.
+/// @param outInfo  Receives the stat of the opened entry, may be NULL.
+/// @return the open descriptor, or -1 if verification failed.
+static int OpenVerifiedAt(int dirFD,
+                          const char *name,
+                          const char *path,
+                          int flags,
+                          dev_t rootDev,
+                          bool requireExec,
+                          struct stat *outInfo,
+                          Logger *logClient)
 {
     struct stat info;
-    struct stat rootInfo;
-    bool pathOK;
-    char *parent;
-    
-    pathOK = true;
-    
-    // Reject if we can't stat the root.
-    if (lstat("/", &rootInfo)) {
-        asl_log(logClient, NULL, ASL_LEVEL_WARNING, "Can't stat /");
-        pathOK = false;
-    }
+    struct stat openInfo;
+    int fd;
     
     // Reject if we can't stat the path.
-    if (lstat(path, &info)) {
-        asl_log(logClient, NULL, ASL_LEVEL_WARNING, "Can't stat %s", path);
-        pathOK = false;
-    }
-    
-    // Reject if path isn't on boot volume.
-    if (info.st_dev != rootInfo.st_dev) {
-        asl_log(logClient, NULL, ASL_LEVEL_WARNING, "%s is not on boot volume", path);
-        pathOK = false;
-    }
-    
-    // Reject symbolic links.
-    if (S_ISLNK(info.st_mode)) {
-        asl_log(logClient, NULL, ASL_LEVEL_WARNING, "%s is a symbolic link", path);
-        pathOK = false;
-    }
-    
-    // Ensure that it's owned by root.
-    if (info.st_uid != 0) {
-        asl_log(logClient, NULL, ASL_LEVEL_WARNING, "%s isn't owned by root", path);
-        pathOK = false;
+    if (fstatat(dirFD, name, &info, AT_SYMLINK_NOFOLLOW)) {
+        LogMessage(logClient, LOG_WARNING, "Can't stat %s", path);
+        return -1;
     }
-    
-    // Reject world writable paths.
-    if (info.st_mode & S_IWOTH) {
-        asl_log(logClient, NULL, ASL_LEVEL_WARNING, "%s is world writable", path);
-        pathOK = false;
+    if (! VerifyPathInfo(path, &info, rootDev, requireExec, logClient)) {
+        return -1;
     }
     
-    // Reject group writable paths unless the gid is wheel or admin.
-    if (info.st_mode & S_IWGRP && !(info.st_gid == 0 || info.st_gid == 80)) {
-        asl_log(logClient, NULL, ASL_LEVEL_WARNING, "%s is group writable", path);
-        pathOK = false;
+    fd = openat(dirFD, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | flags);
+    if (fd == -1) {
+        LogMessage(logClient, LOG_WARNING, "Can't open %s, errno %d", path, errno);
+        return -1;
     }
-    
-    // Path must be executable.
-    if (! (info.st_mode & S_IXUSR)) {
-        asl_log(logClient, NULL, ASL_LEVEL_WARNING, "%s isn't executable", path);
-        pathOK = false;
+    if (fstat(fd, &openInfo)
+        || openInfo.st_dev != info.st_dev
+        || openInfo.st_ino != info.st_ino) {
+        LogMessage(logClient, LOG_WARNING, "%s changed while it was verified", path);
+        close(fd);
+        return -1;
     }
     
-    // Unless we're at the root, recursively check the parent directory.
-    if (strcmp(path, "/") == 0) {
-        return pathOK;
-    
-    } else {
-        
-        parent = malloc(strlen(path) + 1);
-        if (parent == NULL) {
-            asl_log(logClient, NULL, ASL_LEVEL_WARNING, "memory allocation failed");
-            return false;
-        }
-        
-        if (! GetParentDir(path, &parent)) {
-            asl_log(logClient, NULL, ASL_LEVEL_WARNING, "failed to determine parent directory");
-            free(parent);
-            return false;
-        }
-        
-        pathOK = VerifyScript(parent, logClient) && pathOK;
-        free(parent);
-        return pathOK;
+    if (outInfo != NULL) {
+        *outInfo = openInfo;
     }
+    return fd;
 }
 
-/// Execute the script at path as uid/gid.
+/// Verify the chain of directories leading to dirPath.
 ///
-/// Fail authorization if the script exits with EX_NOPERM, otherwise proceed.
-static AuthorizationResult ExecuteScript(const char *path,
-                                         uid_t uid,
-                                         gid_t gid,
-                                         const char *home,
-                                         userContext context,
-                                         aslclient logClient)
+/// The walk starts at / and opens each directory relative to its parent,
+/// verifying it along the way, so the returned descriptor refers to the
+/// directory that was verified no matter what happens to the path later.
+///
+/// Every directory of the chain, from / to dirPath, is left open in
+/// chainFDs with its stat in chainInfo, so the caller can watch them for
+/// changes. Both arrays must hold kMaxChainDepth entries, and the caller
+/// closes the descriptors.
+///
+/// @param create   Create the last directory, readable only by root, if
+///                 it doesn't exist.
+/// @return a descriptor for dirPath, which is also the last entry of
+///         chainFDs, or -1 if verification failed.
+static int VerifyDirChain(const char *dirPath,
+                          bool create,
+                          struct stat *chainInfo,
+                          int *chainFDs,
+                          size_t *outDepth,
+                          Logger *logClient)
 {
-    AuthorizationResult result;
-    pid_t childPid;
-    int childStatus;
-    long maxfd;
-    long fd;
-    char uidStr[3 * sizeof(uid_t) + 1];
-    char gidStr[3 * sizeof(gid_t) + 1];
-    char cfUserTextEncoding[2 * sizeof(uid_t) + 7];
+    char path[MAXPATHLEN];
+    char *component;
+    char *next;
+    size_t depth;
+    int dirFD;
     
-    result = kAuthorizationResultAllow;
+    strlcpy(path, dirPath, sizeof(path));
+    depth = 0;
     
-    if (! VerifyScript(path, logClient)) {
-        asl_log(logClient, NULL, ASL_LEVEL_WARNING,
-                "Not executing %s", path);
-        return result;
+    // Reject if we can't stat the root.
+    dirFD = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFD == -1 || fstat(dirFD, &chainInfo[0])) {
+        LogMessage(logClient, LOG_WARNING, "Can't stat /");
+        if (dirFD != -1) {
+            close(dirFD);
+        }
+        return -1;
+    }
+    chainFDs[depth++] = dirFD;
+    if (! VerifyPathInfo("/", &chainInfo[0], chainInfo[0].st_dev, true, logClient)) {
+        goto fail;
     }
     
-    asl_log(logClient, NULL, ASL_LEVEL_NOTICE,
-            "Executing %s with uid=%d, gid=%d, home='%s'", path, uid, gid, home);
-    
-    childPid = fork();
-    if (childPid == -1) {
-        // Error.
-        asl_log(logClient, NULL, ASL_LEVEL_WARNING,
-                "Fork failed with errno %d", errno);
-    } else if (childPid == 0) {
-        // Child.
-#warning REVIEW: User commands still run in root's session.
-        if (context == kRunAsUser) {
-            if (setgid(gid) || setuid(uid)) {
-                asl_log(logClient, NULL, ASL_LEVEL_ERR,
-                        "setgid/setuid failed, aborting execution of %s", path);
-                exit(EX_NOPERM);
-            }
+    // Walk down one component at a time. Each iteration temporarily cuts
+    // path after the current component, so it can be used for logging.
+    for (component = path + 1; *component != '\0'; component = next) {
+        next = strchr(component, '/');
+        if (next != NULL) {
+            *next = '\0';
         }
-        
-        // Mark any stray file descriptors for closing.
-        maxfd = sysconf(_SC_OPEN_MAX);
-        if (maxfd < 0) {
-            maxfd = OPEN_MAX;
+        if (depth == kMaxChainDepth) {
+            LogMessage(logClient, LOG_WARNING, "%s is too deep", dirPath);
+            goto fail;
         }
-        for (fd = STDERR_FILENO + 1; fd < maxfd; fd++) {
-            // Use FD_CLOEXEC instead of close to avoid libdispatch crash.
-            if (fcntl((int)fd, F_SETFD, FD_CLOEXEC) == -1) {
-                if (errno != EBADF) {
-                    asl_log(logClient, NULL, ASL_LEVEL_ERR,
-                            "Marking file descriptor %ld for closing failed with errno %d", fd, errno);
-                    exit(EX_NOPERM);
-                }
-            }
+        if (create && next == NULL && mkdirat(dirFD, component, 0700) == 0) {
+            LogMessage(logClient, LOG_NOTICE, "Created %s", path);
         }
-        
-        // Set default text encoding for Core Foundation.
-        snprintf(cfUserTextEncoding, sizeof(cfUserTextEncoding), "0x%X:0:0", getuid());
-        if (setenv("__CF_USER_TEXT_ENCODING", cfUserTextEncoding, 1) != 0) {
-            asl_log(logClient, NULL, ASL_LEVEL_WARNING,
-                    "Couldn't set __CF_USER_TEXT_ENCODING");
+        dirFD = OpenVerifiedAt(dirFD, component, path, O_DIRECTORY,
+                               chainInfo[0].st_dev, true, &chainInfo[depth], logClient);
+        if (dirFD == -1) {
+            goto fail;
         }
-        
-        snprintf(uidStr, sizeof(uidStr), "%d", uid);
-        snprintf(gidStr, sizeof(gidStr), "%d", gid);
-        execl(path, path, uidStr, gidStr, home, (char *)NULL);
-        // The following only executes if execl() fails.
-        asl_log(logClient, NULL, ASL_LEVEL_ERR,
-                "Executing %s failed with errno %d", path, errno);
-        exit(EX_NOPERM);
-        
-    } else {
-        // Parent.
-        asl_log(logClient, NULL, ASL_LEVEL_DEBUG,
-                "Waiting for child with pid %d", childPid);
-        if (waitpid(childPid, &childStatus, 0) != childPid) {
-            asl_log(logClient, NULL, ASL_LEVEL_DEBUG,
-                    "Received errno %d while waiting for child", errno);
-        }
-        if (WIFSIGNALED(childStatus)) {
-            asl_log(logClient, NULL, ASL_LEVEL_WARNING,
-                    "%s died with signal %d", path, WTERMSIG(childStatus));
-        } else {
-            asl_log(logClient, NULL, ASL_LEVEL_WARNING,
-                    "%s exited with status %d", path, WEXITSTATUS(childStatus));
-            if (WEXITSTATUS(childStatus) == EX_NOPERM) {
-                // Fail authorization.
-                asl_log(logClient, NULL, ASL_LEVEL_NOTICE,
-                        "%s denied authorization", path);
-                result = kAuthorizationResultDeny;
-            }
+        chainFDs[depth++] = dirFD;
+        if (next == NULL) {
+            break;
         }
+        *next++ = '/';
     }
     
-    return result;
+    *outDepth = depth;
+    return dirFD;
+    
+fail:
+    while (depth > 0) {
+        close(chainFDs[--depth]);
+    }
+    *outDepth = 0;
+    return -1;
 }
 
-#define NOBODY -2
+/// Verify the chain of directories leading to kLoginScriptDir.
+///
+/// Scripts are then verified relative to the returned descriptor with
+/// VerifyScriptAt(). See VerifyDirChain() for the rest.
+static int VerifyScriptDir(struct stat *chainInfo, int *chainFDs, size_t *outDepth, Logger *logClient)
+{
+    return VerifyDirChain(kLoginScriptDir, false, chainInfo, chainFDs, outDepth, logClient);
+}
 
-/// Called by the system to invoke a mechanism.
+/// Open kStateDir, creating it if needed, after verifying it the same way
+/// as kLoginScriptDir.
 ///
-/// This executes a premount or postmount script, either as root or as the user.
-static OSStatus MechanismInvoke(AuthorizationMechanismRef inMechanism)
+/// @return a descriptor for kStateDir, or -1 if verification failed.
+static int OpenStateDir(dev_t *outRootDev, Logger *logClient)
 {
-    OSStatus err;
-    MechanismRecord *mechanism;
-    
-    AuthorizationResult result;
-    
-    uid_t uid;
-    gid_t gid;
-    char *home;
-    AuthorizationContextFlags authContextFlags;
-    const AuthorizationValue *value;
+    struct stat chainInfo[kMaxChainDepth];
+    int chainFDs[kMaxChainDepth];
+    size_t depth;
+    size_t i;
+    int dirFD;
     
-    glob_t g;
-    char scriptPattern[MAXPATHLEN];
-    int i;
-    
-    mechanism = (MechanismRecord *) inMechanism;
-    asl_log(mechanism->fPlugin->fLogClient, NULL, ASL_LEVEL_DEBUG, "LoginScriptPlugin:MechanismInvoke: inMechanism=%p", inMechanism);
-    assert(MechanismValid(mechanism));
+    dirFD = VerifyDirChain(kStateDir, true, chainInfo, chainFDs, &depth, logClient);
+    if (dirFD == -1) {
+        return -1;
+    }
+    for (i = 0; i + 1 < depth; i++) {
+        close(chainFDs[i]);
+    }
+    *outRootDev = chainInfo[0].st_dev;
+    return dirFD;
+}
+
+/// Read a small file from a verified directory.
+///
+/// The file is ignored unless it passes the same checks as the scripts.
+///
+/// @param dirPath  Path of the directory, for logging.
+/// @param maxSize  Larger files are ignored.
+/// @param outInfo  Receives the stat of the file, or zeroes if there isn't
+///                 one. May be NULL.
+/// @return the contents, to be freed by the caller, or NULL if the file
+///         doesn't exist or can't be used.
+static char *ReadVerifiedFile(int dirFD,
+                              const char *dirPath,
+                              const char *name,
+                              off_t maxSize,
+                              dev_t rootDev,
+                              struct stat *outInfo,
+                              Logger *logClient)
+{
+    char path[MAXPATHLEN];
+    char *contents;
+    struct stat info;
+    ssize_t len;
+    int fd;
+    
+    if (outInfo != NULL) {
+        memset(outInfo, 0, sizeof(*outInfo));
+    }
+    if (faccessat(dirFD, name, F_OK, AT_SYMLINK_NOFOLLOW) && errno == ENOENT) {
+        return NULL;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dirPath, name);
+    fd = OpenVerifiedAt(dirFD, name, path, 0, rootDev, false, &info, logClient);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (outInfo != NULL) {
+        *outInfo = info;
+    }
+    contents = NULL;
+    if (S_ISREG(info.st_mode) && info.st_size < maxSize) {
+        contents = malloc((size_t)info.st_size + 1);
+        if (contents != NULL) {
+            len = pread(fd, contents, (size_t)info.st_size, 0);
+            contents[len > 0 ? len : 0] = '\0';
+        }
+    } else {
+        LogMessage(logClient, LOG_WARNING, "Ignoring %s, it's not a regular file or too large", path);
+    }
+    close(fd);
+    return contents;
+}
+
+/// Replace a file in kStateDir, atomically.
+static bool WriteStateFile(int dirFD, const char *name, const char *contents, Logger *logClient)
+{
+    char tmpName[MAXNAMLEN + 1];
+    size_t len;
+    ssize_t written;
+    int fd;
+    
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", name);
+    unlinkat(dirFD, tmpName, 0);
+    fd = openat(dirFD, tmpName, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Can't create %s/%s, errno %d", kStateDir, tmpName, errno);
+        return false;
+    }
+    len = strlen(contents);
+    written = write(fd, contents, len);
+    if (close(fd) != 0 || written != (ssize_t)len || renameat(dirFD, tmpName, dirFD, name) != 0) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Can't write %s/%s, errno %d", kStateDir, name, errno);
+        unlinkat(dirFD, tmpName, 0);
+        return false;
+    }
+    return true;
+}
+
+/// Verify that a script is suitable for launching as root, and open it.
+///
+/// The script must be in the directory verified by VerifyScriptDir(),
+/// and the returned descriptor is what's eventually executed, so the file
+/// can't be swapped between verification and launch.
+///
+/// @return a descriptor for the script, or -1 if verification failed.
+static int VerifyScriptAt(int dirFD, const char *name, const char *path, dev_t rootDev, Logger *logClient)
+{
+    return OpenVerifiedAt(dirFD, name, path, 0, rootDev, true, NULL, logClient);
+}
+
+/// Strip leading and trailing whitespace from str in place.
+static char *TrimWhitespace(char *str)
+{
+    char *end;
+    
+    while (isspace((unsigned char)*str)) {
+        str++;
+    }
+    end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return str;
+}
+
+/// Return a monotonic timestamp in microseconds.
+static uint64_t MonotonicTime(void)
+{
+#if defined(__APPLE__)
+    static mach_timebase_info_data_t timebase;
+    
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time() * timebase.numer / timebase.denom / 1000;
+#else
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * kMicrosPerSecond + (uint64_t)now.tv_nsec / 1000;
+#endif
+}
+
+/// Parse a decimal integer setting in the range [min, max].
+static bool ParseLongSetting(const char *key, const char *value, long min, long max, long *outValue, Logger *logClient)
+{
+    char *end;
+    long number;
+    
+    errno = 0;
+    number = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || number < min || number > max) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Ignoring invalid value '%s' for %s, expected %ld-%ld", value, key, min, max);
+        return false;
+    }
+    *outValue = number;
+    return true;
+}
+
+/// Parse a timeout policy, either allow or deny.
+static bool ParsePolicySetting(const char *key, const char *value, AuthorizationResult *outValue, Logger *logClient)
+{
+    if (strcasecmp(value, "allow") == 0) {
+        *outValue = kAuthorizationResultAllow;
+    } else if (strcasecmp(value, "deny") == 0) {
+        *outValue = kAuthorizationResultDeny;
+    } else {
+        LogMessage(logClient, LOG_WARNING,
+                   "Ignoring invalid value '%s' for %s, expected allow or deny", value, key);
+        return false;
+    }
+    return true;
+}
+
+/// Parse a boolean, yes or no.
+static bool ParseBoolSetting(const char *key, const char *value, bool *outValue, Logger *logClient)
+{
+    if (strcasecmp(value, "yes") == 0 || strcasecmp(value, "true") == 0) {
+        *outValue = true;
+    } else if (strcasecmp(value, "no") == 0 || strcasecmp(value, "false") == 0) {
+        *outValue = false;
+    } else {
+        LogMessage(logClient, LOG_WARNING,
+                   "Ignoring invalid value '%s' for %s, expected yes or no", value, key);
+        return false;
+    }
+    return true;
+}
+
+/// Parse a script order, either history or name.
+static bool ParseOrderSetting(const char *key, const char *value, bool *outHistory, Logger *logClient)
+{
+    if (strcasecmp(value, "history") == 0) {
+        *outHistory = true;
+    } else if (strcasecmp(value, "name") == 0) {
+        *outHistory = false;
+    } else {
+        LogMessage(logClient, LOG_WARNING,
+                   "Ignoring invalid value '%s' for %s, expected history or name", value, key);
+        return false;
+    }
+    return true;
+}
+
+/// Parse a QoS class, interactive, default or background.
+static bool ParseQoSSetting(const char *key, const char *value, uint32_t *outClass, Logger *logClient)
+{
+    if (strcasecmp(value, "interactive") == 0) {
+        *outClass = kScriptQoSInteractive;
+    } else if (strcasecmp(value, "default") == 0) {
+        *outClass = kScriptQoSDefault;
+    } else if (strcasecmp(value, "background") == 0) {
+        *outClass = kScriptQoSBackground;
+    } else {
+        LogMessage(logClient, LOG_WARNING,
+                   "Ignoring invalid value '%s' for %s, expected interactive, default or background", value, key);
+        return false;
+    }
+    return true;
+}
+
+/// Parse a list of CPUs and ranges of CPUs below 64, like 0-3,6, or any.
+static bool ParseCPUsSetting(const char *key, const char *value, uint64_t *outCPUs, Logger *logClient)
+{
+    const char *p;
+    char *end;
+    unsigned long first;
+    unsigned long last;
+    uint64_t cpus;
+    
+    if (strcasecmp(value, "any") == 0) {
+        *outCPUs = 0;
+        return true;
+    }
+    cpus = 0;
+    for (p = value; ; p = end + 1) {
+        if (! isdigit((unsigned char)*p)) {
+            break;
+        }
+        first = last = strtoul(p, &end, 10);
+        if (*end == '-' && isdigit((unsigned char)end[1])) {
+            last = strtoul(end + 1, &end, 10);
+        }
+        if (first > last || last >= 64) {
+            break;
+        }
+        for (; first <= last; first++) {
+            cpus |= 1ULL << first;
+        }
+        if (*end == '\0') {
+            *outCPUs = cpus;
+            return true;
+        }
+        if (*end != ',') {
+            break;
+        }
+    }
+    LogMessage(logClient, LOG_WARNING,
+               "Ignoring invalid value '%s' for %s, expected any or a list of CPUs like 0-3,6", value, key);
+    return false;
+}
+
+/// Parse a log level, one of kLogLevelNames.
+static bool ParseLevelSetting(const char *key, const char *value, int *outValue, Logger *logClient)
+{
+    int level;
+    
+    for (level = LOG_EMERG; level <= LOG_DEBUG; level++) {
+        if (strcasecmp(value, kLogLevelNames[level]) == 0) {
+            *outValue = level;
+            return true;
+        }
+    }
+    LogMessage(logClient, LOG_WARNING,
+               "Ignoring invalid value '%s' for %s, expected error, warning, notice, info or debug", value, key);
+    return false;
+}
+
+/// Parse an absolute path setting.
+static bool ParsePathSetting(const char *key, const char *value, char *outValue, size_t size, Logger *logClient)
+{
+    if (value[0] != '/' || strlen(value) >= size) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Ignoring invalid value '%s' for %s, expected an absolute path", value, key);
+        return false;
+    }
+    strlcpy(outValue, value, size);
+    return true;
+}
+
+/// Parse resource limits, a list of resource=value pairs:
+///
+///     cpu=30 memory=512M files=256 procs=64
+///
+/// cpu is in seconds, memory in bytes with an optional K, M or G suffix,
+/// and 0 removes a limit. Resources that aren't listed are left alone.
+static bool ParseLimitsSetting(const char *key, char *value, ScriptLimits *limits, Logger *logClient)
+{
+    char *word;
+    char *last;
+    char *number;
+    char *end;
+    unsigned long long amount;
+    uint64_t *field;
+    bool ok;
+    
+    ok = true;
+    for (word = strtok_r(value, " \t,", &last); word != NULL; word = strtok_r(NULL, " \t,", &last)) {
+        field = NULL;
+        if ((number = strchr(word, '=')) != NULL) {
+            *number++ = '\0';
+            if (strcmp(word, "cpu") == 0) {
+                field = &limits->fCPU;
+            } else if (strcmp(word, "memory") == 0) {
+                field = &limits->fMemory;
+            } else if (strcmp(word, "files") == 0) {
+                field = &limits->fFiles;
+            } else if (strcmp(word, "procs") == 0) {
+                field = &limits->fProcesses;
+            }
+        }
+        errno = 0;
+        end = number;
+        amount = field != NULL ? strtoull(number, &end, 10) : 0;
+        if (field == &limits->fMemory && end != number) {
+            switch (toupper((unsigned char)*end)) {
+                case 'G': amount *= 1024;   // fall through
+                case 'M': amount *= 1024;   // fall through
+                case 'K': amount *= 1024; end++; break;
+            }
+        }
+        if (field == NULL || errno != 0 || end == number || *end != '\0' || *number == '-') {
+            LogMessage(logClient, LOG_WARNING,
+                       "Ignoring invalid limit '%s' for %s, expected cpu, memory, files or procs=number", word, key);
+            ok = false;
+            continue;
+        }
+        *field = amount;
+    }
+    return ok;
+}
+
+/// Load plugin settings from kSettingsName in kLoginScriptDir.
+///
+/// The settings file is optional, and it's ignored unless it passes the
+/// same ownership checks as the scripts, as it can change how they're run.
+/// Each line is of the form key = value, and # starts a comment.
+///
+/// @param dirFD    Descriptor from VerifyScriptDir(), or -1.
+/// @param outInfo  Receives the stat of the settings file, or zeroes if
+///                 there isn't one.
+static void LoadSettings(int dirFD, dev_t rootDev, PluginSettings *settings, struct stat *outInfo, Logger *logClient)
+{
+    char path[MAXPATHLEN];
+    char line[256];
+    char *key;
+    char *value;
+    FILE *file;
+    int fd;
+    struct stat info;
+    
+    // Defaults, used for anything that isn't set in the file.
+    settings->fMaxConcurrentScripts = 1;
+    settings->fMaxTotalScripts = 16;
+    settings->fScriptTimeout = 0;
+    settings->fPhaseTimeout = 0;
+    settings->fTimeoutGracePeriod = 5;
+    settings->fTimeoutPolicy = kAuthorizationResultDeny;
+    settings->fTraceDirectory[0] = '\0';
+    settings->fAsyncScriptTimeout = 600;
+    settings->fScriptLogDirectory[0] = '\0';
+    settings->fLogLevel = LOG_INFO;
+    settings->fLogFile[0] = '\0';
+    settings->fRequireManifest = false;
+    settings->fUseLauncher = true;
+    settings->fHistoryOrder = true;
+    memset(&settings->fScriptLimits, 0, sizeof(settings->fScriptLimits));
+    settings->fScriptQoS = kScriptQoSDefault;
+    settings->fMaxClassScripts[kScriptQoSInteractive] = 0;
+    settings->fMaxClassScripts[kScriptQoSDefault] = 0;
+    settings->fMaxClassScripts[kScriptQoSBackground] = 1;
+    settings->fBackgroundCPUs = 0;
+    settings->fCgroupDirectory[0] = '\0';
+    settings->fWarmupThreads = 4;
+    settings->fWarmupBudget = 256;
+    settings->fWarmupTimeout = 60;
+    settings->fWarmupWait = 0;
+    memset(outInfo, 0, sizeof(*outInfo));
+    
+    snprintf(path, sizeof(path), "%s/%s", kLoginScriptDir, kSettingsName);
+    if (dirFD == -1 || (faccessat(dirFD, kSettingsName, F_OK, AT_SYMLINK_NOFOLLOW) && errno == ENOENT)) {
+        return;
+    }
+    fstatat(dirFD, kSettingsName, outInfo, AT_SYMLINK_NOFOLLOW);
+    fd = OpenVerifiedAt(dirFD, kSettingsName, path, 0, rootDev, false, &info, logClient);
+    if (fd == -1 || !S_ISREG(info.st_mode)) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Ignoring %s, it must be a root owned file that only root can write to", path);
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    
+    file = fdopen(fd, "r");
+    if (file == NULL) {
+        close(fd);
+        return;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if ((value = strchr(line, '#')) != NULL) {
+            *value = '\0';
+        }
+        if ((value = strchr(line, '=')) == NULL) {
+            continue;
+        }
+        *value++ = '\0';
+        key = TrimWhitespace(line);
+        value = TrimWhitespace(value);
+        
+        if (strcasecmp(key, "MaxConcurrentScripts") == 0) {
+            ParseLongSetting(key, value, 1, kMaxConcurrentScripts, &settings->fMaxConcurrentScripts, logClient);
+        } else if (strcasecmp(key, "MaxTotalScripts") == 0) {
+            ParseLongSetting(key, value, 0, kMaxTotalScripts, &settings->fMaxTotalScripts, logClient);
+        } else if (strcasecmp(key, "ScriptTimeout") == 0) {
+            ParseLongSetting(key, value, 0, kMaxTimeout, &settings->fScriptTimeout, logClient);
+        } else if (strcasecmp(key, "PhaseTimeout") == 0) {
+            ParseLongSetting(key, value, 0, kMaxTimeout, &settings->fPhaseTimeout, logClient);
+        } else if (strcasecmp(key, "TimeoutGracePeriod") == 0) {
+            ParseLongSetting(key, value, 0, kMaxTimeout, &settings->fTimeoutGracePeriod, logClient);
+        } else if (strcasecmp(key, "TimeoutPolicy") == 0) {
+            ParsePolicySetting(key, value, &settings->fTimeoutPolicy, logClient);
+        } else if (strcasecmp(key, "AsyncScriptTimeout") == 0) {
+            ParseLongSetting(key, value, 0, kMaxTimeout, &settings->fAsyncScriptTimeout, logClient);
+        } else if (strcasecmp(key, "ScriptLogDirectory") == 0) {
+            ParsePathSetting(key, value, settings->fScriptLogDirectory, sizeof(settings->fScriptLogDirectory), logClient);
+        } else if (strcasecmp(key, "TraceDirectory") == 0) {
+            ParsePathSetting(key, value, settings->fTraceDirectory, sizeof(settings->fTraceDirectory), logClient);
+        } else if (strcasecmp(key, "LogLevel") == 0) {
+            ParseLevelSetting(key, value, &settings->fLogLevel, logClient);
+        } else if (strcasecmp(key, "LogFile") == 0) {
+            ParsePathSetting(key, value, settings->fLogFile, sizeof(settings->fLogFile), logClient);
+        } else if (strcasecmp(key, "RequireManifest") == 0) {
+            ParseBoolSetting(key, value, &settings->fRequireManifest, logClient);
+        } else if (strcasecmp(key, "UseLauncher") == 0) {
+            ParseBoolSetting(key, value, &settings->fUseLauncher, logClient);
+        } else if (strcasecmp(key, "ScriptOrder") == 0) {
+            ParseOrderSetting(key, value, &settings->fHistoryOrder, logClient);
+        } else if (strcasecmp(key, "ScriptLimits") == 0) {
+            ParseLimitsSetting(key, value, &settings->fScriptLimits, logClient);
+        } else if (strcasecmp(key, "ScriptQoS") == 0) {
+            ParseQoSSetting(key, value, &settings->fScriptQoS, logClient);
+        } else if (strcasecmp(key, "MaxInteractiveScripts") == 0) {
+            ParseLongSetting(key, value, 0, kMaxConcurrentScripts, &settings->fMaxClassScripts[kScriptQoSInteractive], logClient);
+        } else if (strcasecmp(key, "MaxDefaultScripts") == 0) {
+            ParseLongSetting(key, value, 0, kMaxConcurrentScripts, &settings->fMaxClassScripts[kScriptQoSDefault], logClient);
+        } else if (strcasecmp(key, "MaxBackgroundScripts") == 0) {
+            ParseLongSetting(key, value, 0, kMaxConcurrentScripts, &settings->fMaxClassScripts[kScriptQoSBackground], logClient);
+        } else if (strcasecmp(key, "BackgroundCPUs") == 0) {
+            ParseCPUsSetting(key, value, &settings->fBackgroundCPUs, logClient);
+        } else if (strcasecmp(key, "CgroupDirectory") == 0) {
+            ParsePathSetting(key, value, settings->fCgroupDirectory, sizeof(settings->fCgroupDirectory), logClient);
+        } else if (strcasecmp(key, "WarmupThreads") == 0) {
+            ParseLongSetting(key, value, 1, kMaxWarmupThreads, &settings->fWarmupThreads, logClient);
+        } else if (strcasecmp(key, "WarmupBudget") == 0) {
+            ParseLongSetting(key, value, 0, kMaxWarmupBudget, &settings->fWarmupBudget, logClient);
+        } else if (strcasecmp(key, "WarmupTimeout") == 0) {
+            ParseLongSetting(key, value, 1, kMaxTimeout, &settings->fWarmupTimeout, logClient);
+        } else if (strcasecmp(key, "WarmupWait") == 0) {
+            ParseLongSetting(key, value, 0, kMaxTimeout * 1000L, &settings->fWarmupWait, logClient);
+        } else {
+            LogMessage(logClient, LOG_WARNING,
+                       "Ignoring unknown setting '%s' in %s", key, path);
+        }
+    }
+    fclose(file);
+}
+
+/// Parse the lsp-cache key list. The script's contents are always part of
+/// the key, "script" says just that, and "uid" adds the user.
+static void ParseCacheKeys(ScriptEntry *script, char *value, Logger *logClient)
+{
+    char *word;
+    char *last;
+    
+    script->fCache = true;
+    for (word = strtok_r(value, " \t,", &last); word != NULL; word = strtok_r(NULL, " \t,", &last)) {
+        if (strcmp(word, "uid") == 0) {
+            script->fCacheByUid = true;
+        } else if (strcmp(word, "script") != 0) {
+            LogMessage(logClient, LOG_WARNING,
+                       "%s: ignoring unknown lsp-cache key %s", script->fPath, word);
+        }
+    }
+}
+
+/// Read the lsp-* metadata lines from the comment header of a script.
+///
+/// The header is the block of lines starting with # at the top of the
+/// script, and metadata lines look like:
+///
+///     # lsp-after: premount-root-mount_shares
+///
+/// Only the first kMaxScriptHeader bytes of the verified script are examined.
+static void ReadScriptMetadata(ScriptEntry *script, Logger *logClient)
+{
+    char header[kMaxScriptHeader + 1];
+    char *line;
+    char *next;
+    char *key;
+    char *value;
+    ssize_t len;
+    
+    len = pread(script->fFD, header, kMaxScriptHeader, 0);
+    if (len <= 0) {
+        return;
+    }
+    header[len] = '\0';
+    
+    for (line = header; line != NULL && *line == '#'; line = next) {
+        if ((next = strchr(line, '\n')) != NULL) {
+            *next++ = '\0';
+        } else if (line + strlen(line) == header + kMaxScriptHeader) {
+            // Truncated line.
+            break;
+        }
+        key = TrimWhitespace(line + 1);
+        if (strncmp(key, "lsp-", 4) != 0 || (value = strchr(key, ':')) == NULL) {
+            continue;
+        }
+        *value++ = '\0';
+        key = TrimWhitespace(key + 4);
+        value = TrimWhitespace(value);
+        
+        if (strcmp(key, "after") == 0) {
+            if (strlen(script->fAfter) + strlen(value) + 2 > sizeof(script->fAfter)) {
+                LogMessage(logClient, LOG_WARNING,
+                           "%s: lsp-after list too long", script->fPath);
+                continue;
+            }
+            strcat(script->fAfter, " ");
+            strcat(script->fAfter, value);
+        } else if (strcmp(key, "timeout") == 0) {
+            ParseLongSetting("lsp-timeout", value, 0, kMaxTimeout, &script->fTimeout, logClient);
+        } else if (strcmp(key, "on-timeout") == 0) {
+            ParsePolicySetting("lsp-on-timeout", value, &script->fTimeoutPolicy, logClient);
+        } else if (strcmp(key, "async") == 0) {
+            ParseBoolSetting("lsp-async", value, &script->fAsync, logClient);
+        } else if (strcmp(key, "overlap") == 0) {
+            ParseBoolSetting("lsp-overlap", value, &script->fOverlap, logClient);
+        } else if (strcmp(key, "order") == 0) {
+            ParseOrderSetting("lsp-order", value, &script->fHistoryOrder, logClient);
+        } else if (strcmp(key, "cache") == 0) {
+            ParseCacheKeys(script, value, logClient);
+        } else if (strcmp(key, "cache-ttl") == 0) {
+            ParseLongSetting("lsp-cache-ttl", value, 0, LONG_MAX, &script->fCacheTTL, logClient);
+        } else if (strcmp(key, "cache-input") == 0) {
+            if (value[0] != '/' || strlen(script->fCacheInputs) + strlen(value) + 2 > sizeof(script->fCacheInputs)) {
+                LogMessage(logClient, LOG_WARNING,
+                           "%s: ignoring lsp-cache-input %s", script->fPath, value);
+                continue;
+            }
+            if (script->fCacheInputs[0] != '\0') {
+                strcat(script->fCacheInputs, "\n");
+            }
+            strcat(script->fCacheInputs, value);
+        } else if (strcmp(key, "limit") == 0) {
+            ParseLimitsSetting("lsp-limit", value, &script->fLimits, logClient);
+        } else if (strcmp(key, "qos") == 0) {
+            ParseQoSSetting("lsp-qos", value, &script->fQoS.fClass, logClient);
+        } else {
+            LogMessage(logClient, LOG_DEBUG,
+                       "%s: ignoring unknown metadata lsp-%s", script->fPath, key);
+        }
+    }
+}
+
+/// Turn the lsp-after names of each script into indices of the scripts
+/// that have to finish before it can start.
+///
+/// Names that don't match a script in the same phase are ignored, since
+/// scripts in earlier phases have already finished.
+static void ResolveDependencies(ScriptEntry *scripts, size_t numScripts, Logger *logClient)
+{
+    ScriptEntry *script;
+    char after[sizeof(script->fAfter)];
+    char *name;
+    char *last;
+    size_t i;
+    size_t j;
+    
+    for (i = 0; i < numScripts; i++) {
+        script = &scripts[i];
+        strlcpy(after, script->fAfter, sizeof(after));
+        for (name = strtok_r(after, " \t,", &last); name != NULL; name = strtok_r(NULL, " \t,", &last)) {
+            for (j = 0; j < numScripts; j++) {
+                if (j != i && strcmp(scripts[j].fName, name) == 0) {
+                    break;
+                }
+            }
+            if (j == numScripts) {
+                LogMessage(logClient, LOG_NOTICE,
+                           "%s: ignoring lsp-after %s, no such script in this phase", script->fName, name);
+            } else if (script->fNumDeps == kMaxScriptDeps) {
+                LogMessage(logClient, LOG_WARNING,
+                           "%s: too many dependencies, ignoring %s", script->fName, name);
+            } else {
+                script->fDeps[script->fNumDeps++] = j;
+            }
+        }
+    }
+}
+
+/// True if the NAME=value string var sets one of the variables in vars.
+static bool EnvironmentContains(char *const vars[], const char *var)
+{
+    size_t nameLen;
+    size_t i;
+    
+    nameLen = strcspn(var, "=") + 1;
+    for (i = 0; vars[i] != NULL; i++) {
+        if (strncmp(vars[i], var, nameLen) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Build the environment for a script, which is our own environment with
+/// the NAME=value strings in overrides replacing any variables of the same
+/// name.
+///
+/// The strings are copied, so the environment stays valid for as long as
+/// the login it's built for.
+///
+/// @return a malloced array with the strings stored after the terminating
+///         NULL, or NULL on failure.
+static char **BuildScriptEnvironment(char *const overrides[])
+{
+    char **env;
+    char *p;
+    size_t count;
+    size_t size;
+    size_t i;
+    size_t n;
+    
+    count = 0;
+    size = 0;
+    for (i = 0; environ[i] != NULL; i++, count++) {
+        size += strlen(environ[i]) + 1;
+    }
+    for (i = 0; overrides[i] != NULL; i++, count++) {
+        size += strlen(overrides[i]) + 1;
+    }
+    env = malloc((count + 1) * sizeof(*env) + size);
+    if (env == NULL) {
+        return NULL;
+    }
+    p = (char *)&env[count + 1];
+    
+    n = 0;
+    for (i = 0; environ[i] != NULL; i++) {
+        if (! EnvironmentContains(overrides, environ[i])) {
+            env[n++] = p;
+            p = stpcpy(p, environ[i]) + 1;
+        }
+    }
+    for (i = 0; overrides[i] != NULL; i++) {
+        env[n++] = p;
+        p = stpcpy(p, overrides[i]) + 1;
+    }
+    env[n] = NULL;
+    return env;
+}
+
+/// List the descriptors above stderr that this process has open.
+///
+/// The list is made before forking, so the child only has to touch
+/// descriptors that are actually open instead of sweeping every possible
+/// one up to _SC_OPEN_MAX.
+///
+/// @return a malloced array, or NULL if the descriptors can't be listed.
+static int *ListOpenFDs(size_t *outCount)
+{
+    int *fds;
+    size_t count;
+#if defined(__APPLE__)
+    struct proc_fdinfo *info;
+    int size;
+    int i;
+    
+    size = proc_pidinfo(getpid(), PROC_PIDLISTFDS, 0, NULL, 0);
+    if (size <= 0) {
+        return NULL;
+    }
+    // Leave room for descriptors opened by other threads meanwhile.
+    size += 32 * (int)sizeof(*info);
+    info = malloc((size_t)size);
+    fds = malloc((size_t)size / sizeof(*info) * sizeof(*fds));
+    if (info == NULL || fds == NULL
+        || (size = proc_pidinfo(getpid(), PROC_PIDLISTFDS, 0, info, size)) <= 0) {
+        free(info);
+        free(fds);
+        return NULL;
+    }
+    count = 0;
+    for (i = 0; i < size / (int)sizeof(*info); i++) {
+        if (info[i].proc_fd > STDERR_FILENO) {
+            fds[count++] = info[i].proc_fd;
+        }
+    }
+    free(info);
+#else
+    DIR *dir;
+    struct dirent *entry;
+    size_t capacity;
+    int *grown;
+    int fd;
+    
+    dir = opendir("/proc/self/fd");
+    if (dir == NULL) {
+        return NULL;
+    }
+    count = 0;
+    capacity = 64;
+    fds = malloc(capacity * sizeof(*fds));
+    while (fds != NULL && (entry = readdir(dir)) != NULL) {
+        fd = atoi(entry->d_name);
+        if (fd <= STDERR_FILENO || fd == dirfd(dir)) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            grown = realloc(fds, capacity * sizeof(*fds));
+            if (grown == NULL) {
+                free(fds);
+                fds = NULL;
+                break;
+            }
+            fds = grown;
+        }
+        fds[count++] = fd;
+    }
+    closedir(dir);
+    if (fds == NULL) {
+        return NULL;
+    }
+#endif
+    *outCount = count;
+    return fds;
+}
+
+/// Mark every descriptor above stderr for closing on exec.
+///
+/// Called in the child after fork(), so it mustn't allocate. Uses
+/// close_range() where the kernel has it, then the list from ListOpenFDs(),
+/// and only as a last resort sweeps every descriptor up to _SC_OPEN_MAX.
+static bool MarkFDsCloseOnExec(const int *fds, size_t count)
+{
+    long maxfd;
+    long fd;
+    size_t i;
+    
+#if defined(CLOSE_RANGE_CLOEXEC)
+    if (close_range(STDERR_FILENO + 1, ~0U, CLOSE_RANGE_CLOEXEC) == 0) {
+        return true;
+    }
+#endif
+    
+    // Use FD_CLOEXEC instead of close to avoid libdispatch crash.
+    if (fds != NULL) {
+        for (i = 0; i < count; i++) {
+            if (fcntl(fds[i], F_SETFD, FD_CLOEXEC) == -1 && errno != EBADF) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    maxfd = sysconf(_SC_OPEN_MAX);
+    if (maxfd < 0) {
+        maxfd = OPEN_MAX;
+    }
+    for (fd = STDERR_FILENO + 1; fd < maxfd; fd++) {
+        if (fcntl((int)fd, F_SETFD, FD_CLOEXEC) == -1 && errno != EBADF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#if defined(HAVE_SPAWN_CLOSE_FDS)
+/// Launch a script with posix_spawn().
+///
+/// The child gets its own process group and only inherits stdin, stdout
+/// and stderr, contextFD as kScriptContextFD (and the script itself where
+/// it's executed through /dev/fd), with no descriptor sweep needed. stdout
+/// and stderr are replaced by outputFDs when given. posix_spawn() can't
+/// change the uid, so this is only used for scripts that run as root.
+static pid_t SpawnScript(const char *path,
+                         int scriptFD,
+                         const int *outputFDs,
+                         int contextFD,
+                         char *const argv[],
+                         char *const env[],
+                         AuthorizationResult *outResult,
+                         Logger *logClient)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    const char *execPath;
+    pid_t childPid;
+    int err;
+#if defined(__APPLE__)
+    struct stat scriptInfo;
+    struct stat pathInfo;
+    
+    // posix_spawn() needs a path, check that it's still the verified file.
+    if (fstat(scriptFD, &scriptInfo)
+        || lstat(path, &pathInfo)
+        || scriptInfo.st_dev != pathInfo.st_dev
+        || scriptInfo.st_ino != pathInfo.st_ino) {
+        LogMessage(logClient, LOG_ERR,
+                   "%s changed after it was verified", path);
+        *outResult = kAuthorizationResultDeny;
+        return -1;
+    }
+    execPath = path;
+#else
+    // Execute the verified descriptor, moved to a known slot.
+    execPath = "/dev/fd/3";
+#endif
+    
+    if ((err = posix_spawn_file_actions_init(&actions)) != 0) {
+        LogMessage(logClient, LOG_WARNING,
+                   "posix_spawn_file_actions_init failed with errno %d", err);
+        return -1;
+    }
+    if ((err = posix_spawnattr_init(&attr)) != 0) {
+        LogMessage(logClient, LOG_WARNING,
+                   "posix_spawnattr_init failed with errno %d", err);
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+    
+    // Output goes first, as the script may be moved on top of it, and the
+    // context last. LoginContextOpen() keeps it above kScriptContextFD, so
+    // nothing is moved on top of it before that.
+    err = 0;
+    if (err == 0 && outputFDs != NULL) err = posix_spawn_file_actions_adddup2(&actions, outputFDs[0], STDOUT_FILENO);
+    if (err == 0 && outputFDs != NULL) err = posix_spawn_file_actions_adddup2(&actions, outputFDs[1], STDERR_FILENO);
+#if defined(__APPLE__)
+    if (err == 0) err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_CLOEXEC_DEFAULT);
+    if (err == 0) err = posix_spawn_file_actions_addinherit_np(&actions, STDIN_FILENO);
+    if (err == 0 && outputFDs == NULL) err = posix_spawn_file_actions_addinherit_np(&actions, STDOUT_FILENO);
+    if (err == 0 && outputFDs == NULL) err = posix_spawn_file_actions_addinherit_np(&actions, STDERR_FILENO);
+    if (err == 0 && contextFD != -1) err = posix_spawn_file_actions_adddup2(&actions, contextFD, kScriptContextFD);
+#else
+    if (err == 0) err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    if (err == 0) err = posix_spawn_file_actions_adddup2(&actions, scriptFD, 3);
+    if (err == 0 && contextFD != -1) err = posix_spawn_file_actions_adddup2(&actions, contextFD, kScriptContextFD);
+    if (err == 0) err = posix_spawn_file_actions_addclosefrom_np(&actions, kScriptContextFD + 1);
+#endif
+    if (err == 0) err = posix_spawnattr_setpgroup(&attr, 0);
+    
+    if (err == 0) {
+        err = posix_spawn(&childPid, execPath, &actions, &attr, argv, env);
+        if (err != 0) {
+            // Treat it like a failed exec in a forked child.
+            LogMessage(logClient, LOG_ERR,
+                       "Executing %s failed with errno %d", path, err);
+            *outResult = kAuthorizationResultDeny;
+        }
+    } else {
+        LogMessage(logClient, LOG_WARNING,
+                   "Setting up posix_spawn failed with errno %d", err);
+    }
+    
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    
+    return err == 0 ? childPid : -1;
+}
+#endif
+
+/// The steps of ForkScript()'s child that can fail before the exec.
+typedef enum {
+    kForkStepCgroup,
+    kForkStepLimits,
+    kForkStepQoS,               // not fatal, the script still runs
+    kForkStepUser,
+    kForkStepFDs,
+    kForkStepChanged,
+    kForkStepExec
+} forkStep;
+
+/// Report a failed step from ForkScript()'s child to the parent.
+///
+/// The child of a multithreaded host may only make async-signal-safe
+/// calls, so it can't log. It writes the step and errno to a pipe that's
+/// closed on exec instead, and the parent logs them.
+static void ForkReport(int reportFD, forkStep step, int err)
+{
+    int32_t report[2];
+    
+    report[0] = step;
+    report[1] = err;
+    write(reportFD, report, sizeof(report));
+}
+
+/// Log what ForkScript()'s child reported until it executed the script or
+/// exited, and close the pipe.
+static void ForkReadReports(int reportFD, const char *path, Logger *logClient)
+{
+    int32_t report[2];
+    ssize_t len;
+    
+    for (;;) {
+        len = read(reportFD, report, sizeof(report));
+        if (len == -1 && errno == EINTR) {
+            continue;
+        } else if (len != sizeof(report)) {
+            break;
+        }
+        switch (report[0]) {
+            case kForkStepCgroup:
+                LogMessage(logClient, LOG_ERR,
+                           "Joining the cgroup of %s failed with errno %d", path, report[1]);
+                break;
+            case kForkStepLimits:
+                LogMessage(logClient, LOG_ERR,
+                           "Setting the resource limits of %s failed with errno %d", path, report[1]);
+                break;
+            case kForkStepQoS:
+                LogMessage(logClient, LOG_WARNING,
+                           "Setting the QoS class of %s failed with errno %d", path, report[1]);
+                break;
+            case kForkStepUser:
+                LogMessage(logClient, LOG_ERR,
+                           "setgid/setuid failed with errno %d, aborting execution of %s", report[1], path);
+                break;
+            case kForkStepFDs:
+                LogMessage(logClient, LOG_ERR,
+                           "Marking file descriptors for closing failed with errno %d", report[1]);
+                break;
+            case kForkStepChanged:
+                LogMessage(logClient, LOG_ERR,
+                           "%s changed after it was verified", path);
+                break;
+            default:
+                LogMessage(logClient, LOG_ERR,
+                           "Executing %s failed with errno %d", path, report[1]);
+                break;
+        }
+    }
+    close(reportFD);
+}
+
+/// Launch a script with fork() and exec.
+///
+/// This is used for scripts that run as the user, as the child has to
+/// change its uid and gid before executing the script, for scripts with
+/// limits, a QoS class or a cgroup, and for root scripts where
+/// posix_spawn() can't close inherited descriptors.
+///
+/// Like posix_spawn(), it returns once the child has executed the script
+/// or given up, and logs what went wrong in the child.
+static pid_t ForkScript(const char *path,
+                        int scriptFD,
+                        const int *outputFDs,
+                        int contextFD,
+                        const ScriptLimits *limits,
+                        const ScriptQoS *qos,
+                        int cgroupFD,
+                        char *const argv[],
+                        char *const env[],
+                        uid_t uid,
+                        gid_t gid,
+                        userContext context,
+                        Logger *logClient)
+{
+    pid_t childPid;
+    int *fds;
+    size_t numFDs;
+    int reportPipe[2];
+    int reportFD;
+#if !defined(HAVE_FEXECVE)
+    struct stat scriptInfo;
+    struct stat pathInfo;
+#endif
+    
+    // The write end is kept clear of the descriptors the child moves into
+    // place.
+    if (pipe(reportPipe) != 0) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Fork failed, can't create a pipe, errno %d", errno);
+        return -1;
+    }
+    reportFD = fcntl(reportPipe[1], F_DUPFD_CLOEXEC, kScriptContextFD + 1);
+    close(reportPipe[1]);
+    fcntl(reportPipe[0], F_SETFD, FD_CLOEXEC);
+    if (reportFD == -1) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Fork failed, can't create a pipe, errno %d", errno);
+        close(reportPipe[0]);
+        return -1;
+    }
+    
+    numFDs = 0;
+    fds = ListOpenFDs(&numFDs);
+    
+    childPid = fork();
+    if (childPid == -1) {
+        // Error.
+        LogMessage(logClient, LOG_WARNING,
+                   "Fork failed with errno %d", errno);
+    } else if (childPid == 0) {
+        // Child. Only async-signal-safe calls from here on, as other
+        // threads may have held locks in malloc or the logger at the time
+        // of the fork.
+        
+        // Put the script in its own process group so that a timeout can
+        // take out anything it has started as well.
+        setpgid(0, 0);
+        
+        if (outputFDs != NULL) {
+            dup2(outputFDs[0], STDOUT_FILENO);
+            dup2(outputFDs[1], STDERR_FILENO);
+        }
+        
+        // Move into the script's cgroup, and apply its limits while still
+        // root so that the script can't raise them again, and its QoS
+        // class, which may be above the plugin host's.
+        if (cgroupFD != -1 && write(cgroupFD, "0\n", 2) != 2) {
+            ForkReport(reportFD, kForkStepCgroup, errno);
+            _exit(EX_NOPERM);
+        }
+        if (! ScriptLimitsApply(limits)) {
+            ForkReport(reportFD, kForkStepLimits, errno);
+            _exit(EX_NOPERM);
+        }
+        if (! ScriptQoSApply(qos)) {
+            ForkReport(reportFD, kForkStepQoS, errno);
+        }
+        
+#warning REVIEW: User commands still run in root's session.
+        if (context == kRunAsUser) {
+            if (setgid(gid) || setuid(uid)) {
+                ForkReport(reportFD, kForkStepUser, errno);
+                _exit(EX_NOPERM);
+            }
+        }
+        
+        // Mark any stray file descriptors for closing.
+        if (! MarkFDsCloseOnExec(fds, numFDs)) {
+            ForkReport(reportFD, kForkStepFDs, errno);
+            _exit(EX_NOPERM);
+        }
+        
+        // Clear the way for the login context, then put it in place.
+        if (contextFD != -1) {
+            if (scriptFD == kScriptContextFD) {
+                scriptFD = fcntl(scriptFD, F_DUPFD_CLOEXEC, kScriptContextFD + 1);
+            }
+            dup2(contextFD, kScriptContextFD);
+        }
+        
+#if defined(HAVE_FEXECVE)
+        // An interpreter is handed the script as /dev/fd/N, so it has to
+        // survive the exec.
+        fcntl(scriptFD, F_SETFD, 0);
+        fexecve(scriptFD, argv, env);
+#else
+        if (fstat(scriptFD, &scriptInfo)
+            || lstat(path, &pathInfo)
+            || scriptInfo.st_dev != pathInfo.st_dev
+            || scriptInfo.st_ino != pathInfo.st_ino) {
+            ForkReport(reportFD, kForkStepChanged, 0);
+            _exit(EX_NOPERM);
+        }
+        execve(path, argv, env);
+#endif
+        // The following only executes if exec fails.
+        ForkReport(reportFD, kForkStepExec, errno);
+        _exit(EX_NOPERM);
+    } else {
+        // Parent. Also set the process group here, so it's in place before
+        // we might need to signal it.
+        setpgid(childPid, childPid);
+    }
+    
+    close(reportFD);
+    if (childPid != -1) {
+        ForkReadReports(reportPipe[0], path, logClient);
+    } else {
+        close(reportPipe[0]);
+    }
+    free(fds);
+    return childPid;
+}
+
+#pragma mark *     Login Context
+
+/// Get a zero terminated string from the authorization context.
+///
+/// @return the string, owned by the engine, or NULL.
+static const char *GetContextString(PluginRecord *plugin, AuthorizationEngineRef engine, const char *key)
+{
+    AuthorizationContextFlags authContextFlags;
+    const AuthorizationValue *value;
+    
+    if (plugin->fCallbacks->GetContextValue(engine, key, &authContextFlags, &value) != errAuthorizationSuccess
+        || value == NULL
+        || value->length == 0
+        || ((const char *)value->data)[value->length - 1] != '\0') {
+        return NULL;
+    }
+    return value->data;
+}
+
+/// Append a key=value line to a serialized context.
+///
+/// Values that would break the format, or don't fit, are left out.
+static void AppendContextLine(char *blob, size_t *length, const char *key, const char *value, Logger *logClient)
+{
+    int n;
+    
+    if (value == NULL) {
+        return;
+    }
+    if (strchr(value, '\n') != NULL) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Leaving %s out of the login context, it contains a newline", key);
+        return;
+    }
+    n = snprintf(blob + *length, kMaxContextLength - *length, "%s=%s\n", key, value);
+    if (n < 0 || (size_t)n >= kMaxContextLength - *length) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Leaving %s out of the login context, it's too long", key);
+        blob[*length] = '\0';
+        return;
+    }
+    *length += (size_t)n;
+}
+
+/// List the groups of a user, as names and as numbers.
+static void ResolveGroups(const char *username, gid_t gid, char *names, char *gids, size_t size)
+{
+#if defined(__APPLE__)
+    int groups[kMaxContextGroups];
+#else
+    gid_t groups[kMaxContextGroups];
+#endif
+    struct group grp;
+    struct group *result;
+    char *buf;
+    size_t bufSize;
+    size_t namesLen;
+    size_t gidsLen;
+    int numGroups;
+    int i;
+    
+    names[0] = gids[0] = '\0';
+    numGroups = kMaxContextGroups;
+    if (username == NULL) {
+        numGroups = 0;
+    } else if (getgrouplist(username, gid, groups, &numGroups) == -1) {
+        // Only the first kMaxContextGroups are listed.
+        numGroups = MIN(numGroups, kMaxContextGroups);
+    }
+    if (numGroups <= 0) {
+        groups[0] = gid;
+        numGroups = 1;
+    }
+    
+    // Groups with many members need a large buffer.
+    bufSize = 65536;
+    buf = malloc(bufSize);
+    namesLen = gidsLen = 0;
+    for (i = 0; i < numGroups; i++) {
+        result = NULL;
+        if (buf != NULL) {
+            getgrgid_r((gid_t)groups[i], &grp, buf, bufSize, &result);
+        }
+        if (result != NULL) {
+            namesLen += (size_t)snprintf(names + namesLen, size - namesLen, "%s%s", i ? "," : "", result->gr_name);
+        } else {
+            namesLen += (size_t)snprintf(names + namesLen, size - namesLen, "%s%u", i ? "," : "", (unsigned)groups[i]);
+        }
+        gidsLen += (size_t)snprintf(gids + gidsLen, size - gidsLen, "%s%u", i ? "," : "", (unsigned)groups[i]);
+        if (namesLen >= size || gidsLen >= size) {
+            // Too many to list, leave them out rather than truncate.
+            names[0] = gids[0] = '\0';
+            break;
+        }
+    }
+    free(buf);
+}
+
+#if defined(HAVE_MEMFD)
+/// Put a serialized context in a sealed memfd.
+///
+/// @return the descriptor, or -1 on failure.
+static int CreateContextFD(const char *blob, size_t length)
+{
+    int fd;
+    
+    fd = memfd_create("LoginContext", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        return -1;
+    }
+    if (write(fd, blob, length) != (ssize_t)length
+        || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+#endif
+
+static void DestroyLoginContext(LoginContext *login)
+{
+    if (login->fBlobFD != -1) {
+        close(login->fBlobFD);
+    }
+    free(login->fEnvironment[kRunAsRoot]);
+    free(login->fEnvironment[kRunAsUser]);
+    free(login->fBlob);
+    free(login);
+}
+
+/// Gather the context of a login.
+///
+/// Everything but the uid, gid and home directory is optional: what the
+/// authorization context doesn't have is looked up in the user's record,
+/// and what can't be found is left out.
+static LoginContext *CreateLoginContext(PluginRecord *plugin,
+                                        AuthorizationEngineRef engine,
+                                        uid_t uid,
+                                        gid_t gid,
+                                        const char *home,
+                                        Logger *logClient)
+{
+    LoginContext *login;
+    struct passwd pwd;
+    struct passwd *pw;
+    char pwBuf[4096];
+    const char *username;
+    const char *longname;
+    const char *shell;
+    char uidStr[3 * sizeof(uid_t) + 1];
+    char gidStr[3 * sizeof(gid_t) + 1];
+    char *groupNames;
+    char *groupIDs;
+    char encoding[64];
+    char contextFD[32];
+    char *userVar;
+    char *lognameVar;
+    char *homeVar;
+    char *overrides[6];
+    size_t n;
+    
+    login = calloc(1, sizeof(*login));
+    if (login == NULL) {
+        return NULL;
+    }
+    login->fEngine = engine;
+    login->fBlobFD = -1;
+    login->fBlob = malloc(kMaxContextLength);
+    groupNames = malloc(kMaxContextLength);
+    groupIDs = malloc(kMaxContextLength);
+    if (login->fBlob == NULL || groupNames == NULL || groupIDs == NULL) {
+        free(groupNames);
+        free(groupIDs);
+        DestroyLoginContext(login);
+        return NULL;
+    }
+    login->fBlob[0] = '\0';
+    
+    pw = NULL;
+    getpwuid_r(uid, &pwd, pwBuf, sizeof(pwBuf), &pw);
+    if ((username = GetContextString(plugin, engine, "username")) == NULL && pw != NULL) {
+        username = pw->pw_name;
+    }
+    if ((longname = GetContextString(plugin, engine, "longname")) == NULL && pw != NULL) {
+        longname = pw->pw_gecos;
+    }
+    if ((shell = GetContextString(plugin, engine, "shell")) == NULL && pw != NULL) {
+        shell = pw->pw_shell;
+    }
+    ResolveGroups(username, gid, groupNames, groupIDs, kMaxContextLength);
+    
+    snprintf(uidStr, sizeof(uidStr), "%u", (unsigned)uid);
+    snprintf(gidStr, sizeof(gidStr), "%u", (unsigned)gid);
+    AppendContextLine(login->fBlob, &login->fBlobLength, "username", username, logClient);
+    AppendContextLine(login->fBlob, &login->fBlobLength, "longname", longname, logClient);
+    AppendContextLine(login->fBlob, &login->fBlobLength, "uid", uidStr, logClient);
+    AppendContextLine(login->fBlob, &login->fBlobLength, "gid", gidStr, logClient);
+    AppendContextLine(login->fBlob, &login->fBlobLength, "home", home, logClient);
+    AppendContextLine(login->fBlob, &login->fBlobLength, "shell", shell, logClient);
+    AppendContextLine(login->fBlob, &login->fBlobLength, "groups", groupNames, logClient);
+    AppendContextLine(login->fBlob, &login->fBlobLength, "gids", groupIDs, logClient);
+    free(groupNames);
+    free(groupIDs);
+#if defined(HAVE_MEMFD)
+    login->fBlobFD = CreateContextFD(login->fBlob, login->fBlobLength);
+#endif
+    
+    // Root scripts keep root's environment, user scripts get the user's.
+    snprintf(contextFD, sizeof(contextFD), "LSP_CONTEXT_FD=%d", kScriptContextFD);
+    snprintf(encoding, sizeof(encoding), "__CF_USER_TEXT_ENCODING=0x%X:0:0", getuid());
+    overrides[0] = encoding;
+    overrides[1] = contextFD;
+    overrides[2] = NULL;
+    login->fEnvironment[kRunAsRoot] = BuildScriptEnvironment(overrides);
+    
+    snprintf(encoding, sizeof(encoding), "__CF_USER_TEXT_ENCODING=0x%X:0:0", uid);
+    n = 2;
+    if (asprintf(&homeVar, "HOME=%s", home) != -1) {
+        overrides[n++] = homeVar;
+    } else {
+        homeVar = NULL;
+    }
+    if (username != NULL && asprintf(&userVar, "USER=%s", username) != -1) {
+        overrides[n++] = userVar;
+    } else {
+        userVar = NULL;
+    }
+    if (username != NULL && asprintf(&lognameVar, "LOGNAME=%s", username) != -1) {
+        overrides[n++] = lognameVar;
+    } else {
+        lognameVar = NULL;
+    }
+    overrides[n] = NULL;
+    login->fEnvironment[kRunAsUser] = BuildScriptEnvironment(overrides);
+    free(homeVar);
+    free(userVar);
+    free(lognameVar);
+    
+    if (login->fEnvironment[kRunAsRoot] == NULL || login->fEnvironment[kRunAsUser] == NULL) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Couldn't build the script environment");
+    }
+    LogMessage(logClient, LOG_DEBUG,
+               "Gathered the login context for uid %u, %zu bytes", (unsigned)uid, login->fBlobLength);
+    return login;
+}
+
+/// Find the context of the login that engine belongs to, or gather it.
+///
+/// The context is gathered without holding fLoginLock, as looking up
+/// groups may have to wait for a directory server.
+///
+/// @return the context, to be released with ReleaseLoginContext(), or NULL.
+static LoginContext *AcquireLoginContext(PluginRecord *plugin,
+                                         AuthorizationEngineRef engine,
+                                         uid_t uid,
+                                         gid_t gid,
+                                         const char *home,
+                                         Logger *logClient)
+{
+    LoginContext *login;
+    LoginContext *created;
+    
+    created = NULL;
+    for (;;) {
+        pthread_mutex_lock(&plugin->fLoginLock);
+        for (login = plugin->fLogins; login != NULL; login = login->fNext) {
+            if (login->fEngine == engine) {
+                break;
+            }
+        }
+        if (login == NULL && created != NULL) {
+            login = created;
+            login->fNext = plugin->fLogins;
+            plugin->fLogins = login;
+            created = NULL;
+        }
+        if (login != NULL) {
+            login->fRefCount++;
+        }
+        pthread_mutex_unlock(&plugin->fLoginLock);
+        
+        if (login != NULL) {
+            // Another mechanism of the login may have got there first.
+            if (created != NULL) {
+                DestroyLoginContext(created);
+            }
+            return login;
+        }
+        if ((created = CreateLoginContext(plugin, engine, uid, gid, home, logClient)) == NULL) {
+            LogMessage(logClient, LOG_WARNING,
+                       "Couldn't gather the login context");
+            return NULL;
+        }
+    }
+}
+
+/// Drop a reference to a login context, freeing it when the login is done
+/// with it.
+static void ReleaseLoginContext(PluginRecord *plugin, LoginContext *login)
+{
+    LoginContext **link;
+    bool last;
+    
+    pthread_mutex_lock(&plugin->fLoginLock);
+    last = --login->fRefCount == 0;
+    if (last) {
+        for (link = &plugin->fLogins; *link != login; link = &(*link)->fNext)
+            ;
+        *link = login->fNext;
+    }
+    pthread_mutex_unlock(&plugin->fLoginLock);
+    
+    if (last) {
+        DestroyLoginContext(login);
+    }
+}
+
+/// Open a descriptor with the login context for a script to inherit.
+///
+/// Every script gets a read-only descriptor of its own, so scripts that
+/// run at the same time don't share a read position: the memfd reopened
+/// through /proc, or where that can't be done, a pipe that has been
+/// filled with the context. The descriptor is kept above kScriptContextFD,
+/// so moving the others into place can't overwrite it.
+///
+/// @return the descriptor, or -1 on failure.
+static int LoginContextOpen(const LoginContext *login)
+{
+    int pipeFDs[2];
+    int fd;
+    int movedFD;
+#if defined(HAVE_MEMFD)
+    char path[32];
+#endif
+    
+    fd = -1;
+#if defined(HAVE_MEMFD)
+    if (login->fBlobFD != -1) {
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", login->fBlobFD);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+#endif
+    if (fd == -1) {
+        // kMaxContextLength fits in an empty pipe, so this doesn't block.
+        if (pipe(pipeFDs) != 0) {
+            return -1;
+        }
+        fcntl(pipeFDs[0], F_SETFD, FD_CLOEXEC);
+        fcntl(pipeFDs[1], F_SETFD, FD_CLOEXEC);
+        fcntl(pipeFDs[1], F_SETFL, O_NONBLOCK);
+        if (write(pipeFDs[1], login->fBlob, login->fBlobLength) != (ssize_t)login->fBlobLength) {
+            close(pipeFDs[0]);
+            close(pipeFDs[1]);
+            return -1;
+        }
+        close(pipeFDs[1]);
+        fd = pipeFDs[0];
+    }
+    
+    if (fd <= kScriptContextFD) {
+        movedFD = fcntl(fd, F_DUPFD_CLOEXEC, kScriptContextFD + 1);
+        close(fd);
+        fd = movedFD;
+    }
+    return fd;
+}
+
+#pragma mark *     Launcher
+
+#if defined(__APPLE__)
+#define kLauncherSendFlags 0            // the socket has SO_NOSIGPIPE instead
+#else
+#define kLauncherSendFlags MSG_NOSIGNAL
+#endif
+
+/// Start lsp-launcher, which lives next to the plugin's executable.
+///
+/// The launcher is verified like a script before it's started, and talks
+/// to the plugin over a socketpair that it gets as kLauncherSocketFD.
+/// Called with fLauncherLock held.
+static bool LauncherStart(PluginRecord *plugin, Logger *logClient)
+{
+#if defined(HAVE_SPAWN_CLOSE_FDS)
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    struct stat chainInfo[kMaxChainDepth];
+    int chainFDs[kMaxChainDepth];
+    struct stat info;
+    struct stat pathInfo;
+    char dirPath[MAXPATHLEN];
+    char path[MAXPATHLEN];
+    char *argv[2];
+    char *env[1];
+    char *slash;
+    Dl_info image;
+    size_t depth;
+    size_t i;
+    pid_t pid;
+    int sockets[2];
+    int dirFD;
+    int fd;
+    int err;
+    
+    if (dladdr((const void *)&LauncherStart, &image) == 0 || image.dli_fname == NULL
+        || strlcpy(dirPath, image.dli_fname, sizeof(dirPath)) >= sizeof(dirPath)
+        || (slash = strrchr(dirPath, '/')) == NULL) {
+        LogMessage(logClient, LOG_WARNING, "Can't find %s", kLauncherName);
+        return false;
+    }
+    *slash = '\0';
+    if (snprintf(path, sizeof(path), "%s/%s", dirPath, kLauncherName) >= (int)sizeof(path)) {
+        LogMessage(logClient, LOG_WARNING, "Can't find %s, the path is too long", kLauncherName);
+        return false;
+    }
+    
+    dirFD = VerifyDirChain(dirPath, false, chainInfo, chainFDs, &depth, logClient);
+    if (dirFD == -1) {
+        return false;
+    }
+    for (i = 0; i + 1 < depth; i++) {
+        close(chainFDs[i]);
+    }
+    fd = OpenVerifiedAt(dirFD, kLauncherName, path, 0, chainInfo[0].st_dev, true, &info, logClient);
+    close(dirFD);
+    if (fd == -1) {
+        return false;
+    }
+    
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+        LogMessage(logClient, LOG_WARNING, "socketpair failed with errno %d", errno);
+        close(fd);
+        return false;
+    }
+    fcntl(sockets[0], F_SETFD, FD_CLOEXEC);
+    fcntl(sockets[1], F_SETFD, FD_CLOEXEC);
+#if defined(SO_NOSIGPIPE)
+    setsockopt(sockets[0], SOL_SOCKET, SO_NOSIGPIPE, &(int){ 1 }, sizeof(int));
+#endif
+    
+    argv[0] = kLauncherName;
+    argv[1] = NULL;
+    env[0] = NULL;
+    err = posix_spawn_file_actions_init(&actions);
+    if (err == 0 && (err = posix_spawnattr_init(&attr)) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+    }
+    if (err == 0) {
+        err = posix_spawn_file_actions_adddup2(&actions, sockets[1], kLauncherSocketFD);
+#if defined(__APPLE__)
+        if (err == 0) err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_CLOEXEC_DEFAULT);
+        if (err == 0) err = posix_spawn_file_actions_addinherit_np(&actions, STDIN_FILENO);
+        if (err == 0) err = posix_spawn_file_actions_addinherit_np(&actions, STDOUT_FILENO);
+        if (err == 0) err = posix_spawn_file_actions_addinherit_np(&actions, STDERR_FILENO);
+#else
+        if (err == 0) err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        if (err == 0) err = posix_spawn_file_actions_addclosefrom_np(&actions, kLauncherSocketFD + 1);
+#endif
+        if (err == 0) err = posix_spawnattr_setpgroup(&attr, 0);
+        
+        // posix_spawn() needs a path, check that it's still the verified file.
+        if (err == 0 && (fstat(fd, &info) || lstat(path, &pathInfo)
+                         || info.st_dev != pathInfo.st_dev || info.st_ino != pathInfo.st_ino)) {
+            err = EPERM;
+        }
+        if (err == 0) {
+            err = posix_spawn(&pid, path, &actions, &attr, argv, env);
+        }
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+    }
+    close(fd);
+    close(sockets[1]);
+    if (err != 0) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Starting %s failed with errno %d", path, err);
+        close(sockets[0]);
+        return false;
+    }
+    
+    LogMessage(logClient, LOG_INFO, "Started %s, pid %d", kLauncherName, pid);
+    plugin->fLauncherPid = pid;
+    plugin->fLauncherSocket = sockets[0];
+    return true;
+#else
+    return false;
+#endif
+}
+
+/// Stop lsp-launcher, which exits when its socket is closed. Called with
+/// fLauncherLock held.
+static void LauncherStop(PluginRecord *plugin)
+{
+    if (plugin->fLauncherSocket != -1) {
+        close(plugin->fLauncherSocket);
+        plugin->fLauncherSocket = -1;
+    }
+    if (plugin->fLauncherPid != -1) {
+        while (waitpid(plugin->fLauncherPid, NULL, 0) == -1 && errno == EINTR)
+            ;
+        plugin->fLauncherPid = -1;
+    }
+}
+
+/// Hold off using lsp-launcher after it failed, for twice as long each
+/// time it fails in a row, up to kLauncherRetryMax. Scripts are launched
+/// by the plugin in the meantime. Called with fLauncherLock held.
+static void LauncherBackoff(PluginRecord *plugin, Logger *logClient)
+{
+    uint64_t delay;
+    
+    delay = kLauncherRetryMax;
+    if (plugin->fLauncherFailures < 6 && (kLauncherRetryMin << plugin->fLauncherFailures) < kLauncherRetryMax) {
+        delay = kLauncherRetryMin << plugin->fLauncherFailures;
+    }
+    plugin->fLauncherFailures++;
+    plugin->fLauncherRetryTime = MonotonicTime() + delay * kMicrosPerSecond;
+    LogMessage(logClient, LOG_WARNING,
+               "Not using %s for %llu seconds", kLauncherName, (unsigned long long)delay);
+}
+
+/// Send a request to lsp-launcher, starting or restarting it as needed.
+/// Called with fLauncherLock held.
+///
+/// @return false if the launcher isn't available.
+static bool LauncherSend(PluginRecord *plugin,
+                         const LauncherRequest *request,
+                         const char *strings,
+                         const int *fds,
+                         size_t numFDs,
+                         Logger *logClient)
+{
+    union {
+        struct cmsghdr fHeader;
+        char fSpace[CMSG_SPACE(kLauncherMaxFDs * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct iovec iov[2];
+    struct cmsghdr *cmsg;
+    size_t attempt;
+    size_t total;
+    size_t sent;
+    ssize_t n;
+    
+    for (attempt = 0; attempt < 2; attempt++) {
+        // A launcher that has died is replaced.
+        if (plugin->fLauncherPid != -1 && waitpid(plugin->fLauncherPid, NULL, WNOHANG) == plugin->fLauncherPid) {
+            LogMessage(logClient, LOG_WARNING, "%s has died, restarting it", kLauncherName);
+            plugin->fLauncherPid = -1;
+            LauncherStop(plugin);
+        }
+        if (plugin->fLauncherSocket == -1) {
+            if (MonotonicTime() < plugin->fLauncherRetryTime) {
+                return false;
+            }
+            if (! LauncherStart(plugin, logClient)) {
+                LauncherBackoff(plugin, logClient);
+                return false;
+            }
+        }
+        
+        memset(&msg, 0, sizeof(msg));
+        memset(&control, 0, sizeof(control));
+        iov[0].iov_base = (void *)request;
+        iov[0].iov_len = sizeof(*request);
+        iov[1].iov_base = (void *)strings;
+        iov[1].iov_len = request->fLength;
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        msg.msg_control = control.fSpace;
+        msg.msg_controllen = CMSG_SPACE(numFDs * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(numFDs * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, numFDs * sizeof(int));
+        
+        total = sizeof(*request) + request->fLength;
+        sent = 0;
+        while (sent < total) {
+            n = sendmsg(plugin->fLauncherSocket, &msg, kLauncherSendFlags);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            // Anything that didn't fit goes without the descriptors.
+            sent += (size_t)n;
+            msg.msg_control = NULL;
+            msg.msg_controllen = 0;
+            while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov[0].iov_len) {
+                n -= (ssize_t)msg.msg_iov[0].iov_len;
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            }
+            if (msg.msg_iovlen > 0) {
+                msg.msg_iov[0].iov_base = (char *)msg.msg_iov[0].iov_base + n;
+                msg.msg_iov[0].iov_len -= (size_t)n;
+            }
+        }
+        if (sent == total) {
+            return true;
+        }
+        if (sent > 0) {
+            // The launcher can't make sense of the rest of the stream.
+            LogMessage(logClient, LOG_WARNING,
+                       "Sending to %s failed with errno %d", kLauncherName, errno);
+            LauncherStop(plugin);
+            return false;
+        }
+        LogMessage(logClient, LOG_WARNING,
+                   "%s isn't responding, errno %d, restarting it", kLauncherName, errno);
+        LauncherStop(plugin);
+    }
+    LauncherBackoff(plugin, logClient);
+    return false;
+}
+
+/// Have lsp-launcher fork and execute a script.
+///
+/// The script runs as a child of the launcher, which reports its exit
+/// status on the descriptor returned in outStatusFD, see ReapJob().
+///
+/// A request that couldn't be delivered is retried with a new launcher
+/// by LauncherSend(). Once it has been, it's never sent again: if the
+/// launcher dies before it has answered, it may already have forked the
+/// script, so authorization is denied instead, as for a lost exit status.
+///
+/// @return false if the launcher isn't available, and the script should
+///         be launched some other way.
+static bool LauncherSpawn(PluginRecord *plugin,
+                          const char *path,
+                          int scriptFD,
+                          const int *outputFDs,
+                          int contextFD,
+                          const ScriptLimits *limits,
+                          const ScriptQoS *qos,
+                          int cgroupFD,
+                          char *const argv[],
+                          char *const env[],
+                          uid_t uid,
+                          gid_t gid,
+                          userContext context,
+                          pid_t *outPid,
+                          int *outStatusFD,
+                          AuthorizationResult *outResult,
+                          Logger *logClient)
+{
+    LauncherRequest request;
+    char *strings;
+    char *p;
+    size_t length;
+    size_t i;
+    int fds[kLauncherMaxFDs];
+    int replyFDs[2];
+    size_t numFDs;
+    ssize_t len;
+    pid_t launcherPid;
+    int32_t reply;
+    bool sent;
+    
+    memset(&request, 0, sizeof(request));
+    request.fFlags = (context == kRunAsUser ? kLauncherSetUser : 0)
+                   | (outputFDs != NULL ? kLauncherCapture : 0)
+                   | (contextFD != -1 ? kLauncherContext : 0)
+                   | (cgroupFD != -1 ? kLauncherCgroup : 0);
+    request.fUid = (uint32_t)uid;
+    request.fGid = (uint32_t)gid;
+    request.fLimits = *limits;
+    request.fQoS = *qos;
+    length = strlen(path) + 1;
+    for (i = 0; argv[i] != NULL; i++) {
+        length += strlen(argv[i]) + 1;
+    }
+    request.fArgc = (uint32_t)i;
+    for (i = 0; env[i] != NULL; i++) {
+        length += strlen(env[i]) + 1;
+    }
+    request.fEnvc = (uint32_t)i;
+    if (length > kLauncherMaxStrings || (strings = malloc(length)) == NULL) {
+        return false;
+    }
+    p = strings;
+    p = stpcpy(p, path) + 1;
+    for (i = 0; argv[i] != NULL; i++) {
+        p = stpcpy(p, argv[i]) + 1;
+    }
+    for (i = 0; env[i] != NULL; i++) {
+        p = stpcpy(p, env[i]) + 1;
+    }
+    request.fLength = (uint32_t)length;
+    
+    numFDs = 0;
+    fds[numFDs++] = -1;                 // the reply socket
+    fds[numFDs++] = scriptFD;
+    if (outputFDs != NULL) {
+        fds[numFDs++] = outputFDs[0];
+        fds[numFDs++] = outputFDs[1];
+    }
+    if (contextFD != -1) {
+        fds[numFDs++] = contextFD;
+    }
+    if (cgroupFD != -1) {
+        fds[numFDs++] = cgroupFD;
+    }
+    
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, replyFDs) != 0) {
+        free(strings);
+        return false;
+    }
+    fcntl(replyFDs[0], F_SETFD, FD_CLOEXEC);
+    fcntl(replyFDs[1], F_SETFD, FD_CLOEXEC);
+    fds[0] = replyFDs[1];
+    
+    pthread_mutex_lock(&plugin->fLauncherLock);
+    sent = LauncherSend(plugin, &request, strings, fds, numFDs, logClient);
+    launcherPid = plugin->fLauncherPid;
+    pthread_mutex_unlock(&plugin->fLauncherLock);
+    close(replyFDs[1]);
+    free(strings);
+    if (! sent) {
+        close(replyFDs[0]);
+        return false;
+    }
+    
+    // The pid comes back as soon as the launcher has forked, and nothing
+    // at all if the launcher died with the request.
+    while ((len = read(replyFDs[0], &reply, sizeof(reply))) == -1 && errno == EINTR)
+        ;
+    if (len != sizeof(reply)) {
+        close(replyFDs[0]);
+        pthread_mutex_lock(&plugin->fLauncherLock);
+        if (plugin->fLauncherPid == launcherPid) {
+            LauncherStop(plugin);
+            LauncherBackoff(plugin, logClient);
+        }
+        pthread_mutex_unlock(&plugin->fLauncherLock);
+        LogMessage(logClient, LOG_ERR,
+                   "%s died before confirming the launch of %s, denying authorization", kLauncherName, path);
+        *outPid = -1;
+        *outResult = kAuthorizationResultDeny;
+        return true;
+    }
+    
+    pthread_mutex_lock(&plugin->fLauncherLock);
+    plugin->fLauncherFailures = 0;
+    pthread_mutex_unlock(&plugin->fLauncherLock);
+    if (reply <= 0) {
+        // The launcher is fine, it just couldn't fork.
+        LogMessage(logClient, LOG_ERR,
+                   "%s couldn't launch %s, errno %d", kLauncherName, path, -reply);
+        close(replyFDs[0]);
+        *outPid = -1;
+        *outResult = kAuthorizationResultDeny;
+        return true;
+    }
+    fcntl(replyFDs[0], F_SETFL, fcntl(replyFDs[0], F_GETFL) | O_NONBLOCK);
+    *outPid = reply;
+    *outStatusFD = replyFDs[0];
+    return true;
+}
+
+/// True if scripts in context are launched with posix_spawn() rather than
+/// fork() and exec. posix_spawn() can't set limits, a QoS class or join a
+/// cgroup, so contained scripts are forked.
+static bool LaunchUsesSpawn(userContext context, bool contained)
+{
+#if defined(HAVE_SPAWN_CLOSE_FDS)
+    return context == kRunAsRoot && ! contained;
+#else
+    return false;
+#endif
+}
+
+#if !defined(__APPLE__)
+/// Write a value to a cgroup interface file.
+static bool WriteCgroupFile(int dirFD, const char *name, const char *value)
+{
+    ssize_t len;
+    int fd;
+    
+    if ((fd = openat(dirFD, name, O_WRONLY | O_CLOEXEC)) == -1) {
+        return false;
+    }
+    len = write(fd, value, strlen(value));
+    close(fd);
+    return len == (ssize_t)strlen(value);
+}
+#endif
+
+/// Open the cgroup.procs file of a script's cgroup v2, creating the cgroup
+/// in CgroupDirectory if needed, with memory.max and pids.max set from the
+/// script's limits.
+///
+/// Runs of the same script share its cgroup, and with it the limits.
+/// CgroupDirectory has to be a cgroup that root can create children in,
+/// with the memory and pids controllers available to it.
+///
+/// @return the descriptor, or -1 if there's no CgroupDirectory or the
+///         cgroup can't be used, and the script runs with rlimits alone.
+static int OpenScriptCgroup(const PluginSettings *settings, const ScriptEntry *script, Logger *logClient)
+{
+#if defined(__APPLE__)
+    if (settings->fCgroupDirectory[0] != '\0') {
+        LogMessage(logClient, LOG_DEBUG, "Ignoring CgroupDirectory, cgroups are only available on Linux");
+    }
+    (void)script;
+    return -1;
+#else
+    char memoryMax[32];
+    char pidsMax[32];
+    int parentFD;
+    int dirFD;
+    int fd;
+    
+    if (settings->fCgroupDirectory[0] == '\0') {
+        return -1;
+    }
+    if ((parentFD = open(settings->fCgroupDirectory, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Can't open %s, errno %d", settings->fCgroupDirectory, errno);
+        return -1;
+    }
+    // Hand the controllers down, which fails harmlessly if they already are.
+    WriteCgroupFile(parentFD, "cgroup.subtree_control", "+memory +pids");
+    if (mkdirat(parentFD, script->fName, 0755) != 0 && errno != EEXIST) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Can't create the cgroup %s/%s, errno %d", settings->fCgroupDirectory, script->fName, errno);
+        close(parentFD);
+        return -1;
+    }
+    dirFD = openat(parentFD, script->fName, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    close(parentFD);
+    if (dirFD == -1) {
+        return -1;
+    }
+    
+    // Without a limit a missing controller doesn't matter.
+    strlcpy(memoryMax, "max", sizeof(memoryMax));
+    strlcpy(pidsMax, "max", sizeof(pidsMax));
+    if (script->fLimits.fMemory != 0) {
+        snprintf(memoryMax, sizeof(memoryMax), "%llu", (unsigned long long)script->fLimits.fMemory);
+    }
+    if (script->fLimits.fProcesses != 0) {
+        snprintf(pidsMax, sizeof(pidsMax), "%llu", (unsigned long long)script->fLimits.fProcesses);
+    }
+    if ((! WriteCgroupFile(dirFD, "memory.max", memoryMax) && (script->fLimits.fMemory != 0 || errno != ENOENT))
+        || (! WriteCgroupFile(dirFD, "pids.max", pidsMax) && (script->fLimits.fProcesses != 0 || errno != ENOENT))) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Can't set the limits of the cgroup %s/%s, errno %d", settings->fCgroupDirectory, script->fName, errno);
+        close(dirFD);
+        return -1;
+    }
+    fd = openat(dirFD, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+    close(dirFD);
+    return fd;
+#endif
+}
+
+/// Launch the verified script open at scriptFD as uid/gid.
+///
+/// Root scripts are started with posix_spawn() where the platform can
+/// close inherited descriptors as part of the spawn. Everything else is
+/// forked by lsp-launcher if there's a launcher, and falls back to fork()
+/// and exec in the plugin host otherwise. Where fexecve() is available the
+/// child executes the descriptor itself, otherwise it checks that path
+/// still refers to the verified file before executing it.
+///
+/// @param outputFDs    Descriptors for the child's stdout and stderr, or
+///                     NULL to inherit the plugin's.
+/// @param login        The login's context, which provides the environment
+///                     and kScriptContextFD, or NULL.
+/// @param limits       The resource limits to run the script with.
+/// @param qos          The QoS class to run the script with.
+/// @param cgroupFD     The cgroup.procs file of the script's cgroup, or -1.
+/// @param launcher     The plugin whose lsp-launcher to use, or NULL.
+/// @param outStatusFD  Set to the descriptor the launcher reports the exit
+///                     status on, or -1 if the child is the plugin's own.
+/// @param outResult    Set to deny if the script couldn't be executed,
+///                     left alone otherwise.
+/// @return the pid of the child, or -1 if the script wasn't started.
+static pid_t LaunchScript(const char *path,
+                          int scriptFD,
+                          const int *outputFDs,
+                          uid_t uid,
+                          gid_t gid,
+                          const char *home,
+                          userContext context,
+                          const LoginContext *login,
+                          const ScriptLimits *limits,
+                          const ScriptQoS *qos,
+                          int cgroupFD,
+                          PluginRecord *launcher,
+                          int *outStatusFD,
+                          AuthorizationResult *outResult,
+                          Logger *logClient)
+{
+    pid_t childPid;
+    char uidStr[3 * sizeof(uid_t) + 1];
+    char gidStr[3 * sizeof(gid_t) + 1];
+    char *argv[5];
+    char **env;
+    int contextFD;
+    ScriptLimits rlimits;
+    
+    LogMessage(logClient, LOG_NOTICE,
+               "Executing %s with uid=%d, gid=%d, home='%s'", path, uid, gid, home);
+    *outStatusFD = -1;
+    
+    snprintf(uidStr, sizeof(uidStr), "%d", uid);
+    snprintf(gidStr, sizeof(gidStr), "%d", gid);
+    argv[0] = (char *)path;
+    argv[1] = uidStr;
+    argv[2] = gidStr;
+    argv[3] = (char *)home;
+    argv[4] = NULL;
+    
+    // The environment and the context were prepared for the whole login.
+    env = environ;
+    contextFD = -1;
+    if (login != NULL) {
+        if (login->fEnvironment[context] != NULL) {
+            env = login->fEnvironment[context];
+        }
+        if ((contextFD = LoginContextOpen(login)) == -1) {
+            LogMessage(logClient, LOG_WARNING,
+                       "Couldn't pass the login context to %s, errno %d", path, errno);
+        }
+    }
+    
+    // A cgroup limits memory and processes for the whole tree of
+    // processes, so it takes over from the rlimits.
+    rlimits = *limits;
+    if (cgroupFD != -1) {
+        rlimits.fMemory = 0;
+        rlimits.fProcesses = 0;
+    }
+    
+#if defined(HAVE_SPAWN_CLOSE_FDS)
+    if (LaunchUsesSpawn(context, ScriptLimitsSet(&rlimits) || qos->fClass != kScriptQoSDefault || cgroupFD != -1)) {
+        childPid = SpawnScript(path, scriptFD, outputFDs, contextFD, argv, env, outResult, logClient);
+    } else
+#endif
+    if (launcher == NULL
+        || ! LauncherSpawn(launcher, path, scriptFD, outputFDs, contextFD, &rlimits, qos, cgroupFD, argv, env,
+                           uid, gid, context, &childPid, outStatusFD, outResult, logClient)) {
+        childPid = ForkScript(path, scriptFD, outputFDs, contextFD, &rlimits, qos, cgroupFD, argv, env,
+                              uid, gid, context, logClient);
+    }
+    
+    if (contextFD != -1) {
+        close(contextFD);
+    }
+    return childPid;
+}
+
+/// Translate the wait status of a finished script into a result.
+///
+/// Fail authorization if the script exits with EX_NOPERM, otherwise proceed.
+static AuthorizationResult ScriptResult(const char *path, int childStatus, Logger *logClient)
+{
+    if (WIFSIGNALED(childStatus)) {
+        LogMessage(logClient, LOG_WARNING,
+                   "%s died with signal %d", path, WTERMSIG(childStatus));
+    } else {
+        LogMessage(logClient, LOG_WARNING,
+                   "%s exited with status %d", path, WEXITSTATUS(childStatus));
+        if (WEXITSTATUS(childStatus) == EX_NOPERM) {
+            // Fail authorization.
+            LogMessage(logClient, LOG_NOTICE,
+                       "%s denied authorization", path);
+            return kAuthorizationResultDeny;
+        }
+    }
+    return kAuthorizationResultAllow;
+}
+
+
+#pragma mark *     SHA-256
+
+#if defined(__APPLE__)
+
+// CommonCrypto uses the CPU's SHA extensions, or vector code where
+// there are none.
+typedef CC_SHA256_CTX SHA256Context;
+
+static void SHA256Init(SHA256Context *ctx)
+{
+    CC_SHA256_Init(ctx);
+}
+
+static void SHA256Update(SHA256Context *ctx, const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+    CC_LONG n;
+    
+    while (len > 0) {
+        n = (CC_LONG)MIN(len, UINT32_MAX);
+        CC_SHA256_Update(ctx, bytes, n);
+        bytes += n;
+        len -= n;
+    }
+}
+
+static void SHA256Final(SHA256Context *ctx, uint8_t digest[kSHA256Length])
+{
+    CC_SHA256_Final(digest, ctx);
+}
+
+#else
+
+/// SHA256Context holds the state of a running SHA-256 digest.
+struct SHA256Context {
+    uint32_t fState[8];
+    uint64_t fLength;           // bytes hashed so far
+    uint8_t fBlock[64];
+    size_t fBlockLength;
+};
+typedef struct SHA256Context SHA256Context;
+
+static const uint32_t kSHA256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// One round, with the working variables renamed rather than shifted.
+#define SHA256_ROUND(a, b, c, d, e, f, g, h, i) \
+    do { \
+        uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) \
+                    + ((e & f) ^ (~e & g)) + kSHA256K[i] + w[i]; \
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) \
+                    + ((a & b) ^ (a & c) ^ (b & c)); \
+        d += t1; \
+        h = t1 + t2; \
+    } while (0)
+
+static void SHA256Transform(SHA256Context *ctx, const uint8_t *block)
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+    size_t i;
+    
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16
+             | (uint32_t)block[4 * i + 2] << 8 | (uint32_t)block[4 * i + 3];
+    }
+    for (i = 16; i < 64; i++) {
+        w[i] = w[i - 16] + w[i - 7]
+             + (ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3))
+             + (ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    }
+    a = ctx->fState[0];
+    b = ctx->fState[1];
+    c = ctx->fState[2];
+    d = ctx->fState[3];
+    e = ctx->fState[4];
+    f = ctx->fState[5];
+    g = ctx->fState[6];
+    h = ctx->fState[7];
+    for (i = 0; i < 64; i += 8) {
+        SHA256_ROUND(a, b, c, d, e, f, g, h, i);
+        SHA256_ROUND(h, a, b, c, d, e, f, g, i + 1);
+        SHA256_ROUND(g, h, a, b, c, d, e, f, i + 2);
+        SHA256_ROUND(f, g, h, a, b, c, d, e, i + 3);
+        SHA256_ROUND(e, f, g, h, a, b, c, d, i + 4);
+        SHA256_ROUND(d, e, f, g, h, a, b, c, i + 5);
+        SHA256_ROUND(c, d, e, f, g, h, a, b, i + 6);
+        SHA256_ROUND(b, c, d, e, f, g, h, a, i + 7);
+    }
+    ctx->fState[0] += a;
+    ctx->fState[1] += b;
+    ctx->fState[2] += c;
+    ctx->fState[3] += d;
+    ctx->fState[4] += e;
+    ctx->fState[5] += f;
+    ctx->fState[6] += g;
+    ctx->fState[7] += h;
+}
+
+static void SHA256Init(SHA256Context *ctx)
+{
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    
+    memcpy(ctx->fState, initial, sizeof(initial));
+    ctx->fLength = 0;
+    ctx->fBlockLength = 0;
+}
+
+static void SHA256Update(SHA256Context *ctx, const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+    size_t n;
+    
+    ctx->fLength += len;
+    while (len > 0) {
+        // Whole blocks are hashed in place.
+        if (ctx->fBlockLength == 0 && len >= sizeof(ctx->fBlock)) {
+            SHA256Transform(ctx, bytes);
+            bytes += sizeof(ctx->fBlock);
+            len -= sizeof(ctx->fBlock);
+            continue;
+        }
+        n = MIN(len, sizeof(ctx->fBlock) - ctx->fBlockLength);
+        memcpy(ctx->fBlock + ctx->fBlockLength, bytes, n);
+        ctx->fBlockLength += n;
+        bytes += n;
+        len -= n;
+        if (ctx->fBlockLength == sizeof(ctx->fBlock)) {
+            SHA256Transform(ctx, ctx->fBlock);
+            ctx->fBlockLength = 0;
+        }
+    }
+}
+
+static void SHA256Final(SHA256Context *ctx, uint8_t digest[kSHA256Length])
+{
+    uint8_t padding[72];
+    uint64_t bits;
+    size_t padLength;
+    size_t i;
+    
+    bits = ctx->fLength * 8;
+    padLength = (ctx->fBlockLength < 56 ? 56 : 120) - ctx->fBlockLength;
+    memset(padding, 0, sizeof(padding));
+    padding[0] = 0x80;
+    for (i = 0; i < 8; i++) {
+        padding[padLength + i] = (uint8_t)(bits >> (56 - 8 * i));
+    }
+    SHA256Update(ctx, padding, padLength + 8);
+    for (i = 0; i < 8; i++) {
+        digest[4 * i] = (uint8_t)(ctx->fState[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(ctx->fState[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(ctx->fState[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)ctx->fState[i];
+    }
+}
+
+#endif
+
+/// Hash the contents of an open file.
+static bool SHA256File(int fd, uint8_t digest[kSHA256Length])
+{
+    SHA256Context ctx;
+    uint8_t buffer[16384];
+    ssize_t len;
+    off_t offset;
+    
+    SHA256Init(&ctx);
+    offset = 0;
+    while ((len = pread(fd, buffer, sizeof(buffer), offset)) != 0) {
+        if (len == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        SHA256Update(&ctx, buffer, (size_t)len);
+        offset += len;
+    }
+    SHA256Final(&ctx, digest);
+    return true;
+}
+
+/// Format a digest as lowercase hex.
+static void SHA256Hex(const uint8_t digest[kSHA256Length], char hex[2 * kSHA256Length + 1])
+{
+    size_t i;
+    
+    for (i = 0; i < kSHA256Length; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+    }
+}
+
+/// Parse a digest formatted by SHA256Hex(), in either case.
+static bool SHA256Parse(const char *hex, uint8_t digest[kSHA256Length])
+{
+    unsigned int byte;
+    size_t i;
+    
+    for (i = 0; i < kSHA256Length; i++) {
+        if (!isxdigit((unsigned char)hex[2 * i]) || !isxdigit((unsigned char)hex[2 * i + 1])
+            || sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+            return false;
+        }
+        digest[i] = (uint8_t)byte;
+    }
+    return !isxdigit((unsigned char)hex[2 * kSHA256Length]);
+}
+
+
+#pragma mark *     Script Index
+
+#if defined(__APPLE__)
+#define ST_MTIME(info) ((info)->st_mtimespec)
+#define ST_CTIME(info) ((info)->st_ctimespec)
+#else
+#define ST_MTIME(info) ((info)->st_mtim)
+#define ST_CTIME(info) ((info)->st_ctim)
+#endif
+
+/// The bucket in a ScriptIndex for a mechanism.
+static size_t ScriptBucket(scriptPhase phase, userContext context)
+{
+    return (size_t)phase * 2 + (size_t)context;
+}
+
+/// True if two stats describe the same, unchanged, file.
+static bool SameFileInfo(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev
+    && a->st_ino == b->st_ino
+    && a->st_mode == b->st_mode
+    && a->st_uid == b->st_uid
+    && a->st_gid == b->st_gid
+    && a->st_size == b->st_size
+    && ST_MTIME(a).tv_sec == ST_MTIME(b).tv_sec
+    && ST_MTIME(a).tv_nsec == ST_MTIME(b).tv_nsec
+    && ST_CTIME(a).tv_sec == ST_CTIME(b).tv_sec
+    && ST_CTIME(a).tv_nsec == ST_CTIME(b).tv_nsec;
+}
+
+/// Compare an index against the file system.
+///
+/// @param unwatchedOnly    Only check what the watcher doesn't cover.
+static bool ScriptIndexMatchesFiles(const ScriptIndex *index, bool unwatchedOnly)
+{
+    char path[MAXPATHLEN];
+    char *end;
+    struct stat info;
+    const ScriptEntry *script;
+    size_t depth;
+    size_t bucket;
+    size_t i;
+    
+    // The chain of directories, which includes the mtime of
+    // kLoginScriptDir, so scripts that are added or removed are noticed.
+    if (!unwatchedOnly || !index->fChainWatched) {
+        strlcpy(path, kLoginScriptDir, sizeof(path));
+        for (depth = index->fChainDepth; depth > 0; depth--) {
+            if (depth == 1) {
+                strlcpy(path, "/", sizeof(path));
+            }
+            if (lstat(path, &info) || !SameFileInfo(&info, &index->fChainInfo[depth - 1])) {
+                return false;
+            }
+            if ((end = strrchr(path, '/')) != NULL) {
+                *end = '\0';
+            }
+        }
+    }
+    
+    if (!unwatchedOnly || !index->fSettingsWatched) {
+        if (fstatat(index->fDirFD, kSettingsName, &info, AT_SYMLINK_NOFOLLOW)) {
+            if (errno != ENOENT || index->fSettingsInfo.st_ino != 0) {
+                return false;
+            }
+        } else if (!SameFileInfo(&info, &index->fSettingsInfo)) {
+            return false;
+        }
+    }
+    
+    if (!unwatchedOnly || !index->fManifestWatched) {
+        if (fstatat(index->fDirFD, kManifestName, &info, AT_SYMLINK_NOFOLLOW)) {
+            if (errno != ENOENT || index->fManifestInfo.st_ino != 0) {
+                return false;
+            }
+        } else if (!SameFileInfo(&info, &index->fManifestInfo)) {
+            return false;
+        }
+    }
+    
+    if (!unwatchedOnly || !index->fRulesWatched) {
+        if (fstatat(index->fDirFD, kRulesName, &info, AT_SYMLINK_NOFOLLOW)) {
+            if (errno != ENOENT || index->fRulesInfo.st_ino != 0) {
+                return false;
+            }
+        } else if (!SameFileInfo(&info, &index->fRulesInfo)) {
+            return false;
+        }
+    }
+    
+    if (!unwatchedOnly || !index->fWarmupWatched) {
+        if (fstatat(index->fDirFD, kWarmupName, &info, AT_SYMLINK_NOFOLLOW)) {
+            if (errno != ENOENT || index->fWarmupInfo.st_ino != 0) {
+                return false;
+            }
+        } else if (!SameFileInfo(&info, &index->fWarmupInfo)) {
+            return false;
+        }
+    }
+    
+    for (bucket = 0; bucket < kNumScriptBuckets; bucket++) {
+        for (i = 0; i < index->fNumScripts[bucket]; i++) {
+            script = &index->fScripts[bucket][i];
+            if (unwatchedOnly && script->fWatched) {
+                continue;
+            }
+            if (fstatat(index->fDirFD, script->fName, &info, AT_SYMLINK_NOFOLLOW)
+                || !SameFileInfo(&info, &script->fInfo)) {
+                return false;
+            }
+        }
+    }
+    
+    return true;
+}
+
+/// Register a descriptor or path with the index watcher.
+///
+/// @param fd           The file to watch (Darwin).
+/// @param path         The file to watch (Linux).
+/// @param contents     Report changes to contents, not just renames and
+///                     attributes.
+/// @param slot         Where to remember the watch (Linux), or -1.
+/// @return true if the file is being watched.
+static bool ScriptIndexWatch(ScriptIndex *index, int fd, const char *path, bool contents, int slot)
+{
+    if (index->fWatchFD == -1) {
+        return false;
+    }
+#if defined(__APPLE__)
+    struct kevent event;
+    u_int fflags;
+    
+    // Directories above kLoginScriptDir only matter if they're changed
+    // or moved, but the directory itself also has to be watched for
+    // scripts being added and removed.
+    fflags = NOTE_ATTRIB | NOTE_DELETE | NOTE_RENAME | NOTE_REVOKE | NOTE_LINK;
+    if (contents) {
+        fflags |= NOTE_WRITE | NOTE_EXTEND;
+    }
+    EV_SET(&event, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, fflags, 0, NULL);
+    return kevent(index->fWatchFD, &event, 1, NULL, 0, NULL) == 0;
+#else
+    uint32_t mask;
+    int wd;
+    
+    // A directory watch also reports changes to its entries, so the watch
+    // on kLoginScriptDir covers the scripts and the settings. Events in
+    // the directories above it are filtered by name when they're read.
+    mask = IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+         | IN_MOVE_SELF | IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW;
+    if (contents) {
+        mask |= IN_MODIFY;
+    }
+    wd = inotify_add_watch(index->fWatchFD, path, mask);
+    if (slot >= 0) {
+        index->fWatchDescriptors[slot] = wd;
+    }
+    return wd != -1;
+#endif
+}
+
+/// Check the index watcher for changes without blocking.
+static bool ScriptIndexWatcherFired(const ScriptIndex *index)
+{
+#if defined(__APPLE__)
+    struct kevent event;
+    struct timespec zero = { 0, 0 };
+    
+    return kevent(index->fWatchFD, NULL, 0, &event, 1, &zero) != 0;
+#else
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[MAXPATHLEN];
+    const struct inotify_event *event;
+    const char *names[kMaxChainDepth];
+    char *component;
+    ssize_t len;
+    ssize_t offset;
+    size_t depth;
+    bool fired;
+    
+    // names[depth] is the component below chain directory depth that
+    // events in that directory have to mention to matter.
+    strlcpy(path, kLoginScriptDir, sizeof(path));
+    component = path;
+    for (depth = 0; depth + 1 < index->fChainDepth; depth++) {
+        *component++ = '\0';
+        names[depth] = component;
+        component = strchr(component, '/');
+        if (component == NULL) {
+            break;
+        }
+    }
+    
+    fired = false;
+    while ((len = read(index->fWatchFD, buffer, sizeof(buffer))) > 0) {
+        for (offset = 0; offset < len; offset += (ssize_t)(sizeof(*event) + event->len)) {
+            event = (const struct inotify_event *)(buffer + offset);
+            if (event->mask & IN_Q_OVERFLOW) {
+                fired = true;
+                continue;
+            }
+            for (depth = 0; depth < index->fChainDepth; depth++) {
+                if (event->wd == index->fWatchDescriptors[depth]) {
+                    break;
+                }
+            }
+            if (depth + 1 >= index->fChainDepth
+                || event->len == 0
+                || strcmp(event->name, names[depth]) == 0) {
+                fired = true;
+            }
+        }
+    }
+    return fired;
+#endif
+}
+
+/// True if nothing in an index has changed since it was built.
+static bool ScriptIndexIsCurrent(const ScriptIndex *index)
+{
+    if (index->fStale) {
+        return false;
+    }
+    if (index->fWatchFD != -1 && ScriptIndexWatcherFired(index)) {
+        return false;
+    }
+    return ScriptIndexMatchesFiles(index, true);
+}
+
+/// Free an index and close everything it holds open.
+static void DestroyScriptIndex(ScriptIndex *index)
+{
+    size_t bucket;
+    size_t i;
+    
+    for (bucket = 0; bucket < kNumScriptBuckets; bucket++) {
+        for (i = 0; i < index->fNumScripts[bucket]; i++) {
+            if (index->fScripts[bucket][i].fFD != -1) {
+                close(index->fScripts[bucket][i].fFD);
+            }
+        }
+        free(index->fScripts[bucket]);
+    }
+    for (i = 0; i < index->fChainDepth; i++) {
+        close(index->fChainFDs[i]);
+    }
+    if (index->fSettingsFD != -1) {
+        close(index->fSettingsFD);
+    }
+    if (index->fManifestFD != -1) {
+        close(index->fManifestFD);
+    }
+    if (index->fRulesFD != -1) {
+        close(index->fRulesFD);
+    }
+    free(index->fRules);
+    free(index->fRuleText);
+    free(index->fRuleTokens);
+    if (index->fWarmupFD != -1) {
+        close(index->fWarmupFD);
+    }
+    free(index->fWarmupList);
+    if (index->fWatchFD != -1) {
+        close(index->fWatchFD);
+    }
+    free(index);
+}
+
+/// Sort order for ScriptEntry, by name.
+static int CompareScriptEntries(const void *a, const void *b)
+{
+    return strcmp(((const ScriptEntry *)a)->fPath, ((const ScriptEntry *)b)->fPath);
+}
+
+/// Find the scripts of all mechanisms with a single pass over the directory.
+static bool ScanScriptDir(ScriptIndex *index, Logger *logClient)
+{
+    DIR *dir;
+    struct dirent *entry;
+    ScriptEntry *scripts;
+    size_t capacity[kNumScriptBuckets];
+    size_t bucket;
+    int fd;
+    
+    fd = openat(index->fDirFD, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1 || (dir = fdopendir(fd)) == NULL) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Can't read %s, errno %d", kLoginScriptDir, errno);
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    
+    memset(capacity, 0, sizeof(capacity));
+    while ((entry = readdir(dir)) != NULL) {
+        if ((bucket = ScriptPrefixIndex(entry->d_name)) == kNumScriptBuckets) {
+            continue;
+        }
+        
+        if (index->fNumScripts[bucket] == capacity[bucket]) {
+            capacity[bucket] = capacity[bucket] ? 2 * capacity[bucket] : 8;
+            scripts = realloc(index->fScripts[bucket], capacity[bucket] * sizeof(*scripts));
+            if (scripts == NULL) {
+                LogMessage(logClient, LOG_ERR, "Script index allocation failed");
+                closedir(dir);
+                return false;
+            }
+            index->fScripts[bucket] = scripts;
+        }
+        scripts = &index->fScripts[bucket][index->fNumScripts[bucket]++];
+        memset(scripts, 0, sizeof(*scripts));
+        scripts->fFD = -1;
+        snprintf(scripts->fPath, sizeof(scripts->fPath), "%s/%s", kLoginScriptDir, entry->d_name);
+    }
+    closedir(dir);
+    
+    for (bucket = 0; bucket < kNumScriptBuckets; bucket++) {
+        if (index->fNumScripts[bucket] > 1) {
+            qsort(index->fScripts[bucket], index->fNumScripts[bucket], sizeof(ScriptEntry), CompareScriptEntries);
+        }
+    }
+    return true;
+}
+
+/// The kDigestCacheName key of a file: its device, inode, size, mtime
+/// and ctime. Any write to the file changes at least one of them.
+static void DigestCacheKey(const struct stat *info, char *key, size_t size)
+{
+    snprintf(key, size, "%llu %llu %lld %lld.%09ld %lld.%09ld",
+             (unsigned long long)info->st_dev, (unsigned long long)info->st_ino, (long long)info->st_size,
+             (long long)ST_MTIME(info).tv_sec, (long)ST_MTIME(info).tv_nsec,
+             (long long)ST_CTIME(info).tv_sec, (long)ST_CTIME(info).tv_nsec);
+}
+
+/// Find the digest of an unchanged script in the contents of
+/// kDigestCacheName, where each line is "key digest".
+static bool DigestCacheLookup(const char *digests, const char *key, uint8_t digest[kSHA256Length])
+{
+    const char *line;
+    const char *next;
+    size_t keyLength;
+    
+    keyLength = strlen(key);
+    for (line = digests; line != NULL && *line != '\0'; line = next) {
+        if ((next = strchr(line, '\n')) != NULL) {
+            next++;
+        }
+        if (strncmp(line, key, keyLength) == 0 && line[keyLength] == ' ') {
+            return SHA256Parse(line + keyLength + 1, digest);
+        }
+    }
+    return false;
+}
+
+/// True if a script is listed in the contents of kManifestName with its
+/// current digest.
+///
+/// The manifest is in the format of shasum -a 256: each line is a digest
+/// and a script name separated by two spaces, or by a space and a *.
+static bool ManifestAllows(const char *manifest, const ScriptEntry *script)
+{
+    const char *line;
+    const char *next;
+    const char *name;
+    uint8_t digest[kSHA256Length];
+    size_t nameLength;
+    
+    nameLength = strlen(script->fName);
+    for (line = manifest; line != NULL && *line != '\0'; line = next) {
+        if ((next = strchr(line, '\n')) != NULL) {
+            next++;
+        }
+        if (! SHA256Parse(line, digest) || line[2 * kSHA256Length] != ' ') {
+            continue;
+        }
+        name = line + 2 * kSHA256Length + 2;
+        if (name[-1] != ' ' && name[-1] != '*') {
+            continue;
+        }
+        if (strncmp(name, script->fName, nameLength) == 0
+            && (name[nameLength] == '\n' || name[nameLength] == '\0')
+            && memcmp(digest, script->fHash, kSHA256Length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Parse a three letter weekday name.
+///
+/// @return the day, with Sunday as 0, or -1.
+static int ParseWeekday(const char *name, size_t length)
+{
+    static const char *days[] = { "sun", "mon", "tue", "wed", "thu", "fri", "sat" };
+    int day;
+    
+    if (length != 3) {
+        return -1;
+    }
+    for (day = 0; day < 7; day++) {
+        if (strncasecmp(name, days[day], 3) == 0) {
+            return day;
+        }
+    }
+    return -1;
+}
+
+/// Parse a HH:MM time of day.
+///
+/// @return minutes after midnight, or -1.
+static long ParseTimeOfDay(const char *value, char **outEnd)
+{
+    long hours;
+    long minutes;
+    char *end;
+    
+    hours = strtol(value, &end, 10);
+    if (end == value || *end != ':' || hours < 0 || hours > 23) {
+        return -1;
+    }
+    value = end + 1;
+    minutes = strtol(value, &end, 10);
+    if (end - value != 2 || minutes < 0 || minutes > 59) {
+        return -1;
+    }
+    *outEnd = end;
+    return hours * 60 + minutes;
+}
+
+/// Parse the mechanisms of a rule: a comma separated list of script
+/// prefixes, such as premount-root or postmount, or * for all of them.
+static bool ParseRuleBuckets(char *word, unsigned *outBuckets)
+{
+    char *name;
+    char *save;
+    size_t bucket;
+    size_t length;
+    unsigned buckets;
+    
+    *outBuckets = 0;
+    for (name = strtok_r(word, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        buckets = 0;
+        length = strlen(name);
+        for (bucket = 0; bucket < kNumScriptBuckets; bucket++) {
+            if (strcmp(name, "*") == 0
+                || (strncmp(kScriptPrefixes[bucket], name, length) == 0
+                    && (kScriptPrefixes[bucket][length] == '\0' || kScriptPrefixes[bucket][length] == '-'))) {
+                buckets |= 1u << bucket;
+            }
+        }
+        if (buckets == 0) {
+            return false;
+        }
+        *outBuckets |= buckets;
+    }
+    return *outBuckets != 0;
+}
+
+/// Parse a [!]key=value condition of a rule, in place.
+static bool ParseRuleCondition(char *word, RuleCondition *condition)
+{
+    char *value;
+    char *item;
+    char *range;
+    char *end;
+    int first;
+    int last;
+    int day;
+    
+    condition->fNegated = word[0] == '!';
+    if (condition->fNegated) {
+        word++;
+    }
+    if ((value = strchr(word, '=')) == NULL || value[1] == '\0') {
+        return false;
+    }
+    *value++ = '\0';
+    condition->fString = value;
+    condition->fMin = condition->fMax = 0;
+    
+    if (strcmp(word, "user") == 0) {
+        condition->fTest = kRuleUser;
+        return true;
+    } else if (strcmp(word, "group") == 0) {
+        condition->fTest = kRuleGroup;
+        return true;
+    } else if (strcmp(word, "file") == 0) {
+        condition->fTest = kRuleFile;
+        return value[0] == '/';
+    } else if (strcmp(word, "uid") == 0) {
+        condition->fTest = kRuleUid;
+        errno = 0;
+        condition->fMin = condition->fMax = strtol(value, &end, 10);
+        if (end != value && *end == '-') {
+            value = end + 1;
+            condition->fMax = strtol(value, &end, 10);
+        }
+        return errno == 0 && end != value && *end == '\0'
+        && condition->fMin >= 0 && condition->fMin <= condition->fMax;
+    } else if (strcmp(word, "time") == 0) {
+        // The range is end exclusive, and wraps past midnight if it ends
+        // before it starts.
+        condition->fTest = kRuleTime;
+        if ((condition->fMin = ParseTimeOfDay(value, &end)) == -1 || *end != '-'
+            || (condition->fMax = ParseTimeOfDay(end + 1, &end)) == -1 || *end != '\0') {
+            return false;
+        }
+        return condition->fMin != condition->fMax;
+    } else if (strcmp(word, "days") == 0) {
+        // Days and ranges of days, which may wrap past Saturday.
+        condition->fTest = kRuleDays;
+        for (item = value; ; item = end + 1) {
+            end = item + strcspn(item, ",");
+            range = memchr(item, '-', (size_t)(end - item));
+            first = ParseWeekday(item, (size_t)((range != NULL ? range : end) - item));
+            last = range != NULL ? ParseWeekday(range + 1, (size_t)(end - range - 1)) : first;
+            if (first == -1 || last == -1) {
+                return false;
+            }
+            for (day = first; ; day = (day + 1) % 7) {
+                condition->fMin |= 1L << day;
+                if (day == last) {
+                    break;
+                }
+            }
+            if (*end == '\0') {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/// Compile the rules in an index's fRuleText.
+///
+/// Each line is a rule: the mechanisms it applies to, allow or deny, and
+/// any number of conditions, separated by whitespace. Lines that can't be
+/// compiled are logged and ignored, like bad settings.
+static void CompileRules(ScriptIndex *index, Logger *logClient)
+{
+    Rule *rule;
+    char *line;
+    char *next;
+    char *text;
+    char *word;
+    char *save;
+    const char *error;
+    size_t lineNumber;
+    size_t numLines;
+    
+    numLines = 1;
+    for (line = index->fRuleText; *line != '\0'; line++) {
+        numLines += *line == '\n';
+    }
+    index->fRuleTokens = strdup(index->fRuleText);
+    index->fRules = calloc(MIN(numLines, kMaxRules), sizeof(*index->fRules));
+    if (index->fRuleTokens == NULL || index->fRules == NULL) {
+        LogMessage(logClient, LOG_ERR, "Rule allocation failed");
+        return;
+    }
+    
+    for (line = index->fRuleText, lineNumber = 1; line != NULL; line = next, lineNumber++) {
+        if ((next = strchr(line, '\n')) != NULL) {
+            *next++ = '\0';
+        }
+        word = index->fRuleTokens + (line - index->fRuleText);
+        word[strcspn(word, "#\n")] = '\0';
+        line[strcspn(line, "#")] = '\0';
+        text = TrimWhitespace(line);
+        if ((word = strtok_r(word, " \t\r", &save)) == NULL) {
+            continue;
+        }
+        if (index->fNumRules == kMaxRules) {
+            LogMessage(logClient, LOG_ERR, "Ignoring %s/%s after line %zu, it has more than %d rules",
+                       kLoginScriptDir, kRulesName, lineNumber - 1, kMaxRules);
+            break;
+        }
+        
+        rule = &index->fRules[index->fNumRules];
+        error = NULL;
+        if (! ParseRuleBuckets(word, &rule->fBuckets)) {
+            error = "unknown mechanism";
+        } else if ((word = strtok_r(NULL, " \t\r", &save)) == NULL
+                   || (strcmp(word, "allow") != 0 && strcmp(word, "deny") != 0)) {
+            error = "expected allow or deny";
+        } else {
+            rule->fAction = strcmp(word, "deny") == 0 ? kAuthorizationResultDeny : kAuthorizationResultAllow;
+            while (error == NULL && (word = strtok_r(NULL, " \t\r", &save)) != NULL) {
+                if (rule->fNumConditions == kMaxRuleConditions) {
+                    error = "too many conditions";
+                } else if (! ParseRuleCondition(word, &rule->fConditions[rule->fNumConditions++])) {
+                    error = "invalid condition";
+                }
+            }
+        }
+        if (error != NULL) {
+            LogMessage(logClient, LOG_ERR, "Ignoring line %zu of %s/%s, %s: %s",
+                       lineNumber, kLoginScriptDir, kRulesName, error, text);
+            memset(rule, 0, sizeof(*rule));
+            continue;
+        }
+        rule->fLine = lineNumber;
+        rule->fText = text;
+        index->fNumRules++;
+    }
+}
+
+/// Build a new index of kLoginScriptDir.
+///
+/// The watcher is set up before anything is examined, and the result is
+/// compared with the file system once it's complete, so a change that
+/// races with the build makes the index stale rather than going unnoticed.
+///
+/// Script digests are kept in kDigestCacheName, keyed on the file's
+/// fingerprint, so only new and modified scripts are hashed. If there's a
+/// manifest, scripts that aren't listed in it with their digest fail
+/// verification.
+///
+/// @return the index with a reference count of 1, or NULL if the script
+///         directory couldn't be verified.
+static ScriptIndex *BuildScriptIndex(Logger *logClient)
+{
+    ScriptIndex *index;
+    ScriptEntry *script;
+    char path[MAXPATHLEN];
+    char key[kDigestLineLength];
+    char hex[2 * kSHA256Length + 1];
+    char *end;
+    char *manifest;
+    char *digests;
+    char *newDigests;
+    size_t newLength;
+    size_t maxLength;
+    size_t numHashed;
+    size_t bucket;
+    size_t depth;
+    size_t i;
+    struct stat info;
+    dev_t rootDev;
+    dev_t stateRootDev;
+    int stateFD;
+    bool watched;
+    bool useManifest;
+    
+    index = calloc(1, sizeof(*index));
+    if (index == NULL) {
+        LogMessage(logClient, LOG_ERR, "Script index allocation failed");
+        return NULL;
+    }
+    index->fRefCount = 1;
+    index->fSettingsFD = -1;
+    index->fManifestFD = -1;
+    index->fRulesFD = -1;
+    index->fWarmupFD = -1;
+    index->fBuildStart = MonotonicTime();
+#if defined(__APPLE__)
+    index->fWatchFD = kqueue();
+#else
+    index->fWatchFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    for (depth = 0; depth < kMaxChainDepth; depth++) {
+        index->fWatchDescriptors[depth] = -1;
+    }
+#endif
+    
+    // Verify the directory chain and watch it.
+    index->fDirFD = VerifyScriptDir(index->fChainInfo, index->fChainFDs, &index->fChainDepth, logClient);
+    if (index->fDirFD == -1) {
+        DestroyScriptIndex(index);
+        return NULL;
+    }
+    rootDev = index->fChainInfo[0].st_dev;
+    watched = true;
+    strlcpy(path, kLoginScriptDir, sizeof(path));
+    for (depth = index->fChainDepth; depth > 0; depth--) {
+        watched = ScriptIndexWatch(index, index->fChainFDs[depth - 1], depth > 1 ? path : "/",
+                                   depth == index->fChainDepth, (int)depth - 1) && watched;
+        if ((end = strrchr(path, '/')) != NULL) {
+            *end = '\0';
+        }
+    }
+    index->fChainWatched = watched;
+    
+    LoadSettings(index->fDirFD, rootDev, &index->fSettings, &index->fSettingsInfo, logClient);
+    LoggerConfigure(logClient, index->fSettings.fLogLevel, index->fSettings.fLogFile);
+#if defined(__APPLE__)
+    if (index->fSettingsInfo.st_ino != 0) {
+        index->fSettingsFD = openat(index->fDirFD, kSettingsName, O_EVTONLY | O_NOFOLLOW | O_CLOEXEC);
+        index->fSettingsWatched = index->fSettingsFD != -1
+        && ScriptIndexWatch(index, index->fSettingsFD, NULL, true, -1);
+    } else {
+        index->fSettingsWatched = index->fChainWatched;
+    }
+#else
+    index->fSettingsWatched = index->fChainWatched;
+#endif
+    
+    // A manifest that exists but can't be used doesn't let anything run.
+    manifest = NULL;
+    if (fstatat(index->fDirFD, kManifestName, &index->fManifestInfo, AT_SYMLINK_NOFOLLOW) == 0) {
+        manifest = ReadVerifiedFile(index->fDirFD, kLoginScriptDir, kManifestName,
+                                    kMaxManifestEntries * kDigestLineLength, rootDev, NULL, logClient);
+#if defined(__APPLE__)
+        index->fManifestFD = openat(index->fDirFD, kManifestName, O_EVTONLY | O_NOFOLLOW | O_CLOEXEC);
+        index->fManifestWatched = index->fManifestFD != -1
+        && ScriptIndexWatch(index, index->fManifestFD, NULL, true, -1);
+#else
+        index->fManifestWatched = index->fChainWatched;
+#endif
+    } else {
+        memset(&index->fManifestInfo, 0, sizeof(index->fManifestInfo));
+        index->fManifestWatched = index->fChainWatched;
+    }
+    useManifest = index->fManifestInfo.st_ino != 0 || index->fSettings.fRequireManifest;
+    if (useManifest && manifest == NULL) {
+        LogMessage(logClient, LOG_ERR,
+                   "%s/%s is required but missing or invalid, no scripts will run", kLoginScriptDir, kManifestName);
+    }
+    
+    // Rules are compiled once here, and evaluated by every mechanism.
+    if (fstatat(index->fDirFD, kRulesName, &index->fRulesInfo, AT_SYMLINK_NOFOLLOW) == 0) {
+        index->fRuleText = ReadVerifiedFile(index->fDirFD, kLoginScriptDir, kRulesName,
+                                            kMaxRulesLength, rootDev, NULL, logClient);
+        if (index->fRuleText == NULL) {
+            LogMessage(logClient, LOG_ERR, "Ignoring %s/%s, no rules will be applied", kLoginScriptDir, kRulesName);
+        } else {
+            CompileRules(index, logClient);
+        }
+#if defined(__APPLE__)
+        index->fRulesFD = openat(index->fDirFD, kRulesName, O_EVTONLY | O_NOFOLLOW | O_CLOEXEC);
+        index->fRulesWatched = index->fRulesFD != -1
+        && ScriptIndexWatch(index, index->fRulesFD, NULL, true, -1);
+#else
+        index->fRulesWatched = index->fChainWatched;
+#endif
+    } else {
+        memset(&index->fRulesInfo, 0, sizeof(index->fRulesInfo));
+        index->fRulesWatched = index->fChainWatched;
+    }
+    
+    if (fstatat(index->fDirFD, kWarmupName, &index->fWarmupInfo, AT_SYMLINK_NOFOLLOW) == 0) {
+        index->fWarmupList = ReadVerifiedFile(index->fDirFD, kLoginScriptDir, kWarmupName,
+                                              kMaxWarmupLength, rootDev, NULL, logClient);
+#if defined(__APPLE__)
+        index->fWarmupFD = openat(index->fDirFD, kWarmupName, O_EVTONLY | O_NOFOLLOW | O_CLOEXEC);
+        index->fWarmupWatched = index->fWarmupFD != -1
+        && ScriptIndexWatch(index, index->fWarmupFD, NULL, true, -1);
+#else
+        index->fWarmupWatched = index->fChainWatched;
+#endif
+    } else {
+        memset(&index->fWarmupInfo, 0, sizeof(index->fWarmupInfo));
+        index->fWarmupWatched = index->fChainWatched;
+    }
+    
+    if (! ScanScriptDir(index, logClient)) {
+        free(manifest);
+        DestroyScriptIndex(index);
+        return NULL;
+    }
+    
+    stateFD = OpenStateDir(&stateRootDev, logClient);
+    digests = NULL;
+    if (stateFD != -1) {
+        digests = ReadVerifiedFile(stateFD, kStateDir, kDigestCacheName,
+                                   kMaxManifestEntries * kDigestLineLength, stateRootDev, NULL, logClient);
+    }
+    maxLength = 1;
+    for (bucket = 0; bucket < kNumScriptBuckets; bucket++) {
+        maxLength += index->fNumScripts[bucket] * kDigestLineLength;
+    }
+    newDigests = malloc(maxLength);
+    if (newDigests != NULL) {
+        newDigests[0] = '\0';
+    }
+    newLength = 0;
+    numHashed = 0;
+    
+    for (bucket = 0; bucket < kNumScriptBuckets; bucket++) {
+        for (i = 0; i < index->fNumScripts[bucket]; i++) {
+            script = &index->fScripts[bucket][i];
+            script->fName = strrchr(script->fPath, '/') + 1;
+            script->fTimeout = index->fSettings.fScriptTimeout;
+            script->fTimeoutPolicy = index->fSettings.fTimeoutPolicy;
+            script->fHistoryOrder = index->fSettings.fHistoryOrder;
+            script->fLimits = index->fSettings.fScriptLimits;
+            script->fQoS.fClass = index->fSettings.fScriptQoS;
+            script->fVerifyStart = MonotonicTime();
+            fstatat(index->fDirFD, script->fName, &script->fInfo, AT_SYMLINK_NOFOLLOW);
+            script->fFD = VerifyScriptAt(index->fDirFD, script->fName, script->fPath, rootDev, logClient);
+            if (script->fFD != -1) {
+                ReadScriptMetadata(script, logClient);
+                if (script->fQoS.fClass == kScriptQoSBackground) {
+                    script->fQoS.fCPUs = index->fSettings.fBackgroundCPUs;
+                }
+                key[0] = '\0';
+                if (fstat(script->fFD, &info) == 0) {
+                    DigestCacheKey(&info, key, sizeof(key));
+                }
+                if (key[0] == '\0' || ! DigestCacheLookup(digests, key, script->fHash)) {
+                    numHashed++;
+                    if (! SHA256File(script->fFD, script->fHash)) {
+                        script->fCache = false;
+                        key[0] = '\0';
+                    }
+                }
+                if (key[0] != '\0' && newDigests != NULL) {
+                    SHA256Hex(script->fHash, hex);
+                    newLength += (size_t)snprintf(newDigests + newLength, maxLength - newLength, "%s %s\n", key, hex);
+                }
+                if (useManifest && (manifest == NULL || key[0] == '\0' || ! ManifestAllows(manifest, script))) {
+                    LogMessage(logClient, LOG_ERR,
+                               "%s doesn't match %s, not running it", script->fPath, kManifestName);
+                    close(script->fFD);
+                    script->fFD = -1;
+                }
+            }
+            script->fVerifyEnd = MonotonicTime();
+#if defined(__APPLE__)
+            script->fWatched = script->fFD != -1
+            && ScriptIndexWatch(index, script->fFD, NULL, true, -1);
+#else
+            script->fWatched = index->fChainWatched;
+#endif
+        }
+        ResolveDependencies(index->fScripts[bucket], index->fNumScripts[bucket], logClient);
+    }
+    
+    // Rewriting the digest cache also drops scripts that are gone.
+    if (stateFD != -1 && newDigests != NULL && (digests == NULL || strcmp(digests, newDigests) != 0)) {
+        WriteStateFile(stateFD, kDigestCacheName, newDigests, logClient);
+    }
+    if (stateFD != -1) {
+        close(stateFD);
+    }
+    free(newDigests);
+    free(digests);
+    free(manifest);
+    
+    index->fStale = !ScriptIndexMatchesFiles(index, false);
+    index->fBuildEnd = MonotonicTime();
+    
+    LogMessage(logClient, LOG_DEBUG,
+               "Indexed %s: %zu/%zu/%zu/%zu scripts, %zu hashed, %zu rules, %s", kLoginScriptDir,
+               index->fNumScripts[0], index->fNumScripts[1], index->fNumScripts[2], index->fNumScripts[3],
+               numHashed, index->fNumRules, index->fWatchFD != -1 ? "watching for changes" : "checking for changes with stat");
+    
+    return index;
+}
+
+/// Drop a reference to an index, destroying it when it's no longer used.
+static void ReleaseScriptIndex(PluginRecord *plugin, ScriptIndex *index)
+{
+    pthread_mutex_lock(&plugin->fIndexLock);
+    if (--index->fRefCount == 0) {
+        DestroyScriptIndex(index);
+    }
+    pthread_mutex_unlock(&plugin->fIndexLock);
+}
+
+/// Get a reference to an up to date index of kLoginScriptDir, rebuilding
+/// it if anything has changed since last time.
+///
+/// @param outBuilt     Set to true if the index was built by this call.
+/// @return the index, to be released with ReleaseScriptIndex(), or NULL
+///         if the script directory couldn't be verified.
+static ScriptIndex *AcquireScriptIndex(PluginRecord *plugin, bool *outBuilt)
+{
+    ScriptIndex *index;
+    
+    *outBuilt = false;
+    pthread_mutex_lock(&plugin->fIndexLock);
+    if (plugin->fIndex != NULL && ! ScriptIndexIsCurrent(plugin->fIndex)) {
+        LogMessage(plugin->fLogClient, LOG_INFO,
+                   "%s has changed, rebuilding script index", kLoginScriptDir);
+        if (--plugin->fIndex->fRefCount == 0) {
+            DestroyScriptIndex(plugin->fIndex);
+        }
+        plugin->fIndex = NULL;
+    }
+    if (plugin->fIndex == NULL) {
+        plugin->fIndex = BuildScriptIndex(plugin->fLogClient);
+        *outBuilt = plugin->fIndex != NULL;
+    }
+    index = plugin->fIndex;
+    if (index != NULL) {
+        index->fRefCount++;
+    }
+    pthread_mutex_unlock(&plugin->fIndexLock);
+    
+    return index;
+}
+
+
+#pragma mark *     Rules
+
+/// RuleSubject is the user that rules are evaluated for.
+struct RuleSubject {
+    uid_t fUid;
+    gid_t fGid;
+    const char *fName;          // NULL if it's unknown
+    struct passwd fPwd;
+    char fPwBuf[4096];
+    struct tm fNow;             // local time
+#if defined(__APPLE__)
+    int fGroups[kMaxContextGroups];
+#else
+    gid_t fGroups[kMaxContextGroups];
+#endif
+    int fNumGroups;             // -1 until a rule needs them
+};
+typedef struct RuleSubject RuleSubject;
+
+/// True if the subject is a member of a group.
+static bool RuleSubjectInGroup(RuleSubject *subject, const char *name)
+{
+    struct group grp;
+    struct group *result;
+    char *buf;
+    size_t bufSize;
+    gid_t gid;
+    int i;
+    
+    // Groups with many members need a large buffer.
+    bufSize = 65536;
+    if ((buf = malloc(bufSize)) == NULL) {
+        return false;
+    }
+    result = NULL;
+    getgrnam_r(name, &grp, buf, bufSize, &result);
+    gid = result != NULL ? result->gr_gid : (gid_t)-1;
+    free(buf);
+    if (result == NULL) {
+        return false;
+    }
+    if (gid == subject->fGid) {
+        return true;
+    }
+    
+    if (subject->fNumGroups == -1) {
+        subject->fNumGroups = kMaxContextGroups;
+        if (subject->fName == NULL) {
+            subject->fNumGroups = 0;
+        } else if (getgrouplist(subject->fName, subject->fGid, subject->fGroups, &subject->fNumGroups) == -1) {
+            subject->fNumGroups = MIN(subject->fNumGroups, kMaxContextGroups);
+        }
+    }
+    for (i = 0; i < subject->fNumGroups; i++) {
+        if ((gid_t)subject->fGroups[i] == gid) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// True if a condition holds for the subject, or fails for a negated
+/// condition.
+static bool RuleConditionHolds(const RuleCondition *condition, RuleSubject *subject)
+{
+    struct stat info;
+    long minute;
+    bool holds;
+    
+    switch (condition->fTest) {
+        case kRuleUser:
+            holds = subject->fName != NULL && strcmp(subject->fName, condition->fString) == 0;
+            break;
+        case kRuleGroup:
+            holds = RuleSubjectInGroup(subject, condition->fString);
+            break;
+        case kRuleUid:
+            holds = (long)subject->fUid >= condition->fMin && (long)subject->fUid <= condition->fMax;
+            break;
+        case kRuleTime:
+            minute = subject->fNow.tm_hour * 60 + subject->fNow.tm_min;
+            if (condition->fMin < condition->fMax) {
+                holds = minute >= condition->fMin && minute < condition->fMax;
+            } else {
+                holds = minute >= condition->fMin || minute < condition->fMax;
+            }
+            break;
+        case kRuleDays:
+            holds = (condition->fMin >> subject->fNow.tm_wday) & 1;
+            break;
+        case kRuleFile:
+            holds = lstat(condition->fString, &info) == 0;
+            break;
+        default:
+            holds = false;
+            break;
+    }
+    return holds != condition->fNegated;
+}
+
+/// Apply the rules of a mechanism, before its scripts run.
+///
+/// The first rule whose conditions all hold decides: deny fails the
+/// mechanism without running any scripts, and allow skips the remaining
+/// rules and leaves the decision to the scripts.
+static AuthorizationResult EvaluateRules(const ScriptIndex *index,
+                                         size_t bucket,
+                                         PluginRecord *plugin,
+                                         AuthorizationEngineRef engine,
+                                         uid_t uid,
+                                         gid_t gid,
+                                         Logger *logClient)
+{
+    RuleSubject subject;
+    struct passwd *pw;
+    const Rule *rule;
+    time_t now;
+    size_t i;
+    size_t j;
+    
+    for (i = 0; i < index->fNumRules && ! (index->fRules[i].fBuckets & (1u << bucket)); i++)
+        ;
+    if (i == index->fNumRules) {
+        return kAuthorizationResultAllow;
+    }
+    
+    subject.fUid = uid;
+    subject.fGid = gid;
+    subject.fNumGroups = -1;
+    if ((subject.fName = GetContextString(plugin, engine, "username")) == NULL) {
+        pw = NULL;
+        getpwuid_r(uid, &subject.fPwd, subject.fPwBuf, sizeof(subject.fPwBuf), &pw);
+        subject.fName = pw != NULL ? pw->pw_name : NULL;
+    }
+    now = time(NULL);
+    localtime_r(&now, &subject.fNow);
+    
+    for (; i < index->fNumRules; i++) {
+        rule = &index->fRules[i];
+        if (! (rule->fBuckets & (1u << bucket))) {
+            continue;
+        }
+        for (j = 0; j < rule->fNumConditions && RuleConditionHolds(&rule->fConditions[j], &subject); j++)
+            ;
+        if (j < rule->fNumConditions) {
+            continue;
+        }
+        LogMessage(logClient, rule->fAction == kAuthorizationResultAllow ? LOG_INFO : LOG_NOTICE,
+                   "Line %zu of %s %s uid %u for %s: %s", rule->fLine, kRulesName,
+                   rule->fAction == kAuthorizationResultAllow ? "allowed" : "denied",
+                   (unsigned)uid, kScriptPrefixes[bucket], rule->fText);
+        return rule->fAction;
+    }
+    return kAuthorizationResultAllow;
+}
+
+
+#pragma mark *     Child Watcher
+
+/// Prepare a watcher for a phase of at most numJobs jobs.
+///
+/// @param wakeFD   A descriptor that also ends ChildWatcherWait() when it
+///                 becomes readable, or -1.
+static void ChildWatcherInit(ChildWatcher *watcher, size_t numJobs, int wakeFD)
+{
+    watcher->fWakeFD = wakeFD;
+#if defined(__APPLE__)
+    struct kevent event;
+    
+    watcher->fQueue = kqueue();
+    if (watcher->fQueue != -1 && wakeFD != -1) {
+        EV_SET(&event, wakeFD, EVFILT_READ, EV_ADD, 0, 0, NULL);
+        kevent(watcher->fQueue, &event, 1, NULL, 0, NULL);
+    }
+#else
+    watcher->fPollFDs = calloc(3 * numJobs + 1, sizeof(*watcher->fPollFDs));
+#endif
+}
+
+/// Release the resources held by a watcher.
+static void ChildWatcherDestroy(ChildWatcher *watcher)
+{
+#if defined(__APPLE__)
+    if (watcher->fQueue != -1) {
+        close(watcher->fQueue);
+    }
+#else
+    free(watcher->fPollFDs);
+#endif
+}
+
+/// Start watching a running job for exit, and for output.
+///
+/// On Darwin this registers the pid with a kqueue, on Linux it opens a
+/// pidfd. Jobs started by lsp-launcher are watched through fStatusFD
+/// instead. If none of that is possible the job's fWatchFD is left at -1
+/// and ChildWatcherWait falls back to polling.
+static void ChildWatcherAdd(ChildWatcher *watcher, ScriptJob *job)
+{
+    job->fWatchFD = -1;
+#if defined(__APPLE__)
+    struct kevent event;
+    size_t i;
+    
+    if (watcher->fQueue != -1) {
+        // Children of lsp-launcher can only be waited for on fStatusFD.
+        if (job->fStatusFD != -1) {
+            EV_SET(&event, job->fStatusFD, EVFILT_READ, EV_ADD, 0, 0, NULL);
+        } else {
+            EV_SET(&event, job->fPid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, NULL);
+        }
+        if (kevent(watcher->fQueue, &event, 1, NULL, 0, NULL) == 0) {
+            job->fWatchFD = watcher->fQueue;
+        }
+        // Captured output. These go away by themselves when closed.
+        for (i = 0; i < 2; i++) {
+            if (job->fOutput[i].fFD != -1) {
+                EV_SET(&event, job->fOutput[i].fFD, EVFILT_READ, EV_ADD, 0, 0, NULL);
+                kevent(watcher->fQueue, &event, 1, NULL, 0, NULL);
+            }
+        }
+    }
+#else
+    if (watcher->fPollFDs != NULL && job->fStatusFD != -1) {
+        job->fWatchFD = fcntl(job->fStatusFD, F_DUPFD_CLOEXEC, 0);
+    }
+#if defined(SYS_pidfd_open)
+    else if (watcher->fPollFDs != NULL) {
+        job->fWatchFD = (int)syscall(SYS_pidfd_open, job->fPid, 0);
+    }
+#endif
+#endif
+}
+
+/// Stop watching a job that has been reaped.
+static void ChildWatcherRemove(ChildWatcher *watcher, ScriptJob *job)
+{
+#if !defined(__APPLE__)
+    if (job->fWatchFD != -1) {
+        close(job->fWatchFD);
+    }
+#endif
+    job->fWatchFD = -1;
+}
+
+/// Block until a running job may have exited or written output, or
+/// timeoutMs has passed.
+///
+/// The caller reaps with ReapJob() afterwards, so spurious wakeups are
+/// harmless.
+static void ChildWatcherWait(ChildWatcher *watcher, const ScriptJob *jobs, size_t numJobs, int timeoutMs)
+{
+    size_t i;
+    
+    // Jobs that couldn't be registered are polled.
+    for (i = 0; i < numJobs; i++) {
+        if (jobs[i].fState == kScriptRunning && jobs[i].fWatchFD == -1) {
+            if (timeoutMs < 0 || timeoutMs > kChildPollInterval) {
+                timeoutMs = kChildPollInterval;
+            }
+            break;
+        }
+    }
+    
+#if defined(__APPLE__)
+    struct kevent events[8];
+    struct timespec timeout;
+    
+    if (watcher->fQueue == -1) {
+        poll(NULL, 0, timeoutMs);
+        return;
+    }
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+    kevent(watcher->fQueue, NULL, 0, events, 8, timeoutMs < 0 ? NULL : &timeout);
+#else
+    nfds_t nfds;
+    size_t j;
+    
+    nfds = 0;
+    if (watcher->fPollFDs != NULL && watcher->fWakeFD != -1) {
+        watcher->fPollFDs[nfds].fd = watcher->fWakeFD;
+        watcher->fPollFDs[nfds].events = POLLIN;
+        nfds++;
+    }
+    for (i = 0; i < numJobs && watcher->fPollFDs != NULL; i++) {
+        if (jobs[i].fState != kScriptRunning) {
+            continue;
+        }
+        if (jobs[i].fWatchFD != -1) {
+            watcher->fPollFDs[nfds].fd = jobs[i].fWatchFD;
+            watcher->fPollFDs[nfds].events = POLLIN;
+            nfds++;
+        }
+        for (j = 0; j < 2; j++) {
+            if (jobs[i].fOutput[j].fFD != -1) {
+                watcher->fPollFDs[nfds].fd = jobs[i].fOutput[j].fFD;
+                watcher->fPollFDs[nfds].events = POLLIN;
+                nfds++;
+            }
+        }
+    }
+    poll(watcher->fPollFDs, nfds, timeoutMs);
+#endif
+}
+
+/// Reap a running job if it has exited, without blocking, and record its
+/// resource usage.
+///
+/// Children of the plugin are reaped with wait4(). Children of
+/// lsp-launcher are reaped by the launcher, which writes their wait status
+/// and usage to fStatusFD. If the launcher dies first, both are lost, and
+/// the job's process group is killed so that nothing it started carries
+/// on unsupervised.
+///
+/// @return the pid if the job has exited, 0 if it's still running, or -1
+///         with errno set.
+static pid_t ReapJob(ScriptJob *job, int *outStatus)
+{
+    LauncherExit status;
+    struct rusage usage;
+    ssize_t len;
+    pid_t pid;
+    
+    if (job->fStatusFD == -1) {
+        pid = wait4(job->fPid, outStatus, WNOHANG, &usage);
+        if (pid == job->fPid) {
+            ScriptUsageFromRusage(&usage, &job->fUsage);
+            job->fHaveUsage = true;
+        }
+        return pid;
+    }
+    len = read(job->fStatusFD, &status, sizeof(status));
+    if (len == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    close(job->fStatusFD);
+    job->fStatusFD = -1;
+    if (len != sizeof(status)) {
+        kill(-job->fPid, SIGKILL);
+        errno = ECHILD;
+        return -1;
+    }
+    *outStatus = status.fStatus;
+    job->fUsage = status.fUsage;
+    job->fHaveUsage = true;
+    return job->fPid;
+}
+
+/// Log the resources a reaped job used, next to its wall time.
+///
+/// @param kind     Added to the path in parentheses, or NULL.
+static void LogScriptUsage(const ScriptJob *job, const char *kind, Logger *logClient)
+{
+    const ScriptUsage *usage = &job->fUsage;
+    
+    if (! job->fHaveUsage) {
+        return;
+    }
+    LogMessage(logClient, LOG_INFO,
+               "%s%s%s%s: %.2fs wall, %.2fs user, %.2fs system, %llu KB max resident, "
+               "%llu blocks in, %llu out, %llu voluntary and %llu involuntary context switches",
+               job->fScript->fPath, kind != NULL ? " (" : "", kind != NULL ? kind : "", kind != NULL ? ")" : "",
+               (double)(job->fEndTime - job->fStartTime) / kMicrosPerSecond,
+               (double)usage->fUserTime / kMicrosPerSecond,
+               (double)usage->fSystemTime / kMicrosPerSecond,
+               (unsigned long long)usage->fMaxRSS,
+               (unsigned long long)usage->fInBlocks,
+               (unsigned long long)usage->fOutBlocks,
+               (unsigned long long)usage->fVoluntarySwitches,
+               (unsigned long long)usage->fInvoluntarySwitches);
+}
+
+
+#pragma mark *     Result Cache
+
+/// The cache key of a script: its name and contents, and the uid if it
+/// asked for it.
+static void ResultCacheKey(const ScriptEntry *script, uid_t uid, char key[2 * kSHA256Length + 1])
+{
+    SHA256Context ctx;
+    uint8_t digest[kSHA256Length];
+    
+    SHA256Init(&ctx);
+    SHA256Update(&ctx, script->fName, strlen(script->fName) + 1);
+    SHA256Update(&ctx, script->fHash, sizeof(script->fHash));
+    if (script->fCacheByUid) {
+        SHA256Update(&ctx, &uid, sizeof(uid));
+    }
+    SHA256Final(&ctx, digest);
+    SHA256Hex(digest, key);
+}
+
+/// A fingerprint of the current state of a script's lsp-cache-input files.
+static void ResultCacheInputs(const ScriptEntry *script, char inputs[2 * kSHA256Length + 1])
+{
+    SHA256Context ctx;
+    uint8_t digest[kSHA256Length];
+    char paths[sizeof(script->fCacheInputs)];
+    char *path;
+    char *next;
+    struct stat info;
+    int64_t fields[6];
+    
+    SHA256Init(&ctx);
+    strlcpy(paths, script->fCacheInputs, sizeof(paths));
+    for (path = paths; *path != '\0'; path = next) {
+        if ((next = strchr(path, '\n')) != NULL) {
+            *next++ = '\0';
+        } else {
+            next = path + strlen(path);
+        }
+        SHA256Update(&ctx, path, strlen(path) + 1);
+        memset(fields, 0, sizeof(fields));
+        if (stat(path, &info) == 0) {
+            fields[0] = (int64_t)info.st_dev;
+            fields[1] = (int64_t)info.st_ino;
+            fields[2] = (int64_t)info.st_size;
+            fields[3] = (int64_t)ST_MTIME(&info).tv_sec;
+            fields[4] = (int64_t)ST_MTIME(&info).tv_nsec;
+            fields[5] = 1;
+        }
+        SHA256Update(&ctx, fields, sizeof(fields));
+    }
+    SHA256Final(&ctx, digest);
+    SHA256Hex(digest, inputs);
+}
+
+/// Read kResultCacheName into cache, unless it's been read already.
+///
+/// A missing or unreadable file counts as empty, and isn't tried again.
+static void ResultCacheLoad(PluginRecord *plugin, ResultCache *cache, Logger *logClient)
+{
+    dev_t rootDev;
+    int dirFD;
+    
+    if (cache->fLoaded) {
+        return;
+    }
+    cache->fLoaded = true;
+    pthread_mutex_lock(&plugin->fCacheLock);
+    if ((dirFD = OpenStateDir(&rootDev, logClient)) != -1) {
+        cache->fContents = ReadVerifiedFile(dirFD, kStateDir, kResultCacheName, kMaxCacheEntries * kCacheLineLength, rootDev, NULL, logClient);
+        close(dirFD);
+    }
+    pthread_mutex_unlock(&plugin->fCacheLock);
+}
+
+/// Copy the line that starts at line into buffer.
+///
+/// @return the start of the next line, or NULL after the last one.
+static const char *ResultCacheLine(const char *line, char buffer[kCacheLineLength])
+{
+    const char *next;
+    size_t len;
+    
+    if ((next = strchr(line, '\n')) != NULL) {
+        len = (size_t)(next++ - line);
+    } else {
+        len = strlen(line);
+    }
+    if (len >= kCacheLineLength) {
+        len = 0;
+    }
+    memcpy(buffer, line, len);
+    buffer[len] = '\0';
+    
+    return next != NULL && *next != '\0' ? next : NULL;
+}
+
+/// True if key has been stored in cache during this phase.
+static bool ResultCacheAdded(const ResultCache *cache, const char *key)
+{
+    const char *line;
+    size_t keyLength;
+    
+    keyLength = strlen(key);
+    line = cache->fAdded;
+    while (line != NULL && *line != '\0') {
+        if (strncmp(line, key, keyLength) == 0 && line[keyLength] == ' ') {
+            return true;
+        }
+        if ((line = strchr(line, '\n')) != NULL) {
+            line++;
+        }
+    }
+    return false;
+}
+
+/// True if a script has succeeded before with the same key, within its
+/// lsp-cache-ttl, and its inputs haven't changed since.
+static bool ResultCacheLookup(PluginRecord *plugin, ResultCache *cache, const ScriptEntry *script, uid_t uid, Logger *logClient)
+{
+    char key[2 * kSHA256Length + 1];
+    char inputs[2 * kSHA256Length + 1];
+    char lineKey[2 * kSHA256Length + 1];
+    char lineInputs[2 * kSHA256Length + 1];
+    char buffer[kCacheLineLength];
+    const char *line;
+    long long when;
+    
+    ResultCacheLoad(plugin, cache, logClient);
+    ResultCacheKey(script, uid, key);
+    for (line = cache->fContents; line != NULL && *line != '\0'; ) {
+        line = ResultCacheLine(line, buffer);
+        if (sscanf(buffer, "%64s %lld %64s", lineKey, &when, lineInputs) != 3 || strcmp(lineKey, key) != 0) {
+            continue;
+        }
+        if (script->fCacheTTL > 0 && (long long)time(NULL) - when > script->fCacheTTL) {
+            LogMessage(logClient, LOG_DEBUG, "%s: cached result has expired", script->fName);
+            return false;
+        }
+        ResultCacheInputs(script, inputs);
+        if (strcmp(lineInputs, inputs) != 0) {
+            LogMessage(logClient, LOG_DEBUG, "%s: inputs have changed", script->fName);
+            return false;
+        }
+        return true;
+    }
+    
+    return false;
+}
+
+/// Remember that a script succeeded, until ResultCacheFlush().
+///
+/// Only called for scripts that exited with status 0, so a deny can never
+/// be replayed as an allow.
+static void ResultCacheStore(ResultCache *cache, const ScriptEntry *script, uid_t uid, Logger *logClient)
+{
+    char key[2 * kSHA256Length + 1];
+    char inputs[2 * kSHA256Length + 1];
+    char line[kCacheLineLength];
+    char *added;
+    int len;
+    
+    ResultCacheKey(script, uid, key);
+    if (cache->fNumAdded >= kMaxCacheEntries || ResultCacheAdded(cache, key)) {
+        return;
+    }
+    ResultCacheInputs(script, inputs);
+    len = snprintf(line, sizeof(line), "%s %lld %s\n", key, (long long)time(NULL), inputs);
+    if (len < 0 || len >= (int)sizeof(line)) {
+        return;
+    }
+    if ((added = realloc(cache->fAdded, cache->fAddedLength + (size_t)len + 1)) == NULL) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Can't remember the result of %s, out of memory", script->fName);
+        return;
+    }
+    memcpy(added + cache->fAddedLength, line, (size_t)len + 1);
+    cache->fAdded = added;
+    cache->fAddedLength += (size_t)len;
+    cache->fNumAdded++;
+}
+
+/// Write the entries stored in cache to kResultCacheName, and free it.
+///
+/// The file is read again first, as other logins may have written to it
+/// since it was loaded. The new entries go first, and at most
+/// kMaxCacheEntries are kept.
+static void ResultCacheFlush(PluginRecord *plugin, ResultCache *cache, Logger *logClient)
+{
+    char tmpName[MAXNAMLEN + 1];
+    char buffer[kCacheLineLength];
+    char lineKey[2 * kSHA256Length + 1];
+    char *contents;
+    const char *line;
+    FILE *file;
+    size_t numEntries;
+    dev_t rootDev;
+    int dirFD;
+    int fd;
+    bool ok;
+    
+    if (cache->fNumAdded > 0) {
+        snprintf(tmpName, sizeof(tmpName), "%s.tmp", kResultCacheName);
+        pthread_mutex_lock(&plugin->fCacheLock);
+        if ((dirFD = OpenStateDir(&rootDev, logClient)) != -1) {
+            contents = ReadVerifiedFile(dirFD, kStateDir, kResultCacheName, kMaxCacheEntries * kCacheLineLength, rootDev, NULL, logClient);
+            
+            unlinkat(dirFD, tmpName, 0);
+            fd = openat(dirFD, tmpName, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+            if (fd != -1 && (file = fdopen(fd, "w")) != NULL) {
+                fputs(cache->fAdded, file);
+                numEntries = cache->fNumAdded;
+                for (line = contents; line != NULL && *line != '\0' && numEntries < kMaxCacheEntries; ) {
+                    line = ResultCacheLine(line, buffer);
+                    if (sscanf(buffer, "%64s", lineKey) == 1 && ! ResultCacheAdded(cache, lineKey)) {
+                        fprintf(file, "%s\n", buffer);
+                        numEntries++;
+                    }
+                }
+                ok = !ferror(file);
+                if (fclose(file) != 0) {
+                    ok = false;
+                }
+                if (!ok || renameat(dirFD, tmpName, dirFD, kResultCacheName) != 0) {
+                    LogMessage(logClient, LOG_WARNING,
+                               "Can't write %s/%s, errno %d", kStateDir, kResultCacheName, errno);
+                    unlinkat(dirFD, tmpName, 0);
+                }
+            } else {
+                LogMessage(logClient, LOG_WARNING,
+                           "Can't create %s/%s, errno %d", kStateDir, tmpName, errno);
+                if (fd != -1) {
+                    close(fd);
+                }
+            }
+            
+            free(contents);
+            close(dirFD);
+        }
+        pthread_mutex_unlock(&plugin->fCacheLock);
+    }
+    
+    free(cache->fContents);
+    free(cache->fAdded);
+    memset(cache, 0, sizeof(*cache));
+}
+
+
+#pragma mark *     Statistics
+
+typedef enum {
+    kStatsSucceeded,
+    kStatsDenied,
+    kStatsTimedOut,
+    kStatsFailed
+} statsOutcome;
+
+/// Create a new statistics file under a temporary name and rename it to
+/// kStatsName, replacing the one that's there.
+///
+/// The old file is never truncated, since other plugin hosts may have it
+/// mapped and would crash touching pages that are gone; they keep updating
+/// it until they're restarted.
+///
+/// @return a descriptor for the new file, or -1.
+static int StatsCreate(int dirFD, Logger *logClient)
+{
+    StatsFile header;
+    char tmpName[MAXNAMLEN + 1];
+    int fd;
+    
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", kStatsName);
+    unlinkat(dirFD, tmpName, 0);
+    fd = openat(dirFD, tmpName, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Can't create %s/%s, errno %d", kStateDir, tmpName, errno);
+        return -1;
+    }
+    memset(&header, 0, offsetof(StatsFile, fEntries));
+    header.fMagic = kStatsMagic;
+    header.fVersion = kStatsVersion;
+    header.fEntrySize = sizeof(StatsEntry);
+    header.fMaxEntries = kStatsMaxEntries;
+    header.fCreated = (int64_t)time(NULL);
+    if (ftruncate(fd, (off_t)sizeof(StatsFile)) != 0
+        || pwrite(fd, &header, offsetof(StatsFile, fEntries), 0) != (ssize_t)offsetof(StatsFile, fEntries)
+        || renameat(dirFD, tmpName, dirFD, kStatsName) != 0) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Can't initialize %s/%s, errno %d", kStateDir, kStatsName, errno);
+        unlinkat(dirFD, tmpName, 0);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/// Map kStatsName in kStateDir, creating it, or starting it over if it
+/// isn't a statistics file of this version.
+///
+/// Like everything in kStateDir, which only root can enter, the file can
+/// only be read by root, so lsp-stat has to be run as root. It has to be
+/// a root owned regular file that only root can write to. Creation and
+/// resets are serialized with flock() on the current file, against other
+/// plugin hosts; once mapped, the file is only updated with atomic
+/// operations.
+static StatsFile *StatsMap(Logger *logClient)
+{
+    StatsFile header;
+    StatsFile *stats;
+    struct stat info;
+    struct stat pathInfo;
+    dev_t rootDev;
+    size_t attempt;
+    int dirFD;
+    int newFD;
+    int fd;
+    
+    if ((dirFD = OpenStateDir(&rootDev, logClient)) == -1) {
+        return NULL;
+    }
+    fd = -1;
+    for (attempt = 0; attempt < 3 && fd == -1; attempt++) {
+        fd = openat(dirFD, kStatsName, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+        if (fd == -1) {
+            LogMessage(logClient, LOG_WARNING,
+                       "Can't open %s/%s, errno %d", kStateDir, kStatsName, errno);
+            break;
+        }
+        if (fstat(fd, &info) != 0
+            || ! S_ISREG(info.st_mode)
+            || info.st_uid != 0
+            || (info.st_mode & (S_IWGRP | S_IWOTH))
+            || info.st_nlink != 1) {
+            LogMessage(logClient, LOG_WARNING,
+                       "Ignoring %s/%s, it must be a root owned file that only root can write to", kStateDir, kStatsName);
+            close(fd);
+            fd = -1;
+            break;
+        }
+        
+        flock(fd, LOCK_EX);
+        if (fstatat(dirFD, kStatsName, &pathInfo, AT_SYMLINK_NOFOLLOW) != 0
+            || pathInfo.st_dev != info.st_dev || pathInfo.st_ino != info.st_ino) {
+            // Another host replaced it while we waited for the lock.
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        memset(&header, 0, offsetof(StatsFile, fEntries));
+        if (pread(fd, &header, offsetof(StatsFile, fEntries), 0) != (ssize_t)offsetof(StatsFile, fEntries)
+            || header.fMagic != kStatsMagic
+            || header.fVersion != kStatsVersion
+            || header.fEntrySize != sizeof(StatsEntry)
+            || header.fMaxEntries != kStatsMaxEntries
+            || info.st_size != (off_t)sizeof(StatsFile)) {
+            if (info.st_size != 0) {
+                LogMessage(logClient, LOG_NOTICE,
+                           "Starting %s/%s over", kStateDir, kStatsName);
+            }
+            newFD = StatsCreate(dirFD, logClient);
+            close(fd);
+            fd = newFD;
+            break;
+        }
+        flock(fd, LOCK_UN);
+    }
+    close(dirFD);
+    if (fd == -1) {
+        return NULL;
+    }
+    
+    stats = mmap(NULL, sizeof(StatsFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (stats == MAP_FAILED) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Can't map %s/%s, errno %d", kStateDir, kStatsName, errno);
+        return NULL;
+    }
+    return stats;
+}
+
+/// Find the entry for a script or phase, claiming a free one if it's new
+/// and create is set.
+///
+/// Entries are claimed in order, so when two writers want the same new
+/// name, the second finds the first one's claim before any free entry, and
+/// waits for it to be named.
+///
+/// @return the entry, or NULL if there's none and it can't be created.
+static StatsEntry *StatsFindEntry(StatsFile *stats, uint32_t kind, const char *name, bool create)
+{
+    StatsEntry *entry;
+    uint32_t state;
+    size_t spins;
+    size_t i;
+    
+    for (i = 0; i < kStatsMaxEntries; i++) {
+        entry = &stats->fEntries[i];
+        state = __atomic_load_n(&entry->fState, __ATOMIC_ACQUIRE);
+        if (state == kStatsEntryFree) {
+            if (! create) {
+                return NULL;
+            }
+            if (__atomic_compare_exchange_n(&entry->fState, &state, kStatsEntryClaimed, false,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                entry->fKind = kind;
+                strlcpy(entry->fName, name, sizeof(entry->fName));
+                __atomic_store_n(&entry->fState, kStatsEntryReady, __ATOMIC_RELEASE);
+                return entry;
+            }
+        }
+        // A writer that died while naming its entry would leave it claimed.
+        for (spins = 0; state == kStatsEntryClaimed && spins < 1000; spins++) {
+            sched_yield();
+            state = __atomic_load_n(&entry->fState, __ATOMIC_ACQUIRE);
+        }
+        if (state == kStatsEntryReady && entry->fKind == kind
+            && strncmp(entry->fName, name, sizeof(entry->fName) - 1) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/// The plugin's statistics file, mapping it on first use.
+///
+/// @return the mapping, which stays valid until the plugin is destroyed,
+///         or NULL if the file can't be used.
+static StatsFile *StatsAcquire(PluginRecord *plugin)
+{
+    StatsFile *stats;
+    
+    pthread_mutex_lock(&plugin->fStatsLock);
+    if (plugin->fStats == NULL && ! plugin->fStatsFailed) {
+        plugin->fStats = StatsMap(plugin->fLogClient);
+        plugin->fStatsFailed = plugin->fStats == NULL;
+    }
+    stats = plugin->fStats;
+    pthread_mutex_unlock(&plugin->fStatsLock);
+    
+    return stats;
+}
+
+/// Add a run of a script or phase to the statistics file.
+///
+/// @param error    What went wrong, for the last error fields, or NULL.
+static void StatsRecord(PluginRecord *plugin,
+                        uint32_t kind,
+                        const char *name,
+                        uint64_t micros,
+                        statsOutcome outcome,
+                        const char *error)
+{
+    StatsFile *stats;
+    StatsEntry *entry;
+    uint64_t max;
+    uint32_t seq;
+    
+    stats = StatsAcquire(plugin);
+    if (stats == NULL || (entry = StatsFindEntry(stats, kind, name, true)) == NULL) {
+        return;
+    }
+    
+    __atomic_add_fetch(&entry->fRuns, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&entry->fTotalMicros, micros, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&entry->fBuckets[StatsBucket(micros)], 1, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&entry->fMaxMicros, __ATOMIC_RELAXED);
+    while (micros > max
+           && ! __atomic_compare_exchange_n(&entry->fMaxMicros, &max, micros, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    switch (outcome) {
+        case kStatsSucceeded:
+            break;
+        case kStatsDenied:
+            __atomic_add_fetch(&entry->fDenies, 1, __ATOMIC_RELAXED);
+            break;
+        case kStatsTimedOut:
+            __atomic_add_fetch(&entry->fTimeouts, 1, __ATOMIC_RELAXED);
+            break;
+        case kStatsFailed:
+            __atomic_add_fetch(&entry->fFailures, 1, __ATOMIC_RELAXED);
+            break;
+    }
+    
+    if (error == NULL) {
+        return;
+    }
+    // Writers take the sequence from even to odd, and back when done.
+    do {
+        while ((seq = __atomic_load_n(&entry->fErrorSequence, __ATOMIC_RELAXED)) & 1) {
+            sched_yield();
+        }
+    } while (! __atomic_compare_exchange_n(&entry->fErrorSequence, &seq, seq + 1, false,
+                                           __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    entry->fLastErrorTime = (int64_t)time(NULL);
+    strlcpy(entry->fLastError, error, sizeof(entry->fLastError));
+    __atomic_store_n(&entry->fErrorSequence, seq + 2, __ATOMIC_RELEASE);
+}
+
+/// Add a reaped job to the statistics file.
+///
+/// @param jobResult    What ScriptResult() or the timeout policy made of it.
+static void StatsRecordJob(PluginRecord *plugin, const ScriptJob *job, int childStatus, AuthorizationResult jobResult)
+{
+    char error[kStatsErrorLength];
+    statsOutcome outcome;
+    
+    if (job->fTimedOut) {
+        outcome = kStatsTimedOut;
+        strlcpy(error, "timed out", sizeof(error));
+    } else if (jobResult != kAuthorizationResultAllow) {
+        outcome = kStatsDenied;
+        strlcpy(error, "denied authorization", sizeof(error));
+    } else if (WIFSIGNALED(childStatus)) {
+        outcome = kStatsFailed;
+        snprintf(error, sizeof(error), "died with signal %d", WTERMSIG(childStatus));
+    } else if (WEXITSTATUS(childStatus) != 0) {
+        outcome = kStatsFailed;
+        snprintf(error, sizeof(error), "exited with status %d", WEXITSTATUS(childStatus));
+    } else {
+        outcome = kStatsSucceeded;
+    }
+    StatsRecord(plugin, kStatsKindScript, job->fScript->fName, job->fEndTime - job->fLaunchTime,
+                outcome, outcome != kStatsSucceeded ? error : NULL);
+}
+
+
+#pragma mark *     Output Capture
+
+/// Forward a line of output to the log, and the script's log file.
+static void CaptureEmitLine(const ScriptJob *job, size_t stream, const char *line, size_t len, Logger *logClient)
+{
+    static const char *kStreamNames[2] = { "stdout", "stderr" };
+    struct iovec iov[3];
+    char tag[16];
+    
+    LogMessage(logClient, stream == 0 ? LOG_NOTICE : LOG_WARNING,
+               "%s[%s]: %.*s", job->fScript->fName, kStreamNames[stream], (int)len, line);
+    if (job->fLogFD != -1) {
+        snprintf(tag, sizeof(tag), "[%s] ", kStreamNames[stream]);
+        iov[0].iov_base = tag;
+        iov[0].iov_len = strlen(tag);
+        iov[1].iov_base = (void *)line;
+        iov[1].iov_len = len;
+        iov[2].iov_base = "\n";
+        iov[2].iov_len = 1;
+        writev(job->fLogFD, iov, 3);
+    }
+}
+
+/// Read whatever a job has written so far, without blocking, and forward
+/// complete lines.
+///
+/// Each stream has a bounded buffer. A line that doesn't fit is forwarded
+/// in pieces rather than growing it, so a chatty script costs a fixed
+/// amount of memory and is never left blocked on a full pipe.
+static void CaptureRead(ScriptJob *job, Logger *logClient)
+{
+    ScriptOutput *output;
+    char *newline;
+    char *start;
+    ssize_t len;
+    size_t i;
+    
+    for (i = 0; i < 2; i++) {
+        output = &job->fOutput[i];
+        while (output->fFD != -1) {
+            len = read(output->fFD, output->fBuffer + output->fLength, sizeof(output->fBuffer) - output->fLength);
+            if (len == -1 && errno == EINTR) {
+                continue;
+            }
+            if (len <= 0) {
+                if (len == 0 || errno != EAGAIN) {
+                    close(output->fFD);
+                    output->fFD = -1;
+                }
+                break;
+            }
+            output->fLength += (size_t)len;
+            
+            start = output->fBuffer;
+            while ((newline = memchr(start, '\n', output->fLength - (size_t)(start - output->fBuffer))) != NULL) {
+                CaptureEmitLine(job, i, start, (size_t)(newline - start), logClient);
+                start = newline + 1;
+            }
+            output->fLength -= (size_t)(start - output->fBuffer);
+            if (output->fLength == sizeof(output->fBuffer)) {
+                CaptureEmitLine(job, i, output->fBuffer, output->fLength, logClient);
+                output->fLength = 0;
+            } else if (start != output->fBuffer) {
+                memmove(output->fBuffer, start, output->fLength);
+            }
+        }
+    }
+}
+
+/// Stop capturing a job's output.
+///
+/// Called once the script has exited. Whatever is already in the pipes is
+/// forwarded, but the pipes aren't read until EOF, as anything the script
+/// left running in the background may hold them open indefinitely.
+static void CaptureClose(ScriptJob *job, Logger *logClient)
+{
+    size_t i;
+    
+    CaptureRead(job, logClient);
+    for (i = 0; i < 2; i++) {
+        if (job->fOutput[i].fLength > 0) {
+            CaptureEmitLine(job, i, job->fOutput[i].fBuffer, job->fOutput[i].fLength, logClient);
+            job->fOutput[i].fLength = 0;
+        }
+        if (job->fOutput[i].fFD != -1) {
+            close(job->fOutput[i].fFD);
+            job->fOutput[i].fFD = -1;
+        }
+    }
+    if (job->fLogFD != -1) {
+        close(job->fLogFD);
+        job->fLogFD = -1;
+    }
+}
+
+/// Open a script's log in ScriptLogDirectory for appending, creating it if
+/// needed.
+///
+/// The directory is verified like kStateDir, and the log has to be a plain
+/// file owned by root with no other links, so the plugin can't be made to
+/// append to some other file.
+///
+/// @param path  Path of the log, for logging.
+/// @return a descriptor for the log, or -1.
+static int OpenScriptLog(const char *dirPath, const char *name, const char *path, Logger *logClient)
+{
+    struct stat chainInfo[kMaxChainDepth];
+    int chainFDs[kMaxChainDepth];
+    struct stat info;
+    size_t depth;
+    size_t i;
+    int dirFD;
+    int fd;
+    
+    dirFD = VerifyDirChain(dirPath, false, chainInfo, chainFDs, &depth, logClient);
+    if (dirFD == -1) {
+        return -1;
+    }
+    for (i = 0; i + 1 < depth; i++) {
+        close(chainFDs[i]);
+    }
+    fd = openat(dirFD, name, O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC, 0600);
+    close(dirFD);
+    if (fd == -1) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Can't open %s, errno %d", path, errno);
+        return -1;
+    }
+    if (fstat(fd, &info) != 0 || ! S_ISREG(info.st_mode) || info.st_uid != 0 || info.st_nlink != 1) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Not logging to %s, it isn't a file owned by root with a single link", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/// Create the pipes that capture a job's stdout and stderr, and open its
+/// log file if ScriptLogDirectory is set.
+///
+/// @param childFDs Receives the write ends for the child, which the
+///                 caller closes once it has been launched.
+/// @return false if the pipes couldn't be created, in which case the
+///         child inherits the plugin's stdout and stderr.
+static bool CaptureOpen(ScriptJob *job, int childFDs[2], const PluginSettings *settings, Logger *logClient)
+{
+    char path[MAXPATHLEN];
+    char name[NAME_MAX + 1];
+    char header[128];
+    int fds[2];
+    size_t i;
+    time_t now;
+    int len;
+    
+    job->fLogFD = -1;
+    for (i = 0; i < 2; i++) {
+        job->fOutput[i].fFD = -1;
+        job->fOutput[i].fLength = 0;
+        childFDs[i] = -1;
+    }
+    for (i = 0; i < 2; i++) {
+        if (pipe(fds) != 0) {
+            LogMessage(logClient, LOG_WARNING,
+                       "Can't capture output of %s, errno %d", job->fScript->fPath, errno);
+            CaptureClose(job, logClient);
+            for (i = 0; i < 2; i++) {
+                if (childFDs[i] != -1) {
+                    close(childFDs[i]);
+                    childFDs[i] = -1;
+                }
+            }
+            return false;
+        }
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        job->fOutput[i].fFD = fds[0];
+        childFDs[i] = fds[1];
+    }
+    
+    if (settings->fScriptLogDirectory[0] != '\0') {
+        if (snprintf(name, sizeof(name), "%s.log", job->fScript->fName) >= (int)sizeof(name)
+            || snprintf(path, sizeof(path), "%s/%s", settings->fScriptLogDirectory, name) >= (int)sizeof(path)) {
+            LogMessage(logClient, LOG_WARNING,
+                       "Not logging the output of %s, the path of its log is too long", job->fScript->fPath);
+        } else if ((job->fLogFD = OpenScriptLog(settings->fScriptLogDirectory, name, path, logClient)) != -1) {
+            now = time(NULL);
+            len = snprintf(header, sizeof(header), "--- %s", ctime(&now));
+            write(job->fLogFD, header, (size_t)len);
+        }
+    }
+    return true;
+}
+
+
+#pragma mark *     Overlap
+
+/// Set deadline, for pthread_cond_timedwait(), to a number of milliseconds
+/// from now.
+static void DeadlineAfter(struct timespec *deadline, long milliseconds)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += milliseconds / 1000;
+    deadline->tv_nsec += (milliseconds % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/// Start a group for the lsp-overlap scripts of a premount mechanism, and
+/// register it for the matching postmount mechanism to join.
+///
+/// A group from an earlier invocation for the same login and context can't
+/// be joined any more, but lives on until it's released.
+///
+/// Postmount waits for the group for PhaseTimeout, or AsyncScriptTimeout
+/// if there is none, as they're set when the group is created.
+///
+/// @return the group, to be released with ReleaseOverlapGroup(), or NULL.
+static OverlapGroup *CreateOverlapGroup(PluginRecord *plugin,
+                                        AuthorizationEngineRef engine,
+                                        userContext context,
+                                        uid_t uid,
+                                        const PluginSettings *settings)
+{
+    OverlapGroup *group;
+    OverlapGroup **link;
+    
+    group = calloc(1, sizeof(*group));
+    if (group == NULL) {
+        return NULL;
+    }
+    group->fEngine = engine;
+    group->fContext = context;
+    group->fUid = uid;
+    group->fRefCount = 1;
+    group->fResult = kAuthorizationResultAllow;
+    group->fJoinTimeout = settings->fPhaseTimeout > 0 ? settings->fPhaseTimeout : settings->fAsyncScriptTimeout;
+    group->fGracePeriod = settings->fTimeoutGracePeriod;
+    pthread_mutex_init(&group->fLock, NULL);
+    pthread_cond_init(&group->fChanged, NULL);
+    
+    pthread_mutex_lock(&plugin->fOverlapLock);
+    for (link = &plugin->fOverlaps; *link != NULL; link = &(*link)->fNext) {
+        if ((*link)->fEngine == engine && (*link)->fContext == context) {
+            *link = (*link)->fNext;
+            break;
+        }
+    }
+    group->fNext = plugin->fOverlaps;
+    plugin->fOverlaps = group;
+    pthread_mutex_unlock(&plugin->fOverlapLock);
+    
+    return group;
+}
+
+/// Drop a reference to a group, freeing it when nobody holds it any more.
+static void ReleaseOverlapGroup(PluginRecord *plugin, OverlapGroup *group)
+{
+    OverlapGroup **link;
+    bool last;
+    
+    // Under fOverlapLock, so JoinOverlapGroup() can't pick it up as it goes.
+    pthread_mutex_lock(&plugin->fOverlapLock);
+    pthread_mutex_lock(&group->fLock);
+    last = --group->fRefCount == 0;
+    pthread_mutex_unlock(&group->fLock);
+    if (last) {
+        for (link = &plugin->fOverlaps; *link != NULL; link = &(*link)->fNext) {
+            if (*link == group) {
+                *link = group->fNext;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&plugin->fOverlapLock);
+    
+    if (last) {
+        pthread_cond_destroy(&group->fChanged);
+        pthread_mutex_destroy(&group->fLock);
+        free(group);
+    }
+}
+
+/// Count a job that's been left running in a group.
+static void OverlapJobStarted(OverlapGroup *group)
+{
+    pthread_mutex_lock(&group->fLock);
+    group->fRefCount++;
+    group->fRunning++;
+    pthread_mutex_unlock(&group->fLock);
+}
+
+/// True once the jobs of a group have to be terminated, because postmount
+/// has waited long enough for them.
+static bool OverlapGroupExpired(OverlapGroup *group)
+{
+    bool expired;
+    
+    pthread_mutex_lock(&group->fLock);
+    expired = group->fExpired;
+    pthread_mutex_unlock(&group->fLock);
+    
+    return expired;
+}
+
+/// Record the result of a job in a group, and wake up anyone joining it.
+static void OverlapJobFinished(PluginRecord *plugin, OverlapGroup *group, AuthorizationResult result)
+{
+    pthread_mutex_lock(&group->fLock);
+    group->fRunning--;
+    if (result != kAuthorizationResultAllow) {
+        group->fResult = kAuthorizationResultDeny;
+    }
+    pthread_cond_broadcast(&group->fChanged);
+    pthread_mutex_unlock(&group->fLock);
+    ReleaseOverlapGroup(plugin, group);
+}
+
+/// Wake the plugin's supervisor, if it has one, to look at its jobs again.
+static void WakeSupervisor(PluginRecord *plugin)
+{
+    pthread_mutex_lock(&plugin->fSupervisorLock);
+    if (plugin->fSupervisor != NULL) {
+        write(plugin->fSupervisor->fWakePipe[1], "", 1);
+    }
+    pthread_mutex_unlock(&plugin->fSupervisorLock);
+}
+
+/// Wait for the lsp-overlap scripts that the premount mechanism of the
+/// same login and context left running.
+///
+/// Their timeouts are enforced by the supervisor. If they're still running
+/// after the group's fJoinTimeout, the supervisor is told to terminate
+/// them, and their lsp-on-timeout policy applies. A group is only joined
+/// once.
+///
+/// @return deny if one of them denied authorization, timed out with a
+///         deny policy, or couldn't be stopped, otherwise allow.
+static AuthorizationResult JoinOverlapGroup(PluginRecord *plugin,
+                                            AuthorizationEngineRef engine,
+                                            userContext context,
+                                            Logger *logClient)
+{
+    OverlapGroup *group;
+    OverlapGroup **link;
+    AuthorizationResult result;
+    struct timespec deadline;
+    
+    group = NULL;
+    pthread_mutex_lock(&plugin->fOverlapLock);
+    for (link = &plugin->fOverlaps; *link != NULL; link = &(*link)->fNext) {
+        if ((*link)->fEngine == engine && (*link)->fContext == context) {
+            group = *link;
+            *link = group->fNext;
+            pthread_mutex_lock(&group->fLock);
+            group->fRefCount++;
+            pthread_mutex_unlock(&group->fLock);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&plugin->fOverlapLock);
+    if (group == NULL) {
+        return kAuthorizationResultAllow;
+    }
+    
+    pthread_mutex_lock(&group->fLock);
+    if (group->fRunning > 0) {
+        LogMessage(logClient, LOG_NOTICE,
+                   "Waiting for %zu overlapped premount scripts", group->fRunning);
+    }
+    DeadlineAfter(&deadline, group->fJoinTimeout * 1000);
+    while (group->fRunning > 0) {
+        if (group->fJoinTimeout == 0) {
+            pthread_cond_wait(&group->fChanged, &group->fLock);
+        } else if (pthread_cond_timedwait(&group->fChanged, &group->fLock, &deadline) == ETIMEDOUT
+                   && group->fRunning > 0) {
+            if (group->fExpired) {
+                LogMessage(logClient, LOG_ERR,
+                           "Gave up waiting for %zu overlapped premount scripts, denying authorization",
+                           group->fRunning);
+                group->fResult = kAuthorizationResultDeny;
+                break;
+            }
+            LogMessage(logClient, LOG_ERR,
+                       "Overlapped premount scripts still running after %ld seconds, terminating them",
+                       group->fJoinTimeout);
+            group->fExpired = true;
+            pthread_mutex_unlock(&group->fLock);
+            WakeSupervisor(plugin);
+            pthread_mutex_lock(&group->fLock);
+            
+            // Give them the grace period, and the supervisor a moment to
+            // reap them.
+            DeadlineAfter(&deadline, (group->fGracePeriod + 1) * 1000);
+        }
+    }
+    result = group->fResult;
+    pthread_mutex_unlock(&group->fLock);
+    ReleaseOverlapGroup(plugin, group);
+    
+    return result;
+}
+
+
+#pragma mark *     Warm-up
+
+/// True once a job should stop reading ahead, because the plugin is going
+/// away or the job ran out of budget or time.
+static bool WarmupStopped(WarmupJob *job)
+{
+    if (__atomic_load_n(&job->fStop, __ATOMIC_RELAXED)
+        || __atomic_load_n(&job->fOverBudget, __ATOMIC_RELAXED)
+        || __atomic_load_n(&job->fTimedOut, __ATOMIC_RELAXED)) {
+        return true;
+    }
+    if (MonotonicTime() >= job->fDeadline) {
+        __atomic_store_n(&job->fTimedOut, true, __ATOMIC_RELAXED);
+        return true;
+    }
+    return false;
+}
+
+/// Ask the kernel to read a file ahead, as much of it as the budget allows.
+static void WarmupFile(WarmupJob *job, int fd, const struct stat *info)
+{
+#if defined(__APPLE__)
+    struct radvisory advisory;
+#endif
+    uint64_t used;
+    uint64_t count;
+    
+    if (info->st_size <= 0) {
+        return;
+    }
+    used = __atomic_load_n(&job->fBytes, __ATOMIC_RELAXED);
+    do {
+        if (used >= job->fBudget) {
+            __atomic_store_n(&job->fOverBudget, true, __ATOMIC_RELAXED);
+            return;
+        }
+        count = MIN((uint64_t)info->st_size, job->fBudget - used);
+    } while (! __atomic_compare_exchange_n(&job->fBytes, &used, used + count, false,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&job->fFiles, 1, __ATOMIC_RELAXED);
+    
+#if defined(__APPLE__)
+    advisory.ra_offset = 0;
+    advisory.ra_count = (int)MIN(count, (uint64_t)INT_MAX);
+    fcntl(fd, F_RDADVISE, &advisory);
+#else
+    posix_fadvise(fd, 0, (off_t)count, POSIX_FADV_WILLNEED);
+#endif
+}
+
+/// Read ahead a file, or everything below a directory.
+///
+/// Symbolic links aren't followed, and anything that isn't owned by the
+/// user or is on another volume is skipped, so a list entry can't be used
+/// to make the plugin read files the user couldn't.
+static void WarmupPath(WarmupJob *job, int dirFD, const char *name, size_t depth)
+{
+    struct dirent *entry;
+    struct stat info;
+    DIR *dir;
+    int fd;
+    
+    fd = openat(dirFD, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    if (fstat(fd, &info) != 0 || info.st_uid != job->fUid || info.st_dev != job->fHomeDev) {
+        close(fd);
+        return;
+    }
+    if (S_ISREG(info.st_mode)) {
+        WarmupFile(job, fd, &info);
+        close(fd);
+    } else if (S_ISDIR(info.st_mode) && depth < kMaxWarmupDepth && (dir = fdopendir(fd)) != NULL) {
+        while (! WarmupStopped(job) && (entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                WarmupPath(job, dirfd(dir), entry->d_name, depth + 1);
+            }
+        }
+        closedir(dir);
+    } else {
+        close(fd);
+    }
+}
+
+/// Drop a reference to a job, freeing it when nobody holds it any more.
+static void ReleaseWarmupJob(PluginRecord *plugin, WarmupJob *job)
+{
+    WarmupJob **link;
+    bool last;
+    
+    // Under fWarmupLock, so AcquireWarmupJob() can't pick it up as it goes.
+    pthread_mutex_lock(&plugin->fWarmupLock);
+    pthread_mutex_lock(&job->fLock);
+    last = --job->fRefCount == 0;
+    pthread_mutex_unlock(&job->fLock);
+    if (last) {
+        for (link = &plugin->fWarmups; *link != job; link = &(*link)->fNext)
+            ;
+        *link = job->fNext;
+    }
+    pthread_mutex_unlock(&plugin->fWarmupLock);
+    
+    if (last) {
+        if (job->fHomeFD != -1) {
+            close(job->fHomeFD);
+        }
+        free(job->fPaths);
+        free(job->fList);
+        pthread_cond_destroy(&job->fFinished);
+        pthread_mutex_destroy(&job->fLock);
+        free(job);
+    }
+}
+
+/// Thread function of a warm-up job. The threads take paths from the list
+/// until it's exhausted, and the last one to finish reports the result.
+static void *WarmupMain(void *arg)
+{
+    WarmupJob *job;
+    PluginRecord *plugin;
+    statsOutcome outcome;
+    uint64_t elapsed;
+    size_t i;
+    bool last;
+    
+    job = arg;
+    plugin = job->fPlugin;
+    while (! WarmupStopped(job)
+           && (i = __atomic_fetch_add(&job->fNextPath, 1, __ATOMIC_RELAXED)) < job->fNumPaths) {
+        WarmupPath(job, job->fHomeFD, job->fPaths[i], 0);
+    }
+    
+    pthread_mutex_lock(&job->fLock);
+    last = --job->fRunning == 0;
+    if (last) {
+        job->fEnd = MonotonicTime();
+        pthread_cond_broadcast(&job->fFinished);
+    }
+    pthread_mutex_unlock(&job->fLock);
+    
+    if (last) {
+        elapsed = job->fEnd - job->fStart;
+        outcome = job->fTimedOut ? kStatsTimedOut : kStatsSucceeded;
+        LogMessage(plugin->fLogClient, LOG_INFO,
+                   "Read ahead %llu KB in %llu files of %s in %.3f s%s", (unsigned long long)(job->fBytes / 1024),
+                   (unsigned long long)job->fFiles, job->fHome, elapsed / 1e6,
+                   job->fTimedOut ? ", stopped by WarmupTimeout" : job->fOverBudget ? ", stopped by WarmupBudget" : "");
+        StatsRecord(plugin, kStatsKindPhase, "warmup", elapsed, outcome,
+                    outcome == kStatsTimedOut ? "stopped by WarmupTimeout" : NULL);
+    }
+    ReleaseWarmupJob(plugin, job);
+    return NULL;
+}
+
+/// Split a warm-up list into the paths of a job.
+///
+/// Each line is a file or directory relative to the home directory, and #
+/// starts a comment. Directories are read ahead with everything below them.
+static bool ParseWarmupList(WarmupJob *job, const char *list, Logger *logClient)
+{
+    char *line;
+    char *next;
+    char *path;
+    size_t maxPaths;
+    
+    if ((job->fList = strdup(list)) == NULL) {
+        return false;
+    }
+    maxPaths = 1;
+    for (line = job->fList; *line != '\0'; line++) {
+        maxPaths += *line == '\n';
+    }
+    if ((job->fPaths = calloc(maxPaths, sizeof(*job->fPaths))) == NULL) {
+        return false;
+    }
+    for (line = job->fList; line != NULL; line = next) {
+        if ((next = strchr(line, '\n')) != NULL) {
+            *next++ = '\0';
+        }
+        line[strcspn(line, "#")] = '\0';
+        path = TrimWhitespace(line);
+        if (path[0] == '\0') {
+            continue;
+        }
+        if (path[0] == '/' || strcmp(path, "..") == 0 || strncmp(path, "../", 3) == 0
+            || strstr(path, "/../") != NULL || (strlen(path) >= 3 && strcmp(path + strlen(path) - 3, "/..") == 0)) {
+            LogMessage(logClient, LOG_WARNING,
+                       "Ignoring '%s' in %s, expected a path inside the home directory", path, kWarmupName);
+            continue;
+        }
+        job->fPaths[job->fNumPaths++] = path;
+    }
+    return true;
+}
+
+/// Start reading ahead a login's home directory, or join the warm-up that
+/// another mechanism of the login has started.
+///
+/// @param outStarted  Set to true if this call started the job.
+/// @return the job, to be released with ReleaseWarmupJob(), or NULL.
+static WarmupJob *AcquireWarmupJob(PluginRecord *plugin,
+                                   AuthorizationEngineRef engine,
+                                   const PluginSettings *settings,
+                                   const char *list,
+                                   uid_t uid,
+                                   const char *home,
+                                   bool *outStarted,
+                                   Logger *logClient)
+{
+    WarmupJob *job;
+    pthread_attr_t attr;
+    pthread_t thread;
+    struct stat info;
+    long i;
+    
+    *outStarted = false;
+    pthread_mutex_lock(&plugin->fWarmupLock);
+    for (job = plugin->fWarmups; job != NULL && job->fEngine != engine; job = job->fNext)
+        ;
+    if (job != NULL) {
+        pthread_mutex_lock(&job->fLock);
+        job->fRefCount++;
+        pthread_mutex_unlock(&job->fLock);
+    }
+    pthread_mutex_unlock(&plugin->fWarmupLock);
+    if (job != NULL) {
+        return job;
+    }
+    
+    if ((job = calloc(1, sizeof(*job))) == NULL) {
+        return NULL;
+    }
+    job->fEngine = engine;
+    job->fPlugin = plugin;
+    job->fRefCount = 1;
+    job->fUid = uid;
+    job->fHomeFD = open(home, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    job->fBudget = (uint64_t)settings->fWarmupBudget * 1024 * 1024;
+    job->fStart = MonotonicTime();
+    job->fDeadline = job->fStart + (uint64_t)settings->fWarmupTimeout * kMicrosPerSecond;
+    strlcpy(job->fHome, home, sizeof(job->fHome));
+    pthread_mutex_init(&job->fLock, NULL);
+    pthread_cond_init(&job->fFinished, NULL);
+    if (job->fHomeFD == -1 || fstat(job->fHomeFD, &info) != 0) {
+        LogMessage(logClient, LOG_WARNING, "Can't read ahead %s: %s", home, strerror(errno));
+    } else if (ParseWarmupList(job, list, logClient)) {
+        job->fHomeDev = info.st_dev;
+    }
+    
+    pthread_mutex_lock(&plugin->fWarmupLock);
+    job->fNext = plugin->fWarmups;
+    plugin->fWarmups = job;
+    pthread_mutex_unlock(&plugin->fWarmupLock);
+    
+    // Each thread holds a reference until it's done.
+    if (job->fNumPaths > 0) {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_mutex_lock(&job->fLock);
+        for (i = 0; i < MIN(settings->fWarmupThreads, (long)job->fNumPaths); i++) {
+            job->fRefCount++;
+            job->fRunning++;
+            if (pthread_create(&thread, &attr, WarmupMain, job) != 0) {
+                job->fRefCount--;
+                job->fRunning--;
+                LogMessage(logClient, LOG_ERR, "Warm-up thread creation failed");
+                break;
+            }
+        }
+        pthread_mutex_unlock(&job->fLock);
+        pthread_attr_destroy(&attr);
+        LogMessage(logClient, LOG_DEBUG,
+                   "Reading ahead %zu paths in %s on %zu threads", job->fNumPaths, home, job->fRunning);
+    }
+    *outStarted = true;
+    
+    return job;
+}
+
+/// Wait for a warm-up job to finish, for at most a number of milliseconds.
+///
+/// @return true if it has finished.
+static bool WaitForWarmupJob(WarmupJob *job, long milliseconds)
+{
+    struct timespec deadline;
+    bool finished;
+    
+    DeadlineAfter(&deadline, milliseconds);
+    pthread_mutex_lock(&job->fLock);
+    while (job->fRunning > 0 && milliseconds > 0
+           && pthread_cond_timedwait(&job->fFinished, &job->fLock, &deadline) != ETIMEDOUT)
+        ;
+    finished = job->fRunning == 0;
+    pthread_mutex_unlock(&job->fLock);
+    
+    return finished;
+}
+
+/// Stop all warm-up jobs and wait for their threads, before the plugin is
+/// destroyed.
+static void StopWarmupJobs(PluginRecord *plugin)
+{
+    WarmupJob *job;
+    
+    pthread_mutex_lock(&plugin->fWarmupLock);
+    for (job = plugin->fWarmups; job != NULL; job = job->fNext) {
+        __atomic_store_n(&job->fStop, true, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&plugin->fWarmupLock);
+    
+    for (;;) {
+        pthread_mutex_lock(&plugin->fWarmupLock);
+        for (job = plugin->fWarmups; job != NULL; job = job->fNext) {
+            pthread_mutex_lock(&job->fLock);
+            if (job->fRunning > 0) {
+                job->fRefCount++;
+                pthread_mutex_unlock(&job->fLock);
+                break;
+            }
+            pthread_mutex_unlock(&job->fLock);
+        }
+        pthread_mutex_unlock(&plugin->fWarmupLock);
+        if (job == NULL) {
+            break;
+        }
+        pthread_mutex_lock(&job->fLock);
+        while (job->fRunning > 0) {
+            pthread_cond_wait(&job->fFinished, &job->fLock);
+        }
+        pthread_mutex_unlock(&job->fLock);
+        ReleaseWarmupJob(plugin, job);
+    }
+}
+
+
+#pragma mark *     Supervisor
+
+/// Send sig to the process group of a running job.
+///
+/// Scripts are started in their own process group, so this also reaches
+/// anything they have started that's still running.
+static void SignalJob(const ScriptJob *job, int sig)
+{
+    if (kill(-job->fPid, sig) == -1 && errno == ESRCH) {
+        kill(job->fPid, sig);
+    }
+}
+
+/// Log how a detached script exited.
+static void LogAsyncResult(const ScriptJob *job, int childStatus, Logger *logClient)
+{
+    if (job->fTimedOut) {
+        LogMessage(logClient, LOG_NOTICE,
+                   "%s (async) timed out", job->fScript->fPath);
+    } else if (WIFSIGNALED(childStatus)) {
+        LogMessage(logClient, LOG_WARNING,
+                   "%s (async) died with signal %d", job->fScript->fPath, WTERMSIG(childStatus));
+    } else {
+        LogMessage(logClient, LOG_WARNING,
+                   "%s (async) exited with status %d after %.1fs", job->fScript->fPath, WEXITSTATUS(childStatus),
+                   (double)(MonotonicTime() - job->fStartTime) / kMicrosPerSecond);
+        if (WEXITSTATUS(childStatus) == EX_NOPERM) {
+            LogMessage(logClient, LOG_NOTICE,
+                       "%s (async) can't deny authorization, the login has already proceeded", job->fScript->fPath);
+        }
+    }
+}
+
+/// The supervisor thread.
+///
+/// Runs until the supervisor is stopped, reaping detached scripts and
+/// sending SIGTERM and then SIGKILL to those that run out of time.
+static void *SupervisorMain(void *arg)
+{
+    ScriptSupervisor *supervisor;
+    ScriptJob *job;
+    OverlapGroup *group;
+    AuthorizationResult jobResult;
+    ResultCache cache;
+    const char *kind;
+    char buffer[64];
+    size_t slot;
+    size_t i;
+    int childStatus;
+    int reapErrno;
+    pid_t pid;
+    uint64_t now;
+    uint64_t wakeup;
+    int timeoutMs;
+    
+    supervisor = arg;
+    pthread_mutex_lock(&supervisor->fLock);
+    while (! supervisor->fStopping) {
+        
+        // Take over newly detached jobs.
+        while (read(supervisor->fWakePipe[0], buffer, sizeof(buffer)) > 0)
+            ;
+        slot = 0;
+        for (i = 0; i < supervisor->fNumIncoming; i++) {
+            while (supervisor->fJobs[slot].fState == kScriptRunning) {
+                slot++;
+            }
+            supervisor->fJobs[slot] = supervisor->fIncoming[i].fJob;
+            supervisor->fScripts[slot] = supervisor->fIncoming[i].fScript;
+            supervisor->fGracePeriods[slot] = supervisor->fIncoming[i].fGracePeriod;
+            supervisor->fGroups[slot] = supervisor->fIncoming[i].fGroup;
+            supervisor->fScripts[slot].fName = strrchr(supervisor->fScripts[slot].fPath, '/') + 1;
+            supervisor->fJobs[slot].fScript = &supervisor->fScripts[slot];
+            ChildWatcherAdd(&supervisor->fWatcher, &supervisor->fJobs[slot]);
+        }
+        supervisor->fNumIncoming = 0;
+        pthread_mutex_unlock(&supervisor->fLock);
+        
+        // Reap, and enforce deadlines.
+        now = MonotonicTime();
+        wakeup = 0;
+        for (i = 0; i < kMaxAsyncScripts; i++) {
+            job = &supervisor->fJobs[i];
+            if (job->fState != kScriptRunning) {
+                continue;
+            }
+            group = supervisor->fGroups[i];
+            kind = group != NULL ? "overlapped" : "async";
+            CaptureRead(job, supervisor->fLogClient);
+            pid = ReapJob(job, &childStatus);
+            if (pid == job->fPid || (pid == -1 && errno != EINTR)) {
+                reapErrno = errno;
+                job->fEndTime = MonotonicTime();
+                CaptureClose(job, supervisor->fLogClient);
+                if (pid == job->fPid) {
+                    LogScriptUsage(job, kind, supervisor->fLogClient);
+                }
+                jobResult = kAuthorizationResultAllow;
+                if (pid == -1) {
+                    // Like in RunScripts(), a lost status fails closed.
+                    LogMessage(supervisor->fLogClient, LOG_ERR,
+                               "Lost the exit status of %s (%s), errno %d%s", job->fScript->fPath, kind, reapErrno,
+                               group != NULL ? ", denying authorization" : "");
+                    jobResult = kAuthorizationResultDeny;
+                } else if (group == NULL) {
+                    LogAsyncResult(job, childStatus, supervisor->fLogClient);
+                } else if (pid == job->fPid && job->fTimedOut) {
+                    jobResult = job->fScript->fTimeoutPolicy;
+                    LogMessage(supervisor->fLogClient, LOG_NOTICE,
+                               "%s (overlapped) timed out, %s authorization", job->fScript->fPath,
+                               jobResult == kAuthorizationResultAllow ? "allowing" : "denying");
+                } else if (pid == job->fPid) {
+                    jobResult = ScriptResult(job->fScript->fPath, childStatus, supervisor->fLogClient);
+                    if (job->fScript->fCache && WIFEXITED(childStatus) && WEXITSTATUS(childStatus) == 0) {
+                        // The phase is over, so this one is written right away.
+                        memset(&cache, 0, sizeof(cache));
+                        ResultCacheStore(&cache, job->fScript, group->fUid, supervisor->fLogClient);
+                        ResultCacheFlush(supervisor->fPlugin, &cache, supervisor->fLogClient);
+                    }
+                }
+                if (pid == job->fPid) {
+                    StatsRecordJob(supervisor->fPlugin, job, childStatus, jobResult);
+                }
+                job->fState = kScriptFinished;
+                ChildWatcherRemove(&supervisor->fWatcher, job);
+                if (group != NULL) {
+                    supervisor->fGroups[i] = NULL;
+                    OverlapJobFinished(supervisor->fPlugin, group, jobResult);
+                }
+                pthread_mutex_lock(&supervisor->fLock);
+                supervisor->fNumAdopted--;
+                pthread_mutex_unlock(&supervisor->fLock);
+                continue;
+            }
+            if (group != NULL && ! job->fTimedOut && OverlapGroupExpired(group)) {
+                job->fDeadline = now;
+            }
+            if (job->fKillTime != 0 && now >= job->fKillTime) {
+                LogMessage(supervisor->fLogClient, LOG_WARNING,
+                           "Killing %s (%s)", job->fScript->fPath, kind);
+                SignalJob(job, SIGKILL);
+                job->fKillTime = 0;
+                job->fDeadline = 0;
+            } else if (job->fDeadline != 0 && now >= job->fDeadline && job->fKillTime == 0) {
+                LogMessage(supervisor->fLogClient, LOG_WARNING,
+                           "%s (%s) timed out, terminating", job->fScript->fPath, kind);
+                job->fTimedOut = true;
+                SignalJob(job, SIGTERM);
+                job->fKillTime = now + (uint64_t)supervisor->fGracePeriods[i] * kMicrosPerSecond;
+            }
+            if (job->fKillTime != 0 && (wakeup == 0 || job->fKillTime < wakeup)) {
+                wakeup = job->fKillTime;
+            } else if (job->fKillTime == 0 && job->fDeadline != 0 && (wakeup == 0 || job->fDeadline < wakeup)) {
+                wakeup = job->fDeadline;
+            }
+        }
+        
+        timeoutMs = -1;
+        if (wakeup != 0) {
+            timeoutMs = wakeup > now ? (int)MIN((wakeup - now + 999) / 1000, (uint64_t)INT_MAX) : 0;
+        }
+        ChildWatcherWait(&supervisor->fWatcher, supervisor->fJobs, kMaxAsyncScripts, timeoutMs);
+        
+        pthread_mutex_lock(&supervisor->fLock);
+    }
+    pthread_mutex_unlock(&supervisor->fLock);
+    
+    return NULL;
+}
+
+/// Create a supervisor and start its thread.
+static ScriptSupervisor *CreateSupervisor(PluginRecord *plugin)
+{
+    ScriptSupervisor *supervisor;
+    Logger *logClient;
+    int flags;
+    
+    supervisor = calloc(1, sizeof(*supervisor));
+    if (supervisor == NULL) {
+        return NULL;
+    }
+    logClient = plugin->fLogClient;
+    supervisor->fPlugin = plugin;
+    supervisor->fLogClient = logClient;
+    if (pipe(supervisor->fWakePipe) != 0) {
+        free(supervisor);
+        return NULL;
+    }
+    flags = fcntl(supervisor->fWakePipe[0], F_GETFL);
+    fcntl(supervisor->fWakePipe[0], F_SETFL, flags | O_NONBLOCK);
+    fcntl(supervisor->fWakePipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(supervisor->fWakePipe[1], F_SETFD, FD_CLOEXEC);
+    pthread_mutex_init(&supervisor->fLock, NULL);
+    ChildWatcherInit(&supervisor->fWatcher, kMaxAsyncScripts, supervisor->fWakePipe[0]);
+    
+    if (pthread_create(&supervisor->fThread, NULL, SupervisorMain, supervisor) != 0) {
+        LogMessage(logClient, LOG_ERR, "Can't start the async script supervisor");
+        ChildWatcherDestroy(&supervisor->fWatcher);
+        pthread_mutex_destroy(&supervisor->fLock);
+        close(supervisor->fWakePipe[0]);
+        close(supervisor->fWakePipe[1]);
+        free(supervisor);
+        return NULL;
+    }
+    return supervisor;
+}
+
+/// Stop a supervisor and free it.
+///
+/// Scripts that are still running are left alone, they're detached after
+/// all, though those that lsp-launcher started are stopped along with the
+/// launcher. Their groups, if any, are released.
+static void DestroySupervisor(ScriptSupervisor *supervisor)
+{
+    size_t i;
+    
+    pthread_mutex_lock(&supervisor->fLock);
+    supervisor->fStopping = true;
+    pthread_mutex_unlock(&supervisor->fLock);
+    write(supervisor->fWakePipe[1], "", 1);
+    pthread_join(supervisor->fThread, NULL);
+    
+    if (supervisor->fNumAdopted > 0) {
+        LogMessage(supervisor->fLogClient, LOG_NOTICE,
+                   "No longer supervising %zu async scripts", supervisor->fNumAdopted);
+    }
+    for (i = 0; i < kMaxAsyncScripts; i++) {
+        if (supervisor->fJobs[i].fState == kScriptRunning) {
+            CaptureClose(&supervisor->fJobs[i], supervisor->fLogClient);
+            ChildWatcherRemove(&supervisor->fWatcher, &supervisor->fJobs[i]);
+            if (supervisor->fJobs[i].fStatusFD != -1) {
+                close(supervisor->fJobs[i].fStatusFD);
+            }
+            if (supervisor->fGroups[i] != NULL) {
+                OverlapJobFinished(supervisor->fPlugin, supervisor->fGroups[i], kAuthorizationResultAllow);
+            }
+        }
+    }
+    ChildWatcherDestroy(&supervisor->fWatcher);
+    pthread_mutex_destroy(&supervisor->fLock);
+    close(supervisor->fWakePipe[0]);
+    close(supervisor->fWakePipe[1]);
+    free(supervisor);
+}
+
+/// Reserve room for a detached job with the plugin's supervisor, starting
+/// it if needed.
+///
+/// @return the supervisor, or NULL if it's full or couldn't be started.
+static ScriptSupervisor *ReserveSupervisor(PluginRecord *plugin)
+{
+    ScriptSupervisor *supervisor;
+    bool reserved;
+    
+    pthread_mutex_lock(&plugin->fSupervisorLock);
+    if (plugin->fSupervisor == NULL) {
+        plugin->fSupervisor = CreateSupervisor(plugin);
+    }
+    supervisor = plugin->fSupervisor;
+    pthread_mutex_unlock(&plugin->fSupervisorLock);
+    if (supervisor == NULL) {
+        return NULL;
+    }
+    
+    pthread_mutex_lock(&supervisor->fLock);
+    reserved = supervisor->fNumAdopted < kMaxAsyncScripts;
+    if (reserved) {
+        supervisor->fNumAdopted++;
+    }
+    pthread_mutex_unlock(&supervisor->fLock);
+    
+    return reserved ? supervisor : NULL;
+}
+
+/// Hand a launched job over to a supervisor reserved with
+/// ReserveSupervisor(), or give the reservation back if pid is -1.
+///
+/// lsp-overlap jobs are added to group. Jobs without a timeout of their own
+/// get AsyncScriptTimeout.
+static void AdoptJob(ScriptSupervisor *supervisor, const ScriptJob *job, const PluginSettings *settings, OverlapGroup *group)
+{
+    AsyncJob *adopted;
+    long timeout;
+    
+    pthread_mutex_lock(&supervisor->fLock);
+    if (job->fPid == -1) {
+        supervisor->fNumAdopted--;
+    } else {
+        adopted = &supervisor->fIncoming[supervisor->fNumIncoming++];
+        adopted->fJob = *job;
+        adopted->fJob.fState = kScriptRunning;
+        adopted->fJob.fWatchFD = -1;
+        adopted->fJob.fKillTime = 0;
+        timeout = job->fScript->fTimeout > 0 ? job->fScript->fTimeout : settings->fAsyncScriptTimeout;
+        adopted->fJob.fDeadline = timeout > 0 ? job->fStartTime + (uint64_t)timeout * kMicrosPerSecond : 0;
+        adopted->fScript = *job->fScript;
+        adopted->fScript.fFD = -1;
+        adopted->fGracePeriod = settings->fTimeoutGracePeriod;
+        adopted->fGroup = group;
+        if (group != NULL) {
+            OverlapJobStarted(group);
+        }
+    }
+    pthread_mutex_unlock(&supervisor->fLock);
+    write(supervisor->fWakePipe[1], "", 1);
+}
+
+
+#pragma mark *     Script Pool
+
+/// Register a phase with the plugin-wide pool.
+static void PoolJoin(PluginRecord *plugin, PoolClient *client)
+{
+    int i;
+    
+    client->fRunning = 0;
+    client->fWaitingSince = 0;
+    if (pipe(client->fWakePipe) != 0) {
+        client->fWakePipe[0] = client->fWakePipe[1] = -1;
+    }
+    for (i = 0; i < 2 && client->fWakePipe[i] != -1; i++) {
+        fcntl(client->fWakePipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(client->fWakePipe[i], F_SETFL, fcntl(client->fWakePipe[i], F_GETFL) | O_NONBLOCK);
+    }
+    
+    pthread_mutex_lock(&plugin->fPoolLock);
+    client->fNext = plugin->fPoolClients;
+    plugin->fPoolClients = client;
+    pthread_mutex_unlock(&plugin->fPoolLock);
+}
+
+/// Wake every phase that's waiting for a slot, so they can try again.
+/// Called with the plugin's fPoolLock held.
+static void PoolWakeWaiters(PluginRecord *plugin)
+{
+    PoolClient *client;
+    
+    for (client = plugin->fPoolClients; client != NULL; client = client->fNext) {
+        if (client->fWaitingSince != 0 && client->fWakePipe[1] != -1) {
+            write(client->fWakePipe[1], "", 1);
+        }
+    }
+}
+
+/// Empty a phase's wake pipe, which would otherwise keep waking it up.
+static void PoolDrain(PoolClient *client)
+{
+    char buf[64];
+    
+    if (client->fWakePipe[0] != -1) {
+        while (read(client->fWakePipe[0], buf, sizeof(buf)) > 0)
+            ;
+    }
+}
+
+/// Take a slot from the pool for a script that's ready to start.
+///
+/// Slots go to the waiting phase that holds the fewest, and between
+/// phases holding as many, to the one that has waited the longest, so a
+/// login with many scripts can't starve the others.
+///
+/// @param limit    MaxTotalScripts, 0 for no limit.
+/// @return true if a slot was taken, false if the phase has to wait for
+///         its wake pipe.
+static bool PoolAcquire(PluginRecord *plugin, PoolClient *client, long limit)
+{
+    PoolClient *other;
+    uint64_t since;
+    bool granted;
+    
+    PoolDrain(client);
+    pthread_mutex_lock(&plugin->fPoolLock);
+    since = client->fWaitingSince != 0 ? client->fWaitingSince : MonotonicTime();
+    granted = limit == 0 || plugin->fPoolRunning < (size_t)limit;
+    for (other = plugin->fPoolClients; granted && other != NULL; other = other->fNext) {
+        if (other != client && other->fWaitingSince != 0
+            && (other->fRunning < client->fRunning
+                || (other->fRunning == client->fRunning && other->fWaitingSince < since))) {
+            granted = false;
+        }
+    }
+    if (granted) {
+        client->fRunning++;
+        plugin->fPoolRunning++;
+        client->fWaitingSince = 0;
+    } else {
+        client->fWaitingSince = since;
+    }
+    pthread_mutex_unlock(&plugin->fPoolLock);
+    
+    return granted;
+}
+
+/// Return a slot to the pool.
+static void PoolRelease(PluginRecord *plugin, PoolClient *client)
+{
+    pthread_mutex_lock(&plugin->fPoolLock);
+    client->fRunning--;
+    plugin->fPoolRunning--;
+    PoolWakeWaiters(plugin);
+    pthread_mutex_unlock(&plugin->fPoolLock);
+}
+
+/// Stop waiting for a slot, when a phase no longer has a script to start.
+static void PoolStopWaiting(PluginRecord *plugin, PoolClient *client)
+{
+    pthread_mutex_lock(&plugin->fPoolLock);
+    if (client->fWaitingSince != 0) {
+        client->fWaitingSince = 0;
+        PoolWakeWaiters(plugin);
+    }
+    pthread_mutex_unlock(&plugin->fPoolLock);
+    PoolDrain(client);
+}
+
+/// Unregister a phase from the pool once all its scripts have been reaped.
+static void PoolLeave(PluginRecord *plugin, PoolClient *client)
+{
+    PoolClient **link;
+    
+    pthread_mutex_lock(&plugin->fPoolLock);
+    for (link = &plugin->fPoolClients; *link != client; link = &(*link)->fNext)
+        ;
+    *link = client->fNext;
+    plugin->fPoolRunning -= client->fRunning;
+    if (client->fWaitingSince != 0 || client->fRunning != 0) {
+        PoolWakeWaiters(plugin);
+    }
+    pthread_mutex_unlock(&plugin->fPoolLock);
+    
+    if (client->fWakePipe[0] != -1) {
+        close(client->fWakePipe[0]);
+        close(client->fWakePipe[1]);
+    }
+}
+
+
+#pragma mark *     Scheduler
+
+/// Launch a job, updating the scheduler state and arming its deadline.
+///
+/// lsp-async jobs, and lsp-overlap jobs when there's an overlap group, are
+/// handed over to the plugin's supervisor once they've been launched, and
+/// count as finished right away. If the supervisor is full they're run like
+/// any other job.
+///
+/// @return deny if the script couldn't be executed, otherwise allow.
+static AuthorizationResult StartJob(ScriptJob *job,
+                                    ChildWatcher *watcher,
+                                    size_t *running,
+                                    PluginRecord *plugin,
+                                    const PluginSettings *settings,
+                                    uid_t uid,
+                                    gid_t gid,
+                                    const char *home,
+                                    userContext context,
+                                    const LoginContext *login,
+                                    OverlapGroup *overlap,
+                                    ResultCache *cache,
+                                    Logger *logClient)
+{
+    AuthorizationResult result;
+    ScriptSupervisor *supervisor;
+    int outputFDs[2];
+    int cgroupFD;
+    bool captured;
+    
+    if (job->fScript->fCache && ResultCacheLookup(plugin, cache, job->fScript, uid, logClient)) {
+        LogMessage(logClient, LOG_NOTICE,
+                   "Skipping %s, it has already succeeded and nothing has changed", job->fScript->fPath);
+        job->fState = kScriptFinished;
+        job->fCached = true;
+        return kAuthorizationResultAllow;
+    }
+    
+    // Only lsp-overlap jobs are left running in the overlap group.
+    if (job->fScript->fAsync || ! job->fScript->fOverlap) {
+        overlap = NULL;
+    }
+    supervisor = NULL;
+    if ((job->fScript->fAsync || overlap != NULL) && (supervisor = ReserveSupervisor(plugin)) == NULL) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Can't detach %s, running it synchronously", job->fScript->fPath);
+    }
+    
+    result = kAuthorizationResultAllow;
+    job->fLaunchTime = MonotonicTime();
+    captured = CaptureOpen(job, outputFDs, settings, logClient);
+    cgroupFD = OpenScriptCgroup(settings, job->fScript, logClient);
+    job->fContained = cgroupFD != -1 || ScriptLimitsSet(&job->fScript->fLimits)
+                      || job->fScript->fQoS.fClass != kScriptQoSDefault;
+    job->fPid = LaunchScript(job->fScript->fPath, job->fScript->fFD, captured ? outputFDs : NULL,
+                             uid, gid, home, context, login, &job->fScript->fLimits, &job->fScript->fQoS, cgroupFD,
+                             settings->fUseLauncher ? plugin : NULL,
+                             &job->fStatusFD, &result, logClient);
+    job->fStartTime = MonotonicTime();
+    if (captured) {
+        close(outputFDs[0]);
+        close(outputFDs[1]);
+    }
+    if (cgroupFD != -1) {
+        close(cgroupFD);
+    }
+    if (supervisor != NULL) {
+        // The supervisor takes over the captured output as well, unless
+        // there's nothing to supervise.
+        if (job->fPid == -1) {
+            CaptureClose(job, logClient);
+        }
+        AdoptJob(supervisor, job, settings, overlap);
+        job->fState = kScriptFinished;
+        job->fEndTime = job->fStartTime;
+        job->fOutput[0].fFD = job->fOutput[1].fFD = job->fLogFD = job->fStatusFD = -1;
+    } else if (job->fPid == -1) {
+        CaptureClose(job, logClient);
+        job->fState = kScriptFinished;
+        job->fEndTime = job->fStartTime;
+    } else {
+        job->fState = kScriptRunning;
+        if (job->fScript->fTimeout > 0) {
+            job->fDeadline = MonotonicTime() + (uint64_t)job->fScript->fTimeout * kMicrosPerSecond;
+        }
+        ChildWatcherAdd(watcher, job);
+        (*running)++;
+    }
+    return result;
+}
+
+/// True if all jobs that job was declared to run after have finished.
+static bool DependenciesFinished(const ScriptJob *jobs, const ScriptJob *job)
+{
+    size_t i;
+    
+    for (i = 0; i < job->fScript->fNumDeps; i++) {
+        if (jobs[job->fScript->fDeps[i]].fState != kScriptFinished) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Ask a running job to stop, escalating to SIGKILL after the grace period.
+static void TerminateJob(ScriptJob *job, uint64_t now, const PluginSettings *settings)
+{
+    SignalJob(job, SIGTERM);
+    job->fKillTime = now + (uint64_t)settings->fTimeoutGracePeriod * kMicrosPerSecond;
+}
+
+/// Cancel jobs that haven't started yet, returning the combined result of
+/// their timeout policies if cancelled by the phase timeout.
+static AuthorizationResult SkipPendingJobs(ScriptJob *jobs, size_t numJobs, bool timedOut, Logger *logClient)
+{
+    AuthorizationResult result;
+    size_t i;
+    
+    result = kAuthorizationResultAllow;
+    for (i = 0; i < numJobs; i++) {
+        if (jobs[i].fState != kScriptPending) {
+            continue;
+        }
+        LogMessage(logClient, LOG_NOTICE,
+                   "Skipping %s", jobs[i].fScript->fPath);
+        jobs[i].fState = kScriptSkipped;
+        if (timedOut && jobs[i].fScript->fTimeoutPolicy != kAuthorizationResultAllow) {
+            LogMessage(logClient, LOG_NOTICE,
+                       "%s never ran before the phase timed out, denying authorization", jobs[i].fScript->fPath);
+            result = kAuthorizationResultDeny;
+        }
+    }
+    return result;
+}
+
+/// Cancel the rest of a phase after a job has denied authorization.
+///
+/// Pending jobs are skipped and running ones are terminated.
+static void CancelPhase(ScriptJob *jobs, size_t numJobs, const PluginSettings *settings, Logger *logClient)
+{
+    uint64_t now;
+    size_t i;
+    
+    SkipPendingJobs(jobs, numJobs, false, logClient);
+    now = MonotonicTime();
+    for (i = 0; i < numJobs; i++) {
+        if (jobs[i].fState == kScriptRunning && jobs[i].fKillTime == 0) {
+            LogMessage(logClient, LOG_NOTICE,
+                       "Terminating %s", jobs[i].fScript->fPath);
+            TerminateJob(&jobs[i], now, settings);
+        }
+    }
+}
+
+/// Decide the order in which a phase's jobs are considered for starting.
+///
+/// Scripts that fail fast and cheaply should run first, so a login that's
+/// going to be denied finds out early, and one that isn't gets its quick
+/// checks out of the way. Each script's history in the statistics file
+/// gives the chance that it denies, smoothed so that scripts with little
+/// history aren't written off, and its mean run time; sorting on their
+/// ratio minimizes the expected time until a deny. Scripts with lsp-order
+/// name keep their place, and only the scripts between them are reordered.
+/// lsp-after dependencies are still honoured by the scheduler.
+///
+/// @param order    Receives numJobs indexes into jobs.
+static void OrderJobs(PluginRecord *plugin, const ScriptJob *jobs, size_t numJobs, size_t *order, Logger *logClient)
+{
+    StatsFile *stats;
+    StatsEntry *entry;
+    double *priority;
+    double runs;
+    double denies;
+    double mean;
+    char names[512];
+    size_t length;
+    size_t start;
+    size_t end;
+    size_t swap;
+    size_t i;
+    size_t j;
+    bool moved;
+    
+    for (i = 0; i < numJobs; i++) {
+        order[i] = i;
+    }
+    if (numJobs < 2 || (stats = StatsAcquire(plugin)) == NULL
+        || (priority = malloc(numJobs * sizeof(*priority))) == NULL) {
+        return;
+    }
+    for (i = 0; i < numJobs; i++) {
+        runs = denies = 0;
+        mean = kOrderDefaultCost;
+        if ((entry = StatsFindEntry(stats, kStatsKindScript, jobs[i].fScript->fName, false)) != NULL
+            && (runs = (double)__atomic_load_n(&entry->fRuns, __ATOMIC_RELAXED)) > 0) {
+            denies = (double)__atomic_load_n(&entry->fDenies, __ATOMIC_RELAXED);
+            mean = (double)__atomic_load_n(&entry->fTotalMicros, __ATOMIC_RELAXED) / runs;
+        }
+        priority[i] = (denies + 1) / (runs + 2) / (mean + kOrderCostFloor);
+    }
+    
+    // A stable insertion sort of each run of movable jobs.
+    moved = false;
+    for (start = 0; start < numJobs; start = end + 1) {
+        for (end = start; end < numJobs && jobs[end].fScript->fHistoryOrder; end++)
+            ;
+        for (i = start + 1; i < end; i++) {
+            for (j = i; j > start && priority[order[j - 1]] < priority[order[j]]; j--) {
+                swap = order[j];
+                order[j] = order[j - 1];
+                order[j - 1] = swap;
+                moved = true;
+            }
+        }
+    }
+    free(priority);
+    
+    if (moved) {
+        names[0] = '\0';
+        length = 0;
+        for (i = 0; i < numJobs && length < sizeof(names); i++) {
+            length += (size_t)snprintf(names + length, sizeof(names) - length, "%s%s",
+                                       i > 0 ? ", " : "", jobs[order[i]].fScript->fName);
+        }
+        LogMessage(logClient, LOG_DEBUG, "Ordered by history: %s", names);
+    }
+}
+
+/// Run all jobs of a phase, at most MaxConcurrentScripts at a time.
+///
+/// Jobs are started in the given order, or name order, as soon as their
+/// dependencies have finished and a slot in the plugin-wide pool is free, so concurrent
+/// logins share MaxTotalScripts fairly. Interactive jobs are considered
+/// before the others and background jobs last, and each lsp-qos class is
+/// held to its own limit, like MaxBackgroundScripts. A single loop
+/// supervises all running children of the phase. The first
+/// job that denies authorization cancels the rest of the phase: pending jobs
+/// are skipped and running ones are terminated.
+///
+/// The loop also acts as a watchdog. A job that runs past its lsp-timeout,
+/// or is still running when the phase runs out of PhaseTimeout, is sent
+/// SIGTERM and then SIGKILL after TimeoutGracePeriod, and its result is
+/// decided by its lsp-on-timeout policy.
+///
+/// lsp-overlap jobs are left running in overlap if it's given.
+static AuthorizationResult RunScripts(ScriptJob *jobs,
+                                      size_t numJobs,
+                                      const size_t *order,
+                                      PluginRecord *plugin,
+                                      const PluginSettings *settings,
+                                      uid_t uid,
+                                      gid_t gid,
+                                      const char *home,
+                                      userContext context,
+                                      const LoginContext *login,
+                                      OverlapGroup *overlap,
+                                      Logger *logClient)
+{
+    static const uint32_t classOrder[kNumScriptQoS] = {
+        kScriptQoSInteractive, kScriptQoSDefault, kScriptQoSBackground
+    };
+    AuthorizationResult result;
+    AuthorizationResult jobResult;
+    ChildWatcher watcher;
+    PoolClient pool;
+    ResultCache cache;
+    ScriptJob *job;
+    size_t pending;
+    size_t running;
+    size_t classRunning[kNumScriptQoS];
+    size_t reaped;
+    size_t i;
+    size_t c;
+    uint32_t qos;
+    int childStatus;
+    int reapErrno;
+    pid_t pid;
+    uint64_t now;
+    uint64_t phaseDeadline;
+    uint64_t wakeup;
+    int timeoutMs;
+    bool phaseTimedOut;
+    bool throttled;
+    
+    result = kAuthorizationResultAllow;
+    pending = 0;
+    running = 0;
+    memset(classRunning, 0, sizeof(classRunning));
+    phaseTimedOut = false;
+    for (i = 0; i < numJobs; i++) {
+        if (jobs[i].fState == kScriptPending) {
+            pending++;
+        }
+    }
+    phaseDeadline = 0;
+    if (settings->fPhaseTimeout > 0) {
+        phaseDeadline = MonotonicTime() + (uint64_t)settings->fPhaseTimeout * kMicrosPerSecond;
+    }
+    
+    memset(&cache, 0, sizeof(cache));
+    PoolJoin(plugin, &pool);
+    ChildWatcherInit(&watcher, numJobs, pool.fWakePipe[0]);
+    
+    while (pending > 0 || running > 0) {
+        
+        // Start every job that's ready, up to the concurrency limits, a
+        // class at a time.
+        throttled = false;
+        for (c = 0; c < kNumScriptQoS && ! throttled; c++) {
+            for (i = 0; i < numJobs && pending > 0 && running < (size_t)settings->fMaxConcurrentScripts; i++) {
+                job = &jobs[order != NULL ? order[i] : i];
+                qos = job->fScript->fQoS.fClass;
+                if (qos != classOrder[c] || job->fState != kScriptPending || ! DependenciesFinished(jobs, job)) {
+                    continue;
+                }
+                if (settings->fMaxClassScripts[qos] > 0 && classRunning[qos] >= (size_t)settings->fMaxClassScripts[qos]) {
+                    break;
+                }
+                if (! PoolAcquire(plugin, &pool, settings->fMaxTotalScripts)) {
+                    throttled = true;
+                    break;
+                }
+                pending--;
+                if (StartJob(job, &watcher, &running, plugin, settings, uid, gid, home, context, login, overlap, &cache, logClient) != kAuthorizationResultAllow) {
+                    result = kAuthorizationResultDeny;
+                    CancelPhase(jobs, numJobs, settings, logClient);
+                    pending = 0;
+                }
+                if (job->fState != kScriptRunning) {
+                    PoolRelease(plugin, &pool);
+                } else {
+                    classRunning[qos]++;
+                }
+            }
+        }
+        
+        // If nothing is running but jobs are still pending, and none of
+        // them became ready as jobs finished during the pass above (like
+        // detached or failed ones), their dependencies can never finish.
+        // Break the cycle in name order.
+        if (running == 0 && pending > 0 && ! throttled) {
+            for (i = 0; i < numJobs; i++) {
+                if (jobs[i].fState == kScriptPending && DependenciesFinished(jobs, &jobs[i])) {
+                    break;
+                }
+            }
+            if (i < numJobs) {
+                continue;
+            }
+            for (i = 0; jobs[i].fState != kScriptPending; i++)
+                ;
+            if (PoolAcquire(plugin, &pool, settings->fMaxTotalScripts)) {
+                LogMessage(logClient, LOG_ERR,
+                           "Dependency cycle detected, starting %s anyway", jobs[i].fScript->fName);
+                pending--;
+                if (StartJob(&jobs[i], &watcher, &running, plugin, settings, uid, gid, home, context, login, overlap, &cache, logClient) != kAuthorizationResultAllow) {
+                    result = kAuthorizationResultDeny;
+                    CancelPhase(jobs, numJobs, settings, logClient);
+                    pending = 0;
+                }
+                if (jobs[i].fState != kScriptRunning) {
+                    PoolRelease(plugin, &pool);
+                } else {
+                    classRunning[jobs[i].fScript->fQoS.fClass]++;
+                }
+                continue;
+            }
+            throttled = true;
+        }
+        if (! throttled && pool.fWaitingSince != 0) {
+            PoolStopWaiting(plugin, &pool);
+        }
+        
+        // Reap finished children.
+        reaped = 0;
+        for (i = 0; i < numJobs; i++) {
+            job = &jobs[i];
+            if (job->fState != kScriptRunning) {
+                continue;
+            }
+            CaptureRead(job, logClient);
+            pid = ReapJob(job, &childStatus);
+            if (pid == 0 || (pid == -1 && errno == EINTR)) {
+                continue;
+            }
+            reapErrno = errno;
+            
+            job->fState = kScriptFinished;
+            job->fEndTime = MonotonicTime();
+            CaptureClose(job, logClient);
+            ChildWatcherRemove(&watcher, job);
+            PoolRelease(plugin, &pool);
+            classRunning[job->fScript->fQoS.fClass]--;
+            running--;
+            reaped++;
+            if (pid == -1) {
+                // There's no telling whether the script would have denied,
+                // so a gatekeeper can't be bypassed by losing its status.
+                LogMessage(logClient, LOG_ERR,
+                           "Lost the exit status of %s, errno %d, denying authorization",
+                           job->fScript->fPath, reapErrno);
+                if (result == kAuthorizationResultAllow) {
+                    result = kAuthorizationResultDeny;
+                    CancelPhase(jobs, numJobs, settings, logClient);
+                    pending = 0;
+                }
+                continue;
+            }
+            LogScriptUsage(job, NULL, logClient);
+            
+            if (job->fTimedOut) {
+                jobResult = job->fScript->fTimeoutPolicy;
+                LogMessage(logClient, LOG_NOTICE,
+                           "%s timed out, %s authorization", job->fScript->fPath,
+                           jobResult == kAuthorizationResultAllow ? "allowing" : "denying");
+            } else {
+                jobResult = ScriptResult(job->fScript->fPath, childStatus, logClient);
+                if (job->fScript->fCache && WIFEXITED(childStatus) && WEXITSTATUS(childStatus) == 0) {
+                    ResultCacheStore(&cache, job->fScript, uid, logClient);
+                }
+            }
+            StatsRecordJob(plugin, job, childStatus, jobResult);
+            if (jobResult != kAuthorizationResultAllow && result == kAuthorizationResultAllow) {
+                result = kAuthorizationResultDeny;
+                CancelPhase(jobs, numJobs, settings, logClient);
+                pending = 0;
+            }
+        }
+        if (reaped > 0 || (running == 0 && ! throttled)) {
+            continue;
+        }
+        
+        // Enforce deadlines, and figure out when the next one is due.
+        now = MonotonicTime();
+        if (phaseDeadline != 0 && now >= phaseDeadline && !phaseTimedOut) {
+            LogMessage(logClient, LOG_ERR,
+                       "Phase timed out after %ld seconds", settings->fPhaseTimeout);
+            phaseTimedOut = true;
+            if (SkipPendingJobs(jobs, numJobs, true, logClient) != kAuthorizationResultAllow) {
+                result = kAuthorizationResultDeny;
+            }
+            pending = 0;
+        }
+        wakeup = phaseTimedOut ? 0 : phaseDeadline;
+        for (i = 0; i < numJobs; i++) {
+            job = &jobs[i];
+            if (job->fState != kScriptRunning) {
+                continue;
+            }
+            if (!job->fTimedOut && job->fKillTime == 0
+                && (phaseTimedOut || (job->fDeadline != 0 && now >= job->fDeadline))) {
+                LogMessage(logClient, LOG_ERR,
+                           "%s timed out, sending SIGTERM", job->fScript->fPath);
+                job->fTimedOut = true;
+                TerminateJob(job, now, settings);
+            } else if (job->fKillTime != 0 && now >= job->fKillTime) {
+                LogMessage(logClient, LOG_ERR,
+                           "%s still running %ld seconds after SIGTERM, sending SIGKILL",
+                           job->fScript->fPath, settings->fTimeoutGracePeriod);
+                SignalJob(job, SIGKILL);
+                job->fKillTime = UINT64_MAX;
+            }
+            if (job->fKillTime != 0 && job->fKillTime != UINT64_MAX) {
+                if (wakeup == 0 || job->fKillTime < wakeup) {
+                    wakeup = job->fKillTime;
+                }
+            } else if (job->fKillTime == 0 && job->fDeadline != 0) {
+                if (wakeup == 0 || job->fDeadline < wakeup) {
+                    wakeup = job->fDeadline;
+                }
+            }
+        }
+        
+        if (wakeup == 0) {
+            timeoutMs = -1;
+        } else if (wakeup <= now) {
+            timeoutMs = 0;
+        } else {
+            // Round up so we don't wake up just before the deadline.
+            timeoutMs = (int)MIN((wakeup - now + 999) / 1000, INT_MAX);
+        }
+        if (throttled && pool.fWakePipe[0] == -1 && (timeoutMs < 0 || timeoutMs > kChildPollInterval)) {
+            timeoutMs = kChildPollInterval;
+        }
+        ChildWatcherWait(&watcher, jobs, numJobs, timeoutMs);
+    }
+    
+    ChildWatcherDestroy(&watcher);
+    PoolLeave(plugin, &pool);
+    ResultCacheFlush(plugin, &cache, logClient);
+    
+    return result;
+}
+
+#pragma mark *     Tracing
+
+/// Append a JSON string, escaped and quoted, to buffer.
+///
+/// The string is truncated rather than the escaping, so buffer always
+/// holds valid JSON.
+static void AppendJSONString(char *buffer, size_t size, const char *str)
+{
+    size_t len;
+    char escaped[8];
+    
+    len = strlen(buffer);
+    if (len + 3 > size) {
+        return;
+    }
+    buffer[len++] = '"';
+    for (; *str != '\0'; str++) {
+        if (*str == '"' || *str == '\\') {
+            snprintf(escaped, sizeof(escaped), "\\%c", *str);
+        } else if ((unsigned char)*str < 0x20) {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)*str);
+        } else {
+            escaped[0] = *str;
+            escaped[1] = '\0';
+        }
+        if (len + strlen(escaped) + 2 > size) {
+            break;
+        }
+        memcpy(buffer + len, escaped, strlen(escaped));
+        len += strlen(escaped);
+    }
+    buffer[len++] = '"';
+    buffer[len] = '\0';
+}
+
+/// Append a "key": "value" member to the args of a trace event.
+static void TraceArg(char *args, size_t size, const char *key, const char *value)
+{
+    if (args[0] != '\0') {
+        strlcat(args, ", ", size);
+    }
+    AppendJSONString(args, size, key);
+    strlcat(args, ": ", size);
+    AppendJSONString(args, size, value);
+}
+
+/// Add an event to a trace.
+///
+/// Events that don't fit are dropped, tracing never fails a login.
+static TraceEvent *TraceAddEvent(LoginTrace *trace,
+                                 char phase,
+                                 const char *category,
+                                 const char *name,
+                                 int tid,
+                                 uint64_t start,
+                                 uint64_t end)
+{
+    TraceEvent *events;
+    TraceEvent *event;
+    size_t maxEvents;
+    
+    if (trace->fNumEvents == trace->fMaxEvents) {
+        maxEvents = trace->fMaxEvents ? 2 * trace->fMaxEvents : 64;
+        events = realloc(trace->fEvents, maxEvents * sizeof(*events));
+        if (events == NULL) {
+            return NULL;
+        }
+        trace->fEvents = events;
+        trace->fMaxEvents = maxEvents;
+    }
+    event = &trace->fEvents[trace->fNumEvents++];
+    event->fPhase = phase;
+    event->fCategory = category;
+    strlcpy(event->fName, name, sizeof(event->fName));
+    event->fTid = tid;
+    event->fStart = start;
+    event->fEnd = end;
+    event->fArgs[0] = '\0';
+    return event;
+}
+
+/// Find the trace of the login that engine belongs to, or start a new one.
+///
+/// @return the trace, to be released with ReleaseLoginTrace(), or NULL.
+static LoginTrace *AcquireLoginTrace(PluginRecord *plugin, AuthorizationEngineRef engine, uid_t uid)
+{
+    LoginTrace *trace;
+    TraceEvent *event;
+    struct tm now;
+    time_t t;
+    
+    pthread_mutex_lock(&plugin->fTraceLock);
+    for (trace = plugin->fTraces; trace != NULL; trace = trace->fNext) {
+        if (trace->fEngine == engine) {
+            break;
+        }
+    }
+    if (trace == NULL && (trace = calloc(1, sizeof(*trace))) != NULL) {
+        trace->fEngine = engine;
+        t = time(NULL);
+        localtime_r(&t, &now);
+        snprintf(trace->fFileName, sizeof(trace->fFileName),
+                 "login-%u-%04d%02d%02d-%02d%02d%02d-%d.json", (unsigned)uid,
+                 now.tm_year + 1900, now.tm_mon + 1, now.tm_mday,
+                 now.tm_hour, now.tm_min, now.tm_sec, getpid());
+        if ((event = TraceAddEvent(trace, 'M', NULL, "thread_name", 0, 0, 0)) != NULL) {
+            TraceArg(event->fArgs, sizeof(event->fArgs), "name", "LoginScriptPlugin");
+        }
+        trace->fNext = plugin->fTraces;
+        plugin->fTraces = trace;
+    }
+    if (trace != NULL) {
+        trace->fRefCount++;
+    }
+    pthread_mutex_unlock(&plugin->fTraceLock);
+    
+    return trace;
+}
+
+/// Drop a reference to a trace, freeing it when the login is done with it.
+static void ReleaseLoginTrace(PluginRecord *plugin, LoginTrace *trace)
+{
+    LoginTrace **link;
+    
+    pthread_mutex_lock(&plugin->fTraceLock);
+    if (--trace->fRefCount == 0) {
+        for (link = &plugin->fTraces; *link != trace; link = &(*link)->fNext)
+            ;
+        *link = trace->fNext;
+        free(trace->fEvents);
+        free(trace);
+    }
+    pthread_mutex_unlock(&plugin->fTraceLock);
+}
+
+/// Add the spans of a script index build to a trace.
+static void TraceScriptIndex(LoginTrace *trace, const ScriptIndex *index)
+{
+    const ScriptEntry *script;
+    TraceEvent *event;
+    size_t bucket;
+    size_t i;
+    
+    TraceAddEvent(trace, 'X', "index", "BuildScriptIndex", 0, index->fBuildStart, index->fBuildEnd);
+    for (bucket = 0; bucket < kNumScriptBuckets; bucket++) {
+        for (i = 0; i < index->fNumScripts[bucket]; i++) {
+            script = &index->fScripts[bucket][i];
+            event = TraceAddEvent(trace, 'X', "verify", "VerifyScript", 0, script->fVerifyStart, script->fVerifyEnd);
+            if (event != NULL) {
+                TraceArg(event->fArgs, sizeof(event->fArgs), "script", script->fName);
+                TraceArg(event->fArgs, sizeof(event->fArgs), "result", script->fFD != -1 ? "ok" : "failed");
+            }
+        }
+    }
+}
+
+/// Add the spans of the jobs of a phase to a trace, and work out which of
+/// them gated the phase.
+///
+/// The critical path is traced backwards from the job that finished last:
+/// a job was held back by whichever job finished last before it was
+/// launched, be it a dependency or a job occupying a slot, and jobs
+/// launched before any job finished weren't held back at all.
+///
+/// @param phaseStart   When the phase started running scripts.
+/// @param phaseEnd     When the last script of the phase finished.
+static void TraceScriptJobs(LoginTrace *trace,
+                            const char *mechanismName,
+                            const ScriptJob *jobs,
+                            size_t numJobs,
+                            userContext context,
+                            uint64_t phaseStart,
+                            uint64_t phaseEnd,
+                            Logger *logClient)
+{
+    const ScriptJob *job;
+    const ScriptJob *prev;
+    const ScriptJob **path;
+    TraceEvent *event;
+    char summary[sizeof(trace->fCriticalPath)];
+    char span[MAXNAMLEN + 32];
+    char usage[32];
+    size_t pathLen;
+    size_t i;
+    size_t j;
+    int tid;
+    
+    path = calloc(numJobs, sizeof(*path));
+    if (path == NULL) {
+        return;
+    }
+    
+    // Walk the critical path backwards.
+    pathLen = 0;
+    job = NULL;
+    for (i = 0; i < numJobs; i++) {
+        if (jobs[i].fLaunchTime != 0 && (job == NULL || jobs[i].fEndTime > job->fEndTime)) {
+            job = &jobs[i];
+        }
+    }
+    while (job != NULL && pathLen < numJobs) {
+        path[pathLen++] = job;
+        prev = NULL;
+        for (i = 0; i < numJobs; i++) {
+            if (&jobs[i] != job
+                && jobs[i].fLaunchTime != 0
+                && jobs[i].fEndTime <= job->fLaunchTime
+                && (prev == NULL || jobs[i].fEndTime > prev->fEndTime)) {
+                prev = &jobs[i];
+            }
+        }
+        job = prev;
+    }
+    
+    summary[0] = '\0';
+    snprintf(summary, sizeof(summary), "%s:", mechanismName);
+    for (i = pathLen; i > 0; i--) {
+        snprintf(span, sizeof(span), "%s %s %.2fs", i == pathLen ? "" : " >",
+                 path[i - 1]->fScript->fName,
+                 (double)(path[i - 1]->fEndTime - path[i - 1]->fLaunchTime) / kMicrosPerSecond);
+        strlcat(summary, span, sizeof(summary));
+    }
+    snprintf(span, sizeof(span), "%s(phase %.2fs)", pathLen > 0 ? " " : " no scripts ",
+             (double)(phaseEnd - phaseStart) / kMicrosPerSecond);
+    strlcat(summary, span, sizeof(summary));
+    LogMessage(logClient, LOG_INFO, "Critical path %s", summary);
+    
+    if (trace->fCriticalPath[0] != '\0') {
+        strlcat(trace->fCriticalPath, "; ", sizeof(trace->fCriticalPath));
+    }
+    strlcat(trace->fCriticalPath, summary, sizeof(trace->fCriticalPath));
+    
+    // Each script gets its own row, named after it and identified by pid.
+    for (i = 0; i < numJobs; i++) {
+        job = &jobs[i];
+        if (job->fLaunchTime == 0) {
+            event = TraceAddEvent(trace, 'i', "script", job->fScript->fName, 0, phaseEnd, phaseEnd);
+            if (event != NULL) {
+                TraceArg(event->fArgs, sizeof(event->fArgs), "state",
+                         job->fCached ? "cached" : job->fScript->fFD == -1 ? "unverified" : "skipped");
+            }
+            continue;
+        }
+        tid = job->fPid > 0 ? job->fPid : 0;
+        if (tid != 0 && (event = TraceAddEvent(trace, 'M', NULL, "thread_name", tid, 0, 0)) != NULL) {
+            TraceArg(event->fArgs, sizeof(event->fArgs), "name", job->fScript->fName);
+        }
+        event = TraceAddEvent(trace, 'X', "script", job->fScript->fName, tid, job->fLaunchTime, job->fEndTime);
+        if (event != NULL) {
+            for (j = 0; j < pathLen && path[j] != job; j++)
+                ;
+            TraceArg(event->fArgs, sizeof(event->fArgs), "mechanism", mechanismName);
+            TraceArg(event->fArgs, sizeof(event->fArgs), "critical", j < pathLen ? "yes" : "no");
+            if (job->fTimedOut) {
+                TraceArg(event->fArgs, sizeof(event->fArgs), "timedOut", "yes");
+            }
+            if (job->fScript->fAsync) {
+                TraceArg(event->fArgs, sizeof(event->fArgs), "async", "yes");
+            }
+            if (job->fScript->fQoS.fClass != kScriptQoSDefault) {
+                TraceArg(event->fArgs, sizeof(event->fArgs), "qos",
+                         job->fScript->fQoS.fClass == kScriptQoSInteractive ? "interactive" : "background");
+            }
+            if (job->fHaveUsage) {
+                snprintf(usage, sizeof(usage), "%.3f",
+                         (double)(job->fUsage.fUserTime + job->fUsage.fSystemTime) / kMicrosPerSecond);
+                TraceArg(event->fArgs, sizeof(event->fArgs), "cpuSeconds", usage);
+                snprintf(usage, sizeof(usage), "%llu", (unsigned long long)job->fUsage.fMaxRSS);
+                TraceArg(event->fArgs, sizeof(event->fArgs), "maxResidentKB", usage);
+            }
+        }
+        TraceAddEvent(trace, 'X', "launch", LaunchUsesSpawn(context, job->fContained) ? "spawn" : "fork",
+                      tid, job->fLaunchTime, job->fStartTime);
+        if (job->fPid > 0) {
+            TraceAddEvent(trace, 'X', "wait", "wait", tid, job->fStartTime, job->fEndTime);
+        }
+    }
+    
+    free(path);
+}
+
+/// Write a trace to directory as Chrome trace event JSON, which can be
+/// opened with chrome://tracing or Perfetto.
+///
+/// The file is written under a temporary name and renamed into place, so
+/// readers never see a partial trace.
+static void WriteLoginTrace(const LoginTrace *trace, const char *directory, Logger *logClient)
+{
+    char tmpName[sizeof(trace->fFileName) + 4];
+    char name[2 * sizeof(((TraceEvent *)NULL)->fName)];
+    char criticalPath[2 * sizeof(trace->fCriticalPath)];
+    const TraceEvent *event;
+    FILE *file;
+    size_t i;
+    int dirFD;
+    int fd;
+    bool ok;
+    
+    dirFD = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFD == -1) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Can't open trace directory %s, errno %d", directory, errno);
+        return;
+    }
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", trace->fFileName);
+    unlinkat(dirFD, tmpName, 0);
+    fd = openat(dirFD, tmpName, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd == -1 || (file = fdopen(fd, "w")) == NULL) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Can't create trace %s/%s, errno %d", directory, tmpName, errno);
+        if (fd != -1) {
+            close(fd);
+        }
+        close(dirFD);
+        return;
+    }
+    
+    criticalPath[0] = '\0';
+    AppendJSONString(criticalPath, sizeof(criticalPath), trace->fCriticalPath);
+    fprintf(file, "{\"displayTimeUnit\": \"ms\",\n\"otherData\": {\"criticalPath\": %s},\n\"traceEvents\": [", criticalPath);
+    for (i = 0; i < trace->fNumEvents; i++) {
+        event = &trace->fEvents[i];
+        name[0] = '\0';
+        AppendJSONString(name, sizeof(name), event->fName);
+        fprintf(file, "%s\n{\"name\": %s, \"ph\": \"%c\", \"pid\": %d, \"tid\": %d",
+                i == 0 ? "" : ",", name, event->fPhase, getpid(), event->fTid);
+        if (event->fCategory != NULL) {
+            fprintf(file, ", \"cat\": \"%s\"", event->fCategory);
+        }
+        if (event->fPhase != 'M') {
+            fprintf(file, ", \"ts\": %llu", (unsigned long long)event->fStart);
+        }
+        if (event->fPhase == 'X') {
+            fprintf(file, ", \"dur\": %llu", (unsigned long long)(event->fEnd - event->fStart));
+        }
+        fprintf(file, ", \"args\": {%s}}", event->fArgs);
+    }
+    fprintf(file, "\n]}\n");
+    
+    ok = !ferror(file);
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+    if (!ok || renameat(dirFD, tmpName, dirFD, trace->fFileName) != 0) {
+        LogMessage(logClient, LOG_WARNING,
+                   "Can't write trace %s/%s, errno %d", directory, trace->fFileName, errno);
+        unlinkat(dirFD, tmpName, 0);
+    }
+    close(dirFD);
+}
+
+
+#pragma mark *     Overhead
+
+/// Sort order for uint64_t.
+static int CompareUInt64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    
+    return x < y ? -1 : x > y;
+}
+
+/// The time during which at least one script of a phase was running,
+/// that is the union of their wait spans.
+static uint64_t ScriptRunTime(const ScriptJob *jobs, size_t numJobs)
+{
+    uint64_t (*spans)[2];
+    uint64_t total;
+    uint64_t end;
+    size_t numSpans;
+    size_t i;
+    
+    spans = calloc(numJobs, sizeof(*spans));
+    if (spans == NULL) {
+        return 0;
+    }
+    numSpans = 0;
+    for (i = 0; i < numJobs; i++) {
+        if (jobs[i].fLaunchTime != 0 && jobs[i].fPid > 0) {
+            spans[numSpans][0] = jobs[i].fStartTime;
+            spans[numSpans][1] = jobs[i].fEndTime;
+            numSpans++;
+        }
+    }
+    qsort(spans, numSpans, sizeof(*spans), CompareUInt64);
+    
+    total = 0;
+    end = 0;
+    for (i = 0; i < numSpans; i++) {
+        if (spans[i][1] <= end) {
+            continue;
+        }
+        total += spans[i][1] - MAX(spans[i][0], end);
+        end = spans[i][1];
+    }
+    free(spans);
+    return total;
+}
+
+/// Record the plugin's own overhead for a mechanism, and log it along with
+/// percentiles over the last kOverheadSamples invocations.
+///
+/// Overhead is the time spent in MechanismInvoke while no script was
+/// running: looking up the context, verifying and indexing scripts,
+/// launching them, and reaping them.
+static void RecordOverhead(PluginRecord *plugin, const char *mechanismName, uint64_t overhead, uint64_t total)
+{
+    uint64_t sorted[kOverheadSamples];
+    size_t numSamples;
+    
+    pthread_mutex_lock(&plugin->fOverheadLock);
+    plugin->fOverhead[plugin->fNumOverhead++ % kOverheadSamples] = overhead;
+    numSamples = MIN(plugin->fNumOverhead, (size_t)kOverheadSamples);
+    memcpy(sorted, plugin->fOverhead, numSamples * sizeof(*sorted));
+    pthread_mutex_unlock(&plugin->fOverheadLock);
+    
+    qsort(sorted, numSamples, sizeof(*sorted), CompareUInt64);
+    LogMessage(plugin->fLogClient, LOG_INFO,
+               "%s: plugin overhead %.3f ms of %.3f ms (p50 %.3f, p90 %.3f, p99 %.3f ms over %zu invocations)",
+               mechanismName, overhead / 1000.0, total / 1000.0,
+               sorted[numSamples * 50 / 100] / 1000.0,
+               sorted[numSamples * 90 / 100] / 1000.0,
+               sorted[numSamples * 99 / 100] / 1000.0,
+               numSamples);
+}
+
+
+#pragma mark *     Health
+
+/// Count the children of this process that have exited but haven't been
+/// reaped.
+static size_t CountZombieChildren(void)
+{
+    size_t zombies;
+#if defined(__APPLE__)
+    pid_t pids[1024];
+    struct proc_bsdinfo info;
+    int count;
+    int i;
+    
+    zombies = 0;
+    count = proc_listchildpids(getpid(), pids, sizeof(pids));
+    for (i = 0; i < count && i < (int)(sizeof(pids) / sizeof(*pids)); i++) {
+        if (proc_pidinfo(pids[i], PROC_PIDTBSDINFO, 0, &info, sizeof(info)) == sizeof(info)
+            && info.pbi_status == SZOMB) {
+            zombies++;
+        }
+    }
+#else
+    DIR *dir;
+    struct dirent *entry;
+    char path[NAME_MAX + sizeof("/stat")];
+    char buf[512];
+    char *p;
+    char state;
+    long ppid;
+    ssize_t len;
+    int fd;
+    
+    zombies = 0;
+    dir = opendir("/proc");
+    if (dir == NULL) {
+        return 0;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (! isdigit((unsigned char)entry->d_name[0])) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/stat", entry->d_name);
+        if ((fd = openat(dirfd(dir), path, O_RDONLY | O_CLOEXEC)) == -1) {
+            continue;
+        }
+        len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (len <= 0) {
+            continue;
+        }
+        buf[len] = '\0';
+        // The command name may contain anything, so parse from its end.
+        if ((p = strrchr(buf, ')')) != NULL
+            && sscanf(p + 1, " %c %ld", &state, &ppid) == 2
+            && ppid == (long)getpid()
+            && state == 'Z') {
+            zombies++;
+        }
+    }
+    closedir(dir);
+#endif
+    return zombies;
+}
+
+/// The resident size of this process in bytes, or 0 if it's not known.
+static uint64_t ResidentSize(void)
+{
+#if defined(__APPLE__)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count;
+    
+    count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) {
+        return 0;
+    }
+    return info.resident_size;
+#else
+    char buf[128];
+    unsigned long size;
+    unsigned long resident;
+    ssize_t len;
+    int fd;
+    
+    if ((fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC)) == -1) {
+        return 0;
+    }
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    buf[len] = '\0';
+    if (sscanf(buf, "%lu %lu", &size, &resident) != 2) {
+        return 0;
+    }
+    return (uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+/// Check the plugin for leaks after a mechanism has run, when debug
+/// messages are logged.
+///
+/// The authorization host keeps the plugin loaded for many logins, so a
+/// descriptor, child or allocation that leaks once per login adds up.
+/// The first check after kHealthWarmup invocations, when the index,
+/// supervisor and launcher have settled, sets the baseline: the number of
+/// descriptors and the resident size. Growing kHealthFDSlack descriptors past it, or to
+/// twice its size, is warned about, and the baseline moves up so the
+/// warning only repeats if the growth continues. That's coarse enough not
+/// to cry wolf on a production host; lsp-soak in the harness is what
+/// actually tests for leaks.
+static void CheckHealth(PluginRecord *plugin, const char *mechanismName)
+{
+    int *fds;
+    size_t numFDs;
+    size_t zombies;
+    uint64_t rss;
+    bool fdsGrew;
+    bool rssGrew;
+    
+    if (LOG_DEBUG > MAX_LOG_LEVEL || LoggerLevel(plugin->fLogClient) < LOG_DEBUG) {
+        return;
+    }
+    numFDs = 0;
+    fds = ListOpenFDs(&numFDs);
+    free(fds);
+    zombies = CountZombieChildren();
+    rss = ResidentSize();
+    
+    pthread_mutex_lock(&plugin->fOverheadLock);
+    if (plugin->fBaselineFDs == 0 && plugin->fNumOverhead >= kHealthWarmup) {
+        plugin->fBaselineFDs = numFDs;
+        plugin->fBaselineRSS = rss;
+    }
+    fdsGrew = plugin->fBaselineFDs != 0 && numFDs > plugin->fBaselineFDs + kHealthFDSlack;
+    rssGrew = plugin->fBaselineRSS != 0 && rss > 2 * plugin->fBaselineRSS;
+    if (fdsGrew) {
+        plugin->fBaselineFDs = numFDs;
+    }
+    if (rssGrew) {
+        plugin->fBaselineRSS = rss;
+    }
+    pthread_mutex_unlock(&plugin->fOverheadLock);
+    
+    LogMessage(plugin->fLogClient, LOG_DEBUG,
+               "%s: %zu descriptors open, %zu unreaped children, %llu KB resident",
+               mechanismName, numFDs, zombies, (unsigned long long)(rss / 1024));
+    if (fdsGrew) {
+        LogMessage(plugin->fLogClient, LOG_WARNING,
+                   "%zu descriptors are open, the plugin may be leaking them", numFDs);
+    }
+    if (rssGrew) {
+        LogMessage(plugin->fLogClient, LOG_WARNING,
+                   "The resident size has doubled to %llu KB, the plugin may be leaking memory",
+                   (unsigned long long)(rss / 1024));
+    }
+}
+
+
+#define NOBODY -2
+
+/// Called by the system to invoke a mechanism.
+///
+/// This executes a premount or postmount script, either as root or as the user.
+static OSStatus MechanismInvoke(AuthorizationMechanismRef inMechanism)
+{
+    OSStatus err;
+    MechanismRecord *mechanism;
+    
+    AuthorizationResult result;
+    
+    uid_t uid;
+    gid_t gid;
+    char *home;
+    AuthorizationContextFlags authContextFlags;
+    const AuthorizationValue *value;
+    
+    ScriptIndex *index;
+    ScriptJob *jobs;
+    size_t *order;
+    size_t bucket;
+    size_t numJobs;
+    size_t i;
+    bool built;
+    bool warming;
+    
+    LoginTrace *trace;
+    TraceEvent *event;
+    char overheadStr[32];
+    uint64_t overhead;
+    uint64_t invokeStart;
+    uint64_t invokeEnd;
+    uint64_t contextEnd;
+    uint64_t joinEnd;
+    uint64_t indexEnd;
+    uint64_t rulesEnd;
+    uint64_t runStart;
+    uint64_t runEnd;
+    uint64_t waitStart;
+    uint64_t waitEnd;
+    
+    mechanism = (MechanismRecord *) inMechanism;
+    LogMessage(mechanism->fPlugin->fLogClient, LOG_DEBUG, "LoginScriptPlugin:MechanismInvoke: inMechanism=%p", inMechanism);
+    assert(MechanismValid(mechanism));
     
     result = kAuthorizationResultAllow;
+    invokeStart = MonotonicTime();
     
     // Retrieve values from the authorization context.
     uid = NOBODY;
@@ -472,42 +7611,176 @@ static OSStatus MechanismInvoke(AuthorizationMechanismRef inMechanism)
         if ((value->length > 0) && (((const char *) value->data)[value->length - 1] == 0)) {
             home = value->data;
         } else {
-            asl_log(mechanism->fPlugin->fLogClient, NULL, ASL_LEVEL_WARNING,
-                    "GetContextValue didn't return a zero terminated string for home");
+            LogMessage(mechanism->fPlugin->fLogClient, LOG_WARNING,
+                       "GetContextValue didn't return a zero terminated string for home");
         }
     }
+    contextEnd = MonotonicTime();
     
-    if (uid == NOBODY || gid == NOBODY) {
-        asl_log(mechanism->fPlugin->fLogClient, NULL, ASL_LEVEL_WARNING,
-                "Can't execute script, uid lookup failed");
+    // Postmount starts by waiting for the lsp-overlap scripts that premount
+    // left running, and applying their results.
+    joinEnd = contextEnd;
+    if (mechanism->fPhase == kRunAfterHomedirMount) {
+        result = JoinOverlapGroup(mechanism->fPlugin, mechanism->fEngine, mechanism->fContext,
+                                  mechanism->fPlugin->fLogClient);
+        joinEnd = MonotonicTime();
+    }
+    
+    if (result != kAuthorizationResultAllow) {
+        LogMessage(mechanism->fPlugin->fLogClient, LOG_NOTICE,
+                   "Not executing scripts, an overlapped premount script denied authorization");
+    } else if (uid == NOBODY || gid == NOBODY) {
+        LogMessage(mechanism->fPlugin->fLogClient, LOG_WARNING,
+                   "Can't execute script, uid lookup failed");
     } else if (home == NULL) {
-        asl_log(mechanism->fPlugin->fLogClient, NULL, ASL_LEVEL_WARNING,
-                "Can't execute script, homedir lookup failed");
+        LogMessage(mechanism->fPlugin->fLogClient, LOG_WARNING,
+                   "Can't execute script, homedir lookup failed");
+    } else if ((index = AcquireScriptIndex(mechanism->fPlugin, &built)) == NULL) {
+        LogMessage(mechanism->fPlugin->fLogClient, LOG_WARNING,
+                   "Not executing scripts in %s", kLoginScriptDir);
     } else {
         
-        // Find all scripts matching the current phase and context, aborting if
-        // execution doesn't return kAuthorizationResultAllow.
-        snprintf(scriptPattern, sizeof(scriptPattern), "%s/%s-%s*",
-                 kLoginScriptDir,
-                 mechanism->fPhase == kRunBeforeHomedirMount ? "premount" : "postmount",
-                 mechanism->fContext == kRunAsRoot ? "root" : "user");
-        glob(scriptPattern, 0, NULL, &g);
-        for (i = 0; i < g.gl_pathc; i++) {
-            result = ExecuteScript(g.gl_pathv[i], uid, gid, home, mechanism->fContext, mechanism->fPlugin->fLogClient);
-            if (result != kAuthorizationResultAllow) {
-                break;
+        // Rules are applied first, and a rule that denies authorization
+        // saves forking any scripts.
+        indexEnd = MonotonicTime();
+        bucket = ScriptBucket(mechanism->fPhase, mechanism->fContext);
+        result = EvaluateRules(index, bucket, mechanism->fPlugin, mechanism->fEngine,
+                               uid, gid, mechanism->fPlugin->fLogClient);
+        rulesEnd = MonotonicTime();
+        
+        // The first postmount mechanism of a login starts reading ahead the
+        // home directory, which goes on while the scripts run.
+        warming = false;
+        if (result == kAuthorizationResultAllow && mechanism->fPhase == kRunAfterHomedirMount
+            && mechanism->fWarmup == NULL && index->fWarmupList != NULL && index->fSettings.fWarmupBudget > 0) {
+            mechanism->fWarmup = AcquireWarmupJob(mechanism->fPlugin, mechanism->fEngine, &index->fSettings,
+                                                  index->fWarmupList, uid, home, &warming,
+                                                  mechanism->fPlugin->fLogClient);
+        }
+        
+        // Run all scripts matching the current phase and context, aborting
+        // the phase if one doesn't return kAuthorizationResultAllow. The
+        // index has already verified and sorted them.
+        numJobs = index->fNumScripts[bucket];
+        jobs = NULL;
+        runStart = runEnd = rulesEnd;
+        if (result != kAuthorizationResultAllow) {
+            StatsRecord(mechanism->fPlugin, kStatsKindPhase, kScriptPrefixes[bucket], rulesEnd - indexEnd,
+                        kStatsDenied, "denied by a rule");
+        } else if (numJobs > 0) {
+            jobs = calloc(numJobs, sizeof(*jobs));
+            if (jobs == NULL) {
+                LogMessage(mechanism->fPlugin->fLogClient, LOG_ERR,
+                           "Job allocation failed");
+            } else {
+                for (i = 0; i < numJobs; i++) {
+                    jobs[i].fScript = &index->fScripts[bucket][i];
+                    jobs[i].fWatchFD = -1;
+                    jobs[i].fOutput[0].fFD = jobs[i].fOutput[1].fFD = jobs[i].fLogFD = jobs[i].fStatusFD = -1;
+                    if (jobs[i].fScript->fFD == -1) {
+                        LogMessage(mechanism->fPlugin->fLogClient, LOG_WARNING,
+                                   "Not executing %s", jobs[i].fScript->fPath);
+                        jobs[i].fState = kScriptFinished;
+                    } else {
+                        jobs[i].fState = kScriptPending;
+                    }
+                }
+                // lsp-overlap scripts in premount are left running for
+                // postmount to join.
+                if (mechanism->fPhase == kRunBeforeHomedirMount) {
+                    for (i = 0; i < numJobs && ! jobs[i].fScript->fOverlap; i++)
+                        ;
+                    if (i < numJobs) {
+                        if (mechanism->fOverlap != NULL) {
+                            ReleaseOverlapGroup(mechanism->fPlugin, mechanism->fOverlap);
+                        }
+                        mechanism->fOverlap = CreateOverlapGroup(mechanism->fPlugin, mechanism->fEngine,
+                                                                 mechanism->fContext, uid, &index->fSettings);
+                    }
+                }
+                
+                // The context is only gathered once a login has scripts to
+                // run, and then kept for the rest of its mechanisms.
+                if (mechanism->fLogin == NULL) {
+                    mechanism->fLogin = AcquireLoginContext(mechanism->fPlugin, mechanism->fEngine,
+                                                            uid, gid, home, mechanism->fPlugin->fLogClient);
+                }
+                if ((order = malloc(numJobs * sizeof(*order))) != NULL) {
+                    OrderJobs(mechanism->fPlugin, jobs, numJobs, order, mechanism->fPlugin->fLogClient);
+                }
+                runStart = MonotonicTime();
+                result = RunScripts(jobs, numJobs, order, mechanism->fPlugin, &index->fSettings,
+                                    uid, gid, home, mechanism->fContext, mechanism->fLogin,
+                                    mechanism->fOverlap, mechanism->fPlugin->fLogClient);
+                runEnd = MonotonicTime();
+                free(order);
+                for (i = 0; i < numJobs && ! jobs[i].fTimedOut; i++)
+                    ;
+                StatsRecord(mechanism->fPlugin, kStatsKindPhase, kScriptPrefixes[bucket], runEnd - runStart,
+                            result != kAuthorizationResultAllow ? kStatsDenied : i < numJobs ? kStatsTimedOut : kStatsSucceeded,
+                            result != kAuthorizationResultAllow ? "denied authorization" : i < numJobs ? "a script timed out" : NULL);
+            }
+        }
+        
+        // It holds up the login for at most WarmupWait from when it started.
+        waitStart = waitEnd = MonotonicTime();
+        if (warming && index->fSettings.fWarmupWait > 0
+            && waitStart - rulesEnd < (uint64_t)index->fSettings.fWarmupWait * 1000) {
+            WaitForWarmupJob(mechanism->fWarmup,
+                             index->fSettings.fWarmupWait - (long)((waitStart - rulesEnd) / 1000));
+            waitEnd = MonotonicTime();
+        }
+        
+        invokeEnd = MonotonicTime();
+        overhead = invokeEnd - invokeStart - (joinEnd - contextEnd) - (waitEnd - waitStart)
+        - (jobs != NULL ? ScriptRunTime(jobs, numJobs) : 0);
+        RecordOverhead(mechanism->fPlugin, kScriptPrefixes[bucket], overhead, invokeEnd - invokeStart);
+        CheckHealth(mechanism->fPlugin, kScriptPrefixes[bucket]);
+        
+        // Add this mechanism to the login's trace, and write it out.
+        if (index->fSettings.fTraceDirectory[0] != '\0') {
+            if (mechanism->fTrace == NULL) {
+                mechanism->fTrace = AcquireLoginTrace(mechanism->fPlugin, mechanism->fEngine, uid);
+            }
+            if ((trace = mechanism->fTrace) != NULL) {
+                if ((event = TraceAddEvent(trace, 'X', "mechanism", kScriptPrefixes[bucket], 0, invokeStart, invokeEnd)) != NULL) {
+                    snprintf(overheadStr, sizeof(overheadStr), "%.3f ms", overhead / 1000.0);
+                    TraceArg(event->fArgs, sizeof(event->fArgs), "overhead", overheadStr);
+                }
+                TraceAddEvent(trace, 'X', "context", "GetContextValue", 0, invokeStart, contextEnd);
+                if (joinEnd > contextEnd) {
+                    TraceAddEvent(trace, 'X', "overlap", "JoinOverlapGroup", 0, contextEnd, joinEnd);
+                }
+                TraceAddEvent(trace, 'X', "index", "AcquireScriptIndex", 0, joinEnd, indexEnd);
+                if (index->fNumRules > 0) {
+                    TraceAddEvent(trace, 'X', "rules", "EvaluateRules", 0, indexEnd, rulesEnd);
+                }
+                if (built) {
+                    TraceScriptIndex(trace, index);
+                }
+                if (waitEnd > waitStart) {
+                    TraceAddEvent(trace, 'X', "warmup", "WaitForWarmupJob", 0, waitStart, waitEnd);
+                }
+                if (jobs != NULL) {
+                    TraceAddEvent(trace, 'X', "scheduler", "RunScripts", 0, runStart, runEnd);
+                    TraceScriptJobs(trace, kScriptPrefixes[bucket], jobs, numJobs, mechanism->fContext,
+                                    runStart, runEnd, mechanism->fPlugin->fLogClient);
+                }
+                WriteLoginTrace(trace, index->fSettings.fTraceDirectory, mechanism->fPlugin->fLogClient);
             }
         }
-        globfree(&g);
+        
+        free(jobs);
+        ReleaseScriptIndex(mechanism->fPlugin, index);
         
     }
     
     if ((err = mechanism->fPlugin->fCallbacks->SetResult(mechanism->fEngine, result)) != errAuthorizationSuccess) {
-        asl_log(mechanism->fPlugin->fLogClient, NULL, ASL_LEVEL_ERR,
-                "Setting authorization result failed with error %d", err);
+        LogMessage(mechanism->fPlugin->fLogClient, LOG_ERR,
+                   "Setting authorization result failed with error %d", err);
     }
     
-    asl_log(mechanism->fPlugin->fLogClient, NULL, ASL_LEVEL_DEBUG, "LoginScriptPlugin:MechanismInvoke: result=%d", result);
+    LogMessage(mechanism->fPlugin->fLogClient, LOG_DEBUG, "LoginScriptPlugin:MechanismInvoke: result=%d", result);
     
     return result;
 }
@@ -523,12 +7796,12 @@ static OSStatus MechanismDeactivate(AuthorizationMechanismRef inMechanism)
     MechanismRecord *mechanism;
     
     mechanism = (MechanismRecord *) inMechanism;
-    asl_log(mechanism->fPlugin->fLogClient, NULL, ASL_LEVEL_DEBUG, "LoginScriptPlugin:MechanismDeactivate: inMechanism=%p", inMechanism);
+    LogMessage(mechanism->fPlugin->fLogClient, LOG_DEBUG, "LoginScriptPlugin:MechanismDeactivate: inMechanism=%p", inMechanism);
     assert(MechanismValid(mechanism));
     
     err = mechanism->fPlugin->fCallbacks->DidDeactivate(mechanism->fEngine);
     
-    asl_log(mechanism->fPlugin->fLogClient, NULL, ASL_LEVEL_DEBUG, "LoginScriptPlugin:MechanismDeactivate: err=%ld", (long) err);
+    LogMessage(mechanism->fPlugin->fLogClient, LOG_DEBUG, "LoginScriptPlugin:MechanismDeactivate: err=%ld", (long) err);
     
     return err;
 }
@@ -539,9 +7812,21 @@ static OSStatus MechanismDestroy(AuthorizationMechanismRef inMechanism)
     MechanismRecord *mechanism;
     
     mechanism = (MechanismRecord *) inMechanism;
-    asl_log(mechanism->fPlugin->fLogClient, NULL, ASL_LEVEL_DEBUG, "LoginScriptPlugin:MechanismDestroy: inMechanism=%p", inMechanism);
+    LogMessage(mechanism->fPlugin->fLogClient, LOG_DEBUG, "LoginScriptPlugin:MechanismDestroy: inMechanism=%p", inMechanism);
     assert(MechanismValid(mechanism));
     
+    if (mechanism->fTrace != NULL) {
+        ReleaseLoginTrace(mechanism->fPlugin, mechanism->fTrace);
+    }
+    if (mechanism->fLogin != NULL) {
+        ReleaseLoginContext(mechanism->fPlugin, mechanism->fLogin);
+    }
+    if (mechanism->fOverlap != NULL) {
+        ReleaseOverlapGroup(mechanism->fPlugin, mechanism->fOverlap);
+    }
+    if (mechanism->fWarmup != NULL) {
+        ReleaseWarmupJob(mechanism->fPlugin, mechanism->fWarmup);
+    }
     free(mechanism);
     
     return errAuthorizationSuccess;
@@ -563,7 +7848,32 @@ static OSStatus PluginDestroy(AuthorizationPluginRef inPlugin)
     plugin = (PluginRecord *) inPlugin;
     assert(PluginValid(plugin));
     
-    asl_close(plugin->fLogClient);
+    // Warm-up threads log and record statistics until they're stopped.
+    StopWarmupJobs(plugin);
+    if (plugin->fIndex != NULL) {
+        ReleaseScriptIndex(plugin, plugin->fIndex);
+    }
+    pthread_mutex_destroy(&plugin->fIndexLock);
+    pthread_mutex_destroy(&plugin->fTraceLock);
+    pthread_mutex_destroy(&plugin->fLoginLock);
+    pthread_mutex_destroy(&plugin->fOverheadLock);
+    if (plugin->fSupervisor != NULL) {
+        DestroySupervisor(plugin->fSupervisor);
+    }
+    pthread_mutex_destroy(&plugin->fSupervisorLock);
+    pthread_mutex_destroy(&plugin->fOverlapLock);
+    LauncherStop(plugin);
+    pthread_mutex_destroy(&plugin->fLauncherLock);
+    pthread_mutex_destroy(&plugin->fCacheLock);
+    if (plugin->fStats != NULL) {
+        munmap(plugin->fStats, sizeof(*plugin->fStats));
+    }
+    pthread_mutex_destroy(&plugin->fStatsLock);
+    pthread_mutex_destroy(&plugin->fWarmupLock);
+    pthread_mutex_destroy(&plugin->fPoolLock);
+    
+    // Flushes anything still in the ring.
+    LoggerDestroy(plugin->fLogClient);
     
     free(plugin);
     
@@ -598,15 +7908,15 @@ extern OSStatus AuthorizationPluginCreate(const AuthorizationCallbacks *callback
                                           const AuthorizationPluginInterface **outPluginInterface)
 {
     PluginRecord *plugin;
-    aslclient log_client;
+    Logger *log_client;
     
-    log_client = asl_open("LoginScriptPlugin", "se.gu.it.LoginScriptPlugin", 0);
+    log_client = LoggerCreate();
     if (log_client == NULL) {
-        syslog(LOG_ERR, "LoginScriptPlugin: asl_open() failed");
+        syslog(LOG_ERR, "LoginScriptPlugin: LoggerCreate() failed");
         return errAuthorizationInternal;
     }
     
-    asl_log(log_client, NULL, ASL_LEVEL_DEBUG, "LoginScriptPlugin:AuthorizationPluginCreate: callbacks=%p", callbacks);
+    LogMessage(log_client, LOG_DEBUG, "LoginScriptPlugin:AuthorizationPluginCreate: callbacks=%p", callbacks);
     
     assert(callbacks != NULL);
     assert(callbacks->version >= kAuthorizationCallbacksVersion);
@@ -616,7 +7926,8 @@ extern OSStatus AuthorizationPluginCreate(const AuthorizationCallbacks *callback
     // Create the plugin.
     plugin = (PluginRecord *) malloc(sizeof(*plugin));
     if (plugin == NULL) {
-        asl_log(log_client, NULL, ASL_LEVEL_ERR, "Plugin allocation failed");
+        LogMessage(log_client, LOG_ERR, "Plugin allocation failed");
+        LoggerDestroy(log_client);
         return errAuthorizationInternal;
     }
     
@@ -624,11 +7935,39 @@ extern OSStatus AuthorizationPluginCreate(const AuthorizationCallbacks *callback
     plugin->fMagic     = kPluginMagic;
     plugin->fCallbacks = callbacks;
     plugin->fLogClient = log_client;
+    plugin->fIndex     = NULL;
+    plugin->fTraces    = NULL;
+    plugin->fLogins    = NULL;
+    plugin->fOverlaps  = NULL;
+    plugin->fNumOverhead = 0;
+    plugin->fBaselineFDs = 0;
+    plugin->fBaselineRSS = 0;
+    plugin->fSupervisor = NULL;
+    plugin->fLauncherPid = -1;
+    plugin->fLauncherSocket = -1;
+    plugin->fLauncherRetryTime = 0;
+    plugin->fLauncherFailures = 0;
+    plugin->fStats = NULL;
+    plugin->fStatsFailed = false;
+    plugin->fWarmups = NULL;
+    plugin->fPoolClients = NULL;
+    plugin->fPoolRunning = 0;
+    pthread_mutex_init(&plugin->fSupervisorLock, NULL);
+    pthread_mutex_init(&plugin->fLauncherLock, NULL);
+    pthread_mutex_init(&plugin->fCacheLock, NULL);
+    pthread_mutex_init(&plugin->fStatsLock, NULL);
+    pthread_mutex_init(&plugin->fWarmupLock, NULL);
+    pthread_mutex_init(&plugin->fPoolLock, NULL);
+    pthread_mutex_init(&plugin->fIndexLock, NULL);
+    pthread_mutex_init(&plugin->fTraceLock, NULL);
+    pthread_mutex_init(&plugin->fLoginLock, NULL);
+    pthread_mutex_init(&plugin->fOverlapLock, NULL);
+    pthread_mutex_init(&plugin->fOverheadLock, NULL);
     
     *outPlugin = plugin;
     *outPluginInterface = &gPluginInterface;
     
-    asl_log(log_client, NULL, ASL_LEVEL_DEBUG, "LoginScriptPlugin:AuthorizationPluginCreate: *outPlugin=%p, *outPluginInterface=%p", *outPlugin, *outPluginInterface);
+    LogMessage(log_client, LOG_DEBUG, "LoginScriptPlugin:AuthorizationPluginCreate: *outPlugin=%p, *outPluginInterface=%p", *outPlugin, *outPluginInterface);
     
     return errAuthorizationSuccess;
 }
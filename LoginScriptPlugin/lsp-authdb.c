@@ -0,0 +1,652 @@
+//
+//  lsp-authdb.c
+//  LoginScriptPlugin
+//
+//  Adds LoginScriptPlugin's mechanisms to the system.login.console right,
+//  or removes them, in a single pass over the right's plist.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/param.h>
+#include <sys/errno.h>
+#include <sysexits.h>
+
+#include "lsp-verify.h"
+
+extern char **environ;
+
+#define kPluginName "LoginScriptPlugin"
+#define kRightName "system.login.console"
+#define kHomeDirMechanism "HomeDirMechanism"
+#define kSecurityPath "/usr/bin/security"
+
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Reading and Writing
+/////////////////////////////////////////////////////////////////////
+
+
+enum {
+    kMaxRightLength = 1024 * 1024       // bytes of plist read
+};
+
+/// Buffer is a plist in memory.
+struct Buffer {
+    char *fData;
+    size_t fLength;
+};
+typedef struct Buffer Buffer;
+
+/// Read everything from fd, up to kMaxRightLength bytes.
+static bool ReadAll(int fd, Buffer *buffer)
+{
+    size_t capacity;
+    ssize_t n;
+    char *data;
+    
+    buffer->fData = NULL;
+    buffer->fLength = 0;
+    capacity = 0;
+    for (;;) {
+        if (buffer->fLength + 1 >= capacity) {
+            if (capacity >= kMaxRightLength) {
+                errno = EFBIG;
+                return false;
+            }
+            capacity = capacity ? 2 * capacity : 16384;
+            if ((data = realloc(buffer->fData, capacity)) == NULL) {
+                return false;
+            }
+            buffer->fData = data;
+        }
+        n = read(fd, buffer->fData + buffer->fLength, capacity - buffer->fLength - 1);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        if (n == 0) {
+            break;
+        }
+        buffer->fLength += (size_t)n;
+    }
+    buffer->fData[buffer->fLength] = '\0';
+    return true;
+}
+
+/// Write all of a buffer to fd.
+static bool WriteAll(int fd, const char *data, size_t length)
+{
+    ssize_t n;
+    
+    while (length > 0) {
+        n = write(fd, data, length);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        length -= (size_t)n;
+    }
+    return true;
+}
+
+/// Run security authorizationdb with one end of a pipe as its stdin or
+/// stdout, and the other end returned in outFD.
+static pid_t SpawnAuthorizationDB(const char *command, bool writing, int *outFD)
+{
+    posix_spawn_file_actions_t actions;
+    char *argv[] = { "security", "authorizationdb", (char *)command, kRightName, NULL };
+    int fds[2];
+    pid_t pid;
+    int err;
+    
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    if ((err = posix_spawn_file_actions_init(&actions)) != 0) {
+        close(fds[0]);
+        close(fds[1]);
+        errno = err;
+        return -1;
+    }
+    err = posix_spawn_file_actions_adddup2(&actions, fds[writing ? 0 : 1], writing ? STDIN_FILENO : STDOUT_FILENO);
+    if (err == 0) err = posix_spawn_file_actions_addclose(&actions, fds[0]);
+    if (err == 0) err = posix_spawn_file_actions_addclose(&actions, fds[1]);
+    if (err == 0) err = posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    if (err == 0) err = posix_spawn(&pid, kSecurityPath, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[writing ? 0 : 1]);
+    if (err != 0) {
+        close(fds[writing ? 1 : 0]);
+        errno = err;
+        return -1;
+    }
+    *outFD = fds[writing ? 1 : 0];
+    return pid;
+}
+
+/// Wait for a child, true if it exited with status 0.
+static bool WaitForSuccess(pid_t pid)
+{
+    int status;
+    
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/// Read the right from the authorization db, or from path if it's given.
+static bool ReadRight(const char *path, Buffer *buffer)
+{
+    pid_t pid;
+    bool ok;
+    int fd;
+    
+    if (path != NULL) {
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+            return false;
+        }
+        ok = ReadAll(fd, buffer);
+        close(fd);
+        return ok;
+    }
+    if ((pid = SpawnAuthorizationDB("read", false, &fd)) == -1) {
+        return false;
+    }
+    ok = ReadAll(fd, buffer);
+    close(fd);
+    return WaitForSuccess(pid) && ok;
+}
+
+/// Write the right to the authorization db, or replace the file at path
+/// atomically if it's given, keeping its mode.
+static bool WriteRight(const char *path, const Buffer *buffer)
+{
+    char tmpPath[MAXPATHLEN];
+    struct stat info;
+    void (*oldHandler)(int);
+    pid_t pid;
+    bool ok;
+    int fd;
+    
+    if (path != NULL) {
+        if (snprintf(tmpPath, sizeof(tmpPath), "%s.XXXXXX", path) >= (int)sizeof(tmpPath)) {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        if ((fd = mkstemp(tmpPath)) == -1) {
+            return false;
+        }
+        ok = WriteAll(fd, buffer->fData, buffer->fLength)
+            && fchmod(fd, stat(path, &info) == 0 ? info.st_mode & 07777 : 0644) == 0
+            && fsync(fd) == 0;
+        ok = close(fd) == 0 && ok;
+        if (! ok || rename(tmpPath, path) != 0) {
+            unlink(tmpPath);
+            return false;
+        }
+        return true;
+    }
+    if ((pid = SpawnAuthorizationDB("write", true, &fd)) == -1) {
+        return false;
+    }
+    // A write error shows up in the exit status.
+    oldHandler = signal(SIGPIPE, SIG_IGN);
+    ok = WriteAll(fd, buffer->fData, buffer->fLength);
+    close(fd);
+    signal(SIGPIPE, oldHandler);
+    return WaitForSuccess(pid) && ok;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Parsing
+/////////////////////////////////////////////////////////////////////
+
+
+/// Mechanism is the text of a <string> in the mechanisms array, as it
+/// appears in the plist, or one of ours.
+struct Mechanism {
+    const char *fText;
+    size_t fLength;
+};
+typedef struct Mechanism Mechanism;
+
+/// Right is the part of the plist that's edited: the contents of the
+/// mechanisms array, which are regenerated, and the indentation to use.
+struct Right {
+    size_t fStart;              // offset just after <array>
+    size_t fEnd;                // offset of </array>
+    bool fEmpty;                // <array/>, which has no room for contents
+    const char *fIndent;        // whitespace in front of each <string>
+    size_t fIndentLength;
+    const char *fCloseIndent;   // whitespace in front of </array>
+    size_t fCloseIndentLength;
+    Mechanism *fMechanisms;
+    size_t fNumMechanisms;
+};
+typedef struct Right Right;
+
+/// Find the end of the tag, comment, declaration or processing
+/// instruction that starts at p, or NULL if it's not terminated.
+static const char *SkipMarkup(const char *p)
+{
+    const char *end;
+    
+    if (strncmp(p, "<!--", 4) == 0) {
+        return (end = strstr(p + 4, "-->")) != NULL ? end + 3 : NULL;
+    }
+    if (strncmp(p, "<?", 2) == 0) {
+        return (end = strstr(p + 2, "?>")) != NULL ? end + 2 : NULL;
+    }
+    return (end = strchr(p, '>')) != NULL ? end + 1 : NULL;
+}
+
+/// True if the tag at p, which ends just before end, is named name.
+static bool TagIs(const char *p, const char *end, const char *name)
+{
+    size_t length;
+    
+    p += (p[1] == '/') ? 2 : 1;
+    length = strlen(name);
+    return strncmp(p, name, length) == 0
+        && (p + length == end - 1 || p[length] == '/' || p[length] == ' ' || p[length] == '\t'
+            || p[length] == '\n' || p[length] == '\r');
+}
+
+/// The whitespace in front of p back to the start of its line.
+static const char *LineIndent(const char *data, const char *p, size_t *outLength)
+{
+    const char *start;
+    
+    for (start = p; start > data && (start[-1] == ' ' || start[-1] == '\t'); start--)
+        ;
+    *outLength = (size_t)(p - start);
+    return start;
+}
+
+/// Find the mechanisms array of the right and its strings.
+///
+/// This isn't a general plist parser. It tracks how deep the dicts and
+/// arrays are nested to find the mechanisms key of the top level dict,
+/// and expects the array that follows it to hold nothing but strings,
+/// like any right does.
+///
+/// @return false if the plist doesn't look like a right.
+static bool ParseRight(const Buffer *buffer, Right *right)
+{
+    const char *data;
+    const char *p;
+    const char *end;
+    const char *text;
+    const char *close;
+    Mechanism *mechanisms;
+    size_t capacity;
+    size_t depth;
+    bool closing;
+    bool selfClosing;
+    bool found;
+    bool wantArray;
+    
+    memset(right, 0, sizeof(*right));
+    data = buffer->fData;
+    depth = 0;
+    found = false;
+    wantArray = false;
+    capacity = 0;
+    for (p = strchr(data, '<'); p != NULL; p = strchr(end, '<')) {
+        if ((end = SkipMarkup(p)) == NULL) {
+            return false;
+        }
+        if (p[1] == '!' || p[1] == '?') {
+            continue;
+        }
+        closing = p[1] == '/';
+        selfClosing = end[-2] == '/';
+        
+        if (wantArray) {
+            // The value of the mechanisms key.
+            if (closing || ! TagIs(p, end, "array")) {
+                return false;
+            }
+            wantArray = false;
+            found = true;
+            if (selfClosing) {
+                right->fEmpty = true;
+                right->fStart = right->fEnd = (size_t)(end - data);
+                right->fCloseIndent = LineIndent(data, p, &right->fCloseIndentLength);
+                continue;
+            }
+            right->fStart = (size_t)(end - data);
+            
+            // Collect its strings.
+            for (p = strchr(end, '<'); p != NULL; p = strchr(end, '<')) {
+                if ((end = SkipMarkup(p)) == NULL) {
+                    return false;
+                }
+                if (p[1] == '!') {
+                    continue;
+                }
+                if (p[1] == '/' && TagIs(p, end, "array")) {
+                    break;
+                }
+                if (p[1] == '/' || ! TagIs(p, end, "string")) {
+                    return false;
+                }
+                if (right->fNumMechanisms == 0) {
+                    right->fIndent = LineIndent(data, p, &right->fIndentLength);
+                }
+                text = end;
+                if (end[-2] == '/') {
+                    close = end;
+                } else if ((close = strstr(text, "</string>")) == NULL) {
+                    return false;
+                } else {
+                    end = close + strlen("</string>");
+                }
+                if (right->fNumMechanisms == capacity) {
+                    capacity = capacity ? 2 * capacity : 32;
+                    if ((mechanisms = realloc(right->fMechanisms, capacity * sizeof(*mechanisms))) == NULL) {
+                        return false;
+                    }
+                    right->fMechanisms = mechanisms;
+                }
+                right->fMechanisms[right->fNumMechanisms].fText = text;
+                right->fMechanisms[right->fNumMechanisms].fLength = (size_t)(close - text);
+                right->fNumMechanisms++;
+            }
+            if (p == NULL) {
+                return false;
+            }
+            right->fEnd = (size_t)(p - data);
+            right->fCloseIndent = LineIndent(data, p, &right->fCloseIndentLength);
+            continue;
+        }
+        
+        if (TagIs(p, end, "dict") || TagIs(p, end, "array")) {
+            if (closing) {
+                if (depth == 0) {
+                    return false;
+                }
+                depth--;
+            } else if (! selfClosing) {
+                depth++;
+            }
+        } else if (depth == 1 && ! closing && ! selfClosing && TagIs(p, end, "key")
+                   && strncmp(end, "mechanisms</key>", strlen("mechanisms</key>")) == 0) {
+            if (found) {
+                return false;
+            }
+            wantArray = true;
+            end += strlen("mechanisms</key>");
+        }
+    }
+    if (! found) {
+        return false;
+    }
+    if (right->fIndent == NULL) {
+        right->fIndent = "\t\t";
+        right->fIndentLength = 2;
+    }
+    return true;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Editing
+/////////////////////////////////////////////////////////////////////
+
+
+/// True if a mechanism belongs to plugin, like plugin:mechanism,privileged.
+static bool MechanismOf(const Mechanism *mechanism, const char *plugin)
+{
+    size_t length;
+    
+    length = strlen(plugin);
+    return mechanism->fLength > length
+        && strncmp(mechanism->fText, plugin, length) == 0
+        && mechanism->fText[length] == ':';
+}
+
+/// Compute the mechanisms with ours removed and, if enabling, added again
+/// like configureplugin.sh always has: the premount mechanisms in front
+/// of the first HomeDirMechanism, and the postmount mechanisms in front of
+/// the last mechanism.
+///
+/// @param ours     Receives the text of our mechanisms, kNumScriptPrefixes
+///                 strings of MAXPATHLEN bytes.
+/// @return false if enabling and there's no HomeDirMechanism.
+static bool EditMechanisms(const Right *right,
+                           bool enable,
+                           char ours[][MAXPATHLEN],
+                           Mechanism *outMechanisms,
+                           size_t *outNumMechanisms)
+{
+    Mechanism *kept;
+    size_t numKept;
+    size_t homeDir;
+    size_t n;
+    size_t i;
+    
+    // Keep everything that isn't ours.
+    kept = outMechanisms + kNumScriptPrefixes;
+    numKept = 0;
+    homeDir = SIZE_MAX;
+    for (i = 0; i < right->fNumMechanisms; i++) {
+        if (MechanismOf(&right->fMechanisms[i], kPluginName)) {
+            continue;
+        }
+        if (homeDir == SIZE_MAX && MechanismOf(&right->fMechanisms[i], kHomeDirMechanism)) {
+            homeDir = numKept;
+        }
+        kept[numKept++] = right->fMechanisms[i];
+    }
+    if (! enable) {
+        memmove(outMechanisms, kept, numKept * sizeof(*kept));
+        *outNumMechanisms = numKept;
+        return true;
+    }
+    if (homeDir == SIZE_MAX) {
+        return false;
+    }
+    
+    for (i = 0; i < kNumScriptPrefixes; i++) {
+        snprintf(ours[i], MAXPATHLEN, "%s:%s,privileged", kPluginName, kScriptPrefixes[i]);
+    }
+    
+    // The kept mechanisms are moved down in front of where they belong,
+    // which never overtakes the ones that are still to be moved.
+    n = 0;
+    for (i = 0; i < numKept; i++) {
+        if (i == homeDir) {
+            outMechanisms[n].fText = ours[0];
+            outMechanisms[n++].fLength = strlen(ours[0]);
+            outMechanisms[n].fText = ours[1];
+            outMechanisms[n++].fLength = strlen(ours[1]);
+        }
+        if (i == numKept - 1) {
+            outMechanisms[n].fText = ours[2];
+            outMechanisms[n++].fLength = strlen(ours[2]);
+            outMechanisms[n].fText = ours[3];
+            outMechanisms[n++].fLength = strlen(ours[3]);
+        }
+        outMechanisms[n++] = kept[i];
+    }
+    *outNumMechanisms = n;
+    return true;
+}
+
+/// True if two lists of mechanisms are the same.
+static bool SameMechanisms(const Mechanism *a, size_t numA, const Mechanism *b, size_t numB)
+{
+    size_t i;
+    
+    if (numA != numB) {
+        return false;
+    }
+    for (i = 0; i < numA; i++) {
+        if (a[i].fLength != b[i].fLength || memcmp(a[i].fText, b[i].fText, a[i].fLength) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Append to a buffer that's known to be large enough.
+static void Append(Buffer *buffer, const char *data, size_t length)
+{
+    memcpy(buffer->fData + buffer->fLength, data, length);
+    buffer->fLength += length;
+}
+
+/// Build the edited plist, with the mechanisms array regenerated in the
+/// original's indentation and everything else left as it was.
+static bool BuildRight(const Buffer *original, const Right *right,
+                       const Mechanism *mechanisms, size_t numMechanisms, Buffer *outBuffer)
+{
+    size_t length;
+    size_t i;
+    
+    length = original->fLength + strlen("<array></array>") + right->fCloseIndentLength + 2;
+    for (i = 0; i < numMechanisms; i++) {
+        length += 1 + right->fIndentLength + strlen("<string></string>") + mechanisms[i].fLength;
+    }
+    if ((outBuffer->fData = malloc(length + 1)) == NULL) {
+        return false;
+    }
+    outBuffer->fLength = 0;
+    
+    if (right->fEmpty) {
+        // Replace <array/>.
+        Append(outBuffer, original->fData, right->fStart - strlen("<array/>"));
+        Append(outBuffer, "<array>", strlen("<array>"));
+    } else {
+        Append(outBuffer, original->fData, right->fStart);
+    }
+    for (i = 0; i < numMechanisms; i++) {
+        Append(outBuffer, "\n", 1);
+        Append(outBuffer, right->fIndent, right->fIndentLength);
+        Append(outBuffer, "<string>", strlen("<string>"));
+        Append(outBuffer, mechanisms[i].fText, mechanisms[i].fLength);
+        Append(outBuffer, "</string>", strlen("</string>"));
+    }
+    Append(outBuffer, "\n", 1);
+    Append(outBuffer, right->fCloseIndent, right->fCloseIndentLength);
+    if (right->fEmpty) {
+        Append(outBuffer, "</array>", strlen("</array>"));
+    }
+    Append(outBuffer, original->fData + right->fEnd, original->fLength - right->fEnd);
+    outBuffer->fData[outBuffer->fLength] = '\0';
+    return true;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Main
+/////////////////////////////////////////////////////////////////////
+
+
+static void Usage(void)
+{
+    fprintf(stderr,
+            "usage: lsp-authdb [-i file] [-o file] enable | disable\n"
+            "  -i file  read the right from file instead of the authorization db\n"
+            "  -o file  write the right to file, by default the one it was read from\n");
+}
+
+int main(int argc, char *argv[])
+{
+    char ours[kNumScriptPrefixes][MAXPATHLEN];
+    const char *input;
+    const char *output;
+    const char *command;
+    Mechanism *mechanisms;
+    size_t numMechanisms;
+    Buffer original;
+    Buffer edited;
+    Right right;
+    bool enable;
+    int ch;
+    
+    input = NULL;
+    output = NULL;
+    while ((ch = getopt(argc, argv, "i:o:h")) != -1) {
+        switch (ch) {
+            case 'i':
+                input = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                Usage();
+                return EX_USAGE;
+        }
+    }
+    if (optind + 1 != argc
+        || (strcmp(argv[optind], "enable") != 0 && strcmp(argv[optind], "disable") != 0)) {
+        Usage();
+        return EX_USAGE;
+    }
+    command = argv[optind];
+    enable = strcmp(command, "enable") == 0;
+    if (output == NULL) {
+        output = input;
+    }
+    
+    if (! ReadRight(input, &original)) {
+        printf("Failed to read %s from %s, errno %d\n", kRightName, input ? input : "authorization db", errno);
+        return EX_OSERR;
+    }
+    printf("Read %s from %s\n", kRightName, input ? input : "authorization db");
+    
+    if (! ParseRight(&original, &right)) {
+        printf("Can't find the mechanisms of %s\n", kRightName);
+        return EX_DATAERR;
+    }
+    if ((mechanisms = calloc(right.fNumMechanisms + kNumScriptPrefixes, sizeof(*mechanisms))) == NULL) {
+        return EX_OSERR;
+    }
+    if (! EditMechanisms(&right, enable, ours, mechanisms, &numMechanisms)) {
+        printf("%s not found\n", kHomeDirMechanism);
+        return EX_DATAERR;
+    }
+    
+    if (SameMechanisms(right.fMechanisms, right.fNumMechanisms, mechanisms, numMechanisms)) {
+        printf("No change, %s was already %sd\n", kPluginName, command);
+        return EX_OK;
+    }
+    printf("%s %s %s %s mechanisms\n", enable ? "Added" : "Removed", kPluginName,
+           enable ? "to" : "from", kRightName);
+    
+    if (! BuildRight(&original, &right, mechanisms, numMechanisms, &edited)) {
+        return EX_OSERR;
+    }
+    if (! WriteRight(output, &edited)) {
+        printf("Failed to write %s to %s, errno %d\n", kRightName, output ? output : "authorization db", errno);
+        return output ? EX_CANTCREAT : EX_NOPERM;
+    }
+    printf("Wrote %s to %s\n", kRightName, output ? output : "authorization db");
+    
+    return EX_OK;
+}
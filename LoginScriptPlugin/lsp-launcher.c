@@ -0,0 +1,448 @@
+//
+//  lsp-launcher.c
+//  LoginScriptPlugin
+//
+//  A small resident helper that forks and executes scripts on behalf of
+//  the plugin, so the plugin host never has to fork itself.
+//
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/errno.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#if !defined(__APPLE__)
+#include <sys/prctl.h>
+#endif
+
+#include "lsp-launcher.h"
+
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Children
+/////////////////////////////////////////////////////////////////////
+
+
+/// LauncherChild is a script that has been launched and not yet reaped.
+struct LauncherChild {
+    pid_t fPid;
+    int fReplyFD;               // where its exit status goes
+};
+typedef struct LauncherChild LauncherChild;
+
+static LauncherChild *gChildren;
+static size_t gNumChildren;
+static size_t gMaxChildren;
+
+/// The launcher's own pid, which children check their parent against.
+static pid_t gLauncherPid;
+
+/// Written to by the SIGCHLD handler.
+static int gSignalPipe[2];
+
+static void HandleSIGCHLD(int sig)
+{
+    int savedErrno = errno;
+    
+    write(gSignalPipe[1], "", 1);
+    errno = savedErrno;
+}
+
+/// Remember a child until it exits.
+static bool AddChild(pid_t pid, int replyFD)
+{
+    LauncherChild *children;
+    size_t capacity;
+    
+    if (gNumChildren == gMaxChildren) {
+        capacity = gMaxChildren ? 2 * gMaxChildren : 16;
+        children = realloc(gChildren, capacity * sizeof(*children));
+        if (children == NULL) {
+            return false;
+        }
+        gChildren = children;
+        gMaxChildren = capacity;
+    }
+    gChildren[gNumChildren].fPid = pid;
+    gChildren[gNumChildren].fReplyFD = replyFD;
+    gNumChildren++;
+    return true;
+}
+
+/// Reap every child that has exited and report its status and usage.
+static void ReapChildren(void)
+{
+    char buf[64];
+    LauncherExit reply;
+    struct rusage usage;
+    int status;
+    pid_t pid;
+    size_t i;
+    
+    while (read(gSignalPipe[0], buf, sizeof(buf)) > 0)
+        ;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        for (i = 0; i < gNumChildren; i++) {
+            if (gChildren[i].fPid == pid) {
+                memset(&reply, 0, sizeof(reply));
+                reply.fStatus = status;
+                ScriptUsageFromRusage(&usage, &reply.fUsage);
+                write(gChildren[i].fReplyFD, &reply, sizeof(reply));
+                close(gChildren[i].fReplyFD);
+                gChildren[i] = gChildren[--gNumChildren];
+                break;
+            }
+        }
+    }
+}
+
+/// Kill every child that's still running, along with its process group,
+/// and reap it. Its status has nowhere to go, so the reply descriptor is
+/// just closed.
+static void KillChildren(void)
+{
+    size_t i;
+    
+    for (i = 0; i < gNumChildren; i++) {
+        if (kill(-gChildren[i].fPid, SIGKILL) == -1 && errno == ESRCH) {
+            kill(gChildren[i].fPid, SIGKILL);
+        }
+    }
+    for (i = 0; i < gNumChildren; i++) {
+        while (waitpid(gChildren[i].fPid, NULL, 0) == -1 && errno == EINTR)
+            ;
+        close(gChildren[i].fReplyFD);
+    }
+    gNumChildren = 0;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Requests
+/////////////////////////////////////////////////////////////////////
+
+
+/// Read exactly len bytes.
+static bool ReadFully(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t n;
+    
+    while (len > 0) {
+        n = read(fd, p, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/// Receive a request and its descriptors from the plugin.
+///
+/// @return 1 for a request, 0 if the plugin has gone away, or -1 if the
+///         request was malformed.
+static int ReceiveRequest(LauncherRequest *request, int fds[kLauncherMaxFDs], size_t *outNumFDs, char **outStrings)
+{
+    union {
+        struct cmsghdr fHeader;
+        char fSpace[CMSG_SPACE(kLauncherMaxFDs * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+    size_t i;
+    
+    *outNumFDs = 0;
+    *outStrings = NULL;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = request;
+    iov.iov_len = sizeof(*request);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.fSpace;
+    msg.msg_controllen = sizeof(control.fSpace);
+    do {
+        n = recvmsg(kLauncherSocketFD, &msg, 0);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+        return 0;
+    }
+    
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *outNumFDs = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), *outNumFDs * sizeof(int));
+        }
+    }
+    for (i = 0; i < *outNumFDs; i++) {
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    
+    // The rest of the header, if it was split.
+    if ((size_t)n < sizeof(*request)
+        && ! ReadFully(kLauncherSocketFD, (char *)request + n, sizeof(*request) - (size_t)n)) {
+        return 0;
+    }
+    if (request->fLength == 0 || request->fLength > kLauncherMaxStrings
+        || *outNumFDs != 2 + ((request->fFlags & kLauncherCapture) ? 2 : 0)
+                           + ((request->fFlags & kLauncherContext) ? 1 : 0)
+                           + ((request->fFlags & kLauncherCgroup) ? 1 : 0)) {
+        return -1;
+    }
+    *outStrings = malloc(request->fLength + 1);
+    if (*outStrings == NULL || ! ReadFully(kLauncherSocketFD, *outStrings, request->fLength)) {
+        return 0;
+    }
+    (*outStrings)[request->fLength] = '\0';
+    return 1;
+}
+
+/// Split the strings of a request into the path, argv and env.
+static bool SplitStrings(const LauncherRequest *request, char *strings, char ***outArgv, char ***outEnv)
+{
+    char **vectors;
+    char *p;
+    char *end;
+    size_t i;
+    
+    if (request->fArgc > kLauncherMaxStrings || request->fEnvc > kLauncherMaxStrings) {
+        return false;
+    }
+    vectors = malloc((request->fArgc + request->fEnvc + 2) * sizeof(*vectors));
+    if (vectors == NULL) {
+        return false;
+    }
+    p = strings + strlen(strings) + 1;
+    end = strings + request->fLength;
+    for (i = 0; i < request->fArgc + request->fEnvc; i++) {
+        if (p >= end) {
+            free(vectors);
+            return false;
+        }
+        vectors[i + (i >= request->fArgc)] = p;
+        p += strlen(p) + 1;
+    }
+    vectors[request->fArgc] = NULL;
+    vectors[request->fArgc + request->fEnvc + 1] = NULL;
+    *outArgv = vectors;
+    *outEnv = vectors + request->fArgc + 1;
+    return true;
+}
+
+/// Set up the forked child and execute the script. Never returns.
+static void ExecuteScript(const LauncherRequest *request, const int *fds, const char *path, char **argv, char **env)
+{
+    sigset_t mask;
+    int scriptFD = fds[1];
+    int contextFD;
+    size_t next;
+#if !defined(__APPLE__)
+    (void)path;
+#else
+    struct stat scriptInfo;
+    struct stat pathInfo;
+#endif
+    
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    
+    // Put the script in its own process group so that a timeout can
+    // take out anything it has started as well.
+    setpgid(0, 0);
+    
+    next = 2;
+    if (request->fFlags & kLauncherCapture) {
+        dup2(fds[next++], STDOUT_FILENO);
+        dup2(fds[next++], STDERR_FILENO);
+    }
+    
+    // Clear the way for the login context, then put it in place.
+    if (request->fFlags & kLauncherContext) {
+        contextFD = fds[next++];
+        if (scriptFD == kScriptContextFD) {
+            scriptFD = fcntl(scriptFD, F_DUPFD_CLOEXEC, kScriptContextFD + 1);
+        }
+        if (contextFD == kScriptContextFD) {
+            fcntl(contextFD, F_SETFD, 0);
+        } else {
+            dup2(contextFD, kScriptContextFD);
+        }
+    }
+    
+    // Move into the script's cgroup, and apply its limits and QoS class
+    // while still root.
+    if ((request->fFlags & kLauncherCgroup) && write(fds[next++], "0\n", 2) != 2) {
+        syslog(LOG_AUTH | LOG_ERR, "lsp-launcher: Joining the cgroup of %s failed with errno %d", path, errno);
+        _exit(EX_NOPERM);
+    }
+    if (! ScriptLimitsApply(&request->fLimits)) {
+        syslog(LOG_AUTH | LOG_ERR, "lsp-launcher: Setting the resource limits of %s failed with errno %d", path, errno);
+        _exit(EX_NOPERM);
+    }
+    if (! ScriptQoSApply(&request->fQoS)) {
+        syslog(LOG_AUTH | LOG_WARNING, "lsp-launcher: Setting the QoS class of %s failed with errno %d", path, errno);
+    }
+    
+    if (request->fFlags & kLauncherSetUser) {
+        if (setgid((gid_t)request->fGid) || setuid((uid_t)request->fUid)) {
+            syslog(LOG_AUTH | LOG_ERR, "lsp-launcher: setgid/setuid failed, aborting execution of %s", path);
+            _exit(EX_NOPERM);
+        }
+    }
+    
+#if !defined(__APPLE__)
+    // Die with the launcher, which is the only one that can report the
+    // exit status. This has to come after changing user, which clears it,
+    // and the launcher may already have died before it was set.
+    if (prctl(PR_SET_PDEATHSIG, SIGKILL) != 0 || getppid() != gLauncherPid) {
+        _exit(EX_NOPERM);
+    }
+#endif
+    
+#if defined(__APPLE__)
+    if (fstat(scriptFD, &scriptInfo)
+        || lstat(path, &pathInfo)
+        || scriptInfo.st_dev != pathInfo.st_dev
+        || scriptInfo.st_ino != pathInfo.st_ino) {
+        syslog(LOG_AUTH | LOG_ERR, "lsp-launcher: %s changed after it was verified", path);
+        _exit(EX_NOPERM);
+    }
+    execve(path, argv, env);
+#else
+    // An interpreter is handed the script as /dev/fd/N, so it has to
+    // survive the exec.
+    fcntl(scriptFD, F_SETFD, 0);
+    fexecve(scriptFD, argv, env);
+#endif
+    syslog(LOG_AUTH | LOG_ERR, "lsp-launcher: Executing %s failed with errno %d", path, errno);
+    _exit(EX_NOPERM);
+}
+
+/// Fork a child for a request and tell the plugin its pid.
+static void HandleRequest(const LauncherRequest *request, int *fds, char *strings)
+{
+    char **argv;
+    char **env;
+    int32_t reply;
+    pid_t pid;
+    
+    if (! SplitStrings(request, strings, &argv, &env)) {
+        reply = -EINVAL;
+        write(fds[0], &reply, sizeof(reply));
+        return;
+    }
+    
+    pid = fork();
+    if (pid == 0) {
+        ExecuteScript(request, fds, strings, argv, env);
+    }
+    free(argv);
+    
+    if (pid == -1) {
+        reply = -errno;
+        write(fds[0], &reply, sizeof(reply));
+        return;
+    }
+    // Also set the process group here, so it's in place before the plugin
+    // might need to signal it.
+    setpgid(pid, pid);
+    reply = pid;
+    write(fds[0], &reply, sizeof(reply));
+    if (AddChild(pid, fds[0])) {
+        fds[0] = -1;
+    }
+}
+
+
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Main
+/////////////////////////////////////////////////////////////////////
+
+
+int main(void)
+{
+    struct sigaction action;
+    struct pollfd pfds[2];
+    LauncherRequest request;
+    int fds[kLauncherMaxFDs];
+    size_t numFDs;
+    size_t i;
+    char *strings;
+    int result;
+    
+    gLauncherPid = getpid();
+    if (pipe(gSignalPipe) != 0) {
+        return EX_OSERR;
+    }
+    for (i = 0; i < 2; i++) {
+        fcntl(gSignalPipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(gSignalPipe[i], F_SETFL, fcntl(gSignalPipe[i], F_GETFL) | O_NONBLOCK);
+    }
+    fcntl(kLauncherSocketFD, F_SETFD, FD_CLOEXEC);
+    
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = HandleSIGCHLD;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    
+    pfds[0].fd = kLauncherSocketFD;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = gSignalPipe[0];
+    pfds[1].events = POLLIN;
+    for (;;) {
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return EX_OSERR;
+        }
+        if (pfds[1].revents & POLLIN) {
+            ReapChildren();
+        }
+        if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            result = ReceiveRequest(&request, fds, &numFDs, &strings);
+            if (result == 1) {
+                HandleRequest(&request, fds, strings);
+            }
+            for (i = 0; i < numFDs; i++) {
+                if (fds[i] != -1) {
+                    close(fds[i]);
+                }
+            }
+            free(strings);
+            if (result == 0) {
+                // The plugin is gone, and nobody is waiting for the status
+                // of children that are still running, so they're stopped
+                // rather than left to run unsupervised.
+                KillChildren();
+                break;
+            }
+        }
+    }
+    
+    return EX_OK;
+}
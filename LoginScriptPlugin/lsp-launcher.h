@@ -0,0 +1,237 @@
+//
+//  lsp-launcher.h
+//  LoginScriptPlugin
+//
+//  The protocol spoken between LoginScriptPlugin and lsp-launcher.
+//
+
+#ifndef __LoginScriptPlugin__lsp_launcher__
+#define __LoginScriptPlugin__lsp_launcher__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sched.h>
+#if !defined(__APPLE__)
+#include <sys/syscall.h>
+#endif
+
+#define kLauncherName "lsp-launcher"
+
+enum {
+    kLauncherSocketFD = 3,              // the control socket, in the launcher
+    kLauncherMaxStrings = 256 * 1024,   // bytes of strings in a request
+    kLauncherMaxFDs = 6,                // descriptors attached to a request
+    kScriptContextFD = 4                // the login context, in scripts
+};
+
+enum {
+    kLauncherSetUser = 1 << 0,          // change to fUid and fGid first
+    kLauncherCapture = 1 << 1,          // stdout and stderr are attached
+    kLauncherContext = 1 << 2,          // the login context is attached
+    kLauncherCgroup = 1 << 3            // a cgroup.procs file is attached
+};
+
+/// ScriptLimits are the resource limits a script runs with, 0 for none.
+struct ScriptLimits {
+    uint64_t fCPU;                      // seconds of CPU time, RLIMIT_CPU
+    uint64_t fMemory;                   // bytes of address space, RLIMIT_AS
+    uint64_t fFiles;                    // open files, RLIMIT_NOFILE
+    uint64_t fProcesses;                // processes of the uid, RLIMIT_NPROC
+};
+typedef struct ScriptLimits ScriptLimits;
+
+enum {
+    kScriptQoSDefault = 0,              // runs like the plugin host
+    kScriptQoSInteractive = 1,          // ahead of other scripts, for what the user waits on
+    kScriptQoSBackground = 2,           // behind everything else
+    kNumScriptQoS = 3
+};
+
+enum {
+    kScriptQoSInteractiveNice = -5,
+    kScriptQoSBackgroundNice = 10
+};
+
+#if !defined(__APPLE__)
+// From linux/ioprio.h, which isn't always installed.
+enum {
+    kIOPrioWhoProcess = 1,
+    kIOPrioClassShift = 13,
+    kIOPrioClassBE = 2,                 // best effort, with a level from 0 to 7
+    kIOPrioClassIdle = 3                // only when the disk is otherwise idle
+};
+#endif
+
+/// ScriptQoS is the CPU and I/O priority a script runs with.
+struct ScriptQoS {
+    uint32_t fClass;                    // kScriptQoS*
+    uint32_t fReserved;
+    uint64_t fCPUs;                     // mask of the first 64 CPUs it may use, 0 for any
+};
+typedef struct ScriptQoS ScriptQoS;
+
+/// ScriptUsage is what a script used, from wait4().
+struct ScriptUsage {
+    uint64_t fUserTime;                 // microseconds
+    uint64_t fSystemTime;               // microseconds
+    uint64_t fMaxRSS;                   // kilobytes
+    uint64_t fInBlocks;
+    uint64_t fOutBlocks;
+    uint64_t fVoluntarySwitches;
+    uint64_t fInvoluntarySwitches;
+};
+typedef struct ScriptUsage ScriptUsage;
+
+/// LauncherRequest asks lsp-launcher to execute a script.
+///
+/// The request is followed on the control socket by fLength bytes of NUL
+/// terminated strings: the path, fArgc arguments and fEnvc environment
+/// entries. The request itself carries the descriptors: the reply socket,
+/// the verified script, with kLauncherCapture stdout and stderr, and with
+/// kLauncherContext the login context, which the script gets as
+/// kScriptContextFD, and with kLauncherCgroup a cgroup.procs file that the
+/// child moves itself into.
+///
+/// The launcher answers on the reply socket with the child's pid as an
+/// int32_t, or a negated errno if it couldn't fork. When the child has
+/// exited it writes a LauncherExit and closes it.
+struct LauncherRequest {
+    uint32_t fFlags;
+    uint32_t fUid;
+    uint32_t fGid;
+    uint32_t fArgc;
+    uint32_t fEnvc;
+    uint32_t fLength;
+    ScriptLimits fLimits;
+    ScriptQoS fQoS;
+};
+typedef struct LauncherRequest LauncherRequest;
+
+/// LauncherExit reports how a child of the launcher exited.
+struct LauncherExit {
+    int32_t fStatus;                    // from wait4()
+    uint32_t fReserved;
+    ScriptUsage fUsage;
+};
+typedef struct LauncherExit LauncherExit;
+
+/// Convert the rusage of a reaped child.
+static inline void ScriptUsageFromRusage(const struct rusage *usage, ScriptUsage *outUsage)
+{
+    outUsage->fUserTime = (uint64_t)usage->ru_utime.tv_sec * 1000000 + (uint64_t)usage->ru_utime.tv_usec;
+    outUsage->fSystemTime = (uint64_t)usage->ru_stime.tv_sec * 1000000 + (uint64_t)usage->ru_stime.tv_usec;
+#if defined(__APPLE__)
+    outUsage->fMaxRSS = (uint64_t)usage->ru_maxrss / 1024;  // bytes on Darwin
+#else
+    outUsage->fMaxRSS = (uint64_t)usage->ru_maxrss;
+#endif
+    outUsage->fInBlocks = (uint64_t)usage->ru_inblock;
+    outUsage->fOutBlocks = (uint64_t)usage->ru_oublock;
+    outUsage->fVoluntarySwitches = (uint64_t)usage->ru_nvcsw;
+    outUsage->fInvoluntarySwitches = (uint64_t)usage->ru_nivcsw;
+}
+
+/// Apply limits in a forked child, before it changes its uid so that it
+/// can't raise them again.
+///
+/// @return false with errno set if a limit couldn't be set.
+static inline bool ScriptLimitsApply(const ScriptLimits *limits)
+{
+    static const int resources[] = { RLIMIT_CPU, RLIMIT_AS, RLIMIT_NOFILE, RLIMIT_NPROC };
+    const uint64_t values[] = { limits->fCPU, limits->fMemory, limits->fFiles, limits->fProcesses };
+    struct rlimit limit;
+    size_t i;
+    
+    for (i = 0; i < sizeof(resources) / sizeof(*resources); i++) {
+        if (values[i] == 0) {
+            continue;
+        }
+        limit.rlim_cur = limit.rlim_max = (rlim_t)values[i];
+        if (setrlimit(resources[i], &limit) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// True if any limit is set.
+static inline bool ScriptLimitsSet(const ScriptLimits *limits)
+{
+    return limits->fCPU || limits->fMemory || limits->fFiles || limits->fProcesses;
+}
+
+/// Apply a QoS class in a forked child, before it changes its uid so that
+/// it may be given a higher priority than the plugin host.
+///
+/// Everything is attempted even if some of it fails, as the script can run
+/// regardless. CPU affinity is only available on Linux.
+///
+/// @return false with errno set if any of it couldn't be applied.
+static inline bool ScriptQoSApply(const ScriptQoS *qos)
+{
+    int nice;
+    int err;
+#if defined(__APPLE__)
+    int policy;
+#else
+    int ioprio;
+    cpu_set_t cpus;
+    int cpu;
+#endif
+    
+    switch (qos->fClass) {
+        case kScriptQoSInteractive:
+            nice = kScriptQoSInteractiveNice;
+#if defined(__APPLE__)
+            policy = IOPOL_IMPORTANT;
+#else
+            ioprio = kIOPrioClassBE << kIOPrioClassShift;
+#endif
+            break;
+        case kScriptQoSBackground:
+            nice = kScriptQoSBackgroundNice;
+#if defined(__APPLE__)
+            policy = IOPOL_THROTTLE;
+#else
+            ioprio = kIOPrioClassIdle << kIOPrioClassShift;
+#endif
+            break;
+        default:
+            return true;
+    }
+    
+    err = 0;
+    if (setpriority(PRIO_PROCESS, 0, nice) != 0) {
+        err = errno;
+    }
+#if defined(__APPLE__)
+    if (setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, policy) != 0) {
+        err = errno;
+    }
+#else
+    if (syscall(SYS_ioprio_set, kIOPrioWhoProcess, 0, ioprio) != 0) {
+        err = errno;
+    }
+    if (qos->fCPUs != 0) {
+        CPU_ZERO(&cpus);
+        for (cpu = 0; cpu < 64; cpu++) {
+            if (qos->fCPUs & (1ULL << cpu)) {
+                CPU_SET(cpu, &cpus);
+            }
+        }
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+            err = errno;
+        }
+    }
+#endif
+    if (err != 0) {
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+#endif /* defined(__LoginScriptPlugin__lsp_launcher__) */
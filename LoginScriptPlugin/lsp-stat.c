@@ -0,0 +1,375 @@
+//
+//  lsp-stat.c
+//  LoginScriptPlugin
+//
+//  Prints the statistics LoginScriptPlugin keeps for its scripts and
+//  phases, as a table or in the Prometheus text format.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/errno.h>
+#include <sysexits.h>
+
+#include "lsp-stats.h"
+
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Reading
+/////////////////////////////////////////////////////////////////////
+
+
+/// The percentiles shown for every entry.
+static const double kPercentiles[] = { 50.0, 90.0, 99.0 };
+#define kNumPercentiles (sizeof(kPercentiles) / sizeof(*kPercentiles))
+
+/// StatsSnapshot is a copy of an entry, taken while the plugin may be
+/// updating it.
+struct StatsSnapshot {
+    uint32_t fKind;
+    char fName[kStatsNameLength];
+    uint64_t fRuns;
+    uint64_t fDenies;
+    uint64_t fTimeouts;
+    uint64_t fFailures;
+    uint64_t fTotalMicros;
+    uint64_t fMaxMicros;
+    uint64_t fCount;                    // the sum of the buckets
+    uint64_t fPercentiles[kNumPercentiles];
+    int64_t fLastErrorTime;
+    char fLastError[kStatsErrorLength];
+};
+typedef struct StatsSnapshot StatsSnapshot;
+
+/// Copy the last error fields of an entry, retrying until they weren't
+/// written to while they were copied.
+static void ReadLastError(const StatsEntry *entry, StatsSnapshot *snapshot)
+{
+    uint32_t before;
+    uint32_t after;
+    int tries;
+    
+    for (tries = 0; tries < 1000; tries++) {
+        before = __atomic_load_n(&entry->fErrorSequence, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+        snapshot->fLastErrorTime = entry->fLastErrorTime;
+        memcpy(snapshot->fLastError, entry->fLastError, sizeof(snapshot->fLastError));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&entry->fErrorSequence, __ATOMIC_RELAXED);
+        if (before == after) {
+            snapshot->fLastError[sizeof(snapshot->fLastError) - 1] = '\0';
+            return;
+        }
+    }
+    snapshot->fLastErrorTime = 0;
+    snapshot->fLastError[0] = '\0';
+}
+
+/// Take a snapshot of a ready entry, and work out its percentiles.
+///
+/// The counters are updated one at a time, so a run that's being recorded
+/// may be counted in some of them and not yet in others.
+static void TakeSnapshot(const StatsEntry *entry, StatsSnapshot *snapshot)
+{
+    uint32_t buckets[kStatsBuckets];
+    uint64_t cumulative;
+    uint64_t rank;
+    uint32_t bucket;
+    size_t i;
+    
+    memset(snapshot, 0, sizeof(*snapshot));
+    snapshot->fKind = entry->fKind;
+    memcpy(snapshot->fName, entry->fName, sizeof(snapshot->fName));
+    snapshot->fName[sizeof(snapshot->fName) - 1] = '\0';
+    snapshot->fRuns = __atomic_load_n(&entry->fRuns, __ATOMIC_RELAXED);
+    snapshot->fDenies = __atomic_load_n(&entry->fDenies, __ATOMIC_RELAXED);
+    snapshot->fTimeouts = __atomic_load_n(&entry->fTimeouts, __ATOMIC_RELAXED);
+    snapshot->fFailures = __atomic_load_n(&entry->fFailures, __ATOMIC_RELAXED);
+    snapshot->fTotalMicros = __atomic_load_n(&entry->fTotalMicros, __ATOMIC_RELAXED);
+    snapshot->fMaxMicros = __atomic_load_n(&entry->fMaxMicros, __ATOMIC_RELAXED);
+    for (bucket = 0; bucket < kStatsBuckets; bucket++) {
+        buckets[bucket] = __atomic_load_n(&entry->fBuckets[bucket], __ATOMIC_RELAXED);
+        snapshot->fCount += buckets[bucket];
+    }
+    ReadLastError(entry, snapshot);
+    
+    // Report the top of the bucket a percentile falls in, as an HDR
+    // histogram does, but never more than the largest value seen.
+    for (i = 0; i < kNumPercentiles; i++) {
+        rank = (uint64_t)(kPercentiles[i] / 100.0 * (double)snapshot->fCount + 0.999999);
+        cumulative = 0;
+        for (bucket = 0; bucket < kStatsBuckets; bucket++) {
+            cumulative += buckets[bucket];
+            if (cumulative >= rank && cumulative > 0) {
+                break;
+            }
+        }
+        if (bucket < kStatsBuckets) {
+            snapshot->fPercentiles[i] = StatsBucketLimit(bucket);
+            if (snapshot->fPercentiles[i] > snapshot->fMaxMicros) {
+                snapshot->fPercentiles[i] = snapshot->fMaxMicros;
+            }
+        }
+    }
+}
+
+/// Map a statistics file read only, and check that it's one we understand.
+static const StatsFile *MapStats(const char *path)
+{
+    const StatsFile *stats;
+    struct stat info;
+    int fd;
+    
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        fprintf(stderr, "lsp-stat: Can't open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &info) != 0 || info.st_size != (off_t)sizeof(StatsFile)) {
+        fprintf(stderr, "lsp-stat: %s isn't a statistics file of this version\n", path);
+        close(fd);
+        return NULL;
+    }
+    stats = mmap(NULL, sizeof(StatsFile), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (stats == MAP_FAILED) {
+        fprintf(stderr, "lsp-stat: Can't map %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (stats->fMagic != kStatsMagic
+        || stats->fVersion != kStatsVersion
+        || stats->fEntrySize != sizeof(StatsEntry)
+        || stats->fMaxEntries != kStatsMaxEntries) {
+        fprintf(stderr, "lsp-stat: %s isn't a statistics file of this version\n", path);
+        munmap((void *)stats, sizeof(StatsFile));
+        return NULL;
+    }
+    return stats;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Output
+/////////////////////////////////////////////////////////////////////
+
+
+static const char *kKindNames[] = { "script", "phase" };
+
+/// Print the entries of one kind as a table, durations in seconds.
+static void PrintTable(const StatsFile *stats, uint32_t kind)
+{
+    const StatsEntry *entry;
+    StatsSnapshot snapshot;
+    char when[32];
+    struct tm tm;
+    time_t t;
+    size_t i;
+    
+    printf("%-40s %6s %6s %7s %6s %8s %8s %8s %8s %8s  %s\n",
+           kind == kStatsKindPhase ? "PHASE" : "SCRIPT",
+           "RUNS", "DENIED", "TIMEOUT", "FAILED", "MEAN", "P50", "P90", "P99", "MAX", "LAST ERROR");
+    for (i = 0; i < kStatsMaxEntries; i++) {
+        entry = &stats->fEntries[i];
+        if (__atomic_load_n(&entry->fState, __ATOMIC_ACQUIRE) != kStatsEntryReady || entry->fKind != kind) {
+            continue;
+        }
+        TakeSnapshot(entry, &snapshot);
+        when[0] = '\0';
+        if (snapshot.fLastErrorTime != 0) {
+            t = (time_t)snapshot.fLastErrorTime;
+            localtime_r(&t, &tm);
+            strftime(when, sizeof(when), " (%Y-%m-%d %H:%M:%S)", &tm);
+        }
+        printf("%-40s %6llu %6llu %7llu %6llu %8.3f %8.3f %8.3f %8.3f %8.3f  %s%s\n",
+               snapshot.fName,
+               (unsigned long long)snapshot.fRuns,
+               (unsigned long long)snapshot.fDenies,
+               (unsigned long long)snapshot.fTimeouts,
+               (unsigned long long)snapshot.fFailures,
+               snapshot.fRuns ? (double)snapshot.fTotalMicros / snapshot.fRuns / 1e6 : 0.0,
+               (double)snapshot.fPercentiles[0] / 1e6,
+               (double)snapshot.fPercentiles[1] / 1e6,
+               (double)snapshot.fPercentiles[2] / 1e6,
+               (double)snapshot.fMaxMicros / 1e6,
+               snapshot.fLastError, when);
+    }
+}
+
+/// Print a Prometheus label value, escaped.
+static void PrintLabelValue(const char *value)
+{
+    for (; *value != '\0'; value++) {
+        switch (*value) {
+            case '\\': fputs("\\\\", stdout); break;
+            case '"':  fputs("\\\"", stdout); break;
+            case '\n': fputs("\\n", stdout); break;
+            default:   putchar(*value); break;
+        }
+    }
+}
+
+/// Print the start of a sample: the metric name and its labels.
+static void PrintSample(const char *metric, const StatsSnapshot *snapshot, const char *quantile)
+{
+    printf("loginscriptplugin_%s{kind=\"%s\",name=\"", metric, kKindNames[snapshot->fKind == kStatsKindPhase]);
+    PrintLabelValue(snapshot->fName);
+    if (quantile != NULL) {
+        printf("\",quantile=\"%s", quantile);
+    }
+    printf("\"} ");
+}
+
+/// Print all entries in the Prometheus text exposition format, as read by
+/// the node exporter's textfile collector.
+static void PrintPrometheus(const StatsFile *stats)
+{
+    static const struct {
+        const char *fName;
+        const char *fType;
+        const char *fHelp;
+    } kMetrics[] = {
+        { "runs_total", "counter", "Runs of a login script or phase." },
+        { "denies_total", "counter", "Runs that denied authorization." },
+        { "timeouts_total", "counter", "Runs that timed out." },
+        { "failures_total", "counter", "Runs that failed without denying authorization." },
+        { "duration_seconds", "summary", "Wall time from launch to exit." },
+        { "duration_max_seconds", "gauge", "The longest run." },
+        { "last_error_timestamp_seconds", "gauge", "When a run last failed, denied or timed out." }
+    };
+    StatsSnapshot *snapshots;
+    StatsSnapshot *snapshot;
+    char quantile[16];
+    size_t numSnapshots;
+    size_t metric;
+    size_t i;
+    size_t j;
+    
+    snapshots = calloc(kStatsMaxEntries, sizeof(*snapshots));
+    if (snapshots == NULL) {
+        return;
+    }
+    numSnapshots = 0;
+    for (i = 0; i < kStatsMaxEntries; i++) {
+        if (__atomic_load_n(&stats->fEntries[i].fState, __ATOMIC_ACQUIRE) == kStatsEntryReady) {
+            TakeSnapshot(&stats->fEntries[i], &snapshots[numSnapshots++]);
+        }
+    }
+    
+    for (metric = 0; metric < sizeof(kMetrics) / sizeof(*kMetrics); metric++) {
+        printf("# HELP loginscriptplugin_%s %s\n", kMetrics[metric].fName, kMetrics[metric].fHelp);
+        printf("# TYPE loginscriptplugin_%s %s\n", kMetrics[metric].fName, kMetrics[metric].fType);
+        for (i = 0; i < numSnapshots; i++) {
+            snapshot = &snapshots[i];
+            switch (metric) {
+                case 0:
+                    PrintSample("runs_total", snapshot, NULL);
+                    printf("%llu\n", (unsigned long long)snapshot->fRuns);
+                    break;
+                case 1:
+                    PrintSample("denies_total", snapshot, NULL);
+                    printf("%llu\n", (unsigned long long)snapshot->fDenies);
+                    break;
+                case 2:
+                    PrintSample("timeouts_total", snapshot, NULL);
+                    printf("%llu\n", (unsigned long long)snapshot->fTimeouts);
+                    break;
+                case 3:
+                    PrintSample("failures_total", snapshot, NULL);
+                    printf("%llu\n", (unsigned long long)snapshot->fFailures);
+                    break;
+                case 4:
+                    for (j = 0; j < kNumPercentiles; j++) {
+                        snprintf(quantile, sizeof(quantile), "%g", kPercentiles[j] / 100.0);
+                        PrintSample("duration_seconds", snapshot, quantile);
+                        printf("%.6f\n", (double)snapshot->fPercentiles[j] / 1e6);
+                    }
+                    PrintSample("duration_seconds_sum", snapshot, NULL);
+                    printf("%.6f\n", (double)snapshot->fTotalMicros / 1e6);
+                    PrintSample("duration_seconds_count", snapshot, NULL);
+                    printf("%llu\n", (unsigned long long)snapshot->fRuns);
+                    break;
+                case 5:
+                    PrintSample("duration_max_seconds", snapshot, NULL);
+                    printf("%.6f\n", (double)snapshot->fMaxMicros / 1e6);
+                    break;
+                case 6:
+                    if (snapshot->fLastErrorTime != 0) {
+                        PrintSample("last_error_timestamp_seconds", snapshot, NULL);
+                        printf("%lld\n", (long long)snapshot->fLastErrorTime);
+                    }
+                    break;
+            }
+        }
+    }
+    
+    free(snapshots);
+}
+
+
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Main
+/////////////////////////////////////////////////////////////////////
+
+
+static void Usage(void)
+{
+    fprintf(stderr,
+            "usage: lsp-stat [-p] [-f file]\n"
+            "  -p       print in the Prometheus text format\n"
+            "  -f file  read file instead of %s\n", kStatsPath);
+}
+
+int main(int argc, char *argv[])
+{
+    const StatsFile *stats;
+    const char *path;
+    bool prometheus;
+    int ch;
+    
+    path = kStatsPath;
+    prometheus = false;
+    while ((ch = getopt(argc, argv, "pf:h")) != -1) {
+        switch (ch) {
+            case 'p':
+                prometheus = true;
+                break;
+            case 'f':
+                path = optarg;
+                break;
+            default:
+                Usage();
+                return EX_USAGE;
+        }
+    }
+    if (optind != argc) {
+        Usage();
+        return EX_USAGE;
+    }
+    
+    if ((stats = MapStats(path)) == NULL) {
+        return EX_NOINPUT;
+    }
+    if (prometheus) {
+        PrintPrometheus(stats);
+    } else {
+        PrintTable(stats, kStatsKindPhase);
+        printf("\n");
+        PrintTable(stats, kStatsKindScript);
+    }
+    
+    return fflush(stdout) == 0 ? EX_OK : EX_IOERR;
+}
@@ -0,0 +1,113 @@
+//
+//  lsp-stats.h
+//  LoginScriptPlugin
+//
+//  The layout of the statistics file that LoginScriptPlugin keeps and
+//  lsp-stat reads.
+//
+
+#ifndef __LoginScriptPlugin__lsp_stats__
+#define __LoginScriptPlugin__lsp_stats__
+
+#include <stdint.h>
+
+#if defined(__APPLE__)
+#define kStatsPath "/private/var/db/LoginScriptPlugin/Stats"
+#else
+#define kStatsPath "/var/lib/LoginScriptPlugin/Stats"
+#endif
+#define kStatsName "Stats"
+
+enum {
+    kStatsMagic = 'LSPS',
+    kStatsVersion = 1,
+    kStatsMaxEntries = 256,             // scripts and phases tracked
+    kStatsNameLength = 256,
+    kStatsErrorLength = 64,
+    kStatsSubBucketBits = 4,            // 16 buckets per power of two, ~6% precision
+    kStatsSubBuckets = 1 << kStatsSubBucketBits,
+    kStatsMaxBits = 32,                 // microseconds up to about 71 minutes
+    kStatsBuckets = (kStatsMaxBits - kStatsSubBucketBits + 1) * kStatsSubBuckets
+};
+
+enum {
+    kStatsEntryFree = 0,
+    kStatsEntryClaimed = 1,             // its name is being written
+    kStatsEntryReady = 2
+};
+
+enum {
+    kStatsKindScript = 0,
+    kStatsKindPhase = 1
+};
+
+/// StatsEntry holds the statistics of one script or phase.
+///
+/// Entries are claimed once and never freed. The counters and buckets are
+/// only updated with atomic adds, so they can be read without locking. The
+/// last error fields are guarded by fErrorSequence, which is odd while
+/// they're being written: readers retry until they see the same even value
+/// before and after reading them.
+struct StatsEntry {
+    uint32_t fState;                    // kStatsEntry*
+    uint32_t fKind;                     // kStatsKind*
+    char fName[kStatsNameLength];
+    uint64_t fRuns;
+    uint64_t fDenies;                   // denied authorization
+    uint64_t fTimeouts;
+    uint64_t fFailures;                 // other non-zero exits and signals
+    uint64_t fTotalMicros;
+    uint64_t fMaxMicros;
+    uint32_t fErrorSequence;
+    uint32_t fReserved;
+    int64_t fLastErrorTime;             // seconds since the epoch, or 0
+    char fLastError[kStatsErrorLength];
+    uint32_t fBuckets[kStatsBuckets];   // see StatsBucket()
+};
+typedef struct StatsEntry StatsEntry;
+
+/// StatsFile is the whole file, which is mapped by the plugin.
+struct StatsFile {
+    uint32_t fMagic;                    // kStatsMagic
+    uint32_t fVersion;                  // kStatsVersion
+    uint32_t fEntrySize;                // sizeof(StatsEntry)
+    uint32_t fMaxEntries;               // kStatsMaxEntries
+    int64_t fCreated;                   // seconds since the epoch
+    StatsEntry fEntries[kStatsMaxEntries];
+};
+typedef struct StatsFile StatsFile;
+
+/// The histogram bucket of a duration in microseconds.
+///
+/// Like an HDR histogram, values below 2 * kStatsSubBuckets have a bucket
+/// each, and every power of two above that is split into kStatsSubBuckets
+/// buckets, so the relative error is the same at every scale. Values too
+/// large for the histogram go in the last bucket.
+static inline uint32_t StatsBucket(uint64_t micros)
+{
+    uint32_t shift;
+    
+    if (micros < 2 * kStatsSubBuckets) {
+        return (uint32_t)micros;
+    }
+    if (micros >> kStatsMaxBits) {
+        return kStatsBuckets - 1;
+    }
+    for (shift = 0; (micros >> shift) >= 2 * kStatsSubBuckets; shift++)
+        ;
+    return (shift + 1) * kStatsSubBuckets + (uint32_t)(micros >> shift) - kStatsSubBuckets;
+}
+
+/// The largest duration in microseconds that falls in a bucket.
+static inline uint64_t StatsBucketLimit(uint32_t bucket)
+{
+    uint32_t shift;
+    
+    if (bucket < 2 * kStatsSubBuckets) {
+        return bucket;
+    }
+    shift = bucket / kStatsSubBuckets - 1;
+    return (((uint64_t)(bucket % kStatsSubBuckets + kStatsSubBuckets) + 1) << shift) - 1;
+}
+
+#endif /* defined(__LoginScriptPlugin__lsp_stats__) */
@@ -0,0 +1,463 @@
+//
+//  lsp-verify.c
+//  LoginScriptPlugin
+//
+//  Checks the ownership and permissions of the script folder, the
+//  directories leading to it and the scripts in it, with the same rules
+//  as LoginScriptPlugin, and prints the verdict as text or JSON.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/errno.h>
+#include <sysexits.h>
+
+#include "lsp-verify.h"
+
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Verification
+/////////////////////////////////////////////////////////////////////
+
+
+enum {
+    kMaxVerifiedDirs = 256              // directories remembered across arguments
+};
+
+typedef enum {
+    kVerifyDirectory,
+    kVerifyScript,
+    kVerifyConfig
+} verifyKind;
+
+static const char *kVerifyKindNames[] = { "directory", "script", "config" };
+
+/// VerifyResult is the verdict on one path.
+struct VerifyResult {
+    char fPath[MAXPATHLEN];
+    verifyKind fKind;
+    uint32_t fProblems;                 // kVerify* bits
+    int fError;                         // errno if it couldn't be examined, or 0
+};
+typedef struct VerifyResult VerifyResult;
+
+/// VerifiedDir is a directory that has already been checked, so a chain
+/// shared by several arguments is only checked once.
+struct VerifiedDir {
+    char fPath[MAXPATHLEN];
+    int fFD;                            // or -1 if it couldn't be opened
+    bool fOK;                           // it and everything above it passed
+    bool fScanned;                      // its contents have been checked
+    bool fScanOK;                       // and they passed
+};
+typedef struct VerifiedDir VerifiedDir;
+
+/// Verifier holds the results of a run.
+struct Verifier {
+    dev_t fRootDev;
+    VerifyResult *fResults;
+    size_t fNumResults;
+    size_t fCapacity;
+    VerifiedDir fDirs[kMaxVerifiedDirs];
+    size_t fNumDirs;
+};
+typedef struct Verifier Verifier;
+
+/// Append a result, exiting if we run out of memory.
+static VerifyResult *AddResult(Verifier *verifier, const char *path, verifyKind kind)
+{
+    VerifyResult *results;
+    VerifyResult *result;
+    
+    if (verifier->fNumResults == verifier->fCapacity) {
+        verifier->fCapacity = verifier->fCapacity ? 2 * verifier->fCapacity : 64;
+        results = realloc(verifier->fResults, verifier->fCapacity * sizeof(*results));
+        if (results == NULL) {
+            fprintf(stderr, "lsp-verify: out of memory\n");
+            exit(EX_OSERR);
+        }
+        verifier->fResults = results;
+    }
+    result = &verifier->fResults[verifier->fNumResults++];
+    strlcpy(result->fPath, path, sizeof(result->fPath));
+    result->fKind = kind;
+    result->fProblems = 0;
+    result->fError = 0;
+    return result;
+}
+
+/// Check an entry of a directory, the same way the plugin does before it
+/// opens it.
+///
+/// @return false if there was a problem.
+static bool VerifyEntry(Verifier *verifier, int dirFD, const char *name, const char *path, verifyKind kind)
+{
+    VerifyResult *result;
+    struct stat info;
+    
+    result = AddResult(verifier, path, kind);
+    if (fstatat(dirFD, name, &info, AT_SYMLINK_NOFOLLOW) != 0) {
+        result->fError = errno;
+        return false;
+    }
+    result->fProblems = VerifyPathProblems(&info, verifier->fRootDev, kind != kVerifyConfig);
+    return result->fProblems == 0;
+}
+
+/// Find a directory that has already been checked.
+static VerifiedDir *FindVerifiedDir(Verifier *verifier, const char *path)
+{
+    size_t i;
+    
+    for (i = 0; i < verifier->fNumDirs; i++) {
+        if (strcmp(verifier->fDirs[i].fPath, path) == 0) {
+            return &verifier->fDirs[i];
+        }
+    }
+    return NULL;
+}
+
+/// Remember the verdict on a directory. When there's no room left it's
+/// simply checked again if it comes up, and its descriptor stays open
+/// until we exit.
+static void AddVerifiedDir(Verifier *verifier, const char *path, int fd, bool ok)
+{
+    VerifiedDir *dir;
+    
+    if (verifier->fNumDirs == kMaxVerifiedDirs) {
+        return;
+    }
+    dir = &verifier->fDirs[verifier->fNumDirs++];
+    strlcpy(dir->fPath, path, sizeof(dir->fPath));
+    dir->fFD = fd;
+    dir->fOK = ok;
+    dir->fScanned = false;
+    dir->fScanOK = false;
+}
+
+/// Check the chain of directories from / to dirPath, like the plugin's
+/// VerifyDirChain(), one component at a time relative to its parent.
+/// Directories that were checked for an earlier argument aren't checked
+/// or reported again. Unlike the plugin, the walk goes on past a directory
+/// with problems as long as it can be opened, so they're all reported.
+///
+/// @param dirPath  An absolute path without trailing slashes.
+/// @param outOK    Set to false if anything in the chain failed.
+/// @return a descriptor for dirPath, owned by the verifier, or -1 if it
+///         couldn't be opened.
+static int VerifyChain(Verifier *verifier, const char *dirPath, bool *outOK)
+{
+    char path[MAXPATHLEN];
+    VerifiedDir *known;
+    VerifyResult *result;
+    struct stat info;
+    char *component;
+    char *next;
+    int dirFD;
+    int fd;
+    bool ok;
+    
+    strlcpy(path, dirPath, sizeof(path));
+    if ((known = FindVerifiedDir(verifier, "/")) == NULL) {
+        result = AddResult(verifier, "/", kVerifyDirectory);
+        fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1 || fstat(fd, &info) != 0) {
+            result->fError = errno;
+        } else {
+            verifier->fRootDev = info.st_dev;
+            result->fProblems = VerifyPathProblems(&info, verifier->fRootDev, true);
+        }
+        AddVerifiedDir(verifier, "/", fd, fd != -1 && result->fError == 0 && result->fProblems == 0);
+        known = FindVerifiedDir(verifier, "/");
+    }
+    if (known == NULL) {
+        *outOK = false;
+        return -1;
+    }
+    dirFD = known->fFD;
+    ok = known->fOK;
+    
+    // Each iteration temporarily cuts path after the current component.
+    for (component = path + 1; *component != '\0' && dirFD != -1; component = next) {
+        next = strchr(component, '/');
+        if (next != NULL) {
+            *next = '\0';
+        }
+        if (*component == '\0') {
+            // An empty component from a doubled slash.
+        } else if ((known = FindVerifiedDir(verifier, path)) != NULL) {
+            dirFD = known->fFD;
+            ok = ok && known->fOK;
+        } else {
+            ok = VerifyEntry(verifier, dirFD, component, path, kVerifyDirectory) && ok;
+            result = &verifier->fResults[verifier->fNumResults - 1];
+            fd = -1;
+            if (result->fError == 0) {
+                fd = openat(dirFD, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (fd == -1 && result->fProblems == 0) {
+                    result->fError = errno;
+                }
+            }
+            ok = ok && fd != -1;
+            AddVerifiedDir(verifier, path, fd, ok);
+            dirFD = fd;
+        }
+        if (next == NULL) {
+            break;
+        }
+        *next++ = '/';
+    }
+    
+    *outOK = ok && dirFD != -1;
+    return dirFD;
+}
+
+/// qsort() comparator for names.
+static int CompareNames(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/// Check a script folder: the directories leading to it, the scripts in
+/// it and the plugin's files, in name order. A folder that's given twice
+/// is only checked once.
+///
+/// @return false if there was a problem.
+static bool VerifyScriptFolder(Verifier *verifier, const char *folder)
+{
+    char dirPath[MAXPATHLEN];
+    char path[MAXPATHLEN];
+    struct dirent *entry;
+    char **names;
+    size_t numNames;
+    size_t capacity;
+    size_t i;
+    VerifiedDir *known;
+    verifyKind kind;
+    DIR *dir;
+    int dirFD;
+    int fd;
+    bool ok;
+    
+    if (folder[0] != '/' || strlcpy(dirPath, folder, sizeof(dirPath)) >= sizeof(dirPath)) {
+        AddResult(verifier, folder, kVerifyDirectory)->fError = EINVAL;
+        return false;
+    }
+    // Trailing slashes would only add empty components.
+    for (i = strlen(dirPath); i > 1 && dirPath[i - 1] == '/'; i--) {
+        dirPath[i - 1] = '\0';
+    }
+    
+    dirFD = VerifyChain(verifier, dirPath, &ok);
+    if (dirFD == -1) {
+        return false;
+    }
+    if ((known = FindVerifiedDir(verifier, dirPath)) != NULL) {
+        if (known->fScanned) {
+            return ok && known->fScanOK;
+        }
+        known->fScanned = true;
+    }
+    fd = openat(dirFD, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1 || (dir = fdopendir(fd)) == NULL) {
+        AddResult(verifier, dirPath, kVerifyDirectory)->fError = errno;
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    
+    names = NULL;
+    numNames = 0;
+    capacity = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        for (i = 0; i < kNumConfigNames && strcmp(entry->d_name, kConfigNames[i]) != 0; i++)
+            ;
+        if (i == kNumConfigNames && ScriptPrefixIndex(entry->d_name) == kNumScriptPrefixes) {
+            continue;
+        }
+        if (numNames == capacity) {
+            capacity = capacity ? 2 * capacity : 16;
+            if ((names = realloc(names, capacity * sizeof(*names))) == NULL) {
+                fprintf(stderr, "lsp-verify: out of memory\n");
+                exit(EX_OSERR);
+            }
+        }
+        if ((names[numNames++] = strdup(entry->d_name)) == NULL) {
+            fprintf(stderr, "lsp-verify: out of memory\n");
+            exit(EX_OSERR);
+        }
+    }
+    closedir(dir);
+    
+    if (numNames > 1) {
+        qsort(names, numNames, sizeof(*names), CompareNames);
+    }
+    for (i = 0; i < numNames; i++) {
+        kind = ScriptPrefixIndex(names[i]) != kNumScriptPrefixes ? kVerifyScript : kVerifyConfig;
+        if (snprintf(path, sizeof(path), "%s/%s", dirPath, names[i]) >= (int)sizeof(path)) {
+            // The plugin couldn't use it either.
+            AddResult(verifier, path, kind)->fError = ENAMETOOLONG;
+            ok = false;
+        } else if (! VerifyEntry(verifier, dirFD, names[i], path, kind)) {
+            ok = false;
+        }
+        free(names[i]);
+    }
+    free(names);
+    if (known != NULL) {
+        known->fScanOK = ok;
+    }
+    return ok;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Output
+/////////////////////////////////////////////////////////////////////
+
+
+/// Print the problems like configureplugin.sh used to.
+static void PrintText(const Verifier *verifier)
+{
+    const VerifyResult *result;
+    size_t i;
+    size_t j;
+    
+    for (i = 0; i < verifier->fNumResults; i++) {
+        result = &verifier->fResults[i];
+        if (result->fError == ENOENT) {
+            printf("Warning: %s does not exist\n", result->fPath);
+        } else if (result->fError != 0) {
+            printf("Warning: Can't check %s: %s\n", result->fPath, strerror(result->fError));
+        }
+        for (j = 0; j < kNumVerifyProblems; j++) {
+            if (result->fProblems & (1U << j)) {
+                printf("Warning: %s %s\n", result->fPath, kVerifyProblemMessages[j]);
+            }
+        }
+    }
+}
+
+/// Print a string as a JSON string literal.
+static void PrintJSONString(const char *str)
+{
+    const unsigned char *p;
+    
+    putchar('"');
+    for (p = (const unsigned char *)str; *p != '\0'; p++) {
+        if (*p == '"' || *p == '\\') {
+            printf("\\%c", *p);
+        } else if (*p < 0x20) {
+            printf("\\u%04x", *p);
+        } else {
+            putchar(*p);
+        }
+    }
+    putchar('"');
+}
+
+/// Print every path that was checked as a JSON document:
+///
+///     {"ok": false, "paths": [{"path": "/Library", "kind": "directory",
+///      "ok": true, "problems": []}, ...]}
+///
+/// Paths that couldn't be examined have an "error" instead of problems.
+static void PrintJSON(const Verifier *verifier, bool ok)
+{
+    const VerifyResult *result;
+    size_t i;
+    size_t j;
+    bool first;
+    
+    printf("{\"ok\": %s, \"paths\": [", ok ? "true" : "false");
+    for (i = 0; i < verifier->fNumResults; i++) {
+        result = &verifier->fResults[i];
+        printf("%s\n  {\"path\": ", i > 0 ? "," : "");
+        PrintJSONString(result->fPath);
+        printf(", \"kind\": \"%s\", \"ok\": %s", kVerifyKindNames[result->fKind],
+               result->fError == 0 && result->fProblems == 0 ? "true" : "false");
+        if (result->fError != 0) {
+            printf(", \"error\": ");
+            PrintJSONString(strerror(result->fError));
+        } else {
+            printf(", \"problems\": [");
+            first = true;
+            for (j = 0; j < kNumVerifyProblems; j++) {
+                if (result->fProblems & (1U << j)) {
+                    printf("%s\"%s\"", first ? "" : ", ", kVerifyProblemNames[j]);
+                    first = false;
+                }
+            }
+            printf("]");
+        }
+        printf("}");
+    }
+    printf("\n]}\n");
+}
+
+
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Main
+/////////////////////////////////////////////////////////////////////
+
+
+static void Usage(void)
+{
+    fprintf(stderr,
+            "usage: lsp-verify [-j] [folder ...]\n"
+            "  -j       print every path checked as JSON\n"
+            "  folder   check folder instead of %s\n", kLoginScriptDir);
+}
+
+int main(int argc, char *argv[])
+{
+    static Verifier verifier;
+    bool json;
+    bool ok;
+    int ch;
+    int i;
+    
+    json = false;
+    while ((ch = getopt(argc, argv, "jh")) != -1) {
+        switch (ch) {
+            case 'j':
+                json = true;
+                break;
+            default:
+                Usage();
+                return EX_USAGE;
+        }
+    }
+    
+    ok = true;
+    if (optind == argc) {
+        ok = VerifyScriptFolder(&verifier, kLoginScriptDir);
+    }
+    for (i = optind; i < argc; i++) {
+        if (! VerifyScriptFolder(&verifier, argv[i])) {
+            ok = false;
+        }
+    }
+    
+    if (json) {
+        PrintJSON(&verifier, ok);
+    } else {
+        PrintText(&verifier);
+    }
+    
+    if (fflush(stdout) != 0) {
+        return EX_IOERR;
+    }
+    return ok ? EX_OK : EX_NOPERM;
+}
@@ -0,0 +1,144 @@
+//
+//  lsp-verify.h
+//  LoginScriptPlugin
+//
+//  The rules that scripts and the directories leading to them have to
+//  follow, shared by LoginScriptPlugin, lsp-verify and lsp-authdb.
+//
+
+#ifndef __LoginScriptPlugin__lsp_verify__
+#define __LoginScriptPlugin__lsp_verify__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Builds of the test harness point this at a directory of their own.
+#if defined(LSP_SCRIPT_DIR)
+#define kLoginScriptDir LSP_SCRIPT_DIR
+#else
+#define kLoginScriptDir "/Library/Application Support/LoginScriptPlugin"
+#endif
+#define kSettingsName "LoginScriptPlugin.conf"
+#define kManifestName "LoginScriptPlugin.manifest"
+#define kRulesName "LoginScriptPlugin.rules"
+#define kWarmupName "LoginScriptPlugin.warmup"
+
+enum {
+    kNumScriptPrefixes = 4,
+    kNumConfigNames = 4,
+    kAdminGid = 80
+};
+
+/// Script name prefixes, one for each mechanism.
+static const char *const kScriptPrefixes[kNumScriptPrefixes] = {
+    "premount-root",
+    "premount-user",
+    "postmount-root",
+    "postmount-user"
+};
+
+/// Files in kLoginScriptDir that are read rather than executed.
+static const char *const kConfigNames[kNumConfigNames] = {
+    kSettingsName,
+    kManifestName,
+    kRulesName,
+    kWarmupName
+};
+
+enum {
+    kVerifyForeignVolume = 1 << 0,
+    kVerifySymbolicLink = 1 << 1,
+    kVerifyNotRootOwned = 1 << 2,
+    kVerifyWorldWritable = 1 << 3,
+    kVerifyGroupWritable = 1 << 4,
+    kVerifyNotExecutable = 1 << 5,
+    kNumVerifyProblems = 6
+};
+
+/// Short names of the kVerify* bits, in bit order, for machine readers.
+static const char *const kVerifyProblemNames[kNumVerifyProblems] = {
+    "foreign-volume",
+    "symbolic-link",
+    "not-root-owned",
+    "world-writable",
+    "group-writable",
+    "not-executable"
+};
+
+/// What's wrong with a path, in bit order, to follow it in messages.
+static const char *const kVerifyProblemMessages[kNumVerifyProblems] = {
+    "is not on boot volume",
+    "is a symbolic link",
+    "isn't owned by root",
+    "is world writable",
+    "is group writable",
+    "isn't executable"
+};
+
+/// Check the ownership and mode of a path that's part of a script chain.
+///
+/// The path itself and its containing directories should all be owned
+/// by root, and not writable by anyone other than root:wheel or root:admin.
+/// They should be on the boot volume, and must not be symbolic links.
+/// Scripts and directories also have to be executable.
+///
+/// @param info     The result of an lstat of the path.
+/// @param rootDev  The device of the root directory.
+/// @return the kVerify* bits of the problems found, 0 if it's fine.
+static inline uint32_t VerifyPathProblems(const struct stat *info, dev_t rootDev, bool requireExec)
+{
+    uint32_t problems;
+    
+    problems = 0;
+    
+    // Reject if path isn't on boot volume.
+    if (info->st_dev != rootDev) {
+        problems |= kVerifyForeignVolume;
+    }
+    
+    // Reject symbolic links.
+    if (S_ISLNK(info->st_mode)) {
+        problems |= kVerifySymbolicLink;
+    }
+    
+    // Ensure that it's owned by root.
+    if (info->st_uid != 0) {
+        problems |= kVerifyNotRootOwned;
+    }
+    
+    // Reject world writable paths.
+    if (info->st_mode & S_IWOTH) {
+        problems |= kVerifyWorldWritable;
+    }
+    
+    // Reject group writable paths unless the gid is wheel or admin.
+    if (info->st_mode & S_IWGRP && !(info->st_gid == 0 || info->st_gid == kAdminGid)) {
+        problems |= kVerifyGroupWritable;
+    }
+    
+    // Path must be executable.
+    if (requireExec && ! (info->st_mode & S_IXUSR)) {
+        problems |= kVerifyNotExecutable;
+    }
+    
+    return problems;
+}
+
+/// The kScriptPrefixes index of a script name, or kNumScriptPrefixes if
+/// it isn't a script.
+static inline size_t ScriptPrefixIndex(const char *name)
+{
+    size_t i;
+    
+    for (i = 0; i < kNumScriptPrefixes; i++) {
+        if (strncmp(name, kScriptPrefixes[i], strlen(kScriptPrefixes[i])) == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+#endif /* defined(__LoginScriptPlugin__lsp_verify__) */